@@ -0,0 +1,137 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Asynchronous writer of text blocks to a set of output files.
+
+   The computing threads format a block of lines for each file and push it,
+   a background thread appends the blocks to the files in the order pushed.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_ASYNCWRITER_HPP
+#define GCTA2_ASYNCWRITER_HPP
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include "Logger.h"
+
+class AsyncWriter {
+public:
+    // max_pending: blocks queued before push waits for the writer
+    AsyncWriter(const std::vector<std::string> &file_names, int max_pending = 4)
+        : names(file_names), max_pending(max_pending) {
+        for(const auto &name : names){
+            FILE *h_file = fopen(name.c_str(), "wb");
+            if(!h_file){
+                LOGGER.e(0, "can't open [" + name + "] to write.");
+            }
+            files.push_back(h_file);
+        }
+        worker = std::thread(&AsyncWriter::loop, this);
+    }
+
+    ~AsyncWriter(){
+        close();
+    }
+
+    AsyncWriter(const AsyncWriter &) = delete;
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+    size_t size() const { return files.size(); }
+
+    // texts[k] is appended to the file k, an empty string writes nothing
+    void push(std::vector<std::string> &&texts){
+        int failed = -1;
+        {
+            std::unique_lock<std::mutex> lock(mut);
+            cv_space.wait(lock, [this]{return pending.size() < (size_t)max_pending;});
+            failed = failed_file;
+            if(failed == -1){
+                pending.push_back(std::move(texts));
+                cv_data.notify_one();
+            }
+        }
+        check_error(failed);
+    }
+
+    // write the remaining blocks and close the files
+    void close(){
+        if(!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            finished = true;
+        }
+        cv_data.notify_one();
+        worker.join();
+        for(auto h_file : files){
+            fclose(h_file);
+        }
+        files.clear();
+        int failed = -1;
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            failed = failed_file;
+        }
+        check_error(failed);
+    }
+
+private:
+    std::vector<std::string> names;
+    std::vector<FILE *> files;
+    std::deque<std::vector<std::string>> pending;
+    int max_pending;
+    bool finished = false;
+    int failed_file = -1;
+    std::thread worker;
+    std::mutex mut;
+    std::condition_variable cv_data;
+    std::condition_variable cv_space;
+
+    void loop(){
+        while(true){
+            std::vector<std::string> texts;
+            {
+                std::unique_lock<std::mutex> lock(mut);
+                cv_data.wait(lock, [this]{return finished || !pending.empty();});
+                if(pending.empty()) break;
+                texts = std::move(pending.front());
+                pending.pop_front();
+            }
+            cv_space.notify_one();
+            for(size_t k = 0; k < texts.size() && k < files.size(); k++){
+                const std::string &text = texts[k];
+                if(text.empty()) continue;
+                if(fwrite(text.data(), 1, text.size(), files[k]) != text.size()){
+                    std::lock_guard<std::mutex> lock(mut);
+                    if(failed_file == -1) failed_file = k;
+                }
+            }
+        }
+        for(size_t k = 0; k < files.size(); k++){
+            if(fflush(files[k]) != 0){
+                std::lock_guard<std::mutex> lock(mut);
+                if(failed_file == -1) failed_file = k;
+            }
+        }
+    }
+
+    // errors are raised in the calling thread, not in the writer; failed is read under the lock
+    void check_error(int failed){
+        if(failed != -1){
+            LOGGER.e(0, "can't write to [" + names[failed] + "].");
+        }
+    }
+};
+
+#endif //GCTA2_ASYNCWRITER_HPP
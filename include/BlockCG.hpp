@@ -0,0 +1,165 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Block preconditioned conjugate gradient for many right-hand sides.
+
+   The right-hand sides of a group are advanced together: one sparse
+   matrix times block product per iteration, the search directions span
+   the preconditioned residuals of the whole group. The block is kept
+   orthonormal by a rank revealing QR, and the converged columns are
+   dropped from it, so that a dependent or solved column doesn't break
+   the iteration. The preconditioner is the diagonal of the matrix.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_BLOCKCG_HPP
+#define GCTA2_BLOCKCG_HPP
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <omp.h>
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+
+template <typename SparseType>
+class BlockCG {
+public:
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+
+    // A: symmetric positive definite, both triangles stored; kept by reference
+    void compute(const SparseType &A){
+        mat = &A;
+        inv_diag.resize(A.rows());
+        for(int64_t i = 0; i < A.rows(); i++){
+            double d = A.coeff(i, i);
+            inv_diag[i] = d > 0 ? 1.0 / d : 1.0;
+        }
+    }
+
+    // relative residual of each column, the same default as Eigen::ConjugateGradient
+    void setTolerance(double tol){ tolerance = tol; }
+    // default 2 * rows of A
+    void setMaxIterations(int iter){ max_iter = iter; }
+    // columns in a group; the groups are solved in parallel, a single group uses all threads in A * P
+    void setBlockSize(int size){ block_size = std::max(1, size); }
+    int iterations() const { return num_iter; }
+
+    // A^-1 B
+    Eigen::MatrixXd solve(const Eigen::Ref<const Eigen::MatrixXd> B) const {
+        int64_t num_col = B.cols();
+        Eigen::MatrixXd X(B.rows(), num_col);
+        int64_t num_group = (num_col + block_size - 1) / block_size;
+        std::vector<int> group_iter(num_group, 0);
+        #pragma omp parallel for schedule(dynamic) if(num_group > 1)
+        for(int64_t g = 0; g < num_group; g++){
+            int64_t start = g * block_size;
+            int64_t size = std::min((int64_t)block_size, num_col - start);
+            Eigen::MatrixXd cur_X;
+            group_iter[g] = solveBlock(B.middleCols(start, size), cur_X);
+            X.middleCols(start, size) = cur_X;
+        }
+        num_iter = num_group ? *std::max_element(group_iter.begin(), group_iter.end()) : 0;
+        return X;
+    }
+
+private:
+    const SparseType *mat = NULL;
+    Eigen::VectorXd inv_diag;
+    double tolerance = Eigen::NumTraits<double>::epsilon();
+    int max_iter = -1;
+    int block_size = 16;
+    mutable int num_iter = 0;
+
+    // Q = A * P, by rows of A (the columns, A is symmetric)
+    void multiply(const RowMatrix &P, RowMatrix &Q) const {
+        const SparseType &A = *mat;
+        Q.resize(P.rows(), P.cols());
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for(int64_t i = 0; i < A.outerSize(); i++){
+            auto row = Q.row(i);
+            row.setZero();
+            for(typename SparseType::InnerIterator it(A, i); it; ++it){
+                row += it.value() * P.row(it.index());
+            }
+        }
+    }
+
+    // orthonormal basis of the columns of W, the numerically dependent ones dropped
+    static Eigen::MatrixXd orth(const Eigen::MatrixXd &W){
+        Eigen::ColPivHouseholderQR<Eigen::MatrixXd> qr(W);
+        qr.setThreshold(1e-13);
+        int64_t rank = qr.rank();
+        Eigen::MatrixXd Q = Eigen::MatrixXd::Identity(W.rows(), rank);
+        Q.applyOnTheLeft(qr.householderQ());
+        return Q;
+    }
+
+    int solveBlock(const Eigen::Ref<const Eigen::MatrixXd> B, Eigen::MatrixXd &X) const {
+        int64_t n = B.rows();
+        int maxIter = max_iter > 0 ? max_iter : 2 * n;
+        X.setZero(n, B.cols());
+
+        // the unconverged columns
+        std::vector<int64_t> active;
+        Eigen::VectorXd thresh(B.cols());
+        for(int64_t j = 0; j < B.cols(); j++){
+            double norm = B.col(j).norm();
+            thresh[j] = tolerance * norm;
+            if(norm > 0) active.push_back(j);
+        }
+        if(active.empty()) return 0;
+
+        Eigen::MatrixXd R(n, active.size());
+        for(size_t k = 0; k < active.size(); k++) R.col(k) = B.col(active[k]);
+        Eigen::MatrixXd P = orth(inv_diag.asDiagonal() * R);
+
+        RowMatrix P_row, Q_row;
+        int iter = 0;
+        while(iter < maxIter && P.cols() > 0){
+            iter++;
+            P_row = P;
+            multiply(P_row, Q_row);
+            Eigen::MatrixXd Q = Q_row;
+
+            Eigen::LLT<Eigen::MatrixXd> PtQ(P.transpose() * Q);
+            if(PtQ.info() != Eigen::Success) break;
+            Eigen::MatrixXd alpha = PtQ.solve(P.transpose() * R);
+            Eigen::MatrixXd Palpha = P * alpha;
+            for(size_t k = 0; k < active.size(); k++) X.col(active[k]) += Palpha.col(k);
+            R.noalias() -= Q * alpha;
+
+            // drop the converged columns
+            std::vector<int64_t> kept_col;
+            std::vector<int64_t> kept_active;
+            for(size_t k = 0; k < active.size(); k++){
+                if(R.col(k).norm() > thresh[active[k]]){
+                    kept_col.push_back(k);
+                    kept_active.push_back(active[k]);
+                }
+            }
+            if(kept_col.empty()) break;
+            if(kept_col.size() != active.size()){
+                Eigen::MatrixXd R_kept(n, kept_col.size());
+                for(size_t k = 0; k < kept_col.size(); k++) R_kept.col(k) = R.col(kept_col[k]);
+                R.swap(R_kept);
+                active.swap(kept_active);
+            }
+
+            Eigen::MatrixXd Z = inv_diag.asDiagonal() * R;
+            Eigen::MatrixXd beta = PtQ.solve(Q.transpose() * Z);
+            Z.noalias() -= P * beta;
+            P = orth(Z);
+        }
+        return iter;
+    }
+};
+
+#endif //GCTA2_BLOCKCG_HPP
@@ -24,6 +24,9 @@
 #include "Geno.h"
 #include "Pheno.h"
 #include "Marker.h" 
+#include "AsyncWriter.hpp"
+#include "GRMBlocks.hpp"
+#include "BlockCG.hpp"
 #include "Eigen/Dense"
 #include "Eigen/Sparse"
 #include <vector>
@@ -33,6 +36,7 @@
 using Eigen::Map;
 using Eigen::MatrixXd;
 using Eigen::VectorXd;
+using Eigen::RowVectorXd;
 using Eigen::SparseMatrix;
 using Eigen::Dynamic;
 using Eigen::Ref;
@@ -48,6 +52,17 @@ struct SPARes {
     bool bConverge;
 };
 
+// a marker to SPA: the genotypes gIndex of the samples in index (or all),
+//   gPos, gNeg and mu1muGSum are over all the samples
+struct SPAInput {
+    bool need = false;
+    double q, qinv;
+    double gPos, gNeg;
+    double mu1muGSum;
+    vector<uint32_t> index;
+    VectorXd gIndex;
+};
+
 class FastFAM {
 public:
     FastFAM();
@@ -56,6 +71,7 @@ public:
     void calculate_fam(uintptr_t *buf, const vector<uint32_t> &markerIndex);
     void calculate_grammar(uintptr_t *buf, const vector<uint32_t> &markerIndex);
     void calculate_gwa(uintptr_t * geno, const vector<uint32_t> &markerIndex);
+    void calculate_multi(uintptr_t *buf, const vector<uint32_t> &markerIndex);
     void calculate_gwa_2df(uintptr_t * geno, const vector<uint32_t> &markerIndex);
     void calculate_gwa_2df_sandwich(uintptr_t * geno, const vector<uint32_t> &markerIndex);
     void calculate_mixed_2df(uintptr_t *geno, const vector<uint32_t> &markerIndex);
@@ -82,11 +98,13 @@ public:
     void conditionCovarReg(Eigen::Ref<VectorXd> pheno);
     void conditionCovarReg(VectorXd &pheno, VectorXd &condPheno);
     void conditionCovarBinReg(Eigen::Ref<VectorXd> y);
+    void conditionCovarPanel(Eigen::Ref<MatrixXd> X);
 
     
     static int registerOption(map<string, vector<string>>& options_in);
     static void processMain();
     void processFAM(vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks);
+    void processFAMMulti();
     //void processFAM();
 
 
@@ -130,7 +148,71 @@ private:
     double c_inf;
     uint64_t finished_rand_marker = 0;
     Eigen::ConjugateGradient<SpMat, Eigen::Lower|Eigen::Upper> solver;
+    // many right-hand sides of V at once, the null markers of grammar
+    BlockCG<SpMat> blockSolver;
+    // connected components of the sparse GRM, V is factorised on them if set
+    GRMBlocks famBlocks;
+    GRMBlocksSolver famSolver;
+    bool bFamBlocks = false;
+    bool bREMLBlocks = false;       // A of spREML is the GRM of famBlocks and I
     void grammar_func(uintptr_t *genobuf, const vector<uint32_t> &markerIndex);
+    void grammarPanel(int index_panel, int num);
+    // --null-panel: the decoded null SNPs of grammar saved as float columns, read by the later runs
+    //   instead of decoding the scattered SNPs again
+    FILE *hNullPanel = NULL;
+    vector<uint8_t> nullPanelValid;
+    bool loadNullPanel(const string &file_name, uint64_t key, int num_marker, int soft_cap, int min_valid);
+    // the null SNPs decoded for the first trait of --mpheno, kept for the other traits
+    bool bKeepNullPanel = false;
+    Eigen::MatrixXf nullPanelMem;
+    vector<uint8_t> nullPanelMemValid;
+    void grammarMemPanel(int num_marker, int soft_cap, int min_valid);
+
+    // markers are tested in panels: decoded as the columns of a matrix, then the covariates,
+    //   scores and variances are handled by matrix products over the panel
+    MatrixXd panel;
+    int panelSize();
+    void decodePanel(uintptr_t *genobuf, const vector<uint32_t> &markerIndex, int from, int num,
+            uint8_t *isValids, bool saveMarkerInfo = true, bool allowSparse = false);
+    // markers below sparseMAF are decoded as carriers if allowed in decodePanel: the dense ones
+    //   are the first panelDense columns, panelCol is the column of each marker, -1 for the carriers in panelSparse
+    double sparseMAF = 0.01;
+    int panelDense;
+    vector<int> panelCol;
+    vector<GenoBufItem> panelSparse;
+    // sums over all the samples, the covariate adjustment of a marker decoded as carriers
+    //   then runs over the carriers only
+    struct SparseSums {
+        RowVectorXd sumY;   // 1'Y
+        MatrixXd CtY;       // C'Y
+        VectorXd H1;        // H * 1
+        VectorXd Ct1;       // C'1
+        double sumD;        // weights of the variance, binary traits only
+        VectorXd CtD;
+        MatrixXd CtDC;
+    };
+    SparseSums spaSums;
+    void initSparseSums(const Ref<const MatrixXd> Y, SparseSums &sums);
+    void sparseCrossProd(const GenoBufItem &item, const Ref<const MatrixXd> Y, const SparseSums &sums,
+            double &xtx, RowVectorXd &xtY);
+    // G x E tests of a panel: Z = X * E centred, and the 2 x 2 normal equations of (x, z),
+    //   each entry an array over the markers
+    struct GxEFit {
+        Eigen::ArrayXd x_p, z_p;                // x'y, z'y
+        Eigen::ArrayXd inv00, inv01, inv11;     // inverse of [x'x, z'x; z'x, z'z]
+        Eigen::ArrayXd beta_g, beta_gxe;
+    };
+    void fitGxEPanel(const Ref<const MatrixXd> X, MatrixXd &Z, GxEFit &fit);
+    // multiple traits from --mpheno, tested in one pass of the genotypes:
+    //   column t of Ymulti is Vi_y / c_inf of the trait, or the phenotype if it uses linear regression (c_inf 0)
+    bool bMultiTrait = false;
+    vector<int> traitCols;
+    MatrixXd Ymulti;
+    VectorXd traitCinf;
+    VectorXd traitSSy;
+    AsyncWriter *traitWriter = NULL;
+    void fitMultiTraits(SpMat &fam, bool flag_est_GE, double VG, double VR);
+    void setOutputFilters();
     vector<double> v_chisq;
     vector<double> v_c_infs;
     vector<uint8_t> bValids;
@@ -143,6 +225,7 @@ private:
     void logLREML(const Ref<const VectorXd> pheno, vector<double> &varcomp, double &logL, double *Hinv=NULL);
 
     void loadModel();
+    bool bModelLoaded = false;      // phenoVecMu and dWp read from a mapped binary model
 
     SpMat V_inverse;
     vector<double> phenos;
@@ -187,11 +270,22 @@ private:
     vector<char> osBuf;
     uint32_t numMarkerOutput = 0;
 
+    // --shard i/N: a range of the extract index, balanced by the bytes in the genotype file, is tested
+    //   into its own file; the checkpoint after each block is the index of that file for resuming,
+    //   and --merge-shards joins the finished shards in the order of the extract index
+    int shardIndex = 0;
+    int shardCount = 0;
+    std::ofstream osShardCkpt;
+    bool initShard(vector<uint32_t> &extractIndex, uint64_t &resumeBytes);
+    void shardCheckpoint(uintptr_t *genobuf, const vector<uint32_t> &markerIndex);
+    static void mergeShards();
+
     uint32_t seed;
 
     //binary
     bool bBinary = false; 
     void loadBinModel();
+    void loadBinModelLegacy(const string &bin_file, const vector<uint32_t> &id2);
     VectorXd phenoVecMu;
  
     static bool covarGLM(const VectorXd& phenoVec, const MatrixXd& covar, Ref<VectorXd> est_beta, int maxIter=200, double thresh = 1e-6);
@@ -209,10 +303,17 @@ private:
     void estBinGamma();
     void binGrammar_func(uintptr_t *genobuf, const vector<uint32_t> &markerIndex);
     void calculate_spa(uintptr_t *genobuf, const vector<uint32_t> &markerIndex);
-    void getX(uintptr_t *genobuf, const vector<uint32_t> &markerIndex);
+    double spaSparse(const GenoBufItem &item, SPARes &res, SPAInput &input);
     //void conditionCovarRegBin(Eigen::Ref<VectorXd> pheno);
     bool binGridREML(const SpMat& fam, Ref<VectorXd> est_a, int maxIter, double threshold);
-    double binLogL(double cur_tao, const SpMat& fam, const SpMat& W, const Ref<VectorXd> Y, const Ref<MatrixXd> X);
+    // factorisation of V = W + tao * fam for one grid point; each thread keeps one. The pattern of V
+    //   doesn't change with tao or W, so the ordering is analysed once and only the numbers refactorised
+    struct BinLogLContext {
+        Eigen::SimplicialLDLT<SpMat> solver;
+        bool analysed = false;
+        GRMBlocksSolver blockSolver;
+    };
+    double binLogL(double cur_tao, const SpMat& fam, const SpMat& W, const Ref<VectorXd> Y, const Ref<MatrixXd> X, BinLogLContext &context);
     SPARes saddleProb(double q, double var, const Ref<VectorXd> geno, double cutOff);
     SPARes saddleProbSP();
     void output_res_spa(const vector<uint8_t> &isValids, const vector<uint32_t> markerIndex);
@@ -224,11 +325,28 @@ private:
 
     // gene
     void processFAMreg();
-    MatrixXd gX;
-    VectorXd gAF;
-    VectorXd gN;
-    int num_gene_index;
-    
+    // set tests: the markers of all the genes are read once in the order of the extract index,
+    //   the decoded columns are kept in a window until the last gene over them is tested
+    struct SetWindow {
+        uint32_t start = 0;         // position of the first column in the markers of the genes
+        uint32_t size = 0;
+        MatrixXd raw;               // genotypes, flipped to the minor allele
+        MatrixXd adj;               // raw adjusted for the covariates
+        MatrixXd cov;               // adj' D adj, D the variance of the binary trait
+        VectorXd score;             // adj' (y - mu)
+        VectorXd pVar;              // p value of each marker, SPA adjusted; ACAT only
+        VectorXd maf;
+        vector<uint8_t> valid;
+    };
+    SetWindow setWindow;
+    // the genes spanning more columns are tested on their own, cov of the window is budget^2 doubles
+    uint32_t setWindowBudget = 8192;
+    bool bSetBurden = true;
+    bool bSetSKAT = false;
+    bool bSetACAT = false;
+    void setWindowAdd(uintptr_t *genobuf, const vector<uint32_t> &markerIndex);
+    void setWindowDrop(uint32_t start);
+    string setTest(const vector<uint32_t> &columns);
 };
 
 
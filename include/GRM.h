@@ -23,20 +23,36 @@
 #include <vector>
 #include <utility>
 #include <cmath>
+#include <thread>
+#include <atomic>
 #include "constants.hpp"
 #include "mem.hpp"
+#include "GRMContainer.hpp"
 
 using std::string;
 using std::vector;
 using std::pair;
 
+struct GRMCheckpointData;
+
 class GRM {
 public:
     GRM(Pheno *pheno, Marker *marker);
     GRM();
     ~GRM() {
-        posix_mem_free(grm);
-        posix_mem_free(N);
+        if(ckpt_thread.joinable()) ckpt_thread.join();
+        if(bOutOfCore){
+            unmap_ooc();
+        }else{
+            posix_mem_free(grm);
+            posix_mem_free(N);
+        }
+        if(grm_d) posix_mem_free(grm_d);
+        for(auto &target : targets){
+            posix_mem_free(target.grm);
+            posix_mem_free(target.N);
+            delete[] target.sub_miss;
+        }
         posix_mem_free(cmask_buf);
         if(lookup_GRM_table) delete[] lookup_GRM_table;
         if(sub_miss) delete[] sub_miss;
@@ -48,9 +64,15 @@ public:
 
     void calculate_GRM(uintptr_t* genobuf, const vector<uint32_t> &markerIndex);
     void calculate_GRM_blas(uintptr_t* genobuf, const vector<uint32_t> &markerIndex);
+    void calculate_GRM_multi(uintptr_t* genobuf, const vector<uint32_t> &markerIndex);
+    vector<int> decode_markers(uintptr_t* genobuf, const vector<uint32_t> &markerIndex);
+    void add_valid_markers(const vector<int> &validIndex);
+    void calculate_GRM_tiles(int numValidMarker);
     
     void grm_thread(int grm_index_from, int grm_index_to);
     void N_thread(int grm_index_from, int grm_index_to, const uintptr_t* cmask);
+    void N_sparse(const vector<uint32_t> &miss_samples, const uintptr_t *miss_mask);
+    void alloc_N();
     void deduce_GRM();
     vector<uint32_t> divide_parts(uint32_t from, uint32_t to, uint32_t num_parts);
     vector<uint32_t> divide_parts_mem(uint32_t n_sample, uint32_t num_parts);
@@ -59,6 +81,8 @@ public:
     static void processMain();
     void processMakeGRM();
     void processMakeGRMX();
+    void processMakeGRMMulti();
+    void processMakeGRMSparse();
 
     void loop_block(vector<function<void (double *buf, int num_block)>> callbacks
                     = vector<function<void (double *buf, int num_block)>>());
@@ -115,6 +139,7 @@ private:
     double *stdGeno = NULL;
 
     void output_id();
+    uint64_t id_hash = 0; // hash of the IDs in the output .grm.id
 
     string o_name;
 
@@ -130,7 +155,7 @@ private:
     const int num_byte_GRM_read = 100 * 1024 * 1024;
     vector<uint64_t> byte_part_grms;
 
-    void outBinFile(FILE *sFile, FILE *dFile);
+    void outBinFile(GRMRowReader &sFile, FILE *dFile);
 
     bool isDominance = false;
     bool isMtd = false;
@@ -140,6 +165,83 @@ private:
 
     GenoBufItem *gbufitems = NULL;
 
+    // out-of-core accumulation: grm and N are mapped from scratch files,
+    //   grm is stored transposed (each row of the part is contiguous) and
+    //   updated tile by tile
+    bool bOutOfCore = false;
+    uint64_t ooc_grm_bytes = 0;
+    uint64_t ooc_N_bytes = 0;
+    uint32_t ooc_tile_cols = 0;
+    uint32_t ooc_num_panel = 0;
+    void map_ooc(uint64_t fill_grm, uint64_t fill_N);
+    void unmap_ooc();
+
+    // direct sparse GRM: candidate pairs from a bit-packed screen, exact values only for them
+    bool bDirectSparse = false;
+    vector<pair<uint32_t, uint32_t>> sp_pairs;   // (id1, id2), id1 > id2
+    vector<uint32_t> sp_samples;                 // samples in any candidate pair
+    vector<int32_t> sp_compact;                  // sample index -> index in sp_samples, -1 if none
+    vector<double> sp_grm;
+    vector<uint32_t> sp_miss_both;
+    vector<double> sp_diag;
+    void screen_sparse_pairs(const vector<uint32_t> &processIndex, float screen_thresh, int num_screen_marker);
+    void calculate_sparse_GRM(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+    void write_sparse_GRM(float thresh);
+
+    // --update-grm: samples are ordered as in the existing GRM, new samples last
+    vector<uint32_t> sample_order;               // position in GRM -> index in the kept samples
+    uint32_t update_num_old = 0;                 // number of samples in the existing GRM
+    bool bUpdateMarkers = false;                 // true: add SNPs to the existing GRM; false: add samples
+    void init_update_order();
+    void permute_samples(GenoBufItem &item, double *out);
+    void copy_update_grm(FILE *grm_out, FILE *N_out);
+
+    // checkpoint of the accumulated GRM; in memory, a copy is written by a thread so that the BLAS threads go on
+    string ckpt_file;
+    bool bCheckpoint = false;
+    double ckpt_interval = 0;                    // seconds
+    uint64_t ckpt_key = 0;                       // hash of the settings the checkpoint is valid for
+    uint64_t grm_bytes = 0;
+    uint64_t N_bytes = 0;
+    std::thread ckpt_thread;
+    std::atomic<bool> ckpt_busy{false};
+    std::atomic<bool> ckpt_failed{false};
+    bool ckpt_warned = false;
+    void init_checkpoint(const vector<uint32_t> &processIndex);
+    uint32_t load_checkpoint(uint32_t num_marker);
+    void checkpoint(uintptr_t *buf, const vector<uint32_t> &markerIndex);
+    GRMCheckpointData checkpoint_data();
+    void finish_checkpoint();
+    void loop_markers(const vector<uint32_t> &processIndex, bool isSTD,
+            vector<function<void (uintptr_t *, const vector<uint32_t> &)>> &callBacks);
+
+    // additive and dominance GRMs from one pass of the genotypes (--make-grm with --make-grm-d)
+    bool bAddDom = false;
+    double *grm_d = NULL;
+    double *stdGeno_d = NULL;
+    void accumulate_panel(double *panel, double *acc, int numValidMarker);
+
+    // chrX: the male weight of each sample, applied to the finished GRM; empty if no weight
+    vector<double> x_weight;
+
+    // --make-grm-multi: several GRMs from one pass of the genotypes, the accumulators of
+    //   each target are swapped in while its SNPs of the block are added
+    struct GRMTarget {
+        string name;
+        double *grm = NULL;
+        uint32_t *N = NULL;
+        uint32_t *sub_miss = NULL;
+        vector<double> sd;
+        uint32_t numValidMarkers = 0;
+        bool bMAF = false;
+        double maf_from = 0.0;                   // maf_from < MAF <= maf_to
+        double maf_to = 0.5;
+    };
+    vector<GRMTarget> targets;
+    vector<uint64_t> target_mask;                // extract index -> bit t set if the SNP is allowed in target t
+    void init_targets(string spec_file);
+    void swap_target(GRMTarget &target);
+
     //Just for testing
 #ifndef NDEBUG
     FILE * o_geno0;
@@ -0,0 +1,337 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Block diagonal decomposition of a sparse GRM.
+
+   A sparse GRM is mostly unrelated samples plus small families. The
+   connected components of its non-zero pattern are the diagonal blocks of
+   V = Vg * GRM + Ve * I: a singleton is inverted as a scalar, a family is
+   factorised by a dense Cholesky, and a large component is factorised as
+   a sparse matrix. The blocks are independent and handled in parallel.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_GRMBLOCKS_HPP
+#define GCTA2_GRMBLOCKS_HPP
+#include <vector>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <omp.h>
+#include "Eigen/Dense"
+#include "Eigen/Sparse"
+#include <Eigen/SparseCholesky>
+
+class GRMBlocks {
+public:
+    struct Block {
+        std::vector<uint32_t> index;        // samples of the component, ascending
+        Eigen::MatrixXd dense;              // the GRM of the component if not larger than dense_limit
+        Eigen::SparseMatrix<double> sparse; // lower triangle otherwise
+    };
+
+    // fam: a symmetric sparse GRM with both triangles, as FastFAM::readFAM makes it
+    //  components larger than dense_limit samples are kept sparse
+    template <typename SparseType>
+    void init(const SparseType &fam, uint32_t dense_limit = 4096){
+        n = fam.rows();
+        blocks.clear();
+        singletons.clear();
+        single_diag.clear();
+
+        std::vector<uint32_t> parent(n);
+        std::iota(parent.begin(), parent.end(), 0);
+        for(int64_t k = 0; k < fam.outerSize(); ++k){
+            for(typename SparseType::InnerIterator it(fam, k); it; ++it){
+                if(it.row() == it.col()) continue;
+                uint32_t a = find(parent, it.row()), b = find(parent, it.col());
+                if(a != b) parent[std::max(a, b)] = std::min(a, b);
+            }
+        }
+
+        // components in the order of their first sample
+        std::vector<int64_t> comp_of(n, -1);
+        std::vector<uint32_t> comp_size(n, 0);
+        for(uint32_t i = 0; i < n; i++){
+            comp_size[find(parent, i)]++;
+        }
+        std::vector<int64_t> single_of(n, -1);
+        for(uint32_t i = 0; i < n; i++){
+            uint32_t root = find(parent, i);
+            if(comp_size[root] == 1){
+                single_of[i] = singletons.size();
+                singletons.push_back(i);
+                single_diag.push_back(0);
+                continue;
+            }
+            if(comp_of[root] == -1){
+                comp_of[root] = blocks.size();
+                blocks.push_back(Block());
+            }
+            comp_of[i] = comp_of[root];
+            blocks[comp_of[i]].index.push_back(i);
+        }
+
+        std::vector<uint32_t> local(n, 0);
+        for(auto &block : blocks){
+            for(uint32_t k = 0; k < block.index.size(); k++) local[block.index[k]] = k;
+            uint32_t size = block.index.size();
+            if(size <= dense_limit) block.dense.setZero(size, size);
+        }
+
+        std::vector<std::vector<Eigen::Triplet<double>>> triplets(blocks.size());
+        for(int64_t k = 0; k < fam.outerSize(); ++k){
+            for(typename SparseType::InnerIterator it(fam, k); it; ++it){
+                uint32_t r = it.row(), c = it.col();
+                if(r < c) continue;
+                if(single_of[r] != -1){
+                    single_diag[single_of[r]] = it.value();
+                    continue;
+                }
+                int64_t b = comp_of[find(parent, r)];
+                Block &block = blocks[b];
+                if(block.dense.size()){
+                    block.dense(local[r], local[c]) = it.value();
+                    block.dense(local[c], local[r]) = it.value();
+                }else{
+                    triplets[b].push_back(Eigen::Triplet<double>(local[r], local[c], it.value()));
+                }
+            }
+        }
+        for(uint64_t b = 0; b < blocks.size(); b++){
+            if(blocks[b].dense.size()) continue;
+            uint32_t size = blocks[b].index.size();
+            blocks[b].sparse.resize(size, size);
+            blocks[b].sparse.setFromTriplets(triplets[b].begin(), triplets[b].end());
+        }
+    }
+
+    uint32_t size() const { return n; }
+    uint64_t numBlocks() const { return blocks.size(); }
+    uint64_t numSingletons() const { return singletons.size(); }
+    uint32_t maxBlockSize() const {
+        uint32_t max_size = 0;
+        for(const auto &block : blocks) max_size = std::max(max_size, (uint32_t)block.index.size());
+        return max_size;
+    }
+
+private:
+    uint32_t n = 0;
+    std::vector<Block> blocks;
+    std::vector<uint32_t> singletons;
+    std::vector<double> single_diag;    // GRM diagonal of the singletons
+
+    static uint32_t find(std::vector<uint32_t> &parent, uint32_t i){
+        while(parent[i] != i){
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    friend class GRMBlocksSolver;
+};
+
+// Factors of V = Vg * GRM + Ve * I on the blocks
+class GRMBlocksSolver {
+public:
+    // false if V is not positive definite
+    bool compute(const GRMBlocks &grm_blocks, double VG, double VR){
+        return compute(grm_blocks, VG, Eigen::VectorXd::Constant(grm_blocks.size(), VR));
+    }
+
+    // V = Vg * GRM + diag(VR), the residual variance of each sample, e.g. the
+    //   working weights of a GLMM
+    bool compute(const GRMBlocks &grm_blocks, double VG, const Eigen::Ref<const Eigen::VectorXd> VR){
+        blocks = &grm_blocks;
+        uint64_t num_block = blocks->blocks.size();
+        single_inv.resize(blocks->singletons.size());
+        dense_llt.assign(num_block, Eigen::LLT<Eigen::MatrixXd>());
+        sparse_ldlt.assign(num_block, std::shared_ptr<SparseSolver>());
+        block_logdet.assign(num_block, 0);
+        std::vector<char> block_ok(num_block, 1);
+
+        bool success = true;
+        double single_logdet = 0;
+        for(uint64_t k = 0; k < single_inv.size(); k++){
+            double v = VG * blocks->single_diag[k] + VR[blocks->singletons[k]];
+            if(v <= 0) success = false;
+            single_inv[k] = 1.0 / v;
+            single_logdet += std::log(v);
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for(uint64_t b = 0; b < num_block; b++){
+            const GRMBlocks::Block &block = blocks->blocks[b];
+            if(block.dense.size()){
+                Eigen::MatrixXd V = VG * block.dense;
+                for(int64_t i = 0; i < V.rows(); i++) V(i, i) += VR[block.index[i]];
+                dense_llt[b].compute(V);
+                if(dense_llt[b].info() != Eigen::Success){
+                    block_ok[b] = 0;
+                    continue;
+                }
+                block_logdet[b] = 2.0 * dense_llt[b].matrixLLT().diagonal().array().log().sum();
+            }else{
+                Eigen::SparseMatrix<double> V = VG * block.sparse;
+                for(int64_t i = 0; i < V.rows(); i++) V.coeffRef(i, i) += VR[block.index[i]];
+                sparse_ldlt[b] = std::make_shared<SparseSolver>();
+                sparse_ldlt[b]->compute(V);
+                if(sparse_ldlt[b]->info() != Eigen::Success || (sparse_ldlt[b]->vectorD().array() <= 0).any()){
+                    block_ok[b] = 0;
+                    continue;
+                }
+                block_logdet[b] = sparse_ldlt[b]->vectorD().array().log().sum();
+            }
+        }
+        for(char ok : block_ok){
+            if(!ok) success = false;
+        }
+        logdet_V = single_logdet + std::accumulate(block_logdet.begin(), block_logdet.end(), 0.0);
+        return success;
+    }
+
+    double logdet() const { return logdet_V; }
+
+    // V^-1 X
+    template <typename Derived>
+    Eigen::MatrixXd solve(const Eigen::MatrixBase<Derived> &X) const {
+        Eigen::MatrixXd result(X.rows(), X.cols());
+        for(uint64_t k = 0; k < single_inv.size(); k++){
+            uint32_t i = blocks->singletons[k];
+            result.row(i) = X.row(i) * single_inv[k];
+        }
+        #pragma omp parallel for schedule(dynamic)
+        for(uint64_t b = 0; b < blocks->blocks.size(); b++){
+            const std::vector<uint32_t> &index = blocks->blocks[b].index;
+            Eigen::MatrixXd Xb(index.size(), X.cols());
+            for(uint64_t k = 0; k < index.size(); k++) Xb.row(k) = X.row(index[k]);
+            Eigen::MatrixXd Rb = sparse_ldlt[b] ? Eigen::MatrixXd(sparse_ldlt[b]->solve(Xb)) : Eigen::MatrixXd(dense_llt[b].solve(Xb));
+            for(uint64_t k = 0; k < index.size(); k++) result.row(index[k]) = Rb.row(k);
+        }
+        return result;
+    }
+
+    // trace(V^-1 GRM). A large component takes the entries of its V^-1 on the pattern of the
+    //  sparse factor only (the selected inverse), the component is never made dense
+    double traceViA() const {
+        double trace = 0;
+        for(uint64_t k = 0; k < single_inv.size(); k++){
+            trace += blocks->single_diag[k] * single_inv[k];
+        }
+        #pragma omp parallel for schedule(dynamic) reduction(+:trace)
+        for(uint64_t b = 0; b < blocks->blocks.size(); b++){
+            const GRMBlocks::Block &block = blocks->blocks[b];
+            if(block.dense.size()){
+                trace += dense_llt[b].solve(block.dense).trace();
+                continue;
+            }
+            std::vector<double> Z, Zdiag;
+            selectedInverse(*sparse_ldlt[b], Z, Zdiag);
+            const Eigen::SparseMatrix<double> &L = sparse_ldlt[b]->matrixL().nestedExpression();
+            const auto &perm = sparse_ldlt[b]->permutationP().indices();
+            for(int64_t c = 0; c < block.sparse.outerSize(); c++){
+                for(Eigen::SparseMatrix<double>::InnerIterator it(block.sparse, c); it; ++it){
+                    int64_t pr = perm[it.row()], pc = perm[it.col()];
+                    if(pr == pc){
+                        trace += it.value() * Zdiag[pr];
+                    }else{
+                        trace += 2.0 * it.value() * Z[find(L, std::max(pr, pc), std::min(pr, pc))];
+                    }
+                }
+            }
+        }
+        return trace;
+    }
+
+    // V^-1, non-zero only inside the blocks. Each block of V^-1 is dense, false without filling Vi
+    //  if a block is larger than max_block samples
+    template <typename SparseType>
+    bool inverse(SparseType &Vi, uint32_t max_block = 4096) const {
+        uint32_t n = blocks->n;
+        for(const auto &block : blocks->blocks){
+            if(block.index.size() > max_block) return false;
+        }
+        std::vector<std::vector<Eigen::Triplet<double>>> triplets(blocks->blocks.size());
+        #pragma omp parallel for schedule(dynamic)
+        for(uint64_t b = 0; b < blocks->blocks.size(); b++){
+            const std::vector<uint32_t> &index = blocks->blocks[b].index;
+            Eigen::MatrixXd eye = Eigen::MatrixXd::Identity(index.size(), index.size());
+            Eigen::MatrixXd Vbi = sparse_ldlt[b] ? Eigen::MatrixXd(sparse_ldlt[b]->solve(eye)) : Eigen::MatrixXd(dense_llt[b].solve(eye));
+            triplets[b].reserve(index.size() * index.size());
+            for(uint64_t j = 0; j < index.size(); j++){
+                for(uint64_t i = 0; i < index.size(); i++){
+                    triplets[b].push_back(Eigen::Triplet<double>(index[i], index[j], Vbi(i, j)));
+                }
+            }
+        }
+        std::vector<Eigen::Triplet<double>> all;
+        for(uint64_t k = 0; k < single_inv.size(); k++){
+            uint32_t i = blocks->singletons[k];
+            all.push_back(Eigen::Triplet<double>(i, i, single_inv[k]));
+        }
+        for(auto &cur : triplets){
+            all.insert(all.end(), cur.begin(), cur.end());
+            std::vector<Eigen::Triplet<double>>().swap(cur);
+        }
+        Vi.resize(n, n);
+        Vi.setFromTriplets(all.begin(), all.end());
+        Vi.makeCompressed();
+        return true;
+    }
+
+private:
+    typedef Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Lower> SparseSolver;
+    const GRMBlocks *blocks = NULL;
+    double logdet_V = 0;
+    std::vector<double> single_inv;
+    std::vector<Eigen::LLT<Eigen::MatrixXd>> dense_llt;
+    std::vector<std::shared_ptr<SparseSolver>> sparse_ldlt;
+    std::vector<double> block_logdet;
+
+    // position of the entry (row, col), row > col, in the values of L
+    static int64_t find(const Eigen::SparseMatrix<double> &L, int64_t row, int64_t col){
+        const int *begin = L.innerIndexPtr() + L.outerIndexPtr()[col];
+        const int *end = L.innerIndexPtr() + L.outerIndexPtr()[col + 1];
+        return std::lower_bound(begin, end, (int)row) - L.innerIndexPtr();
+    }
+
+    // Takahashi's equations: the entries of (L D L^T)^-1 on the pattern of L, in the layout of
+    //  the values of L (Z) and the diagonal (Zdiag), in the permuted order of the factor
+    static void selectedInverse(const SparseSolver &ldlt, std::vector<double> &Z, std::vector<double> &Zdiag){
+        const Eigen::SparseMatrix<double> &L = ldlt.matrixL().nestedExpression();
+        const Eigen::VectorXd &D = ldlt.vectorD();
+        int64_t size = L.cols();
+        const int *outer = L.outerIndexPtr();
+        const int *rows = L.innerIndexPtr();
+        const double *values = L.valuePtr();
+        Z.assign(L.nonZeros(), 0);
+        Zdiag.assign(size, 0);
+        for(int64_t j = size - 1; j >= 0; j--){
+            int64_t from = outer[j], to = outer[j + 1];
+            for(int64_t a = from; a < to; a++){
+                double sum = 0;
+                for(int64_t b = from; b < to; b++){
+                    int64_t ra = rows[a], rb = rows[b];
+                    double z = ra == rb ? Zdiag[ra] : Z[find(L, std::max(ra, rb), std::min(ra, rb))];
+                    sum += values[b] * z;
+                }
+                Z[a] = -sum;
+            }
+            double diag = 1.0 / D[j];
+            for(int64_t a = from; a < to; a++) diag -= values[a] * Z[a];
+            Zdiag[j] = diag;
+        }
+    }
+};
+
+#endif //GCTA2_GRMBLOCKS_HPP
@@ -0,0 +1,558 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   GRM v2 container (.grm.v2)
+
+   Layout:
+     header (96 bytes, little endian)
+     row blocks: zstd frames of the byte shuffled GRM values, followed by the
+                 frame of N unless all the N in the block equal const_N
+     block index: one GRMv2BlockIndex for each block
+   The header and the index have their own CRC32, each block has the CRC32 of
+   its uncompressed GRM and N values.
+
+   GRMRowReader reads rows of a GRM in either format (.grm.bin or .grm.v2).
+
+   A .grm.N.bin of a GRM without missing genotypes can be a GRMConstNHeader
+   alone: the N of all the pairs is const_N.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_GRMCONTAINER_HPP
+#define GCTA2_GRMCONTAINER_HPP
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <omp.h>
+#include <zlib.h>
+#include "zstd.h"
+#include "Logger.h"
+
+struct GRMv2Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint64_t num_sample;      // samples in .grm.id
+    uint64_t row_start;       // first row stored, not 0 for --make-grm-part
+    uint64_t num_row;
+    uint64_t num_marker;
+    uint32_t method;          // 0: default; 1: --make-grm-alg 1
+    uint32_t flags;
+    float const_N;
+    uint32_t block_elements;  // target number of values in a block
+    uint64_t num_block;
+    uint64_t index_offset;
+    uint64_t id_hash;         // FNV-1a of the lines in .grm.id
+    uint32_t index_crc;
+    uint32_t header_crc;      // CRC32 of the bytes above
+};
+static_assert(sizeof(GRMv2Header) == 96, "unexpected padding in GRMv2Header");
+
+struct GRMv2BlockIndex {
+    uint64_t row_from;
+    uint64_t offset;
+    uint32_t grm_bytes;
+    uint32_t N_bytes;         // 0: all N in the block are const_N
+    uint32_t grm_crc;
+    uint32_t N_crc;
+};
+static_assert(sizeof(GRMv2BlockIndex) == 32, "unexpected padding in GRMv2BlockIndex");
+
+struct GRMConstNHeader {
+    char magic[8];            // "GCTAGRMN"
+    uint64_t num_sample;
+    float const_N;
+    uint32_t reserved;
+};
+static_assert(sizeof(GRMConstNHeader) == 24, "unexpected padding in GRMConstNHeader");
+
+class GRMContainer {
+public:
+    static const char *magic(){ return "GCTAGRM2"; }
+    static const uint32_t version = 2;
+
+    static const uint32_t FLAG_CONST_N = 1;
+    static const uint32_t FLAG_DOMINANCE = 2;
+    static const uint32_t FLAG_XCHR = 4;
+
+    static std::string fileName(const std::string &prefix){
+        return prefix + ".grm.v2";
+    }
+
+    static uint64_t hashID(uint64_t hash, const std::string &line){
+        for(unsigned char c : line){
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= '\n';
+        hash *= 1099511628211ULL;
+        return hash;
+    }
+
+    static uint64_t hashIDs(const std::vector<std::string> &ids){
+        uint64_t hash = 14695981039346656037ULL;
+        for(auto &id : ids) hash = hashID(hash, id);
+        return hash;
+    }
+
+    static uint64_t hashIDFile(const std::string &id_file){
+        std::ifstream h_id(id_file.c_str());
+        if(!h_id) LOGGER.e(0, "cannot open the file [" + id_file + "] to read.");
+        uint64_t hash = 14695981039346656037ULL;
+        std::string line;
+        while(std::getline(h_id, line)){
+            if(!line.empty() && line.back() == '\r') line.pop_back();
+            if(line.empty()) continue;
+            hash = hashID(hash, line);
+        }
+        return hash;
+    }
+
+    // true if file_name is a constant .grm.N.bin of num_sample samples, the N in const_N
+    static bool readConstN(const std::string &file_name, uint64_t num_sample, float &const_N){
+        FILE *h_file = fopen(file_name.c_str(), "rb");
+        if(!h_file) return false;
+        GRMConstNHeader header;
+        bool is_const = fread(&header, sizeof(header), 1, h_file) == 1 && memcmp(header.magic, "GCTAGRMN", 8) == 0;
+        fclose(h_file);
+        if(!is_const) return false;
+        if(header.num_sample != num_sample){
+            LOGGER.e(0, "[" + file_name + "] was saved for " + std::to_string(header.num_sample) + " samples, not the "
+                    + std::to_string(num_sample) + " IDs in the GRM.");
+        }
+        const_N = header.const_N;
+        return true;
+    }
+
+    static bool writeConstN(FILE *h_file, uint64_t num_sample, float const_N){
+        GRMConstNHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "GCTAGRMN", 8);
+        header.num_sample = num_sample;
+        header.const_N = const_N;
+        return fwrite(&header, sizeof(header), 1, h_file) == 1;
+    }
+
+    static uint32_t crc(const void *data, uint64_t bytes){
+        uLong value = crc32(0L, Z_NULL, 0);
+        const Bytef *cur = (const Bytef *)data;
+        // crc32 takes uInt lengths
+        while(bytes){
+            uInt len = bytes > (1U << 30) ? (1U << 30) : (uInt)bytes;
+            value = crc32(value, cur, len);
+            cur += len;
+            bytes -= len;
+        }
+        return (uint32_t)value;
+    }
+
+    // the bytes of floats are grouped by significance, the exponent bytes compress well
+    static void shuffle(const float *in, uint64_t num, char *out){
+        const unsigned char *bytes = (const unsigned char *)in;
+        for(uint64_t i = 0; i < num; i++){
+            for(int b = 0; b < 4; b++) out[b * num + i] = bytes[i * 4 + b];
+        }
+    }
+
+    static void unshuffle(const char *in, uint64_t num, float *out){
+        unsigned char *bytes = (unsigned char *)out;
+        for(uint64_t i = 0; i < num; i++){
+            for(int b = 0; b < 4; b++) bytes[i * 4 + b] = in[b * num + i];
+        }
+    }
+};
+
+class GRMContainerWriter {
+public:
+    // num_row rows starting at row_start; id_hash from GRMContainer::hashIDs of the IDs in .grm.id
+    GRMContainerWriter(const std::string &file_name, uint64_t num_sample, uint64_t row_start, uint64_t num_row,
+            uint64_t num_marker, uint32_t method, uint32_t flags, uint64_t id_hash, int level = 3)
+        : file_name(file_name), level(level) {
+        h_file = fopen(file_name.c_str(), "wb");
+        if(!h_file) LOGGER.e(0, "can't open [" + file_name + "] to write.");
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, GRMContainer::magic(), 8);
+        header.version = GRMContainer::version;
+        header.header_bytes = sizeof(GRMv2Header);
+        header.num_sample = num_sample;
+        header.row_start = row_start;
+        header.num_row = num_row;
+        header.num_marker = num_marker;
+        header.method = method;
+        header.flags = flags | GRMContainer::FLAG_CONST_N;
+        header.block_elements = block_elements;
+        header.id_hash = id_hash;
+        write(&header, sizeof(header));
+        next_row = row_start;
+        block_row = row_start;
+    }
+
+    ~GRMContainerWriter(){
+        if(h_file) fclose(h_file);
+    }
+
+    // append the next row, row_length = row + 1
+    void addRow(const float *grm_row, const float *N_row, uint64_t row_length){
+        if(next_row == header.row_start) header.const_N = N_row[0];
+        grm_buf.insert(grm_buf.end(), grm_row, grm_row + row_length);
+        N_buf.insert(N_buf.end(), N_row, N_row + row_length);
+        next_row++;
+        if(grm_buf.size() >= block_elements) flushBlock();
+    }
+
+    void close(){
+        if(!h_file) return;
+        flushBlock();
+        if(next_row != header.row_start + header.num_row){
+            LOGGER.e(0, "incomplete GRM written to [" + file_name + "].");
+        }
+        header.num_block = index.size();
+        header.index_offset = offset;
+        header.index_crc = GRMContainer::crc(index.data(), index.size() * sizeof(GRMv2BlockIndex));
+        write(index.data(), index.size() * sizeof(GRMv2BlockIndex));
+        header.header_crc = GRMContainer::crc(&header, offsetof(GRMv2Header, header_crc));
+        if(fseek(h_file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, h_file) != 1 || fclose(h_file) != 0){
+            h_file = NULL;
+            LOGGER.e(0, "can't write to [" + file_name + "].");
+        }
+        h_file = NULL;
+    }
+
+    uint64_t bytes() const { return offset; }
+
+private:
+    static const uint32_t block_elements = 8 * 1024 * 1024;
+    std::string file_name;
+    int level;
+    FILE *h_file = NULL;
+    GRMv2Header header;
+    std::vector<GRMv2BlockIndex> index;
+    std::vector<float> grm_buf, N_buf;
+    std::vector<char> shuffle_buf, comp_buf;
+    uint64_t offset = 0;
+    uint64_t next_row = 0;
+    uint64_t block_row = 0;
+
+    void write(const void *data, uint64_t bytes){
+        if(bytes && fwrite(data, 1, bytes, h_file) != bytes){
+            LOGGER.e(0, "can't write to [" + file_name + "].");
+        }
+        offset += bytes;
+    }
+
+    uint32_t compress(const std::vector<float> &values){
+        uint64_t num = values.size();
+        shuffle_buf.resize(num * sizeof(float));
+        GRMContainer::shuffle(values.data(), num, shuffle_buf.data());
+        comp_buf.resize(ZSTD_compressBound(shuffle_buf.size()));
+        size_t comp_bytes = ZSTD_compress(comp_buf.data(), comp_buf.size(), shuffle_buf.data(), shuffle_buf.size(), level);
+        if(ZSTD_isError(comp_bytes)){
+            LOGGER.e(0, "compressing GRM error: " + std::string(ZSTD_getErrorName(comp_bytes)));
+        }
+        write(comp_buf.data(), comp_bytes);
+        return (uint32_t)comp_bytes;
+    }
+
+    void flushBlock(){
+        if(grm_buf.empty()) return;
+        GRMv2BlockIndex item;
+        item.row_from = block_row;
+        item.offset = offset;
+        item.grm_crc = GRMContainer::crc(grm_buf.data(), grm_buf.size() * sizeof(float));
+        item.N_crc = GRMContainer::crc(N_buf.data(), N_buf.size() * sizeof(float));
+        item.grm_bytes = compress(grm_buf);
+        bool const_N = true;
+        for(float value : N_buf){
+            if(value != header.const_N){
+                const_N = false;
+                break;
+            }
+        }
+        if(const_N){
+            item.N_bytes = 0;
+        }else{
+            item.N_bytes = compress(N_buf);
+            header.flags &= ~GRMContainer::FLAG_CONST_N;
+        }
+        index.push_back(item);
+        grm_buf.clear();
+        N_buf.clear();
+        block_row = next_row;
+    }
+};
+
+class GRMContainerReader {
+public:
+    GRMContainerReader(){}
+    ~GRMContainerReader(){
+        close();
+    }
+    GRMContainerReader(const GRMContainerReader &) = delete;
+    GRMContainerReader &operator=(const GRMContainerReader &) = delete;
+
+    void open(const std::string &file_name){
+        close();
+        this->file_name = file_name;
+        h_file = fopen(file_name.c_str(), "rb");
+        if(!h_file) LOGGER.e(0, "cannot open the file [" + file_name + "] to read.");
+        if(fread(&header, sizeof(header), 1, h_file) != 1 || memcmp(header.magic, GRMContainer::magic(), 8) != 0){
+            LOGGER.e(0, "[" + file_name + "] is not a GRM v2 file.");
+        }
+        if(header.version != GRMContainer::version || header.header_bytes != sizeof(GRMv2Header)){
+            LOGGER.e(0, "unsupported version of the GRM file [" + file_name + "].");
+        }
+        if(GRMContainer::crc(&header, offsetof(GRMv2Header, header_crc)) != header.header_crc){
+            LOGGER.e(0, "the header of [" + file_name + "] is corrupted.");
+        }
+        index.resize(header.num_block);
+        if(fseek(h_file, header.index_offset, SEEK_SET) != 0 ||
+                fread(index.data(), sizeof(GRMv2BlockIndex), index.size(), h_file) != index.size() ||
+                GRMContainer::crc(index.data(), index.size() * sizeof(GRMv2BlockIndex)) != header.index_crc){
+            LOGGER.e(0, "the block index of [" + file_name + "] is corrupted.");
+        }
+        cached_block = -1;
+    }
+
+    void close(){
+        if(h_file) fclose(h_file);
+        h_file = NULL;
+        index.clear();
+        cached_block = -1;
+    }
+
+    const GRMv2Header &info() const { return header; }
+    bool constN() const { return header.flags & GRMContainer::FLAG_CONST_N; }
+
+    // the GRM should go with its .grm.id
+    void checkID(const std::string &id_file) const {
+        if(GRMContainer::hashIDFile(id_file) != header.id_hash){
+            LOGGER.e(0, "the IDs in [" + id_file + "] do not match the GRM [" + file_name + "].");
+        }
+    }
+
+    // rows [from, to) to the packed lower triangle, either output can be NULL
+    void readRows(uint64_t from, uint64_t to, float *grm_out, float *N_out){
+        uint64_t base = from * (from + 1) / 2;
+        for(uint64_t block = findBlock(from); from < to; block++){
+            uint64_t row_from = index[block].row_from;
+            uint64_t row_to = rowEnd(block);
+            if(cached_block != (int64_t)block){
+                decodeBlock(block, grm_cache, N_cache);
+                cached_block = block;
+            }
+            uint64_t copy_to = std::min(to, row_to);
+            uint64_t start = from * (from + 1) / 2 - row_from * (row_from + 1) / 2;
+            uint64_t num = copy_to * (copy_to + 1) / 2 - from * (from + 1) / 2;
+            uint64_t out_pos = from * (from + 1) / 2 - base;
+            if(grm_out) memcpy(grm_out + out_pos, grm_cache.data() + start, num * sizeof(float));
+            if(N_out) memcpy(N_out + out_pos, N_cache.data() + start, num * sizeof(float));
+            from = copy_to;
+        }
+    }
+
+    // all the stored rows, blocks are decompressed in parallel
+    void readAll(float *grm_out, float *N_out){
+        uint64_t base = header.row_start * (header.row_start + 1) / 2;
+        int num_thread = omp_get_max_threads();
+        uint64_t batch = (uint64_t)std::max(1, 2 * num_thread);
+        std::vector<std::vector<char>> comps(batch);
+        for(uint64_t start = 0; start < index.size(); start += batch){
+            uint64_t end = std::min((uint64_t)index.size(), start + batch);
+            for(uint64_t block = start; block < end; block++){
+                readCompressed(block, comps[block - start]);
+            }
+            bool failed = false;
+            #pragma omp parallel for schedule(dynamic)
+            for(uint64_t block = start; block < end; block++){
+                uint64_t row_from = index[block].row_from;
+                float *grm_pos = grm_out ? grm_out + row_from * (row_from + 1) / 2 - base : NULL;
+                float *N_pos = N_out ? N_out + row_from * (row_from + 1) / 2 - base : NULL;
+                if(!decompress(block, comps[block - start], grm_pos, N_pos)){
+                    #pragma omp atomic write
+                    failed = true;
+                }
+            }
+            if(failed){
+                LOGGER.e(0, "[" + file_name + "] is corrupted, a row block failed the checksum.");
+            }
+        }
+    }
+
+private:
+    std::string file_name;
+    FILE *h_file = NULL;
+    GRMv2Header header;
+    std::vector<GRMv2BlockIndex> index;
+    std::vector<float> grm_cache, N_cache;
+    int64_t cached_block = -1;
+
+    uint64_t rowEnd(uint64_t block) const {
+        return block + 1 < index.size() ? index[block + 1].row_from : header.row_start + header.num_row;
+    }
+
+    uint64_t findBlock(uint64_t row) const {
+        if(row < header.row_start || row >= header.row_start + header.num_row){
+            LOGGER.e(0, "row " + std::to_string(row + 1) + " is not in [" + file_name + "].");
+        }
+        uint64_t lo = 0, hi = index.size();
+        while(hi - lo > 1){
+            uint64_t mid = (lo + hi) / 2;
+            if(index[mid].row_from <= row) lo = mid;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    void readCompressed(uint64_t block, std::vector<char> &comp){
+        const GRMv2BlockIndex &item = index[block];
+        uint64_t bytes = (uint64_t)item.grm_bytes + item.N_bytes;
+        comp.resize(bytes);
+        if(fseek(h_file, item.offset, SEEK_SET) != 0 || fread(comp.data(), 1, bytes, h_file) != bytes){
+            LOGGER.e(0, "failed to read row block " + std::to_string(block) + " of [" + file_name + "].");
+        }
+    }
+
+    static bool decompressFrame(const char *comp, uint64_t comp_bytes, uint64_t num, float *out, uint32_t expect_crc){
+        std::vector<char> buf(num * sizeof(float));
+        size_t bytes = ZSTD_decompress(buf.data(), buf.size(), comp, comp_bytes);
+        if(ZSTD_isError(bytes) || bytes != buf.size()) return false;
+        GRMContainer::unshuffle(buf.data(), num, out);
+        return GRMContainer::crc(out, num * sizeof(float)) == expect_crc;
+    }
+
+    // thread safe, outputs can be NULL
+    bool decompress(uint64_t block, const std::vector<char> &comp, float *grm_out, float *N_out) const {
+        const GRMv2BlockIndex &item = index[block];
+        uint64_t row_from = item.row_from, row_to = rowEnd(block);
+        uint64_t num = row_to * (row_to + 1) / 2 - row_from * (row_from + 1) / 2;
+        if(grm_out && !decompressFrame(comp.data(), item.grm_bytes, num, grm_out, item.grm_crc)) return false;
+        if(N_out){
+            if(item.N_bytes){
+                return decompressFrame(comp.data() + item.grm_bytes, item.N_bytes, num, N_out, item.N_crc);
+            }
+            std::fill(N_out, N_out + num, header.const_N);
+        }
+        return true;
+    }
+
+    void decodeBlock(uint64_t block, std::vector<float> &grm_out, std::vector<float> &N_out){
+        std::vector<char> comp;
+        readCompressed(block, comp);
+        uint64_t row_from = index[block].row_from, row_to = rowEnd(block);
+        uint64_t num = row_to * (row_to + 1) / 2 - row_from * (row_from + 1) / 2;
+        grm_out.resize(num);
+        N_out.resize(num);
+        if(!decompress(block, comp, grm_out.data(), N_out.data())){
+            LOGGER.e(0, "[" + file_name + "] is corrupted, row block " + std::to_string(block) + " failed the checksum.");
+        }
+    }
+};
+
+// Sequential or random row access to a GRM stored as .grm.bin or .grm.v2, the raw format is preferred.
+class GRMRowReader {
+public:
+    static bool exists(const std::string &prefix, bool fromN = false){
+        return readable(prefix + (fromN ? ".grm.N.bin" : ".grm.bin")) || readable(GRMContainer::fileName(prefix));
+    }
+
+    // fromN: read .grm.N.bin, or N from the container
+    void open(const std::string &prefix, uint64_t num_sample, bool fromN = false){
+        close();
+        bConstN = false;
+        this->fromN = fromN;
+        this->num_sample = num_sample;
+        std::string raw_name = prefix + (fromN ? ".grm.N.bin" : ".grm.bin");
+        if(readable(raw_name) || !readable(GRMContainer::fileName(prefix))){
+            h_raw = fopen(raw_name.c_str(), "rb");
+            if(!h_raw) LOGGER.e(0, "cannot open the file [" + raw_name + "] to read.");
+            file_name = raw_name;
+            bConstN = fromN && GRMContainer::readConstN(raw_name, num_sample, const_N);
+            return;
+        }
+        file_name = GRMContainer::fileName(prefix);
+        container.open(file_name);
+        const GRMv2Header &info = container.info();
+        if(info.row_start != 0 || info.num_row != info.num_sample || info.num_sample != num_sample){
+            LOGGER.e(0, "[" + file_name + "] is a part of GRM or doesn't match the number of IDs.");
+        }
+        container.checkID(prefix + ".grm.id");
+        if(fromN && container.constN()){
+            bConstN = true;
+            const_N = info.const_N;
+        }
+    }
+
+    void close(){
+        if(h_raw) fclose(h_raw);
+        h_raw = NULL;
+        container.close();
+    }
+
+    ~GRMRowReader(){
+        close();
+    }
+
+    bool isContainer() const { return h_raw == NULL; }
+    bool isConstN() const { return bConstN; }
+    float constN() const { return const_N; }
+    const std::string &name() const { return file_name; }
+
+    // rows [from, to) as packed lower triangle, the rows need not follow the previous read
+    bool readRows(uint64_t from, uint64_t to, float *out){
+        if(bConstN){
+            std::fill(out, out + (to * (to + 1) / 2 - from * (from + 1) / 2), const_N);
+            return true;
+        }
+        if(h_raw){
+            uint64_t start = from * (from + 1) / 2;
+            uint64_t num = to * (to + 1) / 2 - start;
+            if(start != raw_pos && fseeko(h_raw, start * sizeof(float), SEEK_SET) != 0) return false;
+            raw_pos = start + num;
+            return fread(out, sizeof(float), num, h_raw) == num;
+        }
+        if(fromN) container.readRows(from, to, NULL, out);
+        else container.readRows(from, to, out, NULL);
+        return true;
+    }
+
+    // the whole triangle
+    void readAll(float *out){
+        if(h_raw){
+            if(!readRows(0, num_sample, out)) LOGGER.e(0, "the size of [" + file_name + "] does not match the number of IDs in the GRM.");
+            return;
+        }
+        if(fromN) container.readAll(NULL, out);
+        else container.readAll(out, NULL);
+    }
+
+private:
+    std::string file_name;
+    bool fromN = false;
+    uint64_t num_sample = 0;
+    FILE *h_raw = NULL;
+    uint64_t raw_pos = 0;
+    bool bConstN = false;
+    float const_N = 0;
+    GRMContainerReader container;
+
+    static bool readable(const std::string &name){
+        FILE *h = fopen(name.c_str(), "rb");
+        if(!h) return false;
+        fclose(h);
+        return true;
+    }
+};
+
+#endif //GCTA2_GRMCONTAINER_HPP
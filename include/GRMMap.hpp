@@ -0,0 +1,211 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Memory mapped read access to the binary GRM (.grm.bin, .grm.N.bin)
+
+   The lower triangle is accessed in place as packed rows, and it is expanded
+   to a dense matrix only when a caller asks for it. A GRM v2 container
+   (.grm.v2) is decompressed into memory when there is no .grm.bin. A constant
+   N (a GRMConstNHeader .grm.N.bin, or a container flagged FLAG_CONST_N) is
+   kept as the value only.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_GRMMAP_HPP
+#define GCTA2_GRMMAP_HPP
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <omp.h>
+#include "Logger.h"
+#include "GRMContainer.hpp"
+#include "MappedFile.hpp"
+
+class GRMMap {
+public:
+    GRMMap(){}
+    GRMMap(const std::string &prefix, uint64_t num_sample, bool withN = false){
+        open(prefix, num_sample, withN);
+    }
+    ~GRMMap(){
+        close();
+    }
+    GRMMap(const GRMMap &) = delete;
+    GRMMap &operator=(const GRMMap &) = delete;
+
+    // num_sample: the number of IDs in .grm.id, used to check the file size
+    void open(const std::string &prefix, uint64_t num_sample, bool withN = false){
+        close();
+        n = num_sample;
+        FILE *h_raw = fopen((prefix + ".grm.bin").c_str(), "rb");
+        if(!h_raw && GRMRowReader::exists(prefix)){
+            grm = read_container(prefix, false, grm_region);
+            if(withN) N = read_container(prefix, true, N_region);
+            return;
+        }
+        if(h_raw) fclose(h_raw);
+        grm = map_file(prefix + ".grm.bin", grm_region);
+        if(withN){
+            std::string N_name = prefix + ".grm.N.bin";
+            bConstN = GRMContainer::readConstN(N_name, n, const_N);
+            if(!bConstN) N = map_file(N_name, N_region);
+        }
+    }
+
+    void close(){
+        unmap_file(grm_region);
+        unmap_file(N_region);
+        grm = NULL;
+        N = NULL;
+        bConstN = false;
+    }
+
+    bool is_open() const { return grm != NULL; }
+    bool hasN() const { return N != NULL || bConstN; }
+    uint64_t size() const { return n; }
+
+    // the N of all pairs is constN(), there are no packed rows of N then
+    bool isConstN() const { return bConstN; }
+    float constN() const { return const_N; }
+
+    // packed row i of the lower triangle, i + 1 elements
+    const float *row(uint64_t i) const { return grm + i * (i + 1) / 2; }
+    const float *rowN(uint64_t i) const {
+        if(bConstN) LOGGER.e(0, "the N of the GRM is a constant, no rows to read.");
+        return N + i * (i + 1) / 2;
+    }
+
+    float at(uint64_t i, uint64_t j) const {
+        return i >= j ? grm[i * (i + 1) / 2 + j] : grm[j * (j + 1) / 2 + i];
+    }
+    float atN(uint64_t i, uint64_t j) const {
+        if(bConstN) return const_N;
+        return i >= j ? N[i * (i + 1) / 2 + j] : N[j * (j + 1) / 2 + i];
+    }
+
+    // Visit the rows [from, to) in blocks of about block_bytes, f(row_from, row_to, packed start of row_from).
+    //  The blocks are contiguous in the file, the next block is read ahead while f works on the current one.
+    template <typename F>
+    void forRowBlocks(uint64_t from, uint64_t to, F f, uint64_t block_bytes = 256ULL * 1024 * 1024) const {
+        uint64_t cur = from;
+        while(cur < to){
+            uint64_t end = cur + 1;
+            while(end < to && ((end + 1) * (end + 2) / 2 - cur * (cur + 1) / 2) * sizeof(float) <= block_bytes) end++;
+            if(end < to){
+                uint64_t next_end = end + 1;
+                while(next_end < to && ((next_end + 1) * (next_end + 2) / 2 - end * (end + 1) / 2) * sizeof(float) <= block_bytes) next_end++;
+                advise(row(end), (next_end * (next_end + 1) / 2 - end * (end + 1) / 2) * sizeof(float));
+            }
+            f(cur, end, row(cur));
+            cur = end;
+        }
+    }
+
+    // Expand the GRM, or the samples in keep (indices in the GRM, in this order), to a dense symmetric matrix.
+    //  Works on any Eigen dense matrix; keep = NULL takes all samples.
+    template <typename MatrixType>
+    void expand(MatrixType &mat, const std::vector<int> *keep = NULL, bool fromN = false) const {
+        int64_t m = keep ? keep->size() : n;
+        if(fromN && bConstN){
+            mat.setConstant(m, m, const_N);
+            return;
+        }
+        const float *data = fromN ? N : grm;
+        if(!data){
+            LOGGER.e(0, "the GRM has not been loaded.");
+        }
+        mat.resize(m, m);
+        #pragma omp parallel for schedule(dynamic, 64)
+        for(int64_t i = 0; i < m; i++){
+            uint64_t r = keep ? (*keep)[i] : i;
+            const float *cur_row = data + r * (r + 1) / 2;
+            for(int64_t j = 0; j <= i; j++){
+                uint64_t c = keep ? (*keep)[j] : j;
+                float value = c <= r ? cur_row[c] : data[c * (c + 1) / 2 + r];
+                mat(i, j) = value;
+            }
+        }
+        // the upper triangle by columns, cache friendly for column major matrices
+        #pragma omp parallel for schedule(dynamic, 64)
+        for(int64_t j = 0; j < m; j++){
+            for(int64_t i = 0; i < j; i++){
+                mat(i, j) = mat(j, i);
+            }
+        }
+    }
+
+private:
+    struct Region{
+        MappedFile file;
+        std::vector<float> buffer; // decompressed from .grm.v2
+    };
+
+    uint64_t n = 0;
+    const float *grm = NULL;
+    const float *N = NULL;
+    bool bConstN = false;
+    float const_N = 0;
+    Region grm_region, N_region;
+
+    const float *map_file(const std::string &file_name, Region &region){
+        uint64_t expect_bytes = n * (n + 1) / 2 * sizeof(float);
+        region.file.open(file_name);
+        if(region.file.size() != expect_bytes){
+            LOGGER.e(0, "the size of [" + file_name + "] does not match the number of IDs in the GRM.");
+        }
+        return (const float *)region.file.data();
+    }
+
+    const float *read_container(const std::string &prefix, bool fromN, Region &region){
+        GRMRowReader reader;
+        reader.open(prefix, n, fromN);
+        if(reader.isConstN()){
+            bConstN = true;
+            const_N = reader.constN();
+            return NULL;
+        }
+        region.buffer.resize(n * (n + 1) / 2);
+        reader.readAll(region.buffer.data());
+        return region.buffer.data();
+    }
+
+    void unmap_file(Region &region){
+        region.file.close();
+        std::vector<float>().swap(region.buffer);
+    }
+
+    void advise(const float *start, uint64_t bytes) const {
+#ifndef _WIN32
+        if(!grm_region.file.isMapped()) return;
+        static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        uintptr_t addr = (uintptr_t)start;
+        uintptr_t aligned = addr & ~(page_size - 1);
+        madvise((void *)aligned, bytes + (addr - aligned), MADV_WILLNEED);
+#endif
+    }
+};
+
+// A kept subset of a mapped GRM, no copy
+class GRMKeepView {
+public:
+    GRMKeepView(const GRMMap &grm_map, const std::vector<int> &keep) : map(grm_map), index(keep){}
+    uint64_t size() const { return index.size(); }
+    float operator()(uint64_t i, uint64_t j) const { return map.at(index[i], index[j]); }
+    float N(uint64_t i, uint64_t j) const { return map.atN(index[i], index[j]); }
+    template <typename MatrixType>
+    void expand(MatrixType &mat, bool fromN = false) const { map.expand(mat, &index, fromN); }
+
+private:
+    const GRMMap &map;
+    const std::vector<int> &index;
+};
+
+#endif //GCTA2_GRMMAP_HPP
@@ -67,12 +67,14 @@ typedef struct GenoBuffer{
 typedef struct GenoBufItem{
     // in
     uint32_t extractedMarkerIndex;   // for allele lookup
+    double sparseMAF = 0;            // decode as carriers if the MAF is below, PLINK bed only
 
     // out
     bool valid;
   //  int refAllele; //0 as 1, 1 as GCTA
     uint8_t isSexXY;   // 0: no, 1: X, 2: Y
     vector<double> geno;
+    vector<double> geno_d; // dominance coding, only when both GRMs are made in one pass
     vector<uintptr_t> missing;
     double af;
     double mean;
@@ -80,6 +82,12 @@ typedef struct GenoBufItem{
     double info;
     uint32_t nValidN;
     uint32_t nValidAllele;
+    // decoded as carriers instead of geno: the genotype is sparse_base,
+    //   or sparse_base + carrier_delta[k] for the sample carriers[k]
+    bool bSparse = false;
+    double sparse_base;
+    vector<uint32_t> carriers;
+    vector<double> carrier_delta;
 } GenoBufItem;
 
 
@@ -137,7 +145,11 @@ public:
 
     bool getGenoHasInfo();
 
-    void setGRMMode(bool grm, bool dominace);
+    // both: decode the additive coding to geno and the dominance coding to geno_d
+    void setGRMMode(bool grm, bool dominace, bool both = false);
+    // The male weight on chrX is left to the caller, who applies it to the GRM once;
+    //  returns false if the males need no weight.
+    bool deferMaleWeight(vector<uint32_t> &maleIndex, double &weight);
     void setGenoItemSize(uint32_t &genoSize, uint32_t &missSize);
  
 private:
@@ -288,10 +300,13 @@ private:
     bool bMakeMiss;
     bool bGRM = false;
     bool bGRMDom = false;
+    bool bGRMBoth = false;
+    bool bDeferMaleWeight = false;
     int iGRMdc = -1; // 0 no male dosage comp; 1 full comp; //default value shall be -1, equal variance
     int iDC = 1;
     bool f_std = false;
     void setMaleWeight(double &weight, bool &needWeight); // set the male weight by bGRM, dc specity
+    void domCoding(double mu, double sd, bool isEffRev, double &a0, double &a1, double &a2, double &na);
 
     int8_t alleModel = 1; // 1: add; 2: Dom; 3: Reces; 4: Het; //currently unused affect a0 a1 a2 na;
 
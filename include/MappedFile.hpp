@@ -0,0 +1,107 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Read only view of a whole file
+
+   The file is memory mapped where possible, otherwise read into a buffer.
+   The data are aligned to 8 bytes in both cases, so that the sections of
+   doubles at aligned offsets can be viewed in place.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_MAPPEDFILE_HPP
+#define GCTA2_MAPPEDFILE_HPP
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include "Logger.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class MappedFile {
+public:
+    MappedFile(){}
+    ~MappedFile(){ close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    void open(const std::string &file_name){
+        close();
+#ifndef _WIN32
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if(fd == -1){
+            LOGGER.e(0, "can't open [" + file_name + "] to read.");
+        }
+        struct stat file_stat;
+        if(fstat(fd, &file_stat) == 0 && file_stat.st_size > 0){
+            void *addr = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(addr != MAP_FAILED){
+                map_addr = addr;
+                map_bytes = file_stat.st_size;
+                file_data = (const char *)addr;
+                file_bytes = map_bytes;
+            }
+        }
+        ::close(fd);
+#endif
+        if(!file_data){
+            // fall back to reading the whole file
+            FILE *h_file = fopen(file_name.c_str(), "rb");
+            if(!h_file){
+                LOGGER.e(0, "can't open [" + file_name + "] to read.");
+            }
+            // 64 bit offsets, a GRM easily exceeds 2 GB
+#ifndef _WIN32
+            fseeko(h_file, 0, SEEK_END);
+            file_bytes = ftello(h_file);
+#else
+            _fseeki64(h_file, 0, SEEK_END);
+            file_bytes = _ftelli64(h_file);
+#endif
+            rewind(h_file);
+            buffer.resize((file_bytes + 7) / 8);
+            if(fread(buffer.data(), 1, file_bytes, h_file) != file_bytes){
+                fclose(h_file);
+                LOGGER.e(0, "can't read [" + file_name + "].");
+            }
+            fclose(h_file);
+            file_data = (const char *)buffer.data();
+        }
+    }
+
+    void close(){
+#ifndef _WIN32
+        if(map_addr) munmap(map_addr, map_bytes);
+#endif
+        map_addr = NULL;
+        map_bytes = 0;
+        std::vector<uint64_t>().swap(buffer);
+        file_data = NULL;
+        file_bytes = 0;
+    }
+
+    const char *data() const { return file_data; }
+    uint64_t size() const { return file_bytes; }
+    bool isMapped() const { return map_addr != NULL; }
+
+private:
+    void *map_addr = NULL;
+    uint64_t map_bytes = 0;
+    std::vector<uint64_t> buffer;
+    const char *file_data = NULL;
+    uint64_t file_bytes = 0;
+};
+
+#endif //GCTA2_MAPPEDFILE_HPP
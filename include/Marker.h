@@ -56,6 +56,8 @@ public:
     int getMIndex(uint32_t raw_index);
     //uint64_t getStartPosSize(uint32_t raw_index);
     void getStartPosSize(uint32_t raw_index, uint64_t &pos, uint64_t &size);
+    // bytes of the marker in the genotype file, 0 if not known (only the indexed bgen has them)
+    uint64_t getMarkerBytes(uint32_t raw_index);
     bool isEffecRev(uint32_t extractedIndex);
     bool isEffecRevRaw(uint32_t rawIndex);
     string get_marker(int rawindex, bool bflip=false);
@@ -49,6 +49,8 @@ public:
     uint8_t extract_genobit(uint8_t * const buf, int index_in_keep);
     vector<uint32_t>& get_index_keep();
     void get_pheno(vector<string>& ids, vector<double>& pheno);
+    int count_mpheno();
+    void get_mpheno(vector<vector<double>>& values, vector<int>& cols);
     void save_pheno(string filename);
     void filter_keep_index(vector<uint32_t>& k_index);
     void getMaskBit(uint64_t *maskp);
@@ -71,6 +73,8 @@ private:
     vector<string> mo_id;
     vector<int8_t> sex;
     vector<double> pheno;
+    vector<vector<double>> mpheno; // traits of a multi-column --mpheno, raw index
+    vector<int> mpheno_cols;
     vector<uint32_t> index_keep;
     vector<uint32_t> index_rm;
 
@@ -0,0 +1,190 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Relatedness pruning on the graph of pairs above the GRM cutoff.
+
+   The pairs are collected by a parallel scan of the GRM rows. The removal
+   works on each connected component of the graph independently.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_RELGRAPH_HPP
+#define GCTA2_RELGRAPH_HPP
+#include <vector>
+#include <set>
+#include <numeric>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <omp.h>
+
+struct RelEdge {
+    uint32_t id1;   // the later sample, id1 > id2
+    uint32_t id2;
+    float value;
+};
+
+class RelGraph {
+public:
+    // Pairs (i, j), j < i < num_sample, with value(i, j) > thresh.
+    //  value is called concurrently for different rows; the result is ordered by row.
+    template <typename F>
+    static std::vector<RelEdge> scan(uint32_t num_sample, float thresh, F value){
+        // rows are handed out in chunks of 256
+        const uint32_t chunk = 256;
+        uint32_t num_chunk = (num_sample + chunk - 1) / chunk;
+        std::vector<std::vector<RelEdge>> chunk_edges(num_chunk);
+        #pragma omp parallel for schedule(dynamic)
+        for(uint32_t c = 0; c < num_chunk; c++){
+            std::vector<RelEdge> &edges = chunk_edges[c];
+            uint32_t row_end = std::min(num_sample, (c + 1) * chunk);
+            for(uint32_t i = c * chunk; i < row_end; i++){
+                for(uint32_t j = 0; j < i; j++){
+                    float cur_value = value(i, j);
+                    if(cur_value > thresh){
+                        RelEdge edge = {i, j, cur_value};
+                        edges.push_back(edge);
+                    }
+                }
+            }
+        }
+        std::vector<RelEdge> result;
+        for(auto &edges : chunk_edges){
+            result.insert(result.end(), edges.begin(), edges.end());
+            std::vector<RelEdge>().swap(edges);
+        }
+        return result;
+    }
+
+    // Samples (0 ~ num_sample-1) to remove so that no pair in edges is left.
+    //  mis = false: the rule of GCTA 1.26, for each pair the sample in more pairs is removed,
+    //               the later one on ties;
+    //  mis = true:  a maximal independent set is kept in each component, by taking the sample
+    //               with the fewest remaining pairs first.
+    static std::vector<uint32_t> prune(uint32_t num_sample, const std::vector<RelEdge> &edges, bool mis){
+        // adjacency in CSR
+        std::vector<uint64_t> offsets(num_sample + 1, 0);
+        for(const auto &edge : edges){
+            offsets[edge.id1 + 1]++;
+            offsets[edge.id2 + 1]++;
+        }
+        for(uint32_t i = 0; i < num_sample; i++) offsets[i + 1] += offsets[i];
+        std::vector<uint32_t> adj(offsets.back());
+        std::vector<uint64_t> fill(offsets.begin(), offsets.end() - 1);
+        for(const auto &edge : edges){
+            adj[fill[edge.id1]++] = edge.id2;
+            adj[fill[edge.id2]++] = edge.id1;
+        }
+
+        // connected components by union-find
+        std::vector<uint32_t> parent(num_sample);
+        std::iota(parent.begin(), parent.end(), 0);
+        for(const auto &edge : edges){
+            uint32_t a = find(parent, edge.id1), b = find(parent, edge.id2);
+            if(a != b) parent[std::max(a, b)] = std::min(a, b);
+        }
+        std::vector<std::vector<uint32_t>> components;
+        std::vector<int64_t> comp_index(num_sample, -1);
+        for(uint32_t i = 0; i < num_sample; i++){
+            if(offsets[i + 1] == offsets[i]) continue;
+            uint32_t root = find(parent, i);
+            if(comp_index[root] == -1){
+                comp_index[root] = components.size();
+                components.push_back(std::vector<uint32_t>());
+            }
+            components[comp_index[root]].push_back(i);
+        }
+
+        std::vector<char> removed(num_sample, 0);
+        #pragma omp parallel for schedule(dynamic)
+        for(uint64_t c = 0; c < components.size(); c++){
+            const std::vector<uint32_t> &members = components[c];
+            if(!mis){
+                for(uint32_t i : members){
+                    uint64_t degree_i = offsets[i + 1] - offsets[i];
+                    for(uint64_t k = offsets[i]; k < offsets[i + 1]; k++){
+                        uint32_t j = adj[k];
+                        uint64_t degree_j = offsets[j + 1] - offsets[j];
+                        // i is removed by the pair (i, j) if it is in more pairs, or the later one on ties
+                        if(degree_i > degree_j || (degree_i == degree_j && i > j)){
+                            removed[i] = 1;
+                            break;
+                        }
+                    }
+                }
+            }else{
+                std::set<std::pair<uint64_t, uint32_t>> queue;
+                std::vector<uint64_t> degree(members.size());
+                std::vector<char> done(members.size(), 0);
+                auto local = [&members](uint32_t id) -> uint64_t {
+                    return std::lower_bound(members.begin(), members.end(), id) - members.begin();
+                };
+                for(uint64_t k = 0; k < members.size(); k++){
+                    degree[k] = offsets[members[k] + 1] - offsets[members[k]];
+                    queue.insert(std::make_pair(degree[k], members[k]));
+                }
+                while(!queue.empty()){
+                    uint32_t id = queue.begin()->second;
+                    queue.erase(queue.begin());
+                    done[local(id)] = 1;
+                    // the neighbours of a kept sample are removed
+                    for(uint64_t k = offsets[id]; k < offsets[id + 1]; k++){
+                        uint32_t nb = adj[k];
+                        uint64_t nb_local = local(nb);
+                        if(done[nb_local]) continue;
+                        done[nb_local] = 1;
+                        removed[nb] = 1;
+                        queue.erase(std::make_pair(degree[nb_local], nb));
+                        for(uint64_t l = offsets[nb]; l < offsets[nb + 1]; l++){
+                            uint64_t nb2_local = local(adj[l]);
+                            if(done[nb2_local]) continue;
+                            queue.erase(std::make_pair(degree[nb2_local], adj[l]));
+                            degree[nb2_local]--;
+                            queue.insert(std::make_pair(degree[nb2_local], adj[l]));
+                        }
+                    }
+                }
+            }
+        }
+
+        std::vector<uint32_t> result;
+        for(uint32_t i = 0; i < num_sample; i++){
+            if(removed[i]) result.push_back(i);
+        }
+        return result;
+    }
+
+    static uint64_t numComponents(uint32_t num_sample, const std::vector<RelEdge> &edges){
+        std::vector<uint32_t> parent(num_sample);
+        std::iota(parent.begin(), parent.end(), 0);
+        std::vector<char> in_edge(num_sample, 0);
+        for(const auto &edge : edges){
+            in_edge[edge.id1] = in_edge[edge.id2] = 1;
+            uint32_t a = find(parent, edge.id1), b = find(parent, edge.id2);
+            if(a != b) parent[std::max(a, b)] = std::min(a, b);
+        }
+        uint64_t count = 0;
+        for(uint32_t i = 0; i < num_sample; i++){
+            if(in_edge[i] && find(parent, i) == i) count++;
+        }
+        return count;
+    }
+
+private:
+    static uint32_t find(std::vector<uint32_t> &parent, uint32_t i){
+        while(parent[i] != i){
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+};
+
+#endif //GCTA2_RELGRAPH_HPP
@@ -0,0 +1,216 @@
+/*
+   GCTA: a tool for Genome-wide Complex Trait Analysis
+
+   Binary sparse GRM (.grm.spb)
+
+   The sparse GRM is stored as a symmetric matrix in CSR, both triangles:
+     header (64 bytes), row offsets (uint32, n + 1), column indices (uint32, nnz),
+     values (float, nnz)
+   The columns in each row are ascending. The file is memory mapped on reading
+   and viewed in place as an Eigen sparse matrix. The pairs in .grm.sp are the
+   lower triangle of the same matrix.
+
+   This file is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   A copy of the GNU General Public License is attached along with this program.
+   If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCTA2_SPARSEGRM_HPP
+#define GCTA2_SPARSEGRM_HPP
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <numeric>
+#include <omp.h>
+#include <sys/stat.h>
+#include "Eigen/Sparse"
+#include "Logger.h"
+#include "GRMContainer.hpp"
+#include "MappedFile.hpp"
+
+struct SparseGRMHeader {
+    char magic[4];            // "GSPB"
+    uint32_t version;
+    uint64_t num_sample;
+    uint64_t nnz;             // both triangles
+    uint64_t id_hash;         // GRMContainer::hashIDs of the lines in .grm.id
+    uint32_t reserved[8];
+};
+
+class SparseGRM {
+public:
+    static std::string fileName(const std::string &prefix){ return prefix + ".grm.spb"; }
+    static bool exists(const std::string &prefix){
+        FILE *h_file = fopen(fileName(prefix).c_str(), "rb");
+        if(!h_file) return false;
+        fclose(h_file);
+        return true;
+    }
+    // the .grm.sp of the same prefix was modified after the .grm.spb was saved
+    static bool stale(const std::string &prefix){
+        struct stat sp_stat, spb_stat;
+        if(stat((prefix + ".grm.sp").c_str(), &sp_stat) != 0) return false;
+        if(stat(fileName(prefix).c_str(), &spb_stat) != 0) return false;
+        return sp_stat.st_mtime > spb_stat.st_mtime;
+    }
+};
+
+// Pairs are added in any order, each once from the lower triangle (id1 >= id2)
+class SparseGRMWriter {
+public:
+    SparseGRMWriter(const std::string &prefix, uint64_t num_sample, uint64_t id_hash)
+        : file_name(SparseGRM::fileName(prefix)), n(num_sample), hash(id_hash){}
+
+    void add(uint32_t id1, uint32_t id2, float value){
+        pair_id1.push_back(id1);
+        pair_id2.push_back(id2);
+        pair_value.push_back(value);
+    }
+
+    uint64_t size() const { return pair_value.size(); }
+
+    // returns the number of pairs saved, the pairs added are released
+    uint64_t close(){
+        uint64_t num_pair = pair_value.size();
+        std::vector<uint64_t> offsets(n + 1, 0);
+        for(uint64_t k = 0; k < pair_value.size(); k++){
+            offsets[pair_id1[k] + 1]++;
+            if(pair_id1[k] != pair_id2[k]) offsets[pair_id2[k] + 1]++;
+        }
+        for(uint64_t i = 0; i < n; i++) offsets[i + 1] += offsets[i];
+        uint64_t nnz = offsets[n];
+        if(nnz > INT32_MAX){
+            LOGGER.e(0, "too many elements in the sparse GRM for [" + file_name + "], save it as text instead.");
+        }
+
+        std::vector<uint32_t> cols(nnz);
+        std::vector<float> values(nnz);
+        std::vector<uint64_t> fill(offsets.begin(), offsets.end() - 1);
+        for(uint64_t k = 0; k < pair_value.size(); k++){
+            uint32_t id1 = pair_id1[k], id2 = pair_id2[k];
+            cols[fill[id1]] = id2;
+            values[fill[id1]++] = pair_value[k];
+            if(id1 != id2){
+                cols[fill[id2]] = id1;
+                values[fill[id2]++] = pair_value[k];
+            }
+        }
+        std::vector<uint32_t>().swap(pair_id1);
+        std::vector<uint32_t>().swap(pair_id2);
+        std::vector<float>().swap(pair_value);
+
+        // ascending columns in each row
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(uint64_t i = 0; i < n; i++){
+            uint64_t start = offsets[i], len = offsets[i + 1] - offsets[i];
+            if(len < 2) continue;
+            std::vector<uint64_t> order(len);
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b){return cols[start + a] < cols[start + b];});
+            std::vector<uint32_t> row_cols(len);
+            std::vector<float> row_values(len);
+            for(uint64_t k = 0; k < len; k++){
+                row_cols[k] = cols[start + order[k]];
+                row_values[k] = values[start + order[k]];
+            }
+            std::copy(row_cols.begin(), row_cols.end(), cols.begin() + start);
+            std::copy(row_values.begin(), row_values.end(), values.begin() + start);
+        }
+
+        SparseGRMHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "GSPB", 4);
+        header.version = 1;
+        header.num_sample = n;
+        header.nnz = nnz;
+        header.id_hash = hash;
+        std::vector<uint32_t> offsets32(offsets.begin(), offsets.end());
+
+        FILE *h_out = fopen(file_name.c_str(), "wb");
+        if(!h_out){
+            LOGGER.e(0, "can't open [" + file_name + "] to write.");
+        }
+        if(fwrite(&header, sizeof(header), 1, h_out) != 1 ||
+                fwrite(offsets32.data(), sizeof(uint32_t), n + 1, h_out) != n + 1 ||
+                fwrite(cols.data(), sizeof(uint32_t), nnz, h_out) != nnz ||
+                fwrite(values.data(), sizeof(float), nnz, h_out) != nnz ||
+                fclose(h_out) != 0){
+            LOGGER.e(0, "can't write to [" + file_name + "].");
+        }
+        return num_pair;
+    }
+
+private:
+    std::string file_name;
+    uint64_t n;
+    uint64_t hash;
+    std::vector<uint32_t> pair_id1;
+    std::vector<uint32_t> pair_id2;
+    std::vector<float> pair_value;
+};
+
+class SparseGRMMap {
+public:
+    typedef Eigen::Map<const Eigen::SparseMatrix<float, Eigen::RowMajor, int>> MatrixMap;
+
+    SparseGRMMap(){}
+    ~SparseGRMMap(){ close(); }
+    SparseGRMMap(const SparseGRMMap &) = delete;
+    SparseGRMMap &operator=(const SparseGRMMap &) = delete;
+
+    // the IDs in prefix.grm.id are checked against the hash in the header
+    void open(const std::string &prefix){
+        close();
+        std::string file_name = SparseGRM::fileName(prefix);
+        file.open(file_name);
+        const char *data = file.data();
+        uint64_t file_bytes = file.size();
+
+        if(file_bytes < sizeof(SparseGRMHeader)){
+            LOGGER.e(0, "[" + file_name + "] is not a binary sparse GRM.");
+        }
+        memcpy(&header, data, sizeof(header));
+        if(memcmp(header.magic, "GSPB", 4) != 0 || header.version != 1){
+            LOGGER.e(0, "[" + file_name + "] is not a binary sparse GRM.");
+        }
+        if(file_bytes != sizeof(SparseGRMHeader) + (header.num_sample + 1 + 2 * header.nnz) * 4){
+            LOGGER.e(0, "the size of [" + file_name + "] does not match its header.");
+        }
+        if(GRMContainer::hashIDFile(prefix + ".grm.id") != header.id_hash){
+            LOGGER.e(0, "the IDs in [" + prefix + ".grm.id] do not match [" + file_name + "].");
+        }
+        offsets = (const int *)(data + sizeof(SparseGRMHeader));
+        cols = offsets + header.num_sample + 1;
+        values = (const float *)(cols + header.nnz);
+    }
+
+    void close(){
+        file.close();
+        offsets = cols = NULL;
+        values = NULL;
+    }
+
+    uint64_t size() const { return header.num_sample; }
+    uint64_t nonZeros() const { return header.nnz; }
+
+    // the whole symmetric matrix, in place
+    MatrixMap matrix() const {
+        return MatrixMap(header.num_sample, header.num_sample, header.nnz, offsets, cols, values);
+    }
+
+private:
+    SparseGRMHeader header;
+    MappedFile file;
+    const int *offsets = NULL;
+    const int *cols = NULL;
+    const float *values = NULL;
+};
+
+#endif //GCTA2_SPARSEGRM_HPP
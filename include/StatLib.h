@@ -26,6 +26,12 @@ namespace StatLib{
 
     double pnorm(double x, bool bLowerTail=false);
 
+    // P(sum lambda_k chi2_1 > q), by matching the moments to a noncentral chi2 (Liu et al. 2009)
+    double pchisqMixture(const VectorXd &lambda, double q);
+
+    // Cauchy combination of the p values with the weights (ACAT)
+    double pCauchy(const VectorXd &p, const VectorXd &weights);
+
     bool rankContrast(int n, double *Z);
 
     VectorXd weightBetaMAF(const VectorXd& MAF, double weight_alpha, double weight_beta);
@@ -34,6 +34,9 @@ int getMemKB();
 int getVMPeakKB();
 int getMemPeakKB();
 
+// memory available to start new jobs without swapping (MemAvailable), -1 if unknown
+long long getMemAvailKB();
+
 #endif //GCTA2_MEM_HPP
 
 
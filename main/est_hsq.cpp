@@ -57,6 +57,15 @@ void gcta::set_reml_mtd(int reml_mtd)
 void gcta::set_reml_inv_method(int method){
     _reml_inv_mtd = method;
 }
+
+void gcta::set_reml_spectral(string eigen_file){
+    _reml_spectral = true;
+    _reml_eigen_file = eigen_file;
+}
+
+void gcta::set_reml_mpheno(const vector<int> &mpheno){
+    _reml_mpheno = mpheno;
+}
     
 
 void gcta::read_phen(string phen_file, vector<string> &phen_ID, vector< vector<string> > &phen_buf, int mphen, int mphen2) {
@@ -74,10 +83,15 @@ void gcta::read_phen(string phen_file, vector<string> &phen_ID, vector< vector<s
     int phen_num = StrFunc::split_string(str_buf, vs_buf) - 2;
     if (phen_num <= 0) LOGGER.e(0, "no phenotype data is found.");
     if (phen_num > 1) LOGGER << "There are " << phen_num << " traits specified in the file [" + phen_file + "]." << endl;
-    if (mphen > phen_num) {
-        stringstream errmsg;
-        errmsg << "can not find the " << mphen << "th trait in the file [" + phen_file + "].";
-        LOGGER.e(0, errmsg.str());
+    // the traits of --mpheno are analysed in the individuals with none of them missing
+    vector<int> phen_cols(1, mphen);
+    if (!_bivar_reml && _reml_mpheno.size() > 1) phen_cols = _reml_mpheno;
+    for (i = 0; i < phen_cols.size(); i++) {
+        if (phen_cols[i] > phen_num) {
+            stringstream errmsg;
+            errmsg << "can not find the " << phen_cols[i] << "th trait in the file [" + phen_file + "].";
+            LOGGER.e(0, errmsg.str());
+        }
     }
     if (_bivar_reml && mphen2 > phen_num) {
         stringstream errmsg;
@@ -86,7 +100,8 @@ void gcta::read_phen(string phen_file, vector<string> &phen_ID, vector< vector<s
     }
     if (_bivar_reml) LOGGER << "Traits " << mphen << " and " << mphen2 << " are included in the bivariate analysis." << endl;
     else {
-        if (phen_num > 1) LOGGER << "Trait #" << mphen << " is included for analysis." << endl;
+        if (phen_cols.size() > 1) LOGGER << phen_cols.size() << " traits are included for analysis." << endl;
+        else if (phen_num > 1) LOGGER << "Trait #" << mphen << " is included for analysis." << endl;
     }
     in_phen.seekg(ios::beg);
     mphen--;
@@ -106,7 +121,9 @@ void gcta::read_phen(string phen_file, vector<string> &phen_ID, vector< vector<s
         if (_bivar_reml) {
             if ((vs_buf[mphen] == "-9" || vs_buf[mphen] == "NA") && (vs_buf[mphen2] == "-9" || vs_buf[mphen2] == "NA")) continue;
         } else {
-            if (vs_buf[mphen] == "-9" || vs_buf[mphen] == "NA") continue;
+            bool miss_flag = false;
+            for (i = 0; i < phen_cols.size() && !miss_flag; i++) miss_flag = (vs_buf[phen_cols[i] - 1] == "-9" || vs_buf[phen_cols[i] - 1] == "NA");
+            if (miss_flag) continue;
         }
         phen_ID.push_back(fid_buf + ":" + pid_buf);
         fid.push_back(fid_buf);
@@ -114,7 +131,8 @@ void gcta::read_phen(string phen_file, vector<string> &phen_ID, vector< vector<s
         phen_buf.push_back(vs_buf);
     }
     in_phen.close();
-    LOGGER << "Non-missing phenotypes of " << phen_buf.size() << " individuals are included from [" + phen_file + "]." << endl;
+    if (phen_cols.size() > 1) LOGGER << "Non-missing phenotypes of all the " << phen_cols.size() << " traits for " << phen_buf.size() << " individuals are included from [" + phen_file + "]." << endl;
+    else LOGGER << "Non-missing phenotypes of " << phen_buf.size() << " individuals are included from [" + phen_file + "]." << endl;
 
     if (_id_map.empty()) {
         _fid = fid;
@@ -253,8 +271,11 @@ void gcta::fit_reml(string grm_file, string phen_file, string qcovar_file, strin
     vector<string> phen_ID, qcovar_ID, covar_ID, qGE_ID, GE_ID, grm_id, grm_files;
     vector< vector<string> > phen_buf, qcovar, covar, GE, qGE; // save individuals by column
 
+    // the GRM is mapped and only the kept samples are expanded, unless it has to be modified in memory
+    bool grm_mapped = false;
     if (grm_flag) {
-        read_grm(grm_file, grm_id, true, false, !(adj_grm_fac > -1.0));
+        if (grm_cutoff <= -1.0 && adj_grm_fac <= -1.0 && dosage_compen <= -1) grm_mapped = read_grm_map(grm_file, grm_id);
+        if (!grm_mapped) read_grm(grm_file, grm_id, true, false, !(adj_grm_fac > -1.0));
         update_id_map_kp(grm_id, _id_map, _keep);
         grm_files.push_back(grm_file);
     } 
@@ -344,11 +365,14 @@ void gcta::fit_reml(string grm_file, string phen_file, string qcovar_file, strin
         _A.resize(_r_indx.size());
         if (mlmassoc) StrFunc::match(uni_id, grm_id, kp);
         else kp = _keep;
-        (_A[0]) = eigenMatrix::Zero(_n, _n);
+        if (grm_mapped) grm_from_map(_A[0], kp);
+        else {
+            (_A[0]) = eigenMatrix::Zero(_n, _n);
 
-        #pragma omp parallel for
-        for (int i = 0; i < _n; i++) {
-            for (int j = 0; j <= i; j++) (_A[0])(j, i) = (_A[0])(i, j) = _grm(kp[i], kp[j]);
+            #pragma omp parallel for
+            for (int i = 0; i < _n; i++) {
+                for (int j = 0; j <= i; j++) (_A[0])(j, i) = (_A[0])(i, j) = _grm(kp[i], kp[j]);
+            }
         }
         if (_reml_diag_one) {
             double diag_mean = (_A[0]).diagonal().mean();
@@ -375,17 +399,22 @@ void gcta::fit_reml(string grm_file, string phen_file, string qcovar_file, strin
         LOGGER << "There are " << grm_files.size() << " GRM file names specified in the file [" + grm_file + "]." << endl;
         for (int i = 0; i < grm_files.size(); i++, pos++) {
             LOGGER << "Reading the GRM from the " << i + 1 << "th file ..." << endl;
-            read_grm(grm_files[i], grm_id, true, false, !(adj_grm_fac > -1.0));
-            if (adj_grm_fac>-1.0) adj_grm(adj_grm_fac);
-            if (dosage_compen>-1) dc(dosage_compen);
-            StrFunc::match(uni_id, grm_id, kp);
-            (_A[pos]) = eigenMatrix::Zero(_n, _n);
+            if (adj_grm_fac <= -1.0 && dosage_compen <= -1 && read_grm_map(grm_files[i], grm_id)) {
+                StrFunc::match(uni_id, grm_id, kp);
+                grm_from_map(_A[pos], kp);
+            } else {
+                read_grm(grm_files[i], grm_id, true, false, !(adj_grm_fac > -1.0));
+                if (adj_grm_fac>-1.0) adj_grm(adj_grm_fac);
+                if (dosage_compen>-1) dc(dosage_compen);
+                StrFunc::match(uni_id, grm_id, kp);
+                (_A[pos]) = eigenMatrix::Zero(_n, _n);
 
-            #pragma omp parallel for
-            for (int j = 0; j < _n; j++) {
-                for (int k = 0; k <= j; k++) {
-                    if (kp[j] >= kp[k]) (_A[pos])(k, j) = (_A[pos])(j, k) = _grm(kp[j], kp[k]);
-                    else (_A[pos])(k, j) = (_A[pos])(j, k) = _grm(kp[k], kp[j]);
+                #pragma omp parallel for
+                for (int j = 0; j < _n; j++) {
+                    for (int k = 0; k <= j; k++) {
+                        if (kp[j] >= kp[k]) (_A[pos])(k, j) = (_A[pos])(j, k) = _grm(kp[j], kp[k]);
+                        else (_A[pos])(k, j) = (_A[pos])(j, k) = _grm(kp[k], kp[j]);
+                    }
                 }
             }
 
@@ -515,8 +544,35 @@ void gcta::fit_reml(string grm_file, string phen_file, string qcovar_file, strin
     if (reml_bending) bend_A();
     //LOGGER << "Prepare time: " << LOGGER.tp("main") << std::endl;
 
+    // spectral REML: one eigen-decomposition of the GRM for all the traits
+    bool spectral = grm_flag && !qGE_flag && !GE_flag && weight_file.empty() && !_within_family && !reml_bending && !mlmassoc && !_cv_blup;
+    if (_reml_spectral && !spectral) LOGGER << "Note: spectral REML requires a single GRM without --gxe, --gxqe, --reml-res-diag, --reml-wfam, --reml-bending or --cvblup. The standard REML is used instead." << endl;
+    if (spectral && (_reml_spectral || _reml_mpheno.size() > 1)) reml_spectral_init(uni_id);
+
     // run REML algorithm
-    reml(pred_rand_eff, est_fix_eff, reml_priors, reml_priors_var, prevalence, -2.0, no_constrain, no_lrt, mlmassoc);
+    if (_reml_mpheno.size() <= 1) {
+        reml(pred_rand_eff, est_fix_eff, reml_priors, reml_priors_var, prevalence, -2.0, no_constrain, no_lrt, mlmassoc);
+        return;
+    }
+    string out_prefix = _out;
+    for (int k = 0; k < _reml_mpheno.size(); k++) {
+        int cur_phen = _reml_mpheno[k];
+        if (k > 0) {
+            _y.setZero(_n);
+            for (int i = 0; i < phen_ID.size(); i++) {
+                iter = uni_id_map.find(phen_ID[i]);
+                if (iter == uni_id_map.end()) continue;
+                _y[iter->second] = atof(phen_buf[i][cur_phen - 1].c_str());
+            }
+            _ncase = 0.0;
+            _flag_CC = check_case_control(_ncase, _y);
+        }
+        _out = out_prefix + ".pheno" + to_string(cur_phen);
+        _reml_AI_not_invertible = false;
+        LOGGER << "\nTrait #" << cur_phen << " (" << k + 1 << " of " << _reml_mpheno.size() << "):" << endl;
+        reml(pred_rand_eff, est_fix_eff, reml_priors, reml_priors_var, prevalence, -2.0, no_constrain, no_lrt, mlmassoc);
+    }
+    _out = out_prefix;
 }
 
 void gcta::drop_comp(vector<int> &drop) {
@@ -753,6 +809,7 @@ void gcta::reml(bool pred_rand_eff, bool est_fix_eff, vector<double> &reml_prior
         u.resize(_n, _r_indx.size());
         for (i = 0; i < _r_indx.size(); i++) {
             if (_bivar_reml || _within_family)(u.col(i)) = (((_Asp[_r_indx[i]]) * Py) * varcmp[i]);
+            else if (_spec_active) (u.col(i)) = ((_spec_evec * spectral_diag(i).cwiseProduct(_spec_evec.transpose() * Py)) * varcmp[i]);
             else (u.col(i)) = (((_A[_r_indx[i]]) * Py) * varcmp[i]);
         }
     }
@@ -1065,6 +1122,11 @@ double gcta::reml_iteration(eigenMatrix &Vi_X, eigenMatrix &Xt_Vi_X_i, eigenMatr
     double logdet = 0.0, logdet_Xt_Vi_X = 0.0, prev_lgL = -1e20, lgL = -1e20, dlogL = 1000.0;
     eigenVector prev_prev_varcmp(varcmp), prev_varcmp(varcmp), varcomp_init(varcmp);
     bool converged_flag = false;
+
+    // spectral REML: the eigenvalues of V, V^-1 X, (X' V^-1 X)^-1 and Py, all in the eigen-space of the GRM
+    eigenVector y_rot, spec_d, spec_p;
+    eigenMatrix spec_W, spec_Ci;
+    if (_spec_active) y_rot = _spec_evec.transpose() * _y;
     for (iter = 0; iter < _reml_max_iter; iter++) {
         if (reml_bivar_fix_rg) update_A(prev_varcmp);
         if (iter == 0) {
@@ -1089,6 +1151,17 @@ double gcta::reml_iteration(eigenMatrix &Vi_X, eigenMatrix &Xt_Vi_X_i, eigenMatr
         LOGGER.ts("DBGtime");
         if (_bivar_reml) calcu_Vi_bivar(_Vi, prev_varcmp, logdet, iter); // Calculate Vi, bivariate analysis //very slow
         else if (_within_family) calcu_Vi_within_family(_Vi, prev_varcmp, logdet, iter); // within-family REML
+        else if (_spec_active) {
+            if (!spectral_Vi(prev_varcmp, spec_d, logdet)) {
+                LOGGER<<"Warning: V matrix is not positive-definite.\n";
+                varcmp = prev_prev_varcmp;
+                if(!spectral_Vi(varcmp, spec_d, logdet)) LOGGER.e(0, "V matrix is not positive-definite.");
+                spectral_P(spec_d, y_rot, spec_W, spec_Ci, spec_p);
+                spectral_Hi(spec_d, spec_W, spec_Ci, Hi);
+                Hi = 2 * Hi;
+                break;
+            }
+        }
         else {
             if (!calcu_Vi(_Vi, prev_varcmp, logdet, iter)){ // Calculate Vi
                 LOGGER<<"Warning: V matrix is not positive-definite.\n";
@@ -1103,16 +1176,19 @@ double gcta::reml_iteration(eigenMatrix &Vi_X, eigenMatrix &Xt_Vi_X_i, eigenMatr
         //LOGGER << "calcu_vi_bivar returned" << endl;
         float time_p = 0;
         LOGGER.ts("DBGtime");
-        logdet_Xt_Vi_X = calcu_P(_Vi, Vi_X, Xt_Vi_X_i, _P); // Calculate P  //quick
+        if (_spec_active) logdet_Xt_Vi_X = spectral_P(spec_d, y_rot, spec_W, spec_Ci, spec_p);
+        else logdet_Xt_Vi_X = calcu_P(_Vi, Vi_X, Xt_Vi_X_i, _P); // Calculate P  //quick
         time_p = LOGGER.tp("DBGtime");
         
         float time_reml = 0;
         LOGGER.ts("DBGtime");
-        if (_reml_mtd == 0) ai_reml(_P, Hi, Py, prev_varcmp, varcmp, dlogL);
+        if (_spec_active) spectral_reml(spec_d, spec_W, spec_Ci, spec_p, Hi, prev_varcmp, varcmp, dlogL);
+        else if (_reml_mtd == 0) ai_reml(_P, Hi, Py, prev_varcmp, varcmp, dlogL);
         else if (_reml_mtd == 1) reml_equation(_P, Hi, Py, varcmp);
         else if (_reml_mtd == 2) em_reml(_P, Py, prev_varcmp, varcmp);  //slow ++
         time_reml = LOGGER.tp("DBGtime");
-        lgL = -0.5 * (logdet_Xt_Vi_X + logdet + (_y.transpose() * Py)(0, 0));
+        if (_spec_active) lgL = -0.5 * (logdet_Xt_Vi_X + logdet + y_rot.dot(spec_p));
+        else lgL = -0.5 * (logdet_Xt_Vi_X + logdet + (_y.transpose() * Py)(0, 0));
 
         if(_reml_force_converge && _reml_AI_not_invertible) break;
             /*{
@@ -1159,7 +1235,8 @@ double gcta::reml_iteration(eigenMatrix &Vi_X, eigenMatrix &Xt_Vi_X_i, eigenMatr
 
         if((_reml_force_converge || _reml_no_converge) && prev_lgL > lgL){
             varcmp = prev_varcmp;
-            calcu_Hi(_P, Hi);
+            if (_spec_active) spectral_Hi(spec_d, spec_W, spec_Ci, Hi);
+            else calcu_Hi(_P, Hi);
             Hi = 2 * Hi;
             break;
         }
@@ -1169,7 +1246,8 @@ double gcta::reml_iteration(eigenMatrix &Vi_X, eigenMatrix &Xt_Vi_X_i, eigenMatr
         if ((varcmp - prev_varcmp).squaredNorm() / varcmp.squaredNorm() < 1e-8 && (fabs(dlogL) < 1e-4 || (fabs(dlogL) < 1e-2 && dlogL < 0))) {
             converged_flag = true;
             if (_reml_mtd == 2) {
-                calcu_Hi(_P, Hi);
+                if (_spec_active) spectral_Hi(spec_d, spec_W, spec_Ci, Hi);
+                else calcu_Hi(_P, Hi);
                 Hi = 2 * Hi;
             } // for calculation of SE
             break;
@@ -1178,6 +1256,11 @@ double gcta::reml_iteration(eigenMatrix &Vi_X, eigenMatrix &Xt_Vi_X_i, eigenMatr
         prev_varcmp = varcmp;
         prev_lgL = lgL;
     }
+    if (_spec_active && spec_p.size() == _n) {
+        Py = _spec_evec * spec_p;
+        Vi_X = _spec_evec * spec_W;
+        Xt_Vi_X_i = spec_Ci;
+    }
     
     if(_reml_fixed_var) LOGGER << "Warning: the model is evaluated at fixed variance components. The (log-)likelihood might not be maximised." <<endl;
     else {
@@ -1816,8 +1899,7 @@ void gcta::HE_reg(string grm_file, bool m_grm_flag, string phen_file, string kee
     
     // Find common individuals in GRM and phenotype files
     // first read in grm.id, which determins the order of model equations
-    vector<ifstream*> A_bin;
-    A_bin.resize(n_grm);
+    vector<GRMMap*> A_map(n_grm);
     int size_grm = 0;
     for (i = 0; i < n_grm; i++) {
         if (i==0) {
@@ -1828,9 +1910,7 @@ void gcta::HE_reg(string grm_file, bool m_grm_flag, string phen_file, string kee
                 LOGGER.e(0, "file [" + grm_files[i] + "] contains a different number of individuals from other GRM files.");
             }
         }
-        string grm_binfile = grm_files[i] + ".grm.bin";
-        A_bin[i] = new ifstream(grm_binfile.c_str(), ios::in | ios::binary);
-        if ((*A_bin[i]).bad()) LOGGER.e(0, "cannot open the file [" + grm_binfile + "] to read.");
+        A_map[i] = new GRMMap(grm_files[i], size_grm);
     }
     update_id_map_kp(grm_id, _id_map, _keep);
 
@@ -1914,57 +1994,40 @@ void gcta::HE_reg(string grm_file, bool m_grm_flag, string phen_file, string kee
     // Fill GRMij into the ordinary least squares equations without reading the whole GRM(s) into memory
     LOGGER << "Constructing ordinary least squares equations ..." << endl;
     eigenVector aij(n_grm);
-    int size = sizeof (float);
-    float f_buf = 0.0;
     float grm_cp, r_cp, r_sd;
-    for (i = 0, ii = 0; i < size_grm; i++) {
-        if (i != grm_kp[ii]) {
-            for (j = 0; j <= i; j++) {
-                for (k = 0; k < n_grm; k++) {
-                    (*A_bin[k]).read((char*) &f_buf, size);
-                }
-            }
-        }
-        else {
-            for (j = 0, jj = 0; j <= i; j++) {
-                if (j != grm_kp[jj] || j==i) {
-                    for (k = 0; k < n_grm; k++) {
-                        (*A_bin[k]).read((char*) &f_buf, size);
-                    }
-                }
-                else {
-                    for (k = 0; k < n_grm; k++) {
-                        (*A_bin[k]).read((char*) &f_buf, size);
-                        aij[k] = f_buf;
-                        r = k + 1;
-                        Lhs(0,r) = Lhs(r,0) += aij[k];
-                        LhsVec[ii](0,r) = LhsVec[ii](r,0) += aij[k];
-                        LhsVec[jj](0,r) = LhsVec[jj](r,0) += aij[k];
-                        for (l = 0; l <= k; l++) {
-                            c = l + 1;
-                            grm_cp = aij[k] * aij[l];
-                            Lhs(c,r) = Lhs(r,c) += grm_cp;
-                            LhsVec[ii](c,r) = LhsVec[ii](r,c) += grm_cp;
-                            LhsVec[jj](c,r) = LhsVec[jj](r,c) += grm_cp;
-                        }
-                        r_cp = aij[k] * _y[ii] * _y[jj];
-                        r_sd = aij[k] *(_y[ii] - _y[jj])*(_y[ii] - _y[jj]);
-                        Rhs_cp[r] += r_cp;
-                        Rhs_sd[r] += r_sd;
-                        RhsCpVec[ii][r] += r_cp;
-                        RhsCpVec[jj][r] += r_cp;
-                        RhsSdVec[ii][r] += r_sd;
-                        RhsSdVec[jj][r] += r_sd;
-                    }
-                    ++jj;
+    vector<const float*> A_row(n_grm);
+    for (ii = 0; ii < _n; ii++) {
+        i = grm_kp[ii];
+        for (k = 0; k < n_grm; k++) A_row[k] = A_map[k]->row(i);
+        for (jj = 0; jj < ii; jj++) {
+            j = grm_kp[jj];
+            for (k = 0; k < n_grm; k++) {
+                aij[k] = A_row[k][j];
+                r = k + 1;
+                Lhs(0,r) = Lhs(r,0) += aij[k];
+                LhsVec[ii](0,r) = LhsVec[ii](r,0) += aij[k];
+                LhsVec[jj](0,r) = LhsVec[jj](r,0) += aij[k];
+                for (l = 0; l <= k; l++) {
+                    c = l + 1;
+                    grm_cp = aij[k] * aij[l];
+                    Lhs(c,r) = Lhs(r,c) += grm_cp;
+                    LhsVec[ii](c,r) = LhsVec[ii](r,c) += grm_cp;
+                    LhsVec[jj](c,r) = LhsVec[jj](r,c) += grm_cp;
                 }
+                r_cp = aij[k] * _y[ii] * _y[jj];
+                r_sd = aij[k] *(_y[ii] - _y[jj])*(_y[ii] - _y[jj]);
+                Rhs_cp[r] += r_cp;
+                Rhs_sd[r] += r_sd;
+                RhsCpVec[ii][r] += r_cp;
+                RhsCpVec[jj][r] += r_cp;
+                RhsSdVec[ii][r] += r_sd;
+                RhsSdVec[jj][r] += r_sd;
             }
-            ++ii;
         }
     }
 
     for (k = 0; k < n_grm; k++) {
-        (*A_bin[k]).close();
+        delete A_map[k];
     }
     
     // compute OLS SE and p-value
@@ -36,6 +36,8 @@
 #include <omp.h>
 #include "Logger.h"
 #include "Matrix.hpp"
+#include "GRMMap.hpp"
+#include "RelGraph.hpp"
 
 #ifdef SINGLE_PRECISION
 typedef Eigen::SparseMatrix<float, Eigen::ColMajor, long long> eigenSparseMat;
@@ -128,6 +130,8 @@ public:
     void set_reml_diag_mul(double value);
     void set_reml_diagV_adj(int method);
     void set_reml_inv_method(int method);
+    void set_reml_spectral(string eigen_file);
+    void set_reml_mpheno(const vector<int> &mpheno);
 
     // bivariate REML analysis
     void fit_bivar_reml(string grm_file, string phen_file, string qcovar_file, string covar_file, string keep_indi_file, string remove_indi_file, string sex_file, int mphen, int mphen2, double grm_cutoff, double adj_grm_fac, int dosage_compen, bool m_grm_flag, bool pred_rand_eff, bool est_fix_eff, int reml_mtd, int MaxIter, vector<double> reml_priors, vector<double> reml_priors_var, vector<int> drop, bool no_lrt, double prevalence, double prevalence2, bool no_constrain, bool ignore_Ce, vector<double> &fixed_rg_val, bool bivar_no_constrain);
@@ -273,6 +277,8 @@ private:
     void read_grm(string grm_file, vector<string> &grm_id, bool out_id_log = true, bool read_id_only = false, bool dont_read_N = false);
     void read_grm_gz(string grm_file, vector<string> &grm_id, bool out_id_log = true, bool read_id_only = false);
     void read_grm_bin(string grm_file, vector<string> &grm_id, bool out_id_log = true, bool read_id_only = false, bool dont_read_N = false);
+    bool read_grm_map(string grm_file, vector<string> &grm_id, bool out_id_log = true);
+    void grm_from_map(eigenMatrix &A, const vector<int> &kp);
     void read_grm_filenames(string merge_grm_file, vector<string> &grm_files, bool out_log = true);
     void merge_grm(string merge_grm_file);
     void rm_cor_indi(double grm_cutoff);
@@ -316,6 +322,17 @@ private:
     void calcu_sum_hsq(double Vp, double VarVp, double &sum_hsq, double &var_sum_hsq, eigenVector &varcmp, eigenMatrix &Hi);
     void output_blup_snp(eigenMatrix &b_SNP);
 
+    // spectral REML analysis with a single GRM
+    void reml_spectral_init(const vector<string> &uni_id);
+    bool reml_spectral_load(uint64_t id_hash, uint64_t grm_hash);
+    void reml_spectral_save(uint64_t id_hash, uint64_t grm_hash);
+    eigenVector spectral_diag(int i);
+    bool spectral_Vi(eigenVector &prev_varcmp, eigenVector &d, double &logdet);
+    double spectral_P(const eigenVector &d, const eigenVector &y_rot, eigenMatrix &W, eigenMatrix &Ci, eigenVector &p);
+    void spectral_tr_PA(const eigenVector &d, const eigenMatrix &W, const eigenMatrix &Ci, eigenVector &tr_PA);
+    void spectral_Hi(const eigenVector &d, const eigenMatrix &W, const eigenMatrix &Ci, eigenMatrix &Hi);
+    void spectral_reml(const eigenVector &d, const eigenMatrix &W, const eigenMatrix &Ci, const eigenVector &p, eigenMatrix &Hi, eigenVector &prev_varcmp, eigenVector &varcmp, double dlogL);
+
     // within-family reml analysis
     void detect_family();
     bool calcu_Vi_within_family(eigenMatrix &Vi, eigenVector &prev_varcmp, double &logdet, int &iter);
@@ -543,6 +560,7 @@ private:
     float * _grm_mkl;
     float * _geno_mkl;
     bool _grm_bin_flag;
+    GRMMap _grm_map; // binary GRM mapped without expanding to _grm
 
     // reml
     int _n;
@@ -577,6 +595,15 @@ private:
     bool _reml_no_converge;
     bool _reml_fixed_var;
     bool _reml_allow_constrain_run = false;
+    vector<int> _reml_mpheno; // traits of --mpheno, fitted in turn
+
+    // spectral REML: A = U diag(eval) U', V = U diag(d) U'
+    bool _reml_spectral = false;
+    bool _spec_active = false;
+    string _reml_eigen_file;
+    eigenVector _spec_eval;
+    eigenMatrix _spec_evec;
+    eigenMatrix _spec_X; // U'X
 
     // within-family reml analysis
     bool _within_family;
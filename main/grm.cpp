@@ -337,88 +337,56 @@ void gcta::read_grm_gz(string grm_file, vector<string> &grm_id, bool out_id_log,
 
 void gcta::read_grm_bin(string grm_file, vector<string> &grm_id, bool out_id_log, bool read_id_only, bool dont_read_N)
 {
-    int i = 0, j = 0, n = read_grm_id(grm_file, grm_id, out_id_log, read_id_only);
+    int n = read_grm_id(grm_file, grm_id, out_id_log, read_id_only);
 
     if (read_id_only) return;
 
     string grm_binfile = grm_file + ".grm.bin";
-    ifstream A_bin(grm_binfile.c_str(), ios::in | ios::binary);
-    if (!A_bin.is_open()) LOGGER.e(0, "cannot open the file [" + grm_binfile + "] to read.");
-    _grm.resize(n, n);
     LOGGER << "Reading the GRM from [" + grm_binfile + "]." << endl;
-    int size = sizeof (float);
-    float f_buf = 0.0;
-    for (i = 0; i < n; i++) {
-        for (j = 0; j <= i; j++) {
-            if (!(A_bin.read((char*) &f_buf, size))) LOGGER.e(0, "Is the size of the [" + grm_binfile + "] file incorrect?");
-            _grm(j, i) = _grm(i, j) = f_buf;
-        }
-    }
-    A_bin.close();
+    _grm_map.open(grm_file, n, !dont_read_N);
+    _grm_map.expand(_grm);
 
     if(!dont_read_N){
         string grm_Nfile = grm_file + ".grm.N.bin";
-        ifstream N_bin(grm_Nfile.c_str(), ios::in | ios::binary);
-        if (!N_bin.is_open()) LOGGER.e(0, "cannot open the file [" + grm_Nfile + "] to read.");
-        _grm_N.resize(n, n);
         LOGGER << "Reading the number of SNPs for the GRM from [" + grm_Nfile + "]." << endl;
-        size = sizeof (float);
-        f_buf = 0.0;
-        for (i = 0; i < n; i++) {
-            for (j = 0; j <= i; j++) {
-                if (!(N_bin.read((char*) &f_buf, size))) LOGGER.e(0, "Is the size of the [" + grm_Nfile + "] file incorrect?");
-                _grm_N(j, i) = _grm_N(i, j) = f_buf;
-            }
-        }
-        N_bin.close();
+        _grm_map.expand(_grm_N, NULL, true);
     }
+    _grm_map.close();
 
     LOGGER << "GRM for " << n << " individuals are included from [" + grm_binfile + "]." << endl;
 }
 
-void gcta::rm_cor_indi(double grm_cutoff) {
-    LOGGER << "Pruning the GRM with a cutoff of " << grm_cutoff << " ..." << endl;
+// Map the binary GRM only, the samples needed are expanded later by grm_from_map.
+//  Returns false for the .grm.gz format, which has to be read by read_grm.
+bool gcta::read_grm_map(string grm_file, vector<string> &grm_id, bool out_id_log)
+{
+    if (!_grm_bin_flag) return false;
+    int n = read_grm_id(grm_file, grm_id, out_id_log, false);
+    string grm_binfile = grm_file + ".grm.bin";
+    LOGGER << "Mapping the GRM from [" + grm_binfile + "]." << endl;
+    _grm_map.open(grm_file, n, false);
+    LOGGER << "GRM for " << n << " individuals are included from [" + grm_binfile + "]." << endl;
+    return true;
+}
 
-    int i = 0, j = 0, i_buf = 0;
+// A = GRM[kp, kp] from the mapped GRM
+void gcta::grm_from_map(eigenMatrix &A, const vector<int> &kp)
+{
+    GRMKeepView view(_grm_map, kp);
+    view.expand(A);
+    _grm_map.close();
+}
 
-    // identify the positions where you see a value > than the threshold
-    vector<int> rm_grm_ID1, rm_grm_ID2;
-    for (i = 0; i < _keep.size(); i++) {
-        for (j = 0; j < i; j++) {
-            if (_grm(_keep[i], _keep[j]) > grm_cutoff) {
-                rm_grm_ID1.push_back(_keep[i]);
-                rm_grm_ID2.push_back(_keep[j]);
-            }
-        }
-    }
+void gcta::rm_cor_indi(double grm_cutoff) {
+    LOGGER << "Pruning the GRM with a cutoff of " << grm_cutoff << " ..." << endl;
 
-    // count the number of appearance of each "position" in the vector, which involves a few steps
-    vector<int> rm_uni_ID(rm_grm_ID1);
-    rm_uni_ID.insert(rm_uni_ID.end(), rm_grm_ID2.begin(), rm_grm_ID2.end());
-    stable_sort(rm_uni_ID.begin(), rm_uni_ID.end());
-    rm_uni_ID.erase(unique(rm_uni_ID.begin(), rm_uni_ID.end()), rm_uni_ID.end());
-    map<int, int> rm_uni_ID_count;
-    for (i = 0; i < rm_uni_ID.size(); i++) {
-        i_buf = count(rm_grm_ID1.begin(), rm_grm_ID1.end(), rm_uni_ID[i]) + count(rm_grm_ID2.begin(), rm_grm_ID2.end(), rm_uni_ID[i]);
-        rm_uni_ID_count.insert(pair<int, int>(rm_uni_ID[i], i_buf));
-    }
-
-    // swapping
-    map<int, int>::iterator iter1, iter2;
-    for (i = 0; i < rm_grm_ID1.size(); i++) {
-        iter1 = rm_uni_ID_count.find(rm_grm_ID1[i]);
-        iter2 = rm_uni_ID_count.find(rm_grm_ID2[i]);
-        if (iter1->second < iter2->second) {
-            i_buf = rm_grm_ID1[i];
-            rm_grm_ID1[i] = rm_grm_ID2[i];
-            rm_grm_ID2[i] = i_buf;
-        }
-    }
-    
-    stable_sort(rm_grm_ID1.begin(), rm_grm_ID1.end());
-    rm_grm_ID1.erase(unique(rm_grm_ID1.begin(), rm_grm_ID1.end()), rm_grm_ID1.end());
+    // pairs above the threshold, pruned on the graph of related individuals
+    vector<RelEdge> edges = RelGraph::scan(_keep.size(), grm_cutoff, [this](uint32_t i, uint32_t j){
+            return (float)_grm(_keep[i], _keep[j]);
+            });
+    vector<uint32_t> rm_index = RelGraph::prune(_keep.size(), edges, false);
     vector<string> removed_ID;
-    for (i = 0; i < rm_grm_ID1.size(); i++) removed_ID.push_back(_fid[rm_grm_ID1[i]] + ":" + _pid[rm_grm_ID1[i]]);
+    for (auto index : rm_index) removed_ID.push_back(_fid[_keep[index]] + ":" + _pid[_keep[index]]);
 
     // update _keep and _id_map
     update_id_map_rm(removed_ID, _id_map, _keep);
@@ -49,6 +49,7 @@ void gcta::mlma(string grm_file, bool m_grm_flag, string subtract_grm_file, stri
         LOGGER.e(0, "no individual is in common among the input files.");
     }
 
+    bool grm_mapped = false;
     if(subtract_grm_flag){
         grm_files.push_back(grm_file);
         grm_files.push_back(subtract_grm_file);
@@ -60,7 +61,8 @@ void gcta::mlma(string grm_file, bool m_grm_flag, string subtract_grm_file, stri
     else{
         if(grm_flag){
             grm_files.push_back(grm_file);
-            read_grm(grm_file, grm_id, true, false, true);
+            grm_mapped = read_grm_map(grm_file, grm_id);
+            if(!grm_mapped) read_grm(grm_file, grm_id, true, false, true);
             update_id_map_kp(grm_id, _id_map, _keep);
         }
         else if (m_grm_flag) {
@@ -141,17 +143,25 @@ void gcta::mlma(string grm_file, bool m_grm_flag, string subtract_grm_file, stri
         _A.resize(_r_indx.size());
         if(grm_flag){
             StrFunc::match(uni_id, grm_id, kp);
-            (_A[0]).resize(_n, _n);
-            #pragma omp parallel for private(j)
-            for(i=0; i<_n; i++){
-                for(j=0; j<=i; j++) (_A[0])(j,i)=(_A[0])(i,j)=_grm(kp[i],kp[j]);
+            if(grm_mapped) grm_from_map(_A[0], kp);
+            else{
+                (_A[0]).resize(_n, _n);
+                #pragma omp parallel for private(j)
+                for(i=0; i<_n; i++){
+                    for(j=0; j<=i; j++) (_A[0])(j,i)=(_A[0])(i,j)=_grm(kp[i],kp[j]);
+                }
+                _grm.resize(0,0);
             }
-            _grm.resize(0,0);
         }
         else if(m_grm_flag){
             LOGGER << "There are " << grm_files.size() << " GRM file names specified in the file [" + grm_file + "]." << endl;
             for (i = 0; i < grm_files.size(); i++) {
                 LOGGER << "Reading the GRM from the " << i + 1 << "th file ..." << endl;
+                if(read_grm_map(grm_files[i], grm_id)){
+                    StrFunc::match(uni_id, grm_id, kp);
+                    grm_from_map(_A[i], kp);
+                    continue;
+                }
                 read_grm(grm_files[i], grm_id, true, false, true);
                 StrFunc::match(uni_id, grm_id, kp);
                 (_A[i]).resize(_n, _n);
@@ -116,6 +116,9 @@ void option(int option_num, char* option_str[])
     int reml_diagV_adj = 0;
     double reml_diag_mul = 0.01;
     int reml_inv_method = 0;
+    bool reml_spectral_flag = false;
+    string reml_eigen_file = "";
+    vector<int> mphen_list;
 
     bool cv_blup = false;
     bool HE_reg_bivar_flag = false;
@@ -747,14 +750,38 @@ void option(int option_num, char* option_str[])
         } else if(strcmp(argv[i], "--reml-inv-mtd") == 0){
             reml_inv_method = stoi(argv[++i]);
             LOGGER << "--reml-inv-mtd " << reml_inv_method << endl;
+        } else if (strcmp(argv[i], "--reml-spectral") == 0) {
+            reml_spectral_flag = true;
+            LOGGER << "--reml-spectral" << endl;
+        } else if (strcmp(argv[i], "--reml-eigen") == 0) {
+            reml_spectral_flag = true;
+            reml_eigen_file = argv[++i];
+            LOGGER << "--reml-eigen " << reml_eigen_file << endl;
         } else if (strcmp(argv[i], "--pheno") == 0) {
             phen_file = argv[++i];
             LOGGER << "--pheno " << phen_file << endl;
             CommFunc::FileExist(phen_file);
         } else if (strcmp(argv[i], "--mpheno") == 0) {
-            mphen = atoi(argv[++i]);
-            LOGGER << "--mpheno " << mphen << endl;
-            if (mphen < 1) LOGGER.e(0, "--mpheno should be > 0.");
+            // a trait, or a list such as 1,3,5-9 for --reml
+            string mphen_str = argv[++i];
+            LOGGER << "--mpheno " << mphen_str << endl;
+            vector<string> mphen_items;
+            StrFunc::split_string(mphen_str, mphen_items, ",");
+            mphen_list.clear();
+            for (int k = 0; k < mphen_items.size(); k++) {
+                size_t dash = mphen_items[k].find('-', 1);
+                if (dash == string::npos) mphen_list.push_back(atoi(mphen_items[k].c_str()));
+                else {
+                    int col_from = atoi(mphen_items[k].substr(0, dash).c_str()), col_to = atoi(mphen_items[k].substr(dash + 1).c_str());
+                    if (col_from > col_to) LOGGER.e(0, "invalid range [" + mphen_items[k] + "] in --mpheno.");
+                    for (int col = col_from; col <= col_to; col++) mphen_list.push_back(col);
+                }
+            }
+            if (mphen_list.empty() || *min_element(mphen_list.begin(), mphen_list.end()) < 1) LOGGER.e(0, "--mpheno should be > 0.");
+            // each trait is analysed once, its output file would be overwritten otherwise
+            stable_sort(mphen_list.begin(), mphen_list.end());
+            mphen_list.erase(unique(mphen_list.begin(), mphen_list.end()), mphen_list.end());
+            mphen = mphen_list[0];
         } else if (strcmp(argv[i], "--qcovar") == 0) {
             qcovar_file = argv[++i];
             LOGGER << "--qcovar " << qcovar_file << endl;
@@ -1263,6 +1290,7 @@ void option(int option_num, char* option_str[])
         if(cv_blup) LOGGER << "Warning: the option --cvblup option is disabled in this analysis." << endl;
         if (reml_lrt_flag) LOGGER << "Warning: the option --reml-lrt option is disabled in this analysis." << endl; 
     }
+    if (mphen_list.size() > 1 && (!reml_flag || bivar_reml_flag || mlma_flag || mlma_loco_flag)) LOGGER.e(0, "multiple traits in --mpheno are only supported by --reml.");
     if(bivar_reml_flag && prevalence_flag) LOGGER.e(0, "--prevalence option is not compatible with --reml-bivar option. Please check the --reml-bivar-prevalence option!");
     if(gsmr_flag || mtcojo_flag){
         if(ref_ld_flag && !w_ld_flag) LOGGER.e(0, "--ref-ld-chr, please specify the directory of the LD score files.");
@@ -1311,6 +1339,8 @@ void option(int option_num, char* option_str[])
     if(reml_allow_constrain_run) pter_gcta->set_reml_allow_constrain_run();
     if(reml_mtd != 0) pter_gcta->set_reml_mtd(reml_mtd);
     if(reml_inv_method != 0) pter_gcta->set_reml_inv_method(reml_inv_method);
+    if(reml_spectral_flag) pter_gcta->set_reml_spectral(reml_eigen_file);
+    if(mphen_list.size() > 1) pter_gcta->set_reml_mpheno(mphen_list);
     pter_gcta->set_reml_diagV_adj(reml_diagV_adj);
     pter_gcta->set_reml_diag_mul(reml_diag_mul);
     pter_gcta->set_diff_freq(freq_thresh); 
@@ -0,0 +1,313 @@
+/*
+ * GCTA: a tool for Genome-wide Complex Trait Analysis
+ *
+ * Spectral REML analysis with a single GRM
+ *
+ * The GRM is eigen-decomposed once, A = U diag(eval) U', so that
+ * V = U diag(d) U' with d = Vg * eval + Ve. With X and y rotated by U',
+ * V^-1, P, tr(PA) and the information matrix reduce to diagonal scalings
+ * and products of n x c matrices, and each REML iteration is O(n * c^2).
+ * The decomposition is shared by all the traits of --mpheno, and can be
+ * saved and reloaded by --reml-eigen.
+ *
+ * This file is distributed under the GNU General Public
+ * License, Version 3.  Please see the file LICENSE for more
+ * details
+ */
+
+#include "gcta.h"
+#include <limits>
+#include "GRMContainer.hpp"
+#include "MappedFile.hpp"
+
+struct RemlEigenHeader {
+    char magic[8];          // "GCTAREIG"
+    uint32_t version;
+    uint32_t reserved0;
+    uint64_t num_sample;
+    uint64_t id_hash;       // GRMContainer::hashIDs of FID:IID of the samples in the analysis
+    uint64_t grm_hash;      // of the lower triangle of the GRM
+    uint64_t reserved[3];
+};
+// followed by the eigenvalues (double, n) and the eigenvectors (double, n x n, column major)
+
+// the lower triangle identifies the GRM of the analysis: FNV-1a of each column,
+// hashed in parallel, then the column hashes in order
+static uint64_t hash_grm(const eigenMatrix &A)
+{
+    int n = A.rows();
+    vector<uint64_t> col_hash(n);
+    #pragma omp parallel for schedule(dynamic)
+    for (int j = 0; j < n; j++) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (int i = j; i < n; i++) {
+            double value = A(i, j);
+            const unsigned char *bytes = (const unsigned char *)&value;
+            for (size_t b = 0; b < sizeof(double); b++) {
+                hash ^= bytes[b];
+                hash *= 1099511628211ULL;
+            }
+        }
+        col_hash[j] = hash;
+    }
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *bytes = (const unsigned char *)col_hash.data();
+    for (uint64_t k = 0; k < col_hash.size() * sizeof(uint64_t); k++) {
+        hash ^= bytes[k];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// eigenvalues (ascending) and eigenvectors of a symmetric matrix by the
+// MRRR driver of LAPACK; A is destroyed
+static bool eigen_decomp_mrrr(MatrixXd &A, VectorXd &eval, MatrixXd &evec)
+{
+    int n = A.rows(), lda = n, ldz = n, il = 0, iu = 0, m = 0, info = 0;
+    int lwork = -1, liwork = -1, iwork_query = 0;
+    char jobz = 'V', range = 'A', uplo = 'L';
+    double vl = 0.0, vu = 0.0, abstol = 0.0, work_query = 0.0;
+    eval.resize(n);
+    evec.resize(n, n);
+    vector<int> isuppz(2 * n);
+#if GCTA_CPU_x86
+    dsyevr(&jobz, &range, &uplo, &n, A.data(), &lda, &vl, &vu, &il, &iu, &abstol, &m, eval.data(), evec.data(), &ldz, isuppz.data(), &work_query, &lwork, &iwork_query, &liwork, &info);
+#else
+    dsyevr_(&jobz, &range, &uplo, &n, A.data(), &lda, &vl, &vu, &il, &iu, &abstol, &m, eval.data(), evec.data(), &ldz, isuppz.data(), &work_query, &lwork, &iwork_query, &liwork, &info);
+#endif
+    if (info != 0) return false;
+    lwork = (int) work_query;
+    liwork = iwork_query;
+    vector<double> work(lwork);
+    vector<int> iwork(liwork);
+#if GCTA_CPU_x86
+    dsyevr(&jobz, &range, &uplo, &n, A.data(), &lda, &vl, &vu, &il, &iu, &abstol, &m, eval.data(), evec.data(), &ldz, isuppz.data(), work.data(), &lwork, iwork.data(), &liwork, &info);
+#else
+    dsyevr_(&jobz, &range, &uplo, &n, A.data(), &lda, &vl, &vu, &il, &iu, &abstol, &m, eval.data(), evec.data(), &ldz, isuppz.data(), work.data(), &lwork, iwork.data(), &liwork, &info);
+#endif
+    return (info == 0 && m == n);
+}
+
+void gcta::reml_spectral_init(const vector<string> &uni_id)
+{
+    uint64_t id_hash = GRMContainer::hashIDs(uni_id);
+    uint64_t grm_hash = hash_grm(_A[0]);
+
+    // the residual component is the unit diagonal in the basis of the GRM
+    _A[_A.size() - 1].resize(0, 0);
+
+    if (_reml_eigen_file.empty() || !reml_spectral_load(id_hash, grm_hash)) {
+        LOGGER << "Eigen-decomposition of the GRM for " << _n << " individuals (may take a while) ..." << endl;
+        LOGGER.ts("REML_EIGEN");
+        VectorXd eval;
+        MatrixXd evec, A_work;
+#ifdef SINGLE_PRECISION
+        A_work = _A[0].cast<double>();
+#else
+        A_work.swap(_A[0]);
+#endif
+        _A[0].resize(0, 0);
+        if (!eigen_decomp_mrrr(A_work, eval, evec)) LOGGER.e(0, "the eigen-decomposition of the GRM failed.");
+        A_work.resize(0, 0);
+#ifdef SINGLE_PRECISION
+        _spec_eval = eval.cast<float>();
+        _spec_evec = evec.cast<float>();
+#else
+        _spec_eval.swap(eval);
+        _spec_evec.swap(evec);
+#endif
+        LOGGER << "Eigen-decomposition finished in " << LOGGER.tp("REML_EIGEN") << " seconds." << endl;
+        if (!_reml_eigen_file.empty()) reml_spectral_save(id_hash, grm_hash);
+    }
+    _A[0].resize(0, 0);
+
+    _spec_X = _spec_evec.transpose() * _X;
+    _spec_active = true;
+    LOGGER << "Spectral REML: each iteration is computed in the eigen-space of the GRM." << endl;
+}
+
+bool gcta::reml_spectral_load(uint64_t id_hash, uint64_t grm_hash)
+{
+    FILE *h_test = fopen(_reml_eigen_file.c_str(), "rb");
+    if (!h_test) return false;
+    fclose(h_test);
+
+    MappedFile file;
+    file.open(_reml_eigen_file);
+    RemlEigenHeader header;
+    if (file.size() < sizeof(header)) {
+        LOGGER << "[" + _reml_eigen_file + "] is not an eigen-decomposition saved by --reml-eigen, it will be overwritten." << endl;
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, "GCTAREIG", 8) != 0 || header.version != 2 || header.num_sample != (uint64_t)_n
+            || file.size() != sizeof(header) + (header.num_sample + header.num_sample * header.num_sample) * sizeof(double)) {
+        LOGGER << "[" + _reml_eigen_file + "] is not an eigen-decomposition for this analysis, it will be overwritten." << endl;
+        return false;
+    }
+    if (header.id_hash != id_hash || header.grm_hash != grm_hash) {
+        LOGGER << "The individuals or the GRM differ from those in [" + _reml_eigen_file + "], it will be overwritten." << endl;
+        return false;
+    }
+
+    const double *eval = (const double *)(file.data() + sizeof(header));
+    _spec_eval = Map<const VectorXd>(eval, _n).cast<eigenVector::Scalar>();
+    _spec_evec = Map<const MatrixXd>(eval + _n, _n, _n).cast<eigenMatrix::Scalar>();
+    LOGGER << "Eigen-decomposition of the GRM for " << _n << " individuals loaded from [" + _reml_eigen_file + "]." << endl;
+    return true;
+}
+
+void gcta::reml_spectral_save(uint64_t id_hash, uint64_t grm_hash)
+{
+    RemlEigenHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "GCTAREIG", 8);
+    header.version = 2;
+    header.num_sample = _n;
+    header.id_hash = id_hash;
+    header.grm_hash = grm_hash;
+
+    FILE *h_out = fopen(_reml_eigen_file.c_str(), "wb");
+    if (!h_out) LOGGER.e(0, "cannot open the file [" + _reml_eigen_file + "] to write.");
+    bool success = (fwrite(&header, sizeof(header), 1, h_out) == 1);
+    VectorXd buf = _spec_eval.cast<double>();
+    success = success && (fwrite(buf.data(), sizeof(double), _n, h_out) == (size_t)_n);
+    for (int j = 0; j < _n && success; j++) {
+        buf = _spec_evec.col(j).cast<double>();
+        success = (fwrite(buf.data(), sizeof(double), _n, h_out) == (size_t)_n);
+    }
+    if (fclose(h_out) != 0 || !success) LOGGER.e(0, "cannot write to the file [" + _reml_eigen_file + "].");
+    LOGGER << "Eigen-decomposition of the GRM saved to [" + _reml_eigen_file + "]." << endl;
+}
+
+// the i-th variance component in the eigen-space of the GRM, a diagonal
+eigenVector gcta::spectral_diag(int i)
+{
+    if (_r_indx[i] == 0) return _spec_eval;
+    return eigenVector::Ones(_n);
+}
+
+// eigenvalues of V; unlike calcu_Vi, V is not required to be positive definite as long as it is invertible
+bool gcta::spectral_Vi(eigenVector &prev_varcmp, eigenVector &d, double &logdet)
+{
+    d = eigenVector::Zero(_n);
+    for (size_t i = 0; i < _r_indx.size(); i++) d += spectral_diag(i) * prev_varcmp[i];
+    if (_r_indx.size() == 1) {
+        logdet = _n * log(prev_varcmp[0]);
+        return true;
+    }
+
+    double thresh = d.cwiseAbs().maxCoeff() * _n * std::numeric_limits<double>::epsilon();
+    if ((d.array().abs() <= thresh).any()) {
+        LOGGER << "Warning: the variance-covaraince matrix V is not invertible." << endl;
+        if (_reml_diagV_adj == 1) {
+            LOGGER << "A small positive value is added to the diagonals. The results might not be reliable!" << endl;
+            d.array() += d.mean() * _reml_diag_mul;
+            if ((d.array().abs() <= thresh).any()) {
+                LOGGER << "Still can't be inverted. Try --reml-alg-inv 2 " << endl;
+                return false;
+            }
+        } else if (_reml_diagV_adj == 2) {
+            LOGGER << "Switching to the \"bending\" approach to invert V. This method hasn't been tested extensively. The results might not be reliable!" << endl;
+            bending_eigenval(d);
+        } else {
+            LOGGER.e(0, "the variance-covariance matrix V is not invertible.\nWe may try --reml-alg-inv 1 to add a small constant value to the diagonals or --reml-alg-inv 2 to bend the matrix V.");
+        }
+    }
+    logdet = d.array().abs().log().sum();
+    return true;
+}
+
+// W = V^-1 X, Ci = (X' V^-1 X)^-1 and p = P y, all in the eigen-space; returns log|X' V^-1 X|
+double gcta::spectral_P(const eigenVector &d, const eigenVector &y_rot, eigenMatrix &W, eigenMatrix &Ci, eigenVector &p)
+{
+    eigenVector di = d.cwiseInverse();
+    W = di.asDiagonal() * _spec_X;
+    Ci = _spec_X.transpose() * W;
+    double logdet_Xt_Vi_X = 0.0;
+    int rank = 0;
+    INVmethod method = (_reml_inv_mtd == 0) ? INV_LLT : static_cast<INVmethod>(_reml_inv_mtd);
+    if (!SquareMatrixInverse(Ci, logdet_Xt_Vi_X, rank, method)) LOGGER.e(0, "\n  the X^t * V^-1 * X matrix is not invertible. Please check the covariate(s) and/or the environmental factor(s).");
+    p = di.cwiseProduct(y_rot) - W * (Ci * (W.transpose() * y_rot));
+    return logdet_Xt_Vi_X;
+}
+
+void gcta::spectral_tr_PA(const eigenVector &d, const eigenMatrix &W, const eigenMatrix &Ci, eigenVector &tr_PA)
+{
+    tr_PA.resize(_r_indx.size());
+    for (size_t i = 0; i < _r_indx.size(); i++) {
+        eigenVector e = spectral_diag(i);
+        tr_PA(i) = e.cwiseQuotient(d).sum() - Ci.cwiseProduct(W.transpose() * e.asDiagonal() * W).sum();
+    }
+}
+
+// inverse of the Fisher information matrix, tr(P A_i P A_j), as calcu_Hi
+void gcta::spectral_Hi(const eigenVector &d, const eigenMatrix &W, const eigenMatrix &Ci, eigenMatrix &Hi)
+{
+    int num = _r_indx.size();
+    eigenVector di = d.cwiseInverse();
+    vector<eigenMatrix> CiG(num);
+    for (int i = 0; i < num; i++) CiG[i] = Ci * (W.transpose() * spectral_diag(i).asDiagonal() * W);
+    Hi.resize(num, num);
+    for (int i = 0; i < num; i++) {
+        for (int j = 0; j <= i; j++) {
+            eigenVector e = spectral_diag(i).cwiseProduct(spectral_diag(j)).cwiseProduct(di);
+            Hi(i, j) = Hi(j, i) = e.dot(di) - 2.0 * Ci.cwiseProduct(W.transpose() * e.asDiagonal() * W).sum() + CiG[i].cwiseProduct(CiG[j].transpose()).sum();
+        }
+    }
+
+    if (!inverse_H(Hi)) {
+        if (_reml_force_converge) {
+            LOGGER << "Warning: the information matrix is not invertible." << endl;
+            _reml_AI_not_invertible = true;
+        }
+        else LOGGER.e(0, "the information matrix is not invertible.");
+    }
+}
+
+// one update of the variance components by the method of _reml_mtd, as ai_reml, reml_equation and em_reml
+void gcta::spectral_reml(const eigenVector &d, const eigenMatrix &W, const eigenMatrix &Ci, const eigenVector &p, eigenMatrix &Hi, eigenVector &prev_varcmp, eigenVector &varcmp, double dlogL)
+{
+    int num = _r_indx.size();
+    eigenMatrix Ep(_n, num);
+    eigenVector R(num);
+    for (int i = 0; i < num; i++) {
+        Ep.col(i) = spectral_diag(i).cwiseProduct(p);
+        R(i) = p.dot(Ep.col(i));
+    }
+
+    // Fisher-scoring
+    if (_reml_mtd == 1) {
+        spectral_Hi(d, W, Ci, Hi);
+        if (_reml_AI_not_invertible) return;
+        varcmp = Hi * R;
+        Hi = 2 * Hi;
+        return;
+    }
+
+    eigenVector tr_PA;
+    spectral_tr_PA(d, W, Ci, tr_PA);
+
+    // EM
+    if (_reml_mtd == 2) {
+        for (int i = 0; i < num; i++) varcmp(i) = prev_varcmp(i) - prev_varcmp(i) * prev_varcmp(i) * (tr_PA(i) - R(i)) / _n;
+        return;
+    }
+
+    // AI: H_ij = 0.5 * (A_i P y)' P (A_j P y)
+    eigenMatrix PEp = d.cwiseInverse().asDiagonal() * Ep - W * (Ci * (W.transpose() * Ep));
+    Hi = 0.5 * (Ep.transpose() * PEp);
+    R = -0.5 * (tr_PA - R);
+    if (!inverse_H(Hi)) {
+        if (_reml_force_converge) {
+            LOGGER << "Warning: the information matrix is not invertible." << endl;
+            _reml_AI_not_invertible = true;
+            return;
+        }
+        else LOGGER.e(0, "the information matrix is not invertible.");
+    }
+
+    eigenVector delta = Hi * R;
+    if (dlogL > 1.0) varcmp = prev_varcmp + 0.316 * delta;
+    else varcmp = prev_varcmp + delta;
+}
@@ -42,9 +42,20 @@
 #include <boost/lexical_cast.hpp>
 #include <iomanip>
 #include "Covar.h"
+#include "SparseGRM.hpp"
+#include "MappedFile.hpp"
 #include <cstdio>
 #include <random>
 #include <chrono>
+#include <map>
+#include <limits>
+#include <fstream>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #include <Eigen/Core>
 #include <Eigen/SparseCore>
@@ -74,6 +85,26 @@ struct MDLHeader{
     bool has_envir;
     double VR_copy;
     uint64_t envirVec_start;
+    // filled in the space reserved before phenoVec_start, zeros in the files saved before them
+    char id_magic[8];           // "GCTAMDLH"
+    uint64_t id_hash;           // GRMContainer::hashIDs of the lines in .mdl.id
+};
+static_assert(sizeof(MDLHeader) <= 512, "MDLHeader overlaps the phenotypes");
+
+// the binary GLMM null model (.mdl.bin2): the header, then the vectors and matrices as doubles,
+//   each at an offset aligned to 64 bytes so that the file is read as mapped; the legacy files
+//   begin with "fGLM" and are parsed field by field
+struct BinMDLHeader{
+    char magic[8];              // "GCTABMDL"
+    uint32_t version;
+    uint32_t num_indi;
+    uint32_t num_covar;
+    uint32_t precise_covar;
+    uint64_t id_hash;           // GRMContainer::hashIDs of the lines in .mdl.id
+    double tao;
+    double c_inf;
+    uint64_t file_bytes;
+    uint64_t section[6];        // mu, phenoVec, phenoVecMu, dWp, covar (n x c), H (c x n)
 };
     
 
@@ -316,6 +347,263 @@ public:
 ArrayXd SPA::mu;
 int SPA::nSample = 0;
 
+// SPA of many markers at once. The genotypes of all the markers are kept in flat arrays, the cumulants
+//   of all the unfinished roots are evaluated by array operations over them, a root per thread.
+//   Each marker has two roots (q and qinv), Newton iterations as SPA::getRootK1 run on each root
+//   independently; the markers with both roots found are removed from the arrays.
+//   As the fast mode of SPA, the samples out of the index are taken by the normal approximation.
+class SPABatch{
+public:
+    SPABatch(const VectorXd &mu) : mu(mu){}
+
+    // index of all the samples takes no normal approximation, as SPA in the full mode
+    void add(const SPAInput &input, SPARes *res){
+        Variant v;
+        v.start = G.size();
+        v.len = input.index.size();
+        v.res = res;
+        double gmu = 0, mu1muG = 0;
+        for(uint64_t k = 0; k < v.len; k++){
+            double cur_mu = mu[input.index[k]];
+            double cur_g = input.gIndex[k];
+            G.push_back(cur_g);
+            MU.push_back(cur_mu);
+            gmu += cur_g * cur_mu;
+            mu1muG += cur_mu * (1.0 - cur_mu) * cur_g * cur_g;
+        }
+        if(v.len == (uint64_t)mu.size()){
+            v.NAmu = 0;
+            v.NAsigma = 0;
+        }else{
+            v.NAmu = (input.qinv + input.q) * 0.5 - gmu;
+            v.NAsigma = input.mu1muGSum - mu1muG;
+        }
+        variants.push_back(v);
+        double qs[2] = {input.q, input.qinv};
+        for(int s = 0; s < 2; s++){
+            Lane lane;
+            lane.q = qs[s];
+            lane.gPos = input.gPos;
+            lane.gNeg = input.gNeg;
+            lanes.push_back(lane);
+        }
+    }
+
+    uint64_t size() const { return variants.size(); }
+
+    // res->p_adj and res->bConverge of all the markers added
+    void solve(double thresh = 0.0001220703, int maxIter = 1000){
+        uint64_t num_lane = lanes.size();
+        active.clear();
+        for(uint64_t v = 0; v < variants.size(); v++){
+            active.push_back(v);
+        }
+        for(uint64_t l = 0; l < num_lane; l++){
+            Lane &lane = lanes[l];
+            const Variant &v = variants[l / 2];
+            if(lane.q >= lane.gPos || lane.q <= lane.gNeg){
+                lane.root = std::numeric_limits<double>::infinity();
+                lane.done = true;
+                lane.converge = true;
+                KorgK2(v, lane.root, lane.k1, lane.k2);
+            }else{
+                lane.t = 0;
+                lane.prevJump = std::numeric_limits<double>::infinity();
+                lane.nIter = 1;
+            }
+        }
+        compact();
+
+        vector<double> t(num_lane), sums;
+        for(uint64_t l = 0; l < num_lane; l++) t[l] = lanes[l].t;
+        evalSums(false, t, sums);
+        for(uint64_t l = 0; l < num_lane; l++){
+            const Variant &v = variants[l / 2];
+            lanes[l].K1eval = sums[l] + v.NAmu + v.NAsigma * lanes[l].t - lanes[l].q;
+        }
+
+        while(!active.empty()){
+            for(uint64_t l = 0; l < num_lane; l++) t[l] = lanes[l].t;
+            evalSums(true, t, sums);
+            for(uint64_t a : active){
+                const Variant &v = variants[a];
+                for(uint64_t l = 2 * a; l < 2 * a + 2; l++){
+                    Lane &lane = lanes[l];
+                    if(lane.done) continue;
+                    double K2eval = sums[l] + v.NAsigma;
+                    lane.tnew = lane.t - lane.K1eval / K2eval;
+                    if(!std::isfinite(lane.tnew)){
+                        finish(lane, v, false);
+                    }else if(std::abs(lane.tnew - lane.t) <= thresh){
+                        finish(lane, v, true);
+                        lane.k2 = K2eval;
+                    }else if(lane.nIter == maxIter){
+                        finish(lane, v, false);
+                    }
+                }
+            }
+            compact();
+            if(active.empty()) break;
+
+            for(uint64_t l = 0; l < num_lane; l++) t[l] = lanes[l].done ? lanes[l].t : lanes[l].tnew;
+            evalSums(false, t, sums);
+            for(uint64_t a : active){
+                const Variant &v = variants[a];
+                for(uint64_t l = 2 * a; l < 2 * a + 2; l++){
+                    Lane &lane = lanes[l];
+                    if(lane.done) continue;
+                    double newK1 = sums[l] + v.NAmu + v.NAsigma * lane.tnew - lane.q;
+                    if(sgn(lane.K1eval) != sgn(newK1)){
+                        double absTnewT1 = std::abs(lane.tnew - lane.t);
+                        if(absTnewT1 > lane.prevJump - thresh){
+                            lane.tnew = lane.t + sgn(newK1 - lane.K1eval) * lane.prevJump * 0.5;
+                            newK1 = K1(v, lane.tnew) + v.NAmu + v.NAsigma * lane.tnew - lane.q;
+                            lane.prevJump = lane.prevJump * 0.5;
+                        }else{
+                            lane.prevJump = absTnewT1;
+                        }
+                    }
+                    lane.nIter++;
+                    lane.t = lane.tnew;
+                    lane.K1eval = newK1;
+                }
+            }
+        }
+
+        for(uint64_t v = 0; v < variants.size(); v++){
+            const Lane &l1 = lanes[2 * v], &l2 = lanes[2 * v + 1];
+            SPARes *res = variants[v].res;
+            if(l1.converge && l2.converge){
+                double p1 = saddleTail(l1.root, l1.q, l1.k1, l1.k2);
+                double p2 = saddleTail(l2.root, l2.q, l2.k1, l2.k2);
+                res->p_adj = std::abs(p1) + std::abs(p2);
+                res->bConverge = true;
+            }else{
+                res->p_adj = std::numeric_limits<double>::quiet_NaN();
+                res->bConverge = false;
+            }
+            if(res->p_adj != 0 && res->p / res->p_adj > 1000){
+                res->p_adj = res->p;
+                res->bConverge = false;
+            }
+        }
+
+        vector<double>().swap(G);
+        vector<double>().swap(MU);
+        variants.clear();
+        lanes.clear();
+        active.clear();
+    }
+
+private:
+    struct Variant{
+        uint64_t start;     // in G and MU, moved by compact
+        uint64_t len;
+        double NAmu;
+        double NAsigma;
+        SPARes *res;
+    };
+    struct Lane{
+        double q, gPos, gNeg;
+        double t = 0, tnew = 0, K1eval = 0, prevJump = 0;
+        int nIter = 0;
+        bool done = false, converge = false;
+        double root = 0, k1 = 0, k2 = 0;
+    };
+    const VectorXd &mu;
+    vector<double> G;
+    vector<double> MU;
+    vector<Variant> variants;
+    vector<Lane> lanes;
+    vector<uint64_t> active;        // unfinished markers, in the order of their genotypes
+
+    // the root is taken at t, the cumulants at the root of a converged one
+    void finish(Lane &lane, const Variant &v, bool converge){
+        lane.done = true;
+        lane.converge = converge;
+        lane.root = lane.t;
+        if(converge){
+            double k2;
+            KorgK2(v, lane.t, lane.k1, k2);
+        }
+    }
+
+    // drop the finished markers, the genotypes of the others moved to the front
+    void compact(){
+        vector<uint64_t> kept;
+        uint64_t pos = 0;
+        for(uint64_t a : active){
+            if(lanes[2 * a].done && lanes[2 * a + 1].done) continue;
+            Variant &v = variants[a];
+            if(v.start != pos){
+                std::copy(G.begin() + v.start, G.begin() + v.start + v.len, G.begin() + pos);
+                std::copy(MU.begin() + v.start, MU.begin() + v.start + v.len, MU.begin() + pos);
+                v.start = pos;
+            }
+            kept.push_back(a);
+            pos += v.len;
+        }
+        active.swap(kept);
+    }
+
+    // sums over the genotypes of the K1 (k2 = false) or K2 terms of each unfinished lane at t[lane];
+    //   each lane is summed by one thread over its own genotypes, so the sums don't depend on the
+    //   scheduling or on where compact moved the genotypes
+    void evalSums(bool k2, const vector<double> &t, vector<double> &sums){
+        sums.assign(lanes.size(), 0);
+        int64_t num_lane = 2 * active.size();
+        #pragma omp parallel for schedule(dynamic)
+        for(int64_t k = 0; k < num_lane; k++){
+            uint64_t l = 2 * active[k / 2] + k % 2;
+            if(lanes[l].done) continue;
+            const Variant &v = variants[l / 2];
+            Map<const ArrayXd> g(G.data() + v.start, v.len), m(MU.data() + v.start, v.len);
+            ArrayXd ex = (-g * t[l]).exp();
+            ArrayXd denom = (1.0 - m) * ex + m;
+            ArrayXd terms;
+            if(k2){
+                terms = (m * (1.0 - m) * g.square() * ex) / denom.square();
+                terms = (!terms.isNaN()).select(terms, 0);
+            }else{
+                terms = (m * g) / denom;
+            }
+            sums[l] = terms.sum();
+        }
+    }
+
+    double K1(const Variant &v, double t) const {
+        Map<const ArrayXd> g(G.data() + v.start, v.len), m(MU.data() + v.start, v.len);
+        return ((m * g) / ((1.0 - m) * (-g * t).exp() + m)).sum();
+    }
+
+    // as SPA::KorgK2 in the fast mode
+    void KorgK2(const Variant &v, double t, double &k1, double &k2) const {
+        Map<const ArrayXd> g(G.data() + v.start, v.len), m(MU.data() + v.start, v.len);
+        ArrayXd genot1exp = (-g * t).exp();
+        ArrayXd div21 = (m * (1.0 - m) * g.square() * genot1exp) / ((1.0 - m) * genot1exp + m).square();
+        k2 = ((!div21.isNaN()).select(div21, 0)).sum() + v.NAsigma;
+        k1 = (1.0 - m + m / genot1exp).log().sum() + v.NAmu * t + 0.5 * v.NAsigma * t * t;
+    }
+
+    // as SPA::getSaddleProb
+    static double saddleTail(double zeta, double q, double k1, double k2){
+        double pval = 0;
+        if(std::isfinite(k1) && std::isfinite(k2)){
+            double temp1 = zeta * q - k1;
+            double w = sgn(zeta) * std::sqrt(2.0) * std::sqrt(temp1);
+            double wi = 1.0 / w;
+            double v = zeta * std::sqrt(k2);
+            double z_test = w + wi * std::log(v * wi);
+            if(z_test > 0){
+                pval = StatLib::pnorm(z_test, false);
+            }else{
+                pval = StatLib::pnorm(z_test, true);
+            }
+        }
+        return pval;
+    }
+};
+
 void FastFAM::loadBinModel(){
         LOGGER << "Loading saved GLM model file prefixed with [" << options["model_file"] << "]..." << std::endl;
         LOGGER << "Note: phenotype, covariates, sparse GRM and association test methods are included in the model file, thus these flags will be ignored." << std::endl;
@@ -343,6 +631,91 @@ void FastFAM::loadBinModel(){
         }
 
         string bin_file = model_file + ".bin2";
+        MappedFile file;
+        file.open(bin_file);
+        if(file.size() >= 5 && memcmp(file.data(), "fGLM", 5) == 0){
+            file.close();
+            loadBinModelLegacy(bin_file, id2);
+            initVar();
+            LOGGER << "  loaded successfully." << std::endl;
+            return;
+        }
+
+        BinMDLHeader header;
+        if(file.size() < sizeof(header)){
+            LOGGER.e(0, "[" + bin_file + "] is not a model file generated by GCTA.");
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if(memcmp(header.magic, "GCTABMDL", 8) != 0 || header.version != 1){
+            LOGGER.e(0, "wrong header in [" + bin_file + "]. This file can only be generated from GCTA.");
+        }
+        if(header.num_indi != num_indi || header.file_bytes != file.size()){
+            LOGGER.e(0, "the size of [" + bin_file + "] does not match its header.");
+        }
+        if(GRMContainer::hashIDFile(id_file) != header.id_hash){
+            LOGGER.e(0, "the IDs in [" + id_file + "] do not match [" + bin_file + "].");
+        }
+        uint64_t num_covar_elements = (uint64_t)num_indi * header.num_covar;
+        uint64_t section_size[6] = {num_indi, num_indi, num_indi, num_indi, num_covar_elements, num_covar_elements};
+        for(int k = 0; k < 6; k++){
+            if(header.section[k] % 8 != 0 || header.section[k] + section_size[k] * sizeof(double) > header.file_bytes){
+                LOGGER.e(0, "the size of [" + bin_file + "] does not match its header.");
+            }
+        }
+
+        num_covar = header.num_covar;
+        bPreciseCovar = header.precise_covar;
+        taoVal = header.tao;
+        c_inf = header.c_inf;
+
+        // copied as a whole if the samples are in the order of the model
+        bool bSameOrder = true;
+        for(uint32_t i = 0; i < num_indi; i++){
+            if(id2[i] != i){
+                bSameOrder = false;
+                break;
+            }
+        }
+        auto section = [&](int k){ return (const double *)(file.data() + header.section[k]); };
+        auto loadVector = [&](int k, VectorXd &vec){
+            vec.resize(num_indi);
+            const double *src = section(k);
+            if(bSameOrder){
+                memcpy(vec.data(), src, sizeof(double) * num_indi);
+            }else{
+                for(uint32_t i = 0; i < num_indi; i++) vec[i] = src[id2[i]];
+            }
+        };
+        loadVector(0, mu);
+        loadVector(1, phenoVec);
+        loadVector(2, phenoVecMu);
+        loadVector(3, dWp);
+
+        covar.resize(num_indi, num_covar);
+        H.resize(num_covar, num_indi);
+        if(bSameOrder){
+            memcpy(covar.data(), section(4), sizeof(double) * num_covar_elements);
+            memcpy(H.data(), section(5), sizeof(double) * num_covar_elements);
+        }else{
+            const double *src_covar = section(4);
+            const double *src_H = section(5);
+            #pragma omp parallel for
+            for(uint32_t i = 0; i < num_indi; i++){
+                for(int j = 0; j < num_covar; j++){
+                    covar(i, j) = src_covar[(uint64_t)j * num_indi + id2[i]];
+                    H(j, i) = src_H[(uint64_t)id2[i] * num_covar + j];
+                }
+            }
+        }
+        file.close();
+
+        bModelLoaded = true;
+        initVar();
+        LOGGER << "  loaded successfully." << std::endl;
+}
+
+// the model files before the mapped format
+void FastFAM::loadBinModelLegacy(const string &bin_file, const vector<uint32_t> &id2){
         FILE* ibin = fopen(bin_file.c_str(), "rb");
         if(!ibin){
             LOGGER.e(0, "can't open file [" + bin_file + "] to read.");
@@ -427,10 +800,7 @@ void FastFAM::loadBinModel(){
         }
         delete[] tempCovar;
 
-        initVar();
-
         fclose(ibin);
-        LOGGER << "  loaded successfully." << std::endl;
 }
 
 void FastFAM::loadModel(){
@@ -454,21 +824,34 @@ void FastFAM::loadModel(){
         pheno->filter_keep_index(id1);
         LOGGER << "  " << num_indi << " valid individuals to be included." << std::endl;
 
-        MDLHeader head;
+        // read as mapped; the samples are reordered from the file directly
         string bin_file = model_file + ".bin";
-        FILE* ibin = fopen(bin_file.c_str(), "rb");
-        if(!ibin){
-            LOGGER.e(0, "can't open file [" + bin_file + "] to read.");
-        }
-        if(fread(&head, sizeof(MDLHeader), 1, ibin) != 1){
+        MappedFile file;
+        file.open(bin_file);
+        MDLHeader head;
+        if(file.size() < sizeof(MDLHeader)){
             LOGGER.e(0, "can't read header in [" + bin_file + "].");
         }
+        memcpy(&head, file.data(), sizeof(MDLHeader));
         if(strcmp(head.magic, "fGWA") != 0){
             LOGGER.e(0, "incorrect header in [" + bin_file + "]. This file can only be generated from GCTA model.");
         }
         if(head.num_indi != modelIDs.size()){
             LOGGER.e(0, "the sample IDs in the saved model is different from that in genotype data file!");
         }
+        if(memcmp(head.id_magic, "GCTAMDLH", 8) == 0){
+            if(GRMContainer::hashIDFile(id_file) != head.id_hash){
+                LOGGER.e(0, "the IDs in [" + id_file + "] do not match [" + bin_file + "].");
+            }
+        }else{
+            LOGGER.w(0, "[" + bin_file + "] was saved by an older version, the sample IDs can't be checked against it.");
+        }
+        auto section = [&](uint64_t start, uint64_t num_item, uint64_t item_bytes, const string &name){
+            if(start % 8 != 0 || start + num_item * item_bytes > file.size()){
+                LOGGER.e(0, "failed to read " + name + " from the saved model.");
+            }
+            return file.data() + start;
+        };
         fam_flag = head.fam_flag;
         if(fam_flag){
             options["grmsparse_file"] = "demo";
@@ -491,41 +874,30 @@ void FastFAM::loadModel(){
 
         // read the phenotype
         LOGGER << "  loading phenotypes..." << std::endl;
-        double *phenoP;
-        double *tempP = new double[num_indi];
+        VectorXd *phenoP;
         if (has_envir){
-            Vi_y.resize(num_indi);
-            phenoP = Vi_y.data();
+            phenoP = &Vi_y;
         }else if((fam_flag && (!bGrammar)) || (!fam_flag)){
-            phenoVec.resize(num_indi);
-            phenoP = phenoVec.data();       
+            phenoP = &phenoVec;
         }else{
-            Vi_y_cinf.resize(num_indi);
-            phenoP = Vi_y_cinf.data();
-        }
-        fseek(ibin, head.phenoVec_start, SEEK_SET);
-        if(fread(tempP, sizeof(double), num_indi, ibin) != num_indi){
-            LOGGER.e(0, "failed to read phenotype from the saved model.");
+            phenoP = &Vi_y_cinf;
         }
-        // switch order;
+        const double *src_pheno = (const double *)section(head.phenoVec_start, num_indi, sizeof(double), "phenotype");
+        phenoP->resize(num_indi);
         for(int i = 0; i < num_indi; i++){
-            phenoP[i] = tempP[id2[i]];
+            (*phenoP)[i] = src_pheno[id2[i]];
         }
-        delete[] tempP;
 
         // read covariates
         LOGGER << "  loading covariates..." << std::endl;
         uint64_t num_covar_elements = (uint64_t)num_indi * head.covarVec_cols;
-        fseek(ibin, head.covarVec_start, SEEK_SET);
+        const double *src_covar = (const double *)section(head.covarVec_start, num_covar_elements * (covarFlag ? 2 : 1),
+                sizeof(double), "covariates");
         this->covar.resize(num_indi, head.covarVec_cols);
-        double *tempCovar = new double[num_covar_elements];
-        if(fread(tempCovar, sizeof(double), num_covar_elements, ibin) != num_covar_elements){
-            LOGGER.e(0, "failed to read covariates from the saved model.");
-        }
         for(uint64_t i = 0; i < head.covarVec_cols; i++){
             uint64_t cur_base = i * num_indi;
             for(uint64_t j = 0; j < num_indi; j++){
-                covar(j, i) = tempCovar[cur_base + id2[j]];
+                covar(j, i) = src_covar[cur_base + id2[j]];
             }
         }
 
@@ -533,34 +905,23 @@ void FastFAM::loadModel(){
             LOGGER << "  loading " << head.covarVec_cols << " covariates..." << std::endl;
             //TODO  H seems incorrect;
             H.resize(num_indi, head.covarVec_cols);
-            if(fread(tempCovar, sizeof(double), num_covar_elements, ibin) != num_covar_elements){
-                LOGGER.e(0, "failed to read covariates from the saved model.");
-            }
+            const double *src_H = src_covar + num_covar_elements;
             for(uint64_t i = 0; i < head.covarVec_cols; i++){
                 uint64_t cur_base = i * num_indi;
                 for(uint64_t j = 0; j < num_indi; j++){
-                    H(j, i) = tempCovar[cur_base + id2[j]];
+                    H(j, i) = src_H[cur_base + id2[j]];
                 }
             }
         }
-        delete[] tempCovar;
 
         //read the environment variable
         if (has_envir){
             LOGGER << "  loading the environment variable..." << std::endl;
-            double *envirE;
-            double *tempE = new double[num_indi];
+            const double *src_envir = (const double *)section(head.envirVec_start, num_indi, sizeof(double), "the environment variable");
             envirVec_scaled.resize(num_indi);
-            envirE = envirVec_scaled.data();
-            fseek(ibin, head.envirVec_start, SEEK_SET);
-            if(fread(tempE, sizeof(double), num_indi, ibin) != num_indi){
-                LOGGER.e(0, "failed to read the environment variable from the saved model.");
-            }
-            // switch order;
             for(int i = 0; i < num_indi; i++){
-                envirE[i] = tempE[id2[i]];
+                envirVec_scaled[i] = src_envir[id2[i]];
             }
-            delete[] tempE;
         }
 
         if(fam_flag && (!bGrammar)){
@@ -575,19 +936,11 @@ void FastFAM::loadModel(){
 
             V_inverse.resize(num_indi, num_indi);
 
-            uint32_t cur_item = 0;
-            InvItem item;
-            while(cur_item < head.V_inverse_items){
-                if(fread(&item, sizeof(item), 1, ibin) == 1){
-                    //V_inverse.insert(item.row, item.col) = item.val;
-                    vi[cur_item] = lookup[item.row];
-                    vj[cur_item] = lookup[item.col];
-                    val[cur_item] = item.val; 
-
-                    cur_item++;
-                }else{
-                    LOGGER.e(0, "failed to read the V inverse from the saved model.");
-                }
+            const InvItem *items = (const InvItem *)section(head.V_inverse_start, head.V_inverse_items, sizeof(InvItem), "the V inverse");
+            for(uint32_t cur_item = 0; cur_item < head.V_inverse_items; cur_item++){
+                vi[cur_item] = lookup[items[cur_item].row];
+                vj[cur_item] = lookup[items[cur_item].col];
+                val[cur_item] = items[cur_item].val;
             }
             //reorder
             vector<size_t> ordIndex = sort_indexes(vj, vi);
@@ -599,7 +952,7 @@ void FastFAM::loadModel(){
 
         V_inverse.finalize();
         V_inverse.makeCompressed();
-        fclose(ibin);
+        file.close();
         LOGGER << "  loaded successfully." << std::endl;
 }
 
@@ -617,6 +970,20 @@ FastFAM::FastFAM(){
     if(options.find("binary") != options.end()){
         bBinary = true;
     }
+
+    if(pheno->count_mpheno() > 1){
+        bMultiTrait = true;
+        if(bBinary || options["model_file"] != "" || options.find("model_only") != options.end()){
+            LOGGER.e(0, "multiple traits in --mpheno can only be tested by --fastGWA-mlm or --fastGWA-lr.");
+        }
+        if(options.find("grmsparse_file") != options.end() && options.find("grammar") == options.end()){
+            LOGGER.e(0, "multiple traits in --mpheno can only be tested by --fastGWA-mlm or --fastGWA-lr.");
+        }
+        if(options.find("inv_file") != options.end() || options.find("save_inv") != options.end() ||
+                options.find("save_bin") != options.end()){
+            LOGGER.e(0, "--load-inv, --save-inv and --save-bin don't support multiple traits in --mpheno.");
+        }
+    }
  
     if(options["model_file"] != ""){
         if(bBinary){
@@ -639,8 +1006,8 @@ FastFAM::FastFAM(){
         LOGGER << "Using random seed: " << seed << std::endl;
     }
 
-    double VG;
-    double VR;
+    double VG = 0;
+    double VR = 0;
     bool flag_est_GE = true;
     if(options.find("G") != options.end()){
         VG = std::stod(options["G"]);
@@ -695,6 +1062,13 @@ FastFAM::FastFAM(){
 
     if(fam_flag){
         readFAM(ffam_file, fam, remain_ids, remain_index_fam);
+        // the G x E models reweight the GRM, the blocks are only for V = Vg * GRM + Ve * I
+        if(!has_envir){
+            famBlocks.init(fam);
+            bFamBlocks = true;
+            LOGGER.i(0, "The sparse GRM has " + to_string(famBlocks.numSingletons()) + " unrelated individuals and "
+                    + to_string(famBlocks.numBlocks()) + " groups of relatives (largest group " + to_string(famBlocks.maxBlockSize()) + ").");
+        }
     }else{
         remain_index_fam.resize(remain_ids.size());
         std::iota(remain_index_fam.begin(), remain_index_fam.end(), 0);
@@ -723,6 +1097,15 @@ FastFAM::FastFAM(){
     phenoVec = Map<VectorXd> (remain_phenos.data(), remain_phenos.size());
     rawPhenoVec = phenoVec;
 
+    if(bMultiTrait){
+        vector<vector<double>> traits;
+        pheno->get_mpheno(traits, traitCols);
+        Ymulti.resize(num_indi, traits.size());
+        for(int t = 0; t < traits.size(); t++){
+            Ymulti.col(t) = Map<VectorXd>(traits[t].data(), num_indi);
+        }
+    }
+
     // condition the covar
     if(has_covar){
         vector<double> remain_covar;
@@ -793,6 +1176,7 @@ FastFAM::FastFAM(){
         covarFlag = true;
         makeIH(concovar);
         if(!bBinary)conditionCovarReg(phenoVec);
+        if(bMultiTrait)conditionCovarPanel(Ymulti);
         if(options.find("save_pheno") != options.end()){
             std::ofstream pheno_w((options["out"] + ".cphen").c_str());
             if(!pheno_w) LOGGER.e(0, "failed to write " + options["out"]+".cphen");
@@ -852,6 +1236,14 @@ FastFAM::FastFAM(){
         //goto saveRes;
     }
 
+    if(bMultiTrait){
+        if(has_envir){
+            LOGGER.e(0, "--envir doesn't support multiple traits in --mpheno.");
+        }
+        fitMultiTraits(fam, flag_est_GE, VG, VR);
+        return;
+    }
+
     // Center
     double phenoVec_mean = phenoVec.mean();
     phenoVec -= VectorXd::Ones(phenoVec.size()) * phenoVec_mean;
@@ -1216,6 +1608,7 @@ saveRes:
         LOGGER << "Sample information has been saved to [" << id_file << "]." << std::endl;
 
         MDLHeader header;
+        memset(&header, 0, sizeof(header));
         header.magic[0] = 'f';
         header.magic[1] = 'G';
         header.magic[2] = 'W';
@@ -1235,6 +1628,8 @@ saveRes:
         if(header.fam_flag & (!header.isGrammar)) header.V_inverse_items = V_inverse.nonZeros();
         header.c_inf = c_inf;
         header.VR_copy = VR_copy;
+        memcpy(header.id_magic, "GCTAMDLH", 8);
+        header.id_hash = GRMContainer::hashIDFile(id_file);
 
         string bin_file = options["out"] + ".mdl.bin";
         FILE* obin = fopen(bin_file.c_str(), "wb");
@@ -1313,7 +1708,86 @@ void FastFAM::initMarkerVars(){
 }
 */
 
+// Fit the null model of each trait in --mpheno. The GRAMMAR-Gamma approximation is used for the traits
+//   with a significant Vg, and linear regression for the others.
+void FastFAM::fitMultiTraits(SpMat &fam, bool flag_est_GE, double VG, double VR){
+    int num_trait = Ymulti.cols();
+    traitCinf.setZero(num_trait);
+    traitSSy.setZero(num_trait);
+    int num_mlm = 0;
+    // the null SNPs of grammar are decoded once, each trait only solves V with them
+    bKeepNullPanel = true;
+    for(int t = 0; t < num_trait; t++){
+        string trait_name = "trait " + to_string(traitCols[t]);
+        LOGGER.i(0, "\nFitting the null model of " + trait_name + " (" + to_string(t + 1) + "/" + to_string(num_trait) + ")...");
+        phenoVec = Ymulti.col(t);
+        phenoVec.array() -= phenoVec.mean();
+        double Vpheno = phenoVec.squaredNorm() / (phenoVec.size() - 1);
+        if(Vpheno < 1e-5){
+            LOGGER.e(0, "the Vp of " + trait_name + " is below 1e-5. Please check the scaling of the phenotype and the covariates.");
+        }
+
+        bool cur_flag = fam_flag;
+        double cur_VG = VG;
+        double cur_VR = VR;
+        if(cur_flag && flag_est_GE){
+            string vgEstMethod = options["VgEstMethod"];
+            if(options["rel_only"] == "yes"){
+                vector<double> Aij, Zij;
+                for(int k = 0; k < fam.outerSize(); ++k){
+                    for(SpMat::InnerIterator it(fam, k); it; ++it){
+                        if(it.row() < it.col()){
+                            Aij.push_back(it.value());
+                            Zij.push_back(phenoVec[it.row()] * phenoVec[it.col()]);
+                        }
+                    }
+                }
+                cur_VG = HEreg(Zij, Aij, cur_flag);
+            }else if(vgEstMethod == "HE"){
+                cur_VG = HEreg(fam, phenoVec, cur_flag);
+            }else if(vgEstMethod == "REML"){
+                cur_VG = spREML(fam, phenoVec, cur_flag);
+            }else{
+                LOGGER.e(0, "only HE and REML can estimate the Vg of multiple traits.");
+            }
+            if(options.find("force_gwa") != options.end()){
+                cur_flag = true;
+            }
+            if(cur_flag){
+                cur_VR = Vpheno - cur_VG;
+                if(cur_VG < 0 && options.find("force_gwa") == options.end()){
+                    LOGGER.w(0, "Constraining Vg to 0.");
+                    cur_flag = false;
+                }else if(cur_VG > Vpheno && options.find("no_constrain") == options.end()){
+                    cur_VG = 0.99 * Vpheno;
+                    LOGGER.w(0, "Constraining Vg to 0.99 * Vp: " + to_string(cur_VG) + ".");
+                }
+            }
+        }
+
+        if(cur_flag){
+            SpMat cur_fam = fam;
+            grammar(cur_fam, cur_VG, cur_VR);
+            Ymulti.col(t) = Vi_y_cinf;
+            traitCinf[t] = c_inf;
+            num_mlm++;
+        }else{
+            if(fam_flag){
+                LOGGER.w(0, "the estimate of Vg of " + trait_name + " is not statistically significant (i.e., p > 0.05), "
+                        "linear regression is used for this trait.");
+            }
+            Ymulti.col(t) = phenoVec;
+            traitSSy[t] = phenoVec.squaredNorm();
+        }
+    }
+    bKeepNullPanel = false;
+    Eigen::MatrixXf().swap(nullPanelMem);
+    vector<uint8_t>().swap(nullPanelMemValid);
+    LOGGER.i(0, "\n" + to_string(num_mlm) + " trait(s) to be tested by fastGWA-MLM, " + to_string(num_trait - num_mlm) + " by linear regression.");
+}
+
 FastFAM::~FastFAM(){
+    delete traitWriter;
     delete pheno;
     delete marker;
     delete geno;
@@ -1364,6 +1838,107 @@ void FastFAM::conditionCovarReg(Eigen::Ref<VectorXd> y){
     }
  }
 
+// X = X - C * (H * X) for all the markers of a panel
+void FastFAM::conditionCovarPanel(Eigen::Ref<MatrixXd> X){
+    if(covarFlag){
+        MatrixXd HX = H * X;
+        X.noalias() -= covar * HX;
+    }
+}
+
+// number of markers in a panel, about 256 MB of genotypes
+int FastFAM::panelSize(){
+    uint64_t num_col = (256ULL << 20) / (sizeof(double) * std::max(num_indi, (uint32_t)1));
+    return (int)std::max((uint64_t)16, std::min(num_col, (uint64_t)256));
+}
+
+// Decode the markers [from, from + num) of the block to the columns of panel, the invalid ones to 0.
+//  isValids: num flags of the markers; saveMarkerInfo: save af, N and info at the index in the block;
+//  allowSparse: rare markers to panelSparse, and the valid dense ones moved to the first panelDense columns
+void FastFAM::decodePanel(uintptr_t *genobuf, const vector<uint32_t> &markerIndex, int from, int num,
+        uint8_t *isValids, bool saveMarkerInfo, bool allowSparse){
+    panel.resize(num_indi, num);
+    panelDense = num;
+    panelCol.resize(num);
+    std::iota(panelCol.begin(), panelCol.end(), 0);
+    if(allowSparse){
+        panelSparse.clear();
+        panelSparse.resize(num);
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for(int k = 0; k < num; k++){
+        int i = from + k;
+        GenoBufItem item;
+        item.extractedMarkerIndex = markerIndex[i];
+        if(allowSparse) item.sparseMAF = sparseMAF;
+        geno->getGenoDouble(genobuf, i, &item);
+        isValids[k] = item.valid;
+        if(!item.valid){
+            panel.col(k).setZero();
+            continue;
+        }
+        if(saveMarkerInfo){
+            af[i] = (float)item.af;
+            countMarkers[i] = item.nValidN;
+            info[i] = item.info;
+        }
+        if(item.bSparse){
+            panelSparse[k] = std::move(item);
+        }else{
+            panel.col(k) = Map<VectorXd>(item.geno.data(), num_indi);
+        }
+    }
+    if(allowSparse){
+        int col = 0;
+        for(int k = 0; k < num; k++){
+            if(!isValids[k] || panelSparse[k].bSparse){
+                panelCol[k] = -1;
+                continue;
+            }
+            if(col != k) panel.col(col) = panel.col(k);
+            panelCol[k] = col++;
+        }
+        panelDense = col;
+    }
+}
+
+void FastFAM::initSparseSums(const Ref<const MatrixXd> Y, SparseSums &sums){
+    sums.sumY = Y.colwise().sum();
+    if(covarFlag){
+        sums.CtY = covar.transpose() * Y;
+        sums.H1 = H.rowwise().sum();
+        sums.Ct1 = covar.colwise().sum().transpose();
+    }
+}
+
+// x'x and x'Y of the marker decoded as carriers, x adjusted for the covariates as conditionCovarPanel;
+//  x = base + delta, x - C * H * x is orthogonal to C, thus the adjusted x'x = x'x - (Hx)'(C'x)
+void FastFAM::sparseCrossProd(const GenoBufItem &item, const Ref<const MatrixXd> Y, const SparseSums &sums,
+        double &xtx, RowVectorXd &xtY){
+    double base = item.sparse_base;
+    xtx = num_indi * base * base;
+    xtY = base * sums.sumY;
+    VectorXd Hx, Ctx;
+    if(covarFlag){
+        Hx = base * sums.H1;
+        Ctx = base * sums.Ct1;
+    }
+    for(size_t k = 0; k < item.carriers.size(); k++){
+        uint32_t i = item.carriers[k];
+        double delta = item.carrier_delta[k];
+        xtx += delta * (2.0 * base + delta);
+        xtY += delta * Y.row(i);
+        if(covarFlag){
+            Hx += delta * H.col(i);
+            Ctx += delta * covar.row(i).transpose();
+        }
+    }
+    if(covarFlag){
+        xtx -= Ctx.dot(Hx);
+        xtY -= Hx.transpose() * sums.CtY;
+    }
+}
+
 void generateRandom(Ref<MatrixXd> mat){
     uint64_t row = mat.rows();
     uint64_t col = mat.cols();
@@ -1441,17 +2016,16 @@ double FastFAM::fitREML(double logdet, const SpMat &fam, const VectorXd &pheno){
     geno->loop_64block(marker_index, callBacks, true);
     //geno->resetLoop();
 
-    VectorXd sum_e2_rand(mcTrails); // sum e rand ^ 2
+    // the random vectors and the phenotype in one solve, the factor is traversed once
     double det2 = det * det;
-    #pragma omp parallel for
-    for(int i = 0; i < mcTrails; i++){
-        rand_y.col(i) = rand_y.col(i) + sqrt_det * rand_e.col(i);
-        randVinvY.col(i) = solver.solve(rand_y.col(i));
-        sum_e2_rand(i) = det2 * (randVinvY.col(i).squaredNorm());
-    }
-
+    rand_y += sqrt_det * rand_e;
+    MatrixXd rhs(n, mcTrails + 1);
+    rhs << rand_y, pheno;
     LOGGER << "solve VinvY" << std::endl;
-    VinvY = solver.solve(pheno);
+    MatrixXd Vi_rhs = solver.solve(rhs);
+    randVinvY = Vi_rhs.leftCols(mcTrails);
+    VinvY = Vi_rhs.col(mcTrails);
+    VectorXd sum_e2_rand = det2 * randVinvY.colwise().squaredNorm().transpose(); // sum e rand ^ 2
     double sum_e2 = det2 * (VinvY.squaredNorm()); 
 
     finished_rand_marker = 0;
@@ -1633,23 +2207,37 @@ void FastFAM::logLREML(const Ref<const VectorXd> pheno, vector<double> &varcomp,
     int n_comp = varcomp.size();
     int n = A[0].cols();
 
-    SpMat V(n, n);
-    for(int j = 0; j < n_comp; j++){
-        V += varcomp[j] * A[j];
-    }
-    //LOGGER << "Non zeros V: " << V.nonZeros() << std::endl;
-
+    // V = Vg * GRM + Ve * I is solved on the blocks of the sparse GRM
+    bool bBlock = bREMLBlocks;
     Eigen::SimplicialLDLT<SpMat> solverV;
-    solverV.compute(V);
-    if(solverV.info() != Eigen::Success){
-        LOGGER.e(0, "the V matrix is not invertible.");
-    }
+    GRMBlocksSolver VBlockSolver;
+    double logdet_V;
+    if(bBlock){
+        if(!VBlockSolver.compute(famBlocks, varcomp[0], varcomp[1])){
+            LOGGER.e(0, "the V matrix is not invertible.");
+        }
+        logdet_V = VBlockSolver.logdet();
+    }else{
+        SpMat V(n, n);
+        for(int j = 0; j < n_comp; j++){
+            V += varcomp[j] * A[j];
+        }
+        //LOGGER << "Non zeros V: " << V.nonZeros() << std::endl;
+
+        solverV.compute(V);
+        if(solverV.info() != Eigen::Success){
+            LOGGER.e(0, "the V matrix is not invertible.");
+        }
 
-    VectorXd d = solverV.vectorD();
-    double logdet_V = d.array().log().sum(); 
-    //double logdet_V = solverV.logAbsDeterminant();
+        VectorXd d = solverV.vectorD();
+        logdet_V = d.array().log().sum(); 
+        //double logdet_V = solverV.logAbsDeterminant();
+    }
+    auto solveV = [&](const MatrixXd &X) -> MatrixXd {
+        return bBlock ? VBlockSolver.solve(X) : MatrixXd(solverV.solve(X));
+    };
 
-    MatrixXd ViX = solverV.solve(covar); // n*c
+    MatrixXd ViX = solveV(covar); // n*c
 
     MatrixXd XtViX = covar.transpose() * ViX; // c*c
     INVmethod method = INV_FQR;
@@ -1662,7 +2250,7 @@ void FastFAM::logLREML(const Ref<const VectorXd> pheno, vector<double> &varcomp,
     MatrixXd b_proj_t = ViX * XtViX; //n*c
     VectorXd b2 = b_proj_t.transpose() * pheno; // c*1
     VectorXd resi = pheno - covar * b2; // n*1
-    VectorXd Py = solverV.solve(resi);
+    VectorXd Py = solveV(resi);
 
     logL = -0.5 * (logdet_V + logdet_XtViX + pheno.dot(Py));
 
@@ -1675,7 +2263,7 @@ void FastFAM::logLREML(const Ref<const VectorXd> pheno, vector<double> &varcomp,
         MatrixXd Hi(n_comp, n_comp);
         for(int i = 0; i < n_comp; i++){
             VectorXd cur_APy = APy.col(i);
-            VectorXd cvec = solverV.solve(cur_APy) - ViX * (b_proj_t.transpose() * cur_APy);
+            VectorXd cvec = solveV(cur_APy) - ViX * (b_proj_t.transpose() * cur_APy);
             Hi(i, i) = 0.5 * cur_APy.dot(cvec);
             for(int j = 0; j < i; j++){
                 Hi(j, i) = 0.5 * APy.col(j).dot(cvec);
@@ -1703,6 +2291,8 @@ double FastFAM::spREML(const Ref<const SpMat> fam, const Ref<const VectorXd> phe
     A[0] = fam;
     A[1].resize(n, n); 
     A[1].setIdentity();
+    // A[0] is the GRM the blocks were built from
+    bREMLBlocks = bFamBlocks;
 
     double Vp = pheno.array().square().sum() / (n - 1);
 
@@ -1858,6 +2448,7 @@ double FastFAM::spREML(const Ref<const SpMat> fam, const Ref<const VectorXd> phe
         A[i].resize(0, 0);
     }
     A.resize(0);
+    bREMLBlocks = false;
 
     double zsq = Vg * Vg / Hinv(0, 0);
     double p = StatLib::pchisqd1(zsq);
@@ -2118,6 +2709,57 @@ void FastFAM::readFAM(string filename, SpMat& fam, const vector<string> &ids, ve
             return remain_index[pos];});
     remain_index = ordered_remain_index;
 
+    if(SparseGRM::exists(filename)){
+        // binary sparse GRM: the kept rows of the mapped matrix are copied to the columns of fam
+        if(SparseGRM::stale(filename)){
+            LOGGER.e(0, "[" + filename + ".grm.sp] is newer than [" + SparseGRM::fileName(filename)
+                    + "], remove the binary file or save it again by --sparse-bin.");
+        }
+        LOGGER.i(0, "Reading the binary sparse GRM from [" + SparseGRM::fileName(filename) + "]...");
+        SparseGRMMap sp_map;
+        sp_map.open(filename);
+        if(sp_map.size() != sublist.size()){
+            LOGGER.e(0, "the number of IDs in [" + filename + ".grm.id] does not match [" + SparseGRM::fileName(filename) + "].");
+        }
+        auto sp_grm = sp_map.matrix();
+        uint32_t n_fam = ordered_fam_index.size();
+        vector<int64_t> new_index(sublist.size(), -1);
+        for(uint32_t index = 0; index != n_fam; index++){
+            new_index[ordered_fam_index[index]] = index;
+        }
+
+        vector<long long> col_counts(n_fam + 1, 0);
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(uint32_t j = 0; j < n_fam; j++){
+            for(SparseGRMMap::MatrixMap::InnerIterator it(sp_grm, ordered_fam_index[j]); it; ++it){
+                if(new_index[it.col()] != -1) col_counts[j + 1]++;
+            }
+        }
+        for(uint32_t j = 0; j < n_fam; j++) col_counts[j + 1] += col_counts[j];
+
+        fam.resize(n_fam, n_fam);
+        fam.resizeNonZeros(col_counts[n_fam]);
+        std::copy(col_counts.begin(), col_counts.end(), fam.outerIndexPtr());
+        long long *inner = fam.innerIndexPtr();
+        double *values = fam.valuePtr();
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(uint32_t j = 0; j < n_fam; j++){
+            vector<std::pair<long long, double>> cur_col;
+            for(SparseGRMMap::MatrixMap::InnerIterator it(sp_grm, ordered_fam_index[j]); it; ++it){
+                int64_t row = new_index[it.col()];
+                if(row != -1) cur_col.push_back(std::make_pair(row, (double)it.value()));
+            }
+            std::sort(cur_col.begin(), cur_col.end());
+            long long pos = col_counts[j];
+            for(auto &item : cur_col){
+                inner[pos] = item.first;
+                values[pos++] = item.second;
+            }
+        }
+        LOGGER.i(0, to_string(col_counts[n_fam]) + " elements loaded from [" + SparseGRM::fileName(filename) + "].");
+        return;
+    }
+
     std::ifstream pair_list((filename + ".grm.sp").c_str());
     if(!pair_list){
         LOGGER.e(0, "can't read [" + filename + ".grm.sp]");
@@ -2187,37 +2829,137 @@ void FastFAM::readFAM(string filename, SpMat& fam, const vector<string> &ids, ve
 
 }
 
+struct NullPanelHeader {
+    char magic[8];          // "GCTANULP"
+    uint64_t key;           // FNV-1a of the samples, the SNPs and the filters
+    uint64_t num_indi;
+    uint64_t num_marker;
+};
+// followed by the valid flag of each SNP (uint8), then the centred genotypes, a float column per SNP
+
 void FastFAM::grammar_func(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     int nMarker = markerIndex.size();
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < nMarker; i++){
-        int index_cur_marker = num_grammar_markers + i;
-        GenoBufItem item;
-        item.extractedMarkerIndex = markerIndex[i];
-        geno->getGenoDouble(genobuf, i, &item);
-        bValids[index_cur_marker] = item.valid;
-        if(item.valid){
-            Map< VectorXd > curGeno(item.geno.data(), num_indi);
-            conditionCovarReg(curGeno);
-            VectorXd Vg = solver.solve(curGeno);
-            double gt_Vg = curGeno.dot(Vg);
-            double g_Vi_y = curGeno.dot(Vi_y);
-            double temp_chisq = g_Vi_y * g_Vi_y / gt_Vg;
-
-            v_chisq[index_cur_marker] = temp_chisq;
-
-            if(temp_chisq < 5){
-                double gt_g = curGeno.dot(curGeno);
-                double tmp_cinf = gt_Vg / gt_g;
-                v_c_infs[index_cur_marker] = tmp_cinf;
-            }else{
-                bValids[index_cur_marker] = false;
+    int panel_size = panelSize();
+    for(int from = 0; from < nMarker; from += panel_size){
+        int num = std::min(panel_size, nMarker - from);
+        int index_panel = num_grammar_markers + from;
+        decodePanel(genobuf, markerIndex, from, num, &bValids[index_panel], false);
+        if(hNullPanel || bKeepNullPanel){
+            // the flags of the decoding, grammarPanel drops the SNPs of large chi-squared later;
+            //  the genotypes rounded as the runs reading the panel get them
+            Eigen::MatrixXf panel_f = panel.cast<float>();
+            panel = panel_f.cast<double>();
+            if(hNullPanel){
+                nullPanelValid.insert(nullPanelValid.end(), bValids.begin() + index_panel, bValids.begin() + index_panel + num);
+                if(fwrite(panel_f.data(), sizeof(float), panel_f.size(), hNullPanel) != panel_f.size()){
+                    LOGGER.e(0, "can't write the null SNP panel to [" + options["null_panel"] + "].");
+                }
+            }
+            if(bKeepNullPanel){
+                std::copy(bValids.begin() + index_panel, bValids.begin() + index_panel + num, nullPanelMemValid.begin() + index_panel);
+                nullPanelMem.middleCols(index_panel, num) = panel_f;
             }
         }
+        grammarPanel(index_panel, num);
     }
     num_grammar_markers += nMarker;
 }
 
+// c_inf and chi-squared of the null SNPs decoded in panel, bValids of them set by the decoding
+void FastFAM::grammarPanel(int index_panel, int num){
+    conditionCovarPanel(panel);
+
+    MatrixXd Vg(num_indi, num);
+    if(bFamBlocks){
+        Vg = famSolver.solve(panel);
+    }else{
+        // the invalid markers are 0 columns, solved as 0
+        Vg = blockSolver.solve(panel);
+    }
+    VectorXd gt_Vg = (panel.cwiseProduct(Vg)).colwise().sum().transpose();
+    VectorXd g_Vi_y = panel.transpose() * Vi_y;
+    VectorXd gt_g = panel.colwise().squaredNorm().transpose();
+
+    for(int k = 0; k < num; k++){
+        int index_cur_marker = index_panel + k;
+        if(!bValids[index_cur_marker]) continue;
+        double temp_chisq = g_Vi_y[k] * g_Vi_y[k] / gt_Vg[k];
+
+        v_chisq[index_cur_marker] = temp_chisq;
+
+        if(temp_chisq < 5){
+            double tmp_cinf = gt_Vg[k] / gt_g[k];
+            v_c_infs[index_cur_marker] = tmp_cinf;
+        }else{
+            bValids[index_cur_marker] = false;
+        }
+    }
+}
+
+// Read the null SNPs from a panel saved by an earlier run, false if it isn't there or was saved for
+//  other samples, SNPs or filters. The panels after the soft cap of grammar has been reached are not read.
+bool FastFAM::loadNullPanel(const string &file_name, uint64_t key, int num_marker, int soft_cap, int min_valid){
+    FILE *h_panel = fopen(file_name.c_str(), "rb");
+    if(!h_panel) return false;
+    NullPanelHeader header;
+    if(fread(&header, sizeof(header), 1, h_panel) != 1 || memcmp(header.magic, "GCTANULP", 8) != 0
+            || header.key != key || header.num_indi != num_indi || header.num_marker != num_marker){
+        fclose(h_panel);
+        LOGGER.w(0, "[" + file_name + "] was saved for other samples, SNPs or filters, it will be saved again.");
+        return false;
+    }
+    if(fread(bValids.data(), 1, num_marker, h_panel) != num_marker){
+        LOGGER.e(0, "[" + file_name + "] is incomplete.");
+    }
+    LOGGER << "  reading the null SNPs from [" << file_name << "]..." << std::endl;
+    if(bKeepNullPanel) std::copy(bValids.begin(), bValids.begin() + num_marker, nullPanelMemValid.begin());
+
+    // all the panels are read if they are kept for the other traits
+    int panel_size = panelSize();
+    int n_valid = 0;
+    int checked = 0;
+    bool finished = false;
+    for(int from = 0; from < num_marker && (!finished || bKeepNullPanel); from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        Eigen::MatrixXf panel_f(num_indi, num);
+        if(fread(panel_f.data(), sizeof(float), panel_f.size(), h_panel) != panel_f.size()){
+            LOGGER.e(0, "[" + file_name + "] is incomplete.");
+        }
+        if(bKeepNullPanel) nullPanelMem.middleCols(from, num) = panel_f;
+        if(finished) continue;
+        panel = panel_f.cast<double>();
+        grammarPanel(from, num);
+
+        // the same stop as the loop over the null SNPs in grammar
+        for(; checked < from + num && !finished; checked++){
+            if(!bValids[checked]) continue;
+            n_valid++;
+            finished = checked >= soft_cap && n_valid >= min_valid;
+        }
+    }
+    fclose(h_panel);
+    return true;
+}
+
+// the null SNPs kept in memory by an earlier trait, the same stop as loadNullPanel
+void FastFAM::grammarMemPanel(int num_marker, int soft_cap, int min_valid){
+    std::copy(nullPanelMemValid.begin(), nullPanelMemValid.end(), bValids.begin());
+    int panel_size = panelSize();
+    int n_valid = 0;
+    int checked = 0;
+    bool finished = false;
+    for(int from = 0; from < num_marker && !finished; from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        panel = nullPanelMem.middleCols(from, num).cast<double>();
+        grammarPanel(from, num);
+
+        for(; checked < from + num && !finished; checked++){
+            if(!bValids[checked]) continue;
+            n_valid++;
+            finished = checked >= soft_cap && n_valid >= min_valid;
+        }
+    }
+}
 
 void FastFAM::grammar(SpMat& fam, double VG, double VR){
     int num_marker_rand = 2000; //1000 -> 2000, longda
@@ -2234,15 +2976,23 @@ void FastFAM::grammar(SpMat& fam, double VG, double VR){
 
     //LOGGER.i(0, "Estimating conjugate gradient...");
     LOGGER.ts("tuning");
-    solver.compute(fam);
-    if(solver.info() != Eigen::Success){
-        LOGGER.e(0, "the V matrix is not invertible.");
-    }
-    //LOGGER << "TCG compute time: " << LOGGER.tp("TCG") << std::endl;
+    if(bFamBlocks){
+        if(!famSolver.compute(famBlocks, VG, VR)){
+            LOGGER.e(0, "the V matrix is not invertible.");
+        }
+        Vi_y = famSolver.solve(phenoVec);
+    }else{
+        solver.compute(fam);
+        if(solver.info() != Eigen::Success){
+            LOGGER.e(0, "the V matrix is not invertible.");
+        }
+        blockSolver.compute(fam);
+        //LOGGER << "TCG compute time: " << LOGGER.tp("TCG") << std::endl;
 
-    //LOGGER.i(0, "Solving Vi * y via conjugate gradient...");
-    //LOGGER.ts("vi_y");
-    Vi_y = solver.solve(phenoVec);
+        //LOGGER.i(0, "Solving Vi * y via conjugate gradient...");
+        //LOGGER.ts("vi_y");
+        Vi_y = solver.solve(phenoVec);
+    }
     //LOGGER << "  time: " << LOGGER.tp("vi_y") << std::endl;
 
 
@@ -2299,13 +3049,75 @@ void FastFAM::grammar(SpMat& fam, double VG, double VR){
     bValids.resize(num_marker_rand);
     num_grammar_markers = 0;
 
-    LOGGER << "  reading genotypes..." << std::endl; 
-    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
-    callBacks.push_back(bind(&FastFAM::grammar_func, this, _1, _2));
-    geno->loopDouble(marker_index, nMarker, true, true, false, false, callBacks);
+    // the samples and the SNPs are the same for all the traits of --mpheno
+    bool bPanelLoaded = false;
+    if(bKeepNullPanel){
+        if(nullPanelMem.cols() == num_marker_rand){
+            LOGGER << "  using the null SNPs read for the first trait..." << std::endl;
+            grammarMemPanel(num_marker_rand, soft_cap, nMarker);
+            bPanelLoaded = true;
+        }else{
+            nullPanelMem.resize(num_indi, num_marker_rand);
+            nullPanelMemValid.assign(num_marker_rand, 0);
+        }
+    }
+    string null_panel_file;
+    uint64_t null_panel_key = 14695981039346656037ULL;
+    if(!bPanelLoaded && options.find("null_panel") != options.end()){
+        null_panel_file = options["null_panel"];
+        for(int i = 0; i < num_indi; i++){
+            null_panel_key = GRMContainer::hashID(null_panel_key, pheno->get_id(i, i, "\t")[0]);
+        }
+        for(auto index : marker_index){
+            null_panel_key = GRMContainer::hashID(null_panel_key, marker->getMarkerStrExtract(index));
+        }
+        std::ostringstream filters;
+        filters << geno->getMAF() << "\t" << geno->getFilterInfo() << "\t" << geno->getFilterMiss();
+        null_panel_key = GRMContainer::hashID(null_panel_key, filters.str());
+        bPanelLoaded = loadNullPanel(null_panel_file, null_panel_key, num_marker_rand, soft_cap, nMarker);
+    }
 
-    if(num_marker_rand != num_grammar_markers){
-        LOGGER.e(0, "some SNPs cannot be read successfully!");
+    if(!bPanelLoaded){
+        string tmp_file = null_panel_file + ".tmp";
+        if(!null_panel_file.empty()){
+            hNullPanel = fopen(tmp_file.c_str(), "wb");
+            if(!hNullPanel){
+                LOGGER.e(0, "can't open [" + tmp_file + "] to write.");
+            }
+            // the valid flags are filled in after decoding
+            NullPanelHeader header;
+            memcpy(header.magic, "GCTANULP", 8);
+            header.key = null_panel_key;
+            header.num_indi = num_indi;
+            header.num_marker = num_marker_rand;
+            vector<uint8_t> flags(num_marker_rand, 0);
+            if(fwrite(&header, sizeof(header), 1, hNullPanel) != 1 || fwrite(flags.data(), 1, flags.size(), hNullPanel) != flags.size()){
+                LOGGER.e(0, "can't write the null SNP panel to [" + tmp_file + "].");
+            }
+        }
+
+        LOGGER << "  reading genotypes..." << std::endl; 
+        vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+        callBacks.push_back(bind(&FastFAM::grammar_func, this, _1, _2));
+        geno->loopDouble(marker_index, nMarker, true, true, false, false, callBacks);
+
+        if(num_marker_rand != num_grammar_markers){
+            LOGGER.e(0, "some SNPs cannot be read successfully!");
+        }
+
+        if(hNullPanel){
+            bool ok = fseek(hNullPanel, sizeof(NullPanelHeader), SEEK_SET) == 0
+                && fwrite(nullPanelValid.data(), 1, nullPanelValid.size(), hNullPanel) == nullPanelValid.size();
+            ok = (fclose(hNullPanel) == 0) && ok;
+            hNullPanel = NULL;
+            vector<uint8_t>().swap(nullPanelValid);
+            // replaced only by a complete panel
+            remove(null_panel_file.c_str());
+            if(!ok || rename(tmp_file.c_str(), null_panel_file.c_str()) != 0){
+                LOGGER.e(0, "can't write the null SNP panel to [" + null_panel_file + "].");
+            }
+            LOGGER << "  saved the null SNPs to [" << null_panel_file << "] for the later runs." << std::endl;
+        }
     }
 
     //reset back
@@ -2390,17 +3202,30 @@ void FastFAM::inverseFAM(SpMat& fam, double VG, double VR){
     fam += eye * VR;
 
     // inverse
-    if(options["inv_method"] == "ldlt"){
-        Eigen::SimplicialLDLT<SpMat> solver;
-        solver.compute(fam);
-
-        if(solver.info() != Eigen::Success){
+    bool bInverted = false;
+    if(bFamBlocks){
+        GRMBlocksSolver invBlockSolver;
+        if(!invBlockSolver.compute(famBlocks, VG, VR)){
             LOGGER.e(0, "the sparse GRM is not invertible.");
         }
-
-        V_inverse = solver.solve(eye); 
-    }else{
-        LOGGER.e(0, "unknown matrix inverse method.");
+        bInverted = invBlockSolver.inverse(V_inverse);
+        if(!bInverted){
+            LOGGER.i(0, "A group of relatives is too large for a dense inverse, the V matrix is inverted as a whole.");
+        }
+    }
+    if(!bInverted){
+        if(options["inv_method"] == "ldlt"){
+            Eigen::SimplicialLDLT<SpMat> solver;
+            solver.compute(fam);
+
+            if(solver.info() != Eigen::Success){
+                LOGGER.e(0, "the sparse GRM is not invertible.");
+            }
+
+            V_inverse = solver.solve(eye); 
+        }else{
+            LOGGER.e(0, "unknown matrix inverse method.");
+        }
     }
 
 
@@ -2415,54 +3240,70 @@ void FastFAM::calculate_gwa(uintptr_t * genobuf, const vector<uint32_t> &markerI
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
 
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
+    SparseSums sums;
+    initSparseSums(phenoVec, sums);
 
-        geno->getGenoDouble(genobuf, i, &item);
-
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
+    int panel_size = panelSize();
+    for(int from = 0; from < num_marker; from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        decodePanel(genobuf, markerIndex, from, num, &isValids[from], true, true);
+        auto dense = panel.leftCols(panelDense);
+        conditionCovarPanel(dense);
 
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
+        VectorXd xtx = dense.colwise().squaredNorm().transpose();
+        VectorXd xty = dense.transpose() * phenoVec;
 
-        conditionCovarReg(xMat);
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < num; k++){
+            int i = from + k;
+            if(!isValids[i]) continue;
 
+            double cur_xtx, cur_xty;
+            if(panelCol[k] >= 0){
+                cur_xtx = xtx[panelCol[k]];
+                cur_xty = xty[panelCol[k]];
+            }else{
+                RowVectorXd xtY;
+                sparseCrossProd(panelSparse[k], phenoVec, sums, cur_xtx, xtY);
+                cur_xty = xtY[0];
+            }
 
-        double xMat_V_x = 1.0 / xMat.dot(xMat);
-        double xMat_V_p = xMat.dot(phenoVec);
-
-        double temp_beta =  xMat_V_x * xMat_V_p;
-        double sse = (SSy - temp_beta * xMat_V_p) * iN;
-        double temp_se = sqrt(sse * xMat_V_x);
-
+            double xMat_V_x = 1.0 / cur_xtx;
+            double xMat_V_p = cur_xty;
 
-        double temp_z = temp_beta / temp_se;
+            double temp_beta =  xMat_V_x * xMat_V_p;
+            double sse = (SSy - temp_beta * xMat_V_p) * iN;
+            double temp_se = sqrt(sse * xMat_V_x);
 
-        beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
-        se[i] = (float)temp_se;
-        p[i] = StatLib::pchisqd1(temp_z * temp_z); 
+            double temp_z = temp_beta / temp_se;
 
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info; 
-        //}else{
-            //beta[index] = nan;
-            //se[index] = nan;
-            //p[index] = nan;
-        //}
+            beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
+            se[i] = (float)temp_se;
+            p[i] = StatLib::pchisqd1(temp_z * temp_z); 
+        }
     }
 
     output_res(isValids, markerIndex);
-   /*
-        std::ofstream o_geno(options["out"] + "_geno.txt");
-        o_geno << dealGeno << std::endl;
-        o_geno.close();
-    */
+}
+
+// Z = X * E centred; the normal equations of y on (x, z) are solved for all the markers at once,
+//  the 2 x 2 inverse in closed form
+void FastFAM::fitGxEPanel(const Ref<const MatrixXd> X, MatrixXd &Z, GxEFit &fit){
+    Z = X.array().colwise() * envirVec_scaled.array();
+    Z.rowwise() -= RowVectorXd(Z.colwise().mean());
+
+    Eigen::ArrayXd x_x = X.colwise().squaredNorm().transpose();
+    Eigen::ArrayXd z_x = Z.cwiseProduct(X).colwise().sum().transpose();
+    Eigen::ArrayXd z_z = Z.colwise().squaredNorm().transpose();
+    fit.x_p = (X.transpose() * phenoVec).array();
+    fit.z_p = (Z.transpose() * phenoVec).array();
+
+    Eigen::ArrayXd det = x_x * z_z - z_x.square();
+    fit.inv00 = z_z / det;
+    fit.inv01 = -z_x / det;
+    fit.inv11 = x_x / det;
+    fit.beta_g = fit.inv00 * fit.x_p + fit.inv01 * fit.z_p;
+    fit.beta_gxe = fit.inv01 * fit.x_p + fit.inv11 * fit.z_p;
 }
 
 void FastFAM::calculate_gwa_2df(uintptr_t * genobuf, const vector<uint32_t> &markerIndex){
@@ -2472,94 +3313,43 @@ void FastFAM::calculate_gwa_2df(uintptr_t * genobuf, const vector<uint32_t> &mar
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
 
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
+    MatrixXd Z;
+    GxEFit fit;
+    int panel_size = panelSize();
+    for(int from = 0; from < num_marker; from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        decodePanel(genobuf, markerIndex, from, num, &isValids[from]);
+        conditionCovarPanel(panel);
+        fitGxEPanel(panel, Z, fit);
 
-        geno->getGenoDouble(genobuf, i, &item);
+        // the first derivative times the inverse of the negative second derivative, scaled by the residual variance
+        Eigen::ArrayXd sse = (SSy - fit.beta_g * fit.x_p - fit.beta_gxe * fit.z_p) * iN;
+        Eigen::ArrayXd se_g = (sse * fit.inv00).sqrt();
+        Eigen::ArrayXd se_gxe = (sse * fit.inv11).sqrt();
+        Eigen::ArrayXd chisq = (fit.beta_g * fit.x_p + fit.beta_gxe * fit.z_p) / sse;
+        Eigen::ArrayXd chisq_g = (fit.beta_g / se_g).square();
+        Eigen::ArrayXd chisq_gxe = (fit.beta_gxe / se_gxe).square();
 
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < num; k++){
+            int i = from + k;
+            if(!isValids[i]) continue;
 
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
+            beta_geno[i] = (float)fit.beta_g[k];
+            se_geno[i] = (float)se_g[k];
+            score_geno[i] = (float)chisq_g[k];
+            p_geno[i] = chisq_g[k] > 0 ? StatLib::pchisqd1(chisq_g[k]) : 1;
 
-        conditionCovarReg(xMat);
-        VectorXd g_times_envir(num_indi); 
-        g_times_envir = xMat.cwiseProduct(envirVec_scaled);
-        //center g_times_envir
-        g_times_envir -=VectorXd::Ones(g_times_envir.size()) * (g_times_envir.mean()) ; 
-        
-        
-        double x_x = xMat.dot(xMat);
-        double xenvir_x = g_times_envir.dot(xMat);
-        double xenvir_xenvir = g_times_envir.dot(g_times_envir);
-        
-        double x_p = phenoVec.dot(xMat);
-        double xenvir_p = phenoVec.dot(g_times_envir);
-        
-        VectorXd first_deri(2);
-        // here the first_deri is not the first derivative of likelihood function. first_deri times variance of residual will be the first derivative 
-        first_deri(0)=x_p;    
-        first_deri(1)=xenvir_p; 
-        
-        // here the ngtv_2nd_deri is not the negative second derivative of likelihood function. ngtv_2nd_deri times variance of residual will be the negative second derivative 
-        MatrixXd ngtv_2nd_deri(2,2);
-        ngtv_2nd_deri(0,0)=x_x;
-        ngtv_2nd_deri(0,1)=ngtv_2nd_deri(1,0)=xenvir_x;
-        ngtv_2nd_deri(1,1)=xenvir_xenvir;
-        
-        MatrixXd ngtv_2nd_deri_inv=ngtv_2nd_deri.inverse();
-        
-        VectorXd temp_beta = ngtv_2nd_deri_inv * first_deri;
-        
-        double sse = (SSy - temp_beta[0] * x_p - temp_beta[1] * xenvir_p ) * iN;
-        
-        VectorXd temp_se(2); 
-        temp_se(0) = sqrt( sse * ngtv_2nd_deri_inv(0,0) );
-        temp_se(1) = sqrt( sse * ngtv_2nd_deri_inv(1,1) );
-        
-        
-        double temp_chisq = first_deri.dot( ngtv_2nd_deri_inv * first_deri ) / sse;
-        double temp_chisq_x = pow(temp_beta[0]/temp_se[0] , 2);
-        double temp_chisq_xenvir = pow(temp_beta[1]/temp_se[1] , 2);
-        
-        beta_geno[i]=(float)temp_beta(0);
-        se_geno[i]=(float)temp_se(0);
-        score_geno[i]=(float)temp_chisq_x;
-        
-        if (temp_chisq_x > 0){
-          p_geno[i] = StatLib::pchisqd1(temp_chisq_x);
-        }else{
-          p_geno[i] = 1;
-        }
-        
-        beta_interaction[i]=(float)temp_beta[1];
-        se_interaction[i]=(float)temp_se[1];
-        score_interaction[i]=(float)temp_chisq_xenvir;
-        
-        if (temp_chisq_xenvir > 0){
-          p_interaction[i] = StatLib::pchisqd1(temp_chisq_xenvir);
-        }else{
-          p_interaction[i] = 1;
-        }
-        
-        cov_geno_interaction[i] = (float)(sse * ngtv_2nd_deri_inv(0,1)) ;
-        
-        score[i] = (float)temp_chisq;
-        if (temp_chisq > 0){
-            p[i] = StatLib::pchisqd2(temp_chisq);
-        }else{
-            p[i] = 1;
-        }
-        
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info; 
+            beta_interaction[i] = (float)fit.beta_gxe[k];
+            se_interaction[i] = (float)se_gxe[k];
+            score_interaction[i] = (float)chisq_gxe[k];
+            p_interaction[i] = chisq_gxe[k] > 0 ? StatLib::pchisqd1(chisq_gxe[k]) : 1;
+
+            cov_geno_interaction[i] = (float)(sse[k] * fit.inv01[k]);
 
+            score[i] = (float)chisq[k];
+            p[i] = chisq[k] > 0 ? StatLib::pchisqd2(chisq[k]) : 1;
+        }
     }
   
     output_res_2df(isValids, markerIndex);
@@ -2570,116 +3360,62 @@ void FastFAM::calculate_gwa_2df_sandwich(uintptr_t * genobuf, const vector<uint3
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
 
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-
-        geno->getGenoDouble(genobuf, i, &item);
-
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
-
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
-        conditionCovarReg(xMat);
-        VectorXd g_times_envir(num_indi);
-        g_times_envir = xMat.cwiseProduct(envirVec_scaled);
-        //center g_times_envir
-        g_times_envir -=VectorXd::Ones(g_times_envir.size()) * (g_times_envir.mean());
-        
-        double x_x = xMat.dot(xMat);
-        double xenvir_x = g_times_envir.dot(xMat);
-        double xenvir_xenvir = g_times_envir.dot(g_times_envir);
-        
-        double x_p = phenoVec.dot(xMat);
-        double xenvir_p = phenoVec.dot(g_times_envir);
-        
-        VectorXd first_deri(2);
-        // here the first_deri is not the first derivative of likelihood function. first_deri times variance of residual will be the first derivative
-        first_deri(0)=x_p;
-        first_deri(1)=xenvir_p;
-        
-        // here the ngtv_2nd_deri is not the negative second derivative of likelihood function. ngtv_2nd_deri times variance of residual will be the negative second derivative
-        // -A matrix is ngtv_2nd_deri
-        MatrixXd ngtv_2nd_deri(2,2);
-        ngtv_2nd_deri(0,0)=x_x;
-        ngtv_2nd_deri(0,1)=ngtv_2nd_deri(1,0)=xenvir_x;
-        ngtv_2nd_deri(1,1)=xenvir_xenvir;
-        
-        // (-A)^(-1) is ngtv_2nd_deri_inv
-        MatrixXd ngtv_2nd_deri_inv=ngtv_2nd_deri.inverse();
-        
-        MatrixXd z_mat(xMat.size(),2);
-        z_mat.col(0)=xMat;
-        z_mat.col(1)=g_times_envir;
-        
-        MatrixXd z_ngtv_2nd_deri_inv = z_mat * ngtv_2nd_deri_inv;
-        MatrixXd hatDiagonal = (z_ngtv_2nd_deri_inv.cwiseProduct(z_mat)).rowwise().sum();
-        
-        VectorXd temp_beta = ngtv_2nd_deri_inv * first_deri;
-        
-        VectorXd residual = phenoVec - xMat * temp_beta[0] - g_times_envir * temp_beta[1];
-        VectorXd residualSquare = residual.cwiseProduct(residual);
-        VectorXd correctedResidualSquare = residualSquare.cwiseProduct( (VectorXd::Ones(hatDiagonal.size()) * (1.0) - hatDiagonal).cwiseInverse() );
-        
-        // B matrix is B_mat
-        MatrixXd B_mat(2,2);
-        VectorXd x_correctedResidualSquare = xMat.cwiseProduct(correctedResidualSquare);
-        VectorXd xenvir_correctedResidualSquare = g_times_envir.cwiseProduct(correctedResidualSquare);
-        B_mat(0,0) = x_correctedResidualSquare.dot(xMat);
-        B_mat(0,1) = B_mat(1,0) = x_correctedResidualSquare.dot(g_times_envir);
-        B_mat(1,1) = xenvir_correctedResidualSquare.dot(g_times_envir);
-        
-        //sandwich variance estimator is (-A)^(-1) * B * (-A)^(-1)
-        MatrixXd sandwich_variance = ngtv_2nd_deri_inv * B_mat * ngtv_2nd_deri_inv;
-        
-        if (std::isnan(sandwich_variance.sum()) == 0){
-            double temp_chisq = temp_beta.dot(sandwich_variance.inverse() * temp_beta);
-            
-            VectorXd temp_se(2);
-            temp_se(0) = sqrt(sandwich_variance(0,0));
-            temp_se(1) = sqrt(sandwich_variance(1,1));
-            
-            double temp_chisq_x = pow(temp_beta[0]/temp_se[0] , 2);
-            double temp_chisq_xenvir = pow(temp_beta[1]/temp_se[1] , 2);
-            
-            beta_geno[i]=(float)temp_beta(0);
-            se_geno[i]=(float)temp_se(0);
-            score_geno[i]=(float)temp_chisq_x;
-            
-            if (temp_chisq_x > 0){
-                p_geno[i] = StatLib::pchisqd1(temp_chisq_x);
-            }else{
-                p_geno[i] = 1;
-            }
-            
-            beta_interaction[i]=(float)temp_beta[1];
-            se_interaction[i]=(float)temp_se[1];
-            score_interaction[i]=(float)temp_chisq_xenvir;
-            
-            if (temp_chisq_xenvir > 0){
-                p_interaction[i] = StatLib::pchisqd1(temp_chisq_xenvir);
-            }else{
-                p_interaction[i] = 1;
-            }
-            
-            cov_geno_interaction[i] = (float)sandwich_variance(0,1) ;
-            
-            score[i] = (float)temp_chisq;
-            if (temp_chisq > 0){
-                p[i] = StatLib::pchisqd2(temp_chisq);
-            }else{
-                p[i] = 1;
-            }
-            
+    MatrixXd Z;
+    GxEFit fit;
+    auto y = phenoVec.array();
+    int panel_size = panelSize();
+    for(int from = 0; from < num_marker; from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        decodePanel(genobuf, markerIndex, from, num, &isValids[from]);
+        conditionCovarPanel(panel);
+        fitGxEPanel(panel, Z, fit);
+
+        // B = sum of the squared residuals corrected by the hat values times (x, z)'(x, z)
+        Eigen::ArrayXd B00 = Eigen::ArrayXd::Zero(num), B01 = Eigen::ArrayXd::Zero(num), B11 = Eigen::ArrayXd::Zero(num);
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < num; k++){
+            if(!isValids[from + k]) continue;
+            auto x = panel.col(k).array();
+            auto z = Z.col(k).array();
+            Eigen::ArrayXd hat = fit.inv00[k] * x.square() + 2.0 * fit.inv01[k] * x * z + fit.inv11[k] * z.square();
+            Eigen::ArrayXd res2 = (y - fit.beta_g[k] * x - fit.beta_gxe[k] * z).square() / (1.0 - hat);
+            B00[k] = (res2 * x.square()).sum();
+            B01[k] = (res2 * x * z).sum();
+            B11[k] = (res2 * z.square()).sum();
+        }
+
+        // sandwich variance estimator (-A)^(-1) * B * (-A)^(-1)
+        const Eigen::ArrayXd &a = fit.inv00, &b = fit.inv01, &c = fit.inv11;
+        Eigen::ArrayXd S00 = a.square() * B00 + 2.0 * a * b * B01 + b.square() * B11;
+        Eigen::ArrayXd S01 = a * b * B00 + (b.square() + a * c) * B01 + b * c * B11;
+        Eigen::ArrayXd S11 = b.square() * B00 + 2.0 * b * c * B01 + c.square() * B11;
+        Eigen::ArrayXd chisq = (S11 * fit.beta_g.square() - 2.0 * S01 * fit.beta_g * fit.beta_gxe + S00 * fit.beta_gxe.square())
+            / (S00 * S11 - S01.square());
+        Eigen::ArrayXd se_g = S00.sqrt();
+        Eigen::ArrayXd se_gxe = S11.sqrt();
+        Eigen::ArrayXd chisq_g = (fit.beta_g / se_g).square();
+        Eigen::ArrayXd chisq_gxe = (fit.beta_gxe / se_gxe).square();
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < num; k++){
+            int i = from + k;
+            if(!isValids[i] || std::isnan(S00[k] + 2.0 * S01[k] + S11[k])) continue;
+
+            beta_geno[i] = (float)fit.beta_g[k];
+            se_geno[i] = (float)se_g[k];
+            score_geno[i] = (float)chisq_g[k];
+            p_geno[i] = chisq_g[k] > 0 ? StatLib::pchisqd1(chisq_g[k]) : 1;
+
+            beta_interaction[i] = (float)fit.beta_gxe[k];
+            se_interaction[i] = (float)se_gxe[k];
+            score_interaction[i] = (float)chisq_gxe[k];
+            p_interaction[i] = chisq_gxe[k] > 0 ? StatLib::pchisqd1(chisq_gxe[k]) : 1;
+
+            cov_geno_interaction[i] = (float)S01[k];
+
+            score[i] = (float)chisq[k];
+            p[i] = chisq[k] > 0 ? StatLib::pchisqd2(chisq[k]) : 1;
         }
-
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info; 
     }
     
     output_res_2df(isValids, markerIndex);
@@ -2912,84 +3648,173 @@ void FastFAM::calculate_fam(uintptr_t *genobuf, const vector<uint32_t> &markerIn
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
 
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
+    int panel_size = panelSize();
+    for(int from = 0; from < num_marker; from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        decodePanel(genobuf, markerIndex, from, num, &isValids[from]);
+        conditionCovarPanel(panel);
 
-        geno->getGenoDouble(genobuf, i, &item);
+        MatrixXd xMat_V = V_inverse * panel;
+        VectorXd xtVx = (xMat_V.cwiseProduct(panel)).colwise().sum().transpose();
+        VectorXd xtVp = xMat_V.transpose() * phenoVec;
 
-        isValids[i] = item.valid;
-        if(!item.valid) {
-            continue;
-        }
- 
-        Map< VectorXd > xMat(item.geno.data(), num_indi);
+        for(int k = 0; k < num; k++){
+            int i = from + k;
+            if(!isValids[i]) continue;
 
-        conditionCovarReg(xMat);
+            double xMat_V_x = 1.0 / xtVx[k];
+            double xMat_V_p = xtVp[k];
 
-        VectorXd xMat_V = V_inverse * xMat;
-        double xMat_V_x = 1.0 / xMat_V.dot(xMat);
-        double xMat_V_p = xMat_V.dot(phenoVec);
+            double temp_beta =  xMat_V_x * xMat_V_p;
+            double temp_se = sqrt(xMat_V_x);
+            double temp_z = temp_beta / temp_se;
 
-        double temp_beta =  xMat_V_x * xMat_V_p;
-        double temp_se = sqrt(xMat_V_x);
-        double temp_z = temp_beta / temp_se;
+            beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
+            se[i] = (float)temp_se;
+            p[i] = StatLib::pchisqd1(temp_z * temp_z); 
+        }
+    }
+    output_res(isValids, markerIndex);
+}
 
+void FastFAM::calculate_grammar(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+    int num_marker = markerIndex.size();
+    vector<uint8_t> isValids(num_marker);
+    SparseSums sums;
+    initSparseSums(Vi_y_cinf, sums);
+
+    int panel_size = panelSize();
+    for(int from = 0; from < num_marker; from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        decodePanel(genobuf, markerIndex, from, num, &isValids[from], true, true);
+        auto dense = panel.leftCols(panelDense);
+        conditionCovarPanel(dense);
+
+        VectorXd gtg = dense.colwise().squaredNorm().transpose();
+        VectorXd gt_Vi_y = dense.transpose() * Vi_y_cinf;
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < num; k++){
+            int i = from + k;
+            if(!isValids[i]) continue;
+
+            double cur_gtg, cur_gt_Vi_y;
+            if(panelCol[k] >= 0){
+                cur_gtg = gtg[panelCol[k]];
+                cur_gt_Vi_y = gt_Vi_y[panelCol[k]];
+            }else{
+                RowVectorXd xtY;
+                sparseCrossProd(panelSparse[k], Vi_y_cinf, sums, cur_gtg, xtY);
+                cur_gt_Vi_y = xtY[0];
+            }
 
-        beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
-        se[i] = (float)temp_se;
-        p[i] = StatLib::pchisqd1(temp_z * temp_z); 
+            double temp_beta = cur_gt_Vi_y / cur_gtg;
+            double temp_chisq = temp_beta * cur_gt_Vi_y * c_inf;
+            double temp_se = sqrt(temp_beta * temp_beta / temp_chisq);
 
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info;
+            beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
+            se[i] = (float)temp_se;
+            p[i] = StatLib::pchisqd1(temp_chisq); 
+        }
     }
+
     output_res(isValids, markerIndex);
 }
 
-void FastFAM::calculate_grammar(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+
+// All the traits of --mpheno: the panel is multiplied with the stacked Vi_y / c_inf (or phenotypes) of the traits.
+void FastFAM::calculate_multi(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+    static double iN = 1.0 /(num_indi - (covarFlag ? covar.cols() : 1.0) - 1.0);
+
     int num_marker = markerIndex.size();
+    int num_trait = Ymulti.cols();
     vector<uint8_t> isValids(num_marker);
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-        geno->getGenoDouble(genobuf, i, &item);
-        
-        isValids[i] = item.valid;
-        if(!item.valid){
-            continue;
+    MatrixXd res_beta(num_marker, num_trait);
+    MatrixXd res_se(num_marker, num_trait);
+    MatrixXd res_p(num_marker, num_trait);
+    SparseSums sums;
+    initSparseSums(Ymulti, sums);
+
+    int panel_size = panelSize();
+    for(int from = 0; from < num_marker; from += panel_size){
+        int num = std::min(panel_size, num_marker - from);
+        decodePanel(genobuf, markerIndex, from, num, &isValids[from], true, true);
+        auto dense = panel.leftCols(panelDense);
+        conditionCovarPanel(dense);
+
+        VectorXd gtg(num);
+        MatrixXd gtY(num, num_trait);
+        VectorXd dense_gtg = dense.colwise().squaredNorm().transpose();
+        MatrixXd dense_gtY = dense.transpose() * Ymulti;
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < num; k++){
+            if(!isValids[from + k]) continue;
+            if(panelCol[k] >= 0){
+                gtg[k] = dense_gtg[panelCol[k]];
+                gtY.row(k) = dense_gtY.row(panelCol[k]);
+            }else{
+                RowVectorXd xtY;
+                sparseCrossProd(panelSparse[k], Ymulti, sums, gtg[k], xtY);
+                gtY.row(k) = xtY;
+            }
         }
-        
-        Map< VectorXd > xvec(item.geno.data(), num_indi);
 
-        conditionCovarReg(xvec);
-
-        double gtg = xvec.dot(xvec);
-        //double gt_Vi_y = xvec.dot(Vi_y);
-        double gt_Vi_y = xvec.dot(Vi_y_cinf);
+        #pragma omp parallel for schedule(dynamic)
+        for(int t = 0; t < num_trait; t++){
+            for(int k = 0; k < num; k++){
+                int i = from + k;
+                if(!isValids[i]) continue;
+                double temp_beta = gtY(k, t) / gtg[k];
+                double temp_se, temp_chisq;
+                if(traitCinf[t] > 0){
+                    temp_chisq = temp_beta * gtY(k, t) * traitCinf[t];
+                    temp_se = sqrt(temp_beta * temp_beta / temp_chisq);
+                }else{
+                    double sse = (traitSSy[t] - temp_beta * gtY(k, t)) * iN;
+                    temp_se = sqrt(sse / gtg[k]);
+                    temp_chisq = (temp_beta / temp_se) * (temp_beta / temp_se);
+                }
+                res_beta(i, t) = temp_beta;
+                res_se(i, t) = temp_se;
+                res_p(i, t) = StatLib::pchisqd1(temp_chisq);
+            }
+        }
+    }
 
-        //double temp_beta = gt_Vi_y / gtg / c_inf;
-        double temp_beta = gt_Vi_y / gtg;
-        //double temp_chisq = temp_beta * gt_Vi_y;
-        double temp_chisq = temp_beta * gt_Vi_y * c_inf;
-        double temp_se = sqrt(temp_beta * temp_beta / temp_chisq);
+    vector<string> res_marker(num_marker);
+    int numKept = 0;
+    for(int i = 0; i != num_marker; i++){
+        if(!isValids[i] && !bOutResAll) continue;
+        numKept++;
+        std::ostringstream os;
+        os << marker->getMarkerStrExtract(markerIndex[i]) << "\t" << countMarkers[i] << "\t" << af[i];
+        res_marker[i] = os.str();
+    }
 
-        beta[i] = (float)temp_beta; //* geno->RDev[cur_raw_marker]; 
-        se[i] = (float)temp_se;
-        p[i] = StatLib::pchisqd1(temp_chisq); 
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info;
+    vector<string> texts(num_trait);
+    #pragma omp parallel for schedule(dynamic)
+    for(int t = 0; t < num_trait; t++){
+        std::ostringstream os;
+        for(int i = 0; i != num_marker; i++){
+            if(res_marker[i].empty()) continue;
+            os << res_marker[i];
+            if(isValids[i]){
+                os << "\t" << (float)res_beta(i, t) << "\t" << (float)res_se(i, t) << "\t" << res_p(i, t);
+            }else{
+                os << "\tNA\tNA\tNA";
+            }
+            if(hasInfo){
+                os << "\t" << info[i];
+            }
+            os << "\n";
+        }
+        texts[t] = os.str();
     }
+    traitWriter->push(std::move(texts));
 
-    output_res(isValids, markerIndex);
+    numMarkerOutput += numKept;
 }
 
-
 void FastFAM::calculate_mixed_2df(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     //calculate residualized phenotype
     phenoVec = VR_copy * Vi_y;
@@ -3008,30 +3833,268 @@ void FastFAM::calculate_mixed_2df_sandwich(uintptr_t *genobuf, const vector<uint
     calculate_gwa_2df_sandwich(genobuf, markerIndex);
 }
 
+// default filters of the tested variants unless --nofilter
+void FastFAM::setOutputFilters(){
+    if(options.find("no_filter") == options.end()){
+        bOutResAll = false;
+        double preAF = geno->getMAF();
+        double preInfo = geno->getFilterInfo();
+        double preMiss = geno->getFilterMiss();
+        if(preAF < 1e-10){
+            geno->setMAF(0.0001);
+            LOGGER << "  Filtering out variants with MAF < 0.0001, or customise it with --maf flag." << std::endl; 
+        }
+        /*
+        if(preInfo < 1e-10 && hasInfo){
+            geno->setFilterInfo(0.3);
+            LOGGER << "  Filtering out variants with imputation INFO score < 0.30, or customise it with --info flag." << std::endl;
+        }
+        */
+        if(preMiss < 1e-10){
+            geno->setFilterMiss(0.9);
+            LOGGER << "  Filtering out variants with missingness rate > 0.10, or customise it with --geno flag." << std::endl;
+        }
+    }else{
+        bOutResAll = true;
+    }
+}
+
+static string shardFileName(const string &out, int index, int count){
+    return out + ".shard" + to_string(index) + "of" + to_string(count);
+}
+
+// the fields of the complete lines in a shard checkpoint, a line cut by an interruption is dropped
+static vector<vector<string>> readShardCheckpoint(const string &file_name){
+    vector<vector<string>> lines;
+    std::ifstream in(file_name.c_str(), std::ios::binary);
+    if(!in) return lines;
+    string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t start = 0, end;
+    while((end = content.find('\n', start)) != string::npos){
+        vector<string> fields;
+        string line = content.substr(start, end - start);
+        boost::split(fields, line, boost::is_any_of("\t"));
+        lines.push_back(fields);
+        start = end + 1;
+    }
+    return lines;
+}
+
+static bool truncateFile(const string &file_name, uint64_t bytes){
+#ifndef _WIN32
+    return truncate(file_name.c_str(), bytes) == 0;
+#else
+    int fd = _open(file_name.c_str(), _O_RDWR | _O_BINARY);
+    if(fd < 0) return false;
+    bool ok = _chsize_s(fd, bytes) == 0;
+    _close(fd);
+    return ok;
+#endif
+}
+
+// The range of this shard in the extract index: the markers are split at equal bytes of the
+//  genotype file, or equal counts if the bytes of a marker are not known (fixed in PLINK bed).
+//  Resumes from the checkpoint of the shard if there is one; false if the shard has finished.
+bool FastFAM::initShard(vector<uint32_t> &extractIndex, uint64_t &resumeBytes){
+    uint32_t num_extract = marker->count_extract();
+    vector<uint64_t> cum_bytes(num_extract + 1, 0);
+    bool bBytes = true;
+    for(uint32_t i = 0; i < num_extract && bBytes; i++){
+        uint64_t bytes = marker->getMarkerBytes(marker->getRawIndex(i));
+        bBytes = bytes > 0;
+        cum_bytes[i + 1] = cum_bytes[i] + bytes;
+    }
+    if(!bBytes){
+        std::iota(cum_bytes.begin(), cum_bytes.end(), 0);
+    }
+    uint64_t total = cum_bytes[num_extract];
+    auto boundary = [&](uint64_t k){
+        uint64_t target = total / shardCount * k + total % shardCount * k / shardCount;
+        return (uint32_t)(std::lower_bound(cum_bytes.begin(), cum_bytes.end(), target) - cum_bytes.begin());
+    };
+    uint32_t start = boundary(shardIndex - 1);
+    uint32_t end = boundary(shardIndex);
+
+    sFileName = shardFileName(options["out"], shardIndex, shardCount);
+    string ckpt_file = sFileName + ".ckpt";
+    std::ostringstream ss_header;
+    ss_header << "SHARD\t" << shardIndex << "\t" << shardCount << "\t" << start << "\t" << end << "\t" << num_extract << "\t" << num_indi;
+    string header = ss_header.str();
+    LOGGER.i(0, "Shard " + to_string(shardIndex) + " of " + to_string(shardCount) + ": SNPs " + to_string(start + 1) + " to "
+            + to_string(end) + " of " + to_string(num_extract) + " in the extract list.");
+
+    uint32_t next = start;
+    string progress;
+    auto lines = readShardCheckpoint(ckpt_file);
+    if(!lines.empty()){
+        if(boost::algorithm::join(lines[0], "\t") != header){
+            LOGGER.e(0, "the checkpoint [" + ckpt_file + "] was saved with different SNPs, samples or shards. "
+                    "Remove it and [" + sFileName + "] to run the shard from the beginning.");
+        }
+        const vector<string> &last = lines.back();
+        if(last[0] == "END"){
+            LOGGER.i(0, "The shard has finished in [" + sFileName + "] already.");
+            return false;
+        }
+        if(lines.size() > 1){
+            if(last.size() != 3){
+                LOGGER.e(0, "the checkpoint [" + ckpt_file + "] is broken.");
+            }
+            next = std::stoul(last[0]);
+            resumeBytes = std::stoull(last[1]);
+            numMarkerOutput = std::stoul(last[2]);
+            progress = boost::algorithm::join(last, "\t") + "\n";
+
+            std::ifstream in(sFileName.c_str(), std::ios::binary | std::ios::ate);
+            if(!in || (uint64_t)in.tellg() < resumeBytes || next < start || next > end){
+                LOGGER.e(0, "[" + sFileName + "] doesn't match its checkpoint [" + ckpt_file + "].");
+            }
+            in.close();
+            // the results after the last checkpoint are computed again
+            if(!truncateFile(sFileName, resumeBytes)){
+                LOGGER.e(0, "can't truncate [" + sFileName + "] to resume.");
+            }
+            LOGGER.i(0, "Resumed from the checkpoint [" + ckpt_file + "]: " + to_string(next - start) + " of "
+                    + to_string(end - start) + " SNPs have been tested.");
+        }
+    }
+
+    // rewritten without a cut line, then appended after each block
+    osShardCkpt.open(ckpt_file.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+    if(!osShardCkpt){
+        LOGGER.e(0, "can't open [" + ckpt_file + "] to write.");
+    }
+    osShardCkpt << header << "\n" << progress << std::flush;
+
+    extractIndex.resize(end - next);
+    std::iota(extractIndex.begin(), extractIndex.end(), next);
+    return true;
+}
+
+// after the block is written: the results up to here are complete
+void FastFAM::shardCheckpoint(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+    osOut.flush();
+    if(!osOut){
+        LOGGER.e(0, "can't write to [" + sFileName + "].");
+    }
+    osShardCkpt << markerIndex.back() + 1 << "\t" << (uint64_t)osOut.tellp() << "\t" << numMarkerOutput << std::endl;
+    if(!osShardCkpt){
+        LOGGER.e(0, "can't write the checkpoint of [" + sFileName + "].");
+    }
+}
+
+// join the shards of --shard i/N in the order of the extract index, the header kept once
+void FastFAM::mergeShards(){
+    int count = (int)options_d["merge_shards"];
+    string out = options["out"];
+    LOGGER.i(0, "Merging " + to_string(count) + " shards of fastGWA results to [" + out + "]...");
+    FILE *h_out = fopen(out.c_str(), "wb");
+    if(!h_out){
+        LOGGER.e(0, "can't open [" + out + "] to write.");
+    }
+
+    vector<char> buf(1 << 24);
+    uint64_t num_saved = 0;
+    uint32_t pre_end = 0;
+    vector<string> first_header;
+    for(int index = 1; index <= count; index++){
+        string shard_file = shardFileName(out, index, count);
+        string ckpt_file = shard_file + ".ckpt";
+        auto lines = readShardCheckpoint(ckpt_file);
+        if(lines.empty() || lines[0].size() != 7 || lines[0][0] != "SHARD"){
+            LOGGER.e(0, "can't read the checkpoint of shard " + to_string(index) + " in [" + ckpt_file + "].");
+        }
+        const vector<string> &header = lines[0];
+        const vector<string> &last = lines.back();
+        if(last[0] != "END" || last.size() != 3){
+            LOGGER.e(0, "shard " + to_string(index) + " of " + to_string(count) + " in [" + shard_file + "] hasn't finished.");
+        }
+        if(index == 1) first_header = header;
+        if(std::stoi(header[1]) != index || std::stoi(header[2]) != count || std::stoul(header[3]) != pre_end
+                || header[5] != first_header[5] || header[6] != first_header[6]){
+            LOGGER.e(0, "the shards in [" + out + ".shard*] were not run on the same SNPs and samples.");
+        }
+        pre_end = std::stoul(header[4]);
+        uint64_t remain = std::stoull(last[1]);
+        num_saved += std::stoull(last[2]);
+
+        FILE *h_in = fopen(shard_file.c_str(), "rb");
+        if(!h_in){
+            LOGGER.e(0, "can't open [" + shard_file + "] to read.");
+        }
+        if(index > 1){
+            // skip the header line
+            int c;
+            while(remain && (c = fgetc(h_in)) != EOF){
+                remain--;
+                if(c == '\n') break;
+            }
+        }
+        while(remain){
+            size_t num_read = fread(buf.data(), 1, std::min(remain, (uint64_t)buf.size()), h_in);
+            if(num_read == 0){
+                LOGGER.e(0, "[" + shard_file + "] is shorter than its checkpoint.");
+            }
+            if(fwrite(buf.data(), 1, num_read, h_out) != num_read){
+                LOGGER.e(0, "can't write to [" + out + "].");
+            }
+            remain -= num_read;
+        }
+        fclose(h_in);
+    }
+    if(pre_end != std::stoul(first_header[5])){
+        LOGGER.e(0, "the shards in [" + out + ".shard*] don't cover all the SNPs.");
+    }
+    if(fclose(h_out) != 0){
+        LOGGER.e(0, "can't write to [" + out + "].");
+    }
+    LOGGER << "Saved " << num_saved << " SNPs." << std::endl;
+}
+
 void FastFAM::processFAM(vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks){
     sFileName = options["out"]; 
+    vector<uint32_t> extractIndex;
+    uint64_t resumeBytes = 0;
+    if(options_d.find("shard_count") != options_d.end()){
+        shardIndex = (int)options_d["shard_index"];
+        shardCount = (int)options_d["shard_count"];
+        if(!initShard(extractIndex, resumeBytes)) return;
+    }else{
+        extractIndex.resize(marker->count_extract());
+        std::iota(extractIndex.begin(), extractIndex.end(), 0);
+    }
+
     int buf_size = 23068672;
     osBuf.resize(buf_size);
     osOut.rdbuf()->pubsetbuf(&osBuf[0], buf_size);
     if(options.find("save_bin") == options.end()){
         bSaveBin = false;
         LOGGER << "fastGWA results will be saved in text format to [" << sFileName << "]." << std::endl;
-        osOut.open(sFileName.c_str());
-        vector<string> header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA", "SE", "P"};
-        if(hasInfo)header.push_back("INFO");
-        if(bBinary){
-            header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "T", "SE_T", "P_noSPA", "BETA", "SE",  "P",  "CONVERGE"};
-            if(hasInfo)header.push_back("INFO");
-        }
-        if(has_envir){
-            header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA_G", "BETA_G_by_E", "SE_G", "SE_G_by_E", "Cov_BETA_G_and_G_by_E", "chisq_G", "chisq_G_by_E", "chisq_2df", "P_G", "P_G_by_E", "P_2df"};
+        if(resumeBytes){
+            // appended after the last block in the checkpoint, initShard has cut the rest
+            osOut.open(sFileName.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+            osOut.seekp(resumeBytes);
+            if(!osOut){
+                LOGGER.e(0, "can't open [" + sFileName + "] to write.");
+            }
+        }else{
+            osOut.open(sFileName.c_str());
+            vector<string> header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA", "SE", "P"};
             if(hasInfo)header.push_back("INFO");
+            if(bBinary){
+                header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "T", "SE_T", "P_noSPA", "BETA", "SE",  "P",  "CONVERGE"};
+                if(hasInfo)header.push_back("INFO");
+            }
+            if(has_envir){
+                header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA_G", "BETA_G_by_E", "SE_G", "SE_G_by_E", "Cov_BETA_G_and_G_by_E", "chisq_G", "chisq_G_by_E", "chisq_2df", "P_G", "P_G_by_E", "P_2df"};
+                if(hasInfo)header.push_back("INFO");
+            }
+            string header_string = boost::algorithm::join(header, "\t");
+            if(osOut.bad()){
+                LOGGER.e(0, "can't open [" + sFileName + "] to write.");
+            }
+            osOut << header_string << std::endl;
         }
-        string header_string = boost::algorithm::join(header, "\t");
-        if(osOut.bad()){
-            LOGGER.e(0, "can't open [" + sFileName + "] to write.");
-        }
-        osOut << header_string << std::endl;
     }else{
         bSaveBin = true;
         LOGGER << "fastGWA results will be saved in binary format to [" << sFileName << "(.snpinfo, .bin)]" << std::endl;
@@ -3047,31 +4110,7 @@ void FastFAM::processFAM(vector<function<void (uintptr_t *, const vector<uint32_
     }
 
 
-    if(options.find("no_filter") == options.end()){
-        bOutResAll = false;
-        double preAF = geno->getMAF();
-        double preInfo = geno->getFilterInfo();
-        double preMiss = geno->getFilterMiss();
-        if(preAF < 1e-10){
-            geno->setMAF(0.0001);
-            LOGGER << "  Filtering out variants with MAF < 0.0001, or customise it with --maf flag." << std::endl; 
-        }
-        /*
-        if(preInfo < 1e-10 && hasInfo){
-            geno->setFilterInfo(0.3);
-            LOGGER << "  Filtering out variants with imputation INFO score < 0.30, or customise it with --info flag." << std::endl;
-        }
-        */
-        if(preMiss < 1e-10){
-            geno->setFilterMiss(0.9);
-            LOGGER << "  Filtering out variants with missingness rate > 0.10, or customise it with --geno flag." << std::endl;
-        }
-    }else{
-        bOutResAll = true;
-    }
-
-    vector<uint32_t> extractIndex(marker->count_extract());
-    std::iota(extractIndex.begin(), extractIndex.end(), 0);
+    setOutputFilters();
 
     int nMarker = 1024;
  
@@ -3104,15 +4143,27 @@ void FastFAM::processFAM(vector<function<void (uintptr_t *, const vector<uint32_
         p_geno = new double[nMarker];
         p_interaction = new double[nMarker];
     }
-    geno->loopDouble(extractIndex, nMarker, true, bCenter, false, false, callBacks);
+    if(shardCount){
+        callBacks.push_back(bind(&FastFAM::shardCheckpoint, this, _1, _2));
+    }
+    if(!extractIndex.empty()){
+        geno->loopDouble(extractIndex, nMarker, true, bCenter, false, false, callBacks);
+    }
 
     osOut.flush();
+    uint64_t outBytes = osOut.tellp();
     osOut.close();
     if(bOut){
         fflush(bOut);
         fclose(bOut);
     }
     LOGGER << "Saved " << numMarkerOutput << " SNPs." << std::endl;
+    if(shardCount){
+        osShardCkpt << "END\t" << outBytes << "\t" << numMarkerOutput << std::endl;
+        osShardCkpt.close();
+        LOGGER.i(0, "Shard " + to_string(shardIndex) + " of " + to_string(shardCount) + " finished. Use \"--merge-shards "
+                + to_string(shardCount) + "\" with the same --out to join the shards once all have finished.");
+    }
 
     delete[] beta;
     delete[] se;
@@ -3144,6 +4195,7 @@ int FastFAM::registerOption(map<string, vector<string>>& options_in){
     int returnValue = 0;
     //DEBUG: change to .fastFAM
     options["out"] = options_in["out"][0] + ".fastGWA";
+    options["out_prefix"] = options_in["out"][0];
 
     string curFlag = "--fastGWA";
     if(options_in.find(curFlag) != options_in.end()){
@@ -3295,6 +4347,16 @@ int FastFAM::registerOption(map<string, vector<string>>& options_in){
         options_in.erase(curFlag);
     }
 
+    curFlag = "--null-panel";
+    if(options_in.find(curFlag) != options_in.end()){
+        if(options_in[curFlag].size() == 1){
+            options["null_panel"] = options_in[curFlag][0];
+        }else{
+            LOGGER.e(0, curFlag + " takes one file to save or read the null SNPs.");
+        }
+        options_in.erase(curFlag);
+    }
+
     curFlag = "--c-inf-no-filter";
     if(options_in.find(curFlag) != options_in.end()){
         options["c-inf-no-filter"] = "yes";
@@ -3346,9 +4408,24 @@ int FastFAM::registerOption(map<string, vector<string>>& options_in){
         LOGGER.e(0, "can't generate and load model at the same time.");
     }
     
+    // set tests, any of them in one pass of the genotypes
+    vector<string> regionTests;
     curFlag = "--burden";
     if(options_in.find(curFlag) != options_in.end()){
-        options["regiontest"] = "burden";
+        regionTests.push_back("burden");
+    }
+
+    curFlag = "--skat";
+    if(options_in.find(curFlag) != options_in.end()){
+        regionTests.push_back("skat");
+    }
+
+    curFlag = "--acat-v";
+    if(options_in.find(curFlag) != options_in.end()){
+        regionTests.push_back("acat");
+    }
+    if(!regionTests.empty()){
+        options["regiontest"] = boost::algorithm::join(regionTests, ",");
     }
 
     curFlag = "--set-list";
@@ -3372,6 +4449,53 @@ int FastFAM::registerOption(map<string, vector<string>>& options_in){
     }
 
 
+    curFlag = "--shard";
+    if(options_in.find(curFlag) != options_in.end()){
+        auto &values = options_in[curFlag];
+        int index = 0, count = 0;
+        size_t pos = values.size() == 1 ? values[0].find('/') : string::npos;
+        if(pos != string::npos){
+            try{
+                index = std::stoi(values[0].substr(0, pos));
+                count = std::stoi(values[0].substr(pos + 1));
+            }catch(std::exception&){
+                index = 0;
+            }
+        }
+        if(index < 1 || index > count){
+            LOGGER.e(0, curFlag + " takes i/N to test the shard i of N, 1 <= i <= N.");
+        }
+        if(options["model_file"] == ""){
+            LOGGER.e(0, curFlag + " tests with a null model fitted once by --model-only, load it by --load-model.");
+        }
+        if(options.find("save_bin") != options.end() || options.find("regiontest") != options.end()){
+            LOGGER.e(0, curFlag + " can't be used with --save-bin or the set based tests.");
+        }
+        options_d["shard_index"] = index;
+        options_d["shard_count"] = count;
+        options_in.erase(curFlag);
+    }
+
+    curFlag = "--merge-shards";
+    if(options_in.find(curFlag) != options_in.end()){
+        auto &values = options_in[curFlag];
+        int count = 0;
+        if(values.size() == 1){
+            try{
+                count = std::stoi(values[0]);
+            }catch(std::exception&){
+                count = 0;
+            }
+        }
+        if(count < 1){
+            LOGGER.e(0, curFlag + " takes the number of shards N of --shard i/N.");
+        }
+        options_d["merge_shards"] = count;
+        processFunctions.push_back("merge_shards");
+        returnValue++;
+        options_in.erase(curFlag);
+    }
+
     curFlag = "--save-pheno";
     if(options_in.find(curFlag) != options_in.end()){
         options["save_pheno"] = "yes";
@@ -3492,6 +4616,9 @@ int FastFAM::registerOption(map<string, vector<string>>& options_in){
 void FastFAM::processMain(){
     vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
     for(auto &process_function : processFunctions){
+        if(process_function == "merge_shards"){
+            mergeShards();
+        }
         if(process_function == "fast_fam"){
             FastFAM ffam;
             if(options.find("save_inv") != options.end()){
@@ -3507,6 +4634,11 @@ void FastFAM::processMain(){
             if(options.find("binary") != options.end()){
                 bBinary = true;
             }
+            if(ffam.bMultiTrait){
+                LOGGER.i(0, "\nPerforming fastGWA association analysis of " + to_string(ffam.traitCols.size()) + " traits...");
+                ffam.processFAMMulti();
+                continue;
+            }
             if(options.find("grmsparse_file") != options.end() && ffam.fam_flag){
                 if(options.find("envir") != options.end()){
                     if (options.find("noSandwich") != options.end()){
@@ -3554,17 +4686,69 @@ void FastFAM::processMain(){
     }
 }
 
+void FastFAM::processFAMMulti(){
+    vector<string> file_names(traitCols.size());
+    for(int t = 0; t < traitCols.size(); t++){
+        file_names[t] = options["out_prefix"] + ".pheno" + to_string(traitCols[t]) + ".fastGWA";
+    }
+    LOGGER << "fastGWA results of " << file_names.size() << " traits will be saved in text format to ["
+        << options["out_prefix"] << ".pheno*.fastGWA]." << std::endl;
+    traitWriter = new AsyncWriter(file_names);
+
+    vector<string> header = {"CHR", "SNP", "POS", "A1", "A2", "N", "AF1", "BETA", "SE", "P"};
+    if(hasInfo)header.push_back("INFO");
+    string header_string = boost::algorithm::join(header, "\t") + "\n";
+    traitWriter->push(vector<string>(file_names.size(), header_string));
+
+    setOutputFilters();
+
+    vector<uint32_t> extractIndex(marker->count_extract());
+    std::iota(extractIndex.begin(), extractIndex.end(), 0);
+
+    int nMarker = 1024;
+    countMarkers = new uint32_t[nMarker];
+    af = new float[nMarker];
+    info = new float[nMarker];
+    numMarkerOutput = 0;
+
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(bind(&FastFAM::calculate_multi, this, _1, _2));
+    geno->loopDouble(extractIndex, nMarker, true, true, false, false, callBacks);
+
+    traitWriter->close();
+    LOGGER << "Saved " << numMarkerOutput << " SNPs for each trait." << std::endl;
+
+    delete[] countMarkers;
+    delete[] af;
+    delete[] info;
+}
+
 void FastFAM::processFAMreg(){
     if(options.find("geneset") == options.end()){
         LOGGER.e(0, "can't find the region set. Plese specify it by the --set-list flag.");
     }
+    if(!bBinary){
+        LOGGER.e(0, "set based test is only available for a binary trait in the current version.");
+    }
+    vector<string> tests;
+    boost::split(tests, options["regiontest"], boost::is_any_of(","));
+    bSetBurden = std::find(tests.begin(), tests.end(), "burden") != tests.end();
+    bSetSKAT = std::find(tests.begin(), tests.end(), "skat") != tests.end();
+    bSetACAT = std::find(tests.begin(), tests.end(), "acat") != tests.end();
+
     sFileName = options["out"]; 
 
     LOGGER << "fastGWA-BB results will be saved in text format to [" << sFileName << "]." << std::endl;
     osOut.open(sFileName.c_str());
-    vector<string> header = {"GENE", "START", "END", "VAR_N", "MAF_MEAN", "BETA", "SE", "P"};
-    if(bBinary){
-        header = {"GENE", "START", "END", "VAR_N", "MAF_MEAN", "T", "SE_T", "P_noSPA", "BETA", "SE",  "P",  "CONVERGE"};
+    vector<string> header = {"GENE", "VAR_N", "MAF_MEAN"};
+    if(bSetBurden){
+        header.insert(header.end(), {"T", "SE_T", "P_noSPA", "BETA", "SE",  "P",  "CONVERGE"});
+    }
+    if(bSetSKAT){
+        header.insert(header.end(), {"Q_SKAT", "P_SKAT"});
+    }
+    if(bSetACAT){
+        header.push_back("P_ACAT");
     }
     string header_string = boost::algorithm::join(header, "\t");
     if(osOut.bad()){
@@ -3579,7 +4763,7 @@ void FastFAM::processFAMreg(){
     if(numGeneBlock == 0){
         LOGGER.e(0, "can't find a valid gene in the genotype file.");
     }else{
-        LOGGER << "Processing " << numGeneBlock << " genes by " << options["regiontest"] << " test..." << std::endl;
+        LOGGER << "Processing " << numGeneBlock << " genes by " << boost::algorithm::join(tests, ", ") << " test..." << std::endl;
     }
 
     double preMiss = geno->getFilterMiss();
@@ -3588,74 +4772,271 @@ void FastFAM::processFAMreg(){
         LOGGER << "  Filtering out variants with missingness rate > 0.10, or customise it with --geno flag." << std::endl;
     }
 
-    //
-    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> calls;
-    calls.push_back(bind(&FastFAM::getX, this, _1, _2));
-    int nMarker = 100;
+    // the genes spanning more columns than the window budget are tested on their own first,
+    //  so that the window of the others stays bounded: it holds at most the span of a gene and a panel
+    vector<string> lines(numGeneBlock);
+    vector<uint8_t> tested(numGeneBlock, 0);
+    vector<uint8_t> bOwnWindow(numGeneBlock, 0);
+    vector<uint32_t> setMarkers;
+    {
+        vector<uint32_t> allMarkers;
+        for(const auto &gene : genelist){
+            allMarkers.insert(allMarkers.end(), gene.second.begin(), gene.second.end());
+        }
+        std::sort(allMarkers.begin(), allMarkers.end());
+        allMarkers.erase(std::unique(allMarkers.begin(), allMarkers.end()), allMarkers.end());
+        for(int i = 0; i < numGeneBlock; i++){
+            const vector<uint32_t> &glist = genelist[i].second;
+            uint32_t first = std::lower_bound(allMarkers.begin(), allMarkers.end(), *std::min_element(glist.begin(), glist.end())) - allMarkers.begin();
+            uint32_t last = std::lower_bound(allMarkers.begin(), allMarkers.end(), *std::max_element(glist.begin(), glist.end())) - allMarkers.begin();
+            if(last - first + 1 > setWindowBudget){
+                bOwnWindow[i] = 1;
+                LOGGER.w(0, "gene " + genelist[i].first + " spans " + to_string(last - first + 1)
+                        + " variants of the gene list, more than " + to_string(setWindowBudget) + ", it is tested on its own.");
+            }else{
+                setMarkers.insert(setMarkers.end(), glist.begin(), glist.end());
+            }
+        }
+    }
+    std::sort(setMarkers.begin(), setMarkers.end());
+    setMarkers.erase(std::unique(setMarkers.begin(), setMarkers.end()), setMarkers.end());
 
     LOGGER.ts("LOOP_SET_TOT");
- 
     for(int i = 0; i < numGeneBlock; i++){
-        string genename = genelist[i].first;
-        vector<uint32_t> &glist = genelist[i].second;
-        int curNumMarker = glist.size();
-        gAF.resize(curNumMarker);
-        gX.resize(num_indi, curNumMarker);
-        bValids.resize(curNumMarker);
-        gN.resize(curNumMarker);
-        num_gene_index = 0;
-        geno->loopDouble(glist, nMarker, true, false, false, false, calls, false);
-        
-        int move_seg = 0;
-        vector<uint32_t> keptIndex;
-        for(int j = 0; j < curNumMarker; j++){
-            if(!bValids[j]){
-                move_seg++;
-            }else{
-                if(move_seg != 0){
-                    gX.col(j - move_seg) = gX.col(j);
-                    gAF[j - move_seg] = gAF(j);
-                    gN[j - move_seg] = gN(j);
-                }
-                keptIndex.push_back(glist[j]);
-            }
+        if(!bOwnWindow[i]) continue;
+        vector<uint32_t> ownMarkers(genelist[i].second);
+        std::sort(ownMarkers.begin(), ownMarkers.end());
+        ownMarkers.erase(std::unique(ownMarkers.begin(), ownMarkers.end()), ownMarkers.end());
+        vector<uint32_t> cols;
+        for(uint32_t index : genelist[i].second){
+            cols.push_back(std::lower_bound(ownMarkers.begin(), ownMarkers.end(), index) - ownMarkers.begin());
+        }
+        setWindow = SetWindow();
+        vector<function<void (uintptr_t *, const vector<uint32_t> &)>> ownCalls;
+        ownCalls.push_back(bind(&FastFAM::setWindowAdd, this, _1, _2));
+        geno->loopDouble(ownMarkers, panelSize(), true, false, false, false, ownCalls, false);
+        string res = setTest(cols);
+        if(!res.empty()) lines[i] = genelist[i].first + "\t" + res;
+        tested[i] = 1;
+    }
+
+    // the markers of the other genes in the order of the extract index, each read once;
+    //  the columns of a gene are the positions of its markers in them
+    vector<int> order;
+    vector<vector<uint32_t>> geneCols(numGeneBlock);
+    vector<uint32_t> geneFirst(numGeneBlock), geneLast(numGeneBlock);
+    for(int i = 0; i < numGeneBlock; i++){
+        if(bOwnWindow[i]) continue;
+        const vector<uint32_t> &glist = genelist[i].second;
+        vector<uint32_t> &cols = geneCols[i];
+        cols.reserve(glist.size());
+        for(uint32_t index : glist){
+            cols.push_back(std::lower_bound(setMarkers.begin(), setMarkers.end(), index) - setMarkers.begin());
         }
-        int nValidMarker = curNumMarker - move_seg;
-        if(nValidMarker == 0){
-            continue;
+        geneFirst[i] = *std::min_element(cols.begin(), cols.end());
+        geneLast[i] = *std::max_element(cols.begin(), cols.end());
+        order.push_back(i);
+    }
+
+    // a gene is tested once its last marker is decoded, the window then keeps the columns
+    //  from the first marker of the genes not tested yet
+    int numStream = order.size();
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b){return geneLast[a] < geneLast[b];});
+    vector<uint32_t> keepFrom(numStream + 1, std::numeric_limits<uint32_t>::max());
+    for(int k = numStream - 1; k >= 0; k--){
+        keepFrom[k] = std::min(keepFrom[k + 1], geneFirst[order[k]]);
+    }
+
+    setWindow = SetWindow();
+    int nextGene = 0, nextOutput = 0;
+
+    // in the order of the gene list
+    auto writeLines = [&](){
+        while(nextOutput < numGeneBlock && tested[nextOutput]){
+            if(!lines[nextOutput].empty()) osOut << lines[nextOutput] << "\n";
+            string().swap(lines[nextOutput]);
+            nextOutput++;
         }
-        gAF.conservativeResize(nValidMarker);
-        gX.conservativeResize(num_indi, nValidMarker);
-        gN.conservativeResize(nValidMarker);
-
-        vector<bool> bFlip(nValidMarker, false);
-        for(int j = 0; j < nValidMarker; j++){
-            if(gAF(j) > 0.5){
-                double af = 1.0 - gAF(j);
-                gAF(j) = af;
-                gX.col(j) = -gX.col(j).array() + 2.0;
-                bFlip[j] = true;
-            }
+    };
+
+    auto testGenes = [&](uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+        setWindowAdd(genobuf, markerIndex);
+        uint32_t decoded = setWindow.start + setWindow.size;
+        int from = nextGene;
+        while(nextGene < numStream && geneLast[order[nextGene]] < decoded){
+            nextGene++;
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = from; k < nextGene; k++){
+            int i = order[k];
+            vector<uint32_t> cols(geneCols[i]);
+            for(auto &col : cols) col -= setWindow.start;
+            string res = setTest(cols);
+            if(!res.empty()) lines[i] = genelist[i].first + "\t" + res;
+            tested[i] = 1;
+        }
+
+        writeLines();
+        setWindowDrop(keepFrom[nextGene]);
+
+        if(nextGene / 2000 != from / 2000){
+            float elapse_time = LOGGER.tp("LOOP_SET_TOT");
+            float finished_percent = (float) nextGene / numStream;
+            float remain_time = (1.0 / finished_percent - 1) * elapse_time / 60;
 
+            std::ostringstream ss;
+            ss << std::fixed << std::setprecision(1) << "proceeded " << nextGene << " genes. Estimated time remaining " << remain_time << " min"; 
+
+            LOGGER.i(1, ss.str());
         }
+    };
 
-        VectorXd weight = StatLib::weightBetaMAF(gAF, 1, 25);
-        SpMat weights(nValidMarker, nValidMarker);
-        weights.setIdentity();
-        weights.diagonal() = weight; 
+    if(numStream){
+        vector<function<void (uintptr_t *, const vector<uint32_t> &)>> calls;
+        calls.push_back(testGenes);
+        geno->loopDouble(setMarkers, panelSize(), true, false, false, false, calls, false);
+    }
+    writeLines();
+    setWindow = SetWindow();
+    osOut.close();
 
-        MatrixXd GW = gX * weights;
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(1) << "All " << numGeneBlock << " genes finished in " << LOGGER.tp("LOOP_SET_TOT") << " sec";
+    LOGGER.i(0, ss.str());
+}
+
+// Decode the markers of a block to the end of the set window: the genotypes flipped to the minor allele,
+//  adjusted for the covariates as the single marker test, then the scores and the cross products
+//  with all the columns in the window, so that the covariance of a gene is a sub-matrix of cov
+void FastFAM::setWindowAdd(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
+    SetWindow &w = setWindow;
+    uint32_t num = markerIndex.size();
+    uint32_t from = w.size, to = w.size + num;
+    if(to > w.raw.cols()){
+        uint32_t cap = std::max(to, (uint32_t)(2 * w.raw.cols()));
+        w.raw.conservativeResize(num_indi, cap);
+        w.adj.conservativeResize(num_indi, cap);
+        w.cov.conservativeResize(cap, cap);
+        w.score.conservativeResize(cap);
+        w.pVar.conservativeResize(cap);
+        w.maf.conservativeResize(cap);
+        w.valid.resize(cap);
+    }
 
-        VectorXd GW1 = GW * MatrixXd::Ones(nValidMarker, 1);
-        VectorXd GW2 = GW1;
-        if(bPreciseCovar){
-            conditionCovarBinReg(GW1);
+    #pragma omp parallel for schedule(dynamic)
+    for(uint32_t k = 0; k < num; k++){
+        uint32_t col = from + k;
+        GenoBufItem item;
+        item.extractedMarkerIndex = markerIndex[k];
+        geno->getGenoDouble(genobuf, k, &item);
+        w.valid[col] = item.valid;
+        if(!item.valid){
+            w.raw.col(col).setZero();
+            w.maf[col] = 0;
+            continue;
+        }
+        Map< VectorXd > xvec(item.geno.data(), num_indi);
+        if(item.af > 0.5){
+            w.raw.col(col) = -xvec.array() + 2.0;
+            w.maf[col] = 1.0 - item.af;
         }else{
-            GW1 = GW1.array() - GW1.mean();
+            w.raw.col(col) = xvec;
+            w.maf[col] = item.af;
+        }
+    }
+
+    auto adj = w.adj.middleCols(from, num);
+    adj = w.raw.middleCols(from, num);
+    if(bPreciseCovar){
+        MatrixXd HX = H * adj;
+        adj.noalias() -= covar * HX;
+    }else{
+        adj.rowwise() -= adj.colwise().mean();
+    }
+    w.score.segment(from, num).noalias() = adj.transpose() * phenoVecMu;
+    MatrixXd Dadj = dWp.asDiagonal() * adj;
+    w.cov.block(0, from, to, num).noalias() = w.adj.leftCols(to).transpose() * Dadj;
+    w.cov.block(from, 0, num, from) = w.cov.block(0, from, from, num).transpose();
+    w.size = to;
+
+    if(!bSetACAT) return;
+    #pragma omp parallel for schedule(dynamic)
+    for(uint32_t col = from; col < to; col++){
+        w.pVar[col] = std::numeric_limits<double>::quiet_NaN();
+        double varSNP = std::sqrt(w.cov(col, col) * c_inf);
+        if(!w.valid[col] || !(varSNP > 0)) continue;
+        double chisq = std::abs(w.score[col]) / varSNP;
+        double pval = StatLib::pchisqd1(chisq * chisq);
+        if(chisq >= spaCutOff){
+            SPARes res;
+            res.score = w.score[col];
+            res.p = pval;
+            res.bConverge = true;
+            vector<uint32_t> index0;
+            for(uint32_t i = 0; i < num_indi; i++){
+                if(w.raw(i, col) > 1e-6) index0.push_back(i);
+            }
+            VectorXd xvec = w.adj.col(col);
+            if(!bPreciseCovar) conditionCovarBinReg(xvec);
+            double q = xvec.dot(phenoVec);
+            double qinv = q - res.score - res.score;
+            SPA spa(q, qinv, xvec, index0);
+            spa.saddleProb(&res);
+            pval = res.p_adj;
         }
-        double varSNP = std::sqrt(GW1.dot(dWp.cwiseProduct(GW1)) * c_inf);
+        w.pVar[col] = pval;
+    }
+}
+
+// Drop the columns before the position start
+void FastFAM::setWindowDrop(uint32_t start){
+    SetWindow &w = setWindow;
+    uint32_t num_drop = std::min(start, w.start + w.size) - w.start;
+    if(num_drop == 0) return;
+    uint32_t num_keep = w.size - num_drop;
+    for(uint32_t k = 0; k < num_keep; k++){
+        uint32_t col = num_drop + k;
+        w.raw.col(k) = w.raw.col(col);
+        w.adj.col(k) = w.adj.col(col);
+        w.cov.col(k).head(num_keep) = w.cov.col(col).segment(num_drop, num_keep);
+    }
+    std::copy(w.score.data() + num_drop, w.score.data() + w.size, w.score.data());
+    std::copy(w.pVar.data() + num_drop, w.pVar.data() + w.size, w.pVar.data());
+    std::copy(w.maf.data() + num_drop, w.maf.data() + w.size, w.maf.data());
+    std::copy(w.valid.begin() + num_drop, w.valid.begin() + w.size, w.valid.begin());
+    w.start += num_drop;
+    w.size = num_keep;
+}
+
+// The tests of a gene on its columns in the set window, all from the scores and their covariance;
+//  empty if no valid marker
+string FastFAM::setTest(const vector<uint32_t> &columns){
+    const SetWindow &w = setWindow;
+    vector<uint32_t> cols;
+    for(uint32_t col : columns){
+        if(w.valid[col]) cols.push_back(col);
+    }
+    int num = cols.size();
+    if(num == 0) return "";
+
+    VectorXd maf(num), score(num);
+    MatrixXd cov(num, num);
+    for(int j = 0; j < num; j++){
+        maf[j] = w.maf[cols[j]];
+        score[j] = w.score[cols[j]];
+        for(int i = 0; i < num; i++){
+            cov(i, j) = w.cov(cols[i], cols[j]);
+        }
+    }
+    VectorXd weight = StatLib::weightBetaMAF(maf, 1, 25);
+
+    std::ostringstream ss;
+    ss << num << "\t" << maf.mean();
+    if(bSetBurden){
+        double varSNP = std::sqrt(weight.dot(cov * weight) * c_inf);
         SPARes res;
-        res.score = GW1.dot(phenoVecMu);
+        res.score = weight.dot(score);
         double chisq = std::abs(res.score) / varSNP;
         res.p = StatLib::pchisqd1(chisq * chisq);
 
@@ -3663,6 +5044,12 @@ void FastFAM::processFAMreg(){
         if( chisq < spaCutOff){
             res.p_adj = res.p;
         }else{
+            VectorXd GW1 = VectorXd::Zero(num_indi);
+            VectorXd GW2 = VectorXd::Zero(num_indi);
+            for(int j = 0; j < num; j++){
+                GW1 += weight[j] * w.adj.col(cols[j]);
+                GW2 += weight[j] * w.raw.col(cols[j]);
+            }
             vector<uint32_t> index0;
             index0.reserve(num_indi);
             double thresh = 1e-6;
@@ -3682,51 +5069,35 @@ void FastFAM::processFAMreg(){
         int rConverge = (int)res.bConverge;
         double temp_beta = res.score / (varSNP *varSNP);
         double se = std::abs(temp_beta) / sqrt(StatLib::qchisqd1(res.p_adj));
+        ss << "\t" << res.score << "\t" << varSNP << "\t" << res.p << "\t"
+            << temp_beta << "\t" << se << "\t" << res.p_adj << "\t" << rConverge;
+    }
 
-        osOut << genename << "\t" << gAF.size() << "\t" << gAF.mean() << "\t"
-            << res.score << "\t" << varSNP << "\t" << res.p << "\t"
-            << temp_beta << "\t" << se << "\t" << res.p_adj << "\t" << rConverge << std::endl;
-
-        int curNGene = i + 1;
-        if(curNGene % 2000 == 0) {
-            float elapse_time = LOGGER.tp("LOOP_SET_TOT");
-            float finished_percent = (float) curNGene / numGeneBlock;
-            float remain_time = (1.0 / finished_percent - 1) * elapse_time / 60;
-
-            std::ostringstream ss;
-            ss << std::fixed << std::setprecision(1) << "proceeded " << curNGene << " genes. Estimated time remaining " << remain_time << " min"; 
-
-            LOGGER.i(1, ss.str());
+    if(bSetSKAT){
+        // Q = sum (w_j * score_j)^2, a mixture of chi2_1 by the eigenvalues of the covariance of w * score
+        double Q = weight.cwiseProduct(score).squaredNorm();
+        MatrixXd Kw = c_inf * weight.asDiagonal() * cov * weight.asDiagonal();
+        Eigen::SelfAdjointEigenSolver<MatrixXd> eigen(Kw, Eigen::EigenvaluesOnly);
+        const VectorXd &values = eigen.eigenvalues();
+        double thresh = values.cwiseMax(0).mean() * 1e-5;
+        vector<double> lambda;
+        for(int j = 0; j < values.size(); j++){
+            if(values[j] > thresh) lambda.push_back(values[j]);
         }
-
+        double pSKAT = StatLib::pchisqMixture(Map<VectorXd>(lambda.data(), lambda.size()), Q);
+        ss << "\t" << Q << "\t" << pSKAT;
     }
-    osOut.close();
-    //osSets.close();
-
-    std::ostringstream ss;
-    ss << std::fixed << std::setprecision(1) << "All " << numGeneBlock << " genes finished in " << LOGGER.tp("LOOP_SET_TOT") << " sec";
-    LOGGER.i(0, ss.str());
-}
 
-void FastFAM::getX(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
-    int num_marker = markerIndex.size();
-    vector<uint8_t> isValids(num_marker);
-    for(int i = 0; i < num_marker; i++){
-        int index_cur_marker = num_gene_index + i;
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-        geno->getGenoDouble(genobuf, i, &item);
-        
-        bValids[index_cur_marker] = item.valid;
-        if(item.valid){
-            Map< VectorXd > xvec(item.geno.data(), num_indi);
-            gX.col(index_cur_marker) = xvec;
-            gAF[index_cur_marker] = item.af;
-            gN[index_cur_marker] = item.nValidN;
+    if(bSetACAT){
+        // ACAT-V weights: w_j^2 * maf_j * (1 - maf_j)
+        VectorXd pvals(num), weight_acat(num);
+        for(int j = 0; j < num; j++){
+            pvals[j] = w.pVar[cols[j]];
+            weight_acat[j] = weight[j] * weight[j] * maf[j] * (1.0 - maf[j]);
         }
+        ss << "\t" << StatLib::pCauchy(pvals, weight_acat);
     }
-    num_gene_index += num_marker;
+    return ss.str();
 }
 
 bool FastFAM::covarGLM(const VectorXd& phenoVec, const MatrixXd& covar, Ref<VectorXd> est_beta, int maxIter, double thresh){
@@ -3771,21 +5142,39 @@ bool checkNAN(const MatrixXd &mat){
 }
 
 
-double FastFAM::binLogL(double cur_tao, const SpMat& fam, const SpMat& W, const Ref<VectorXd> Y, const Ref<MatrixXd> X){
-    SpMat V = W + cur_tao * fam;
-    Eigen::SimplicialLDLT<SpMat> solverV;
-    solverV.compute(V);
-    if(solverV.info() != Eigen::Success){
-        LOGGER.e(0, "the V matrix is not invertible.");
-    }
+double FastFAM::binLogL(double cur_tao, const SpMat& fam, const SpMat& W, const Ref<VectorXd> Y, const Ref<MatrixXd> X, BinLogLContext &context){
+    MatrixXd ViX;
+    VectorXd ViY;
+    double logdet_V;
+    if(bFamBlocks && famBlocks.size() == W.rows()){
+        // on the connected components, the logdet is summed from the blocks;
+        //  V not positive definite gives NaN as the log of a negative D in LDLT does
+        if(!context.blockSolver.compute(famBlocks, cur_tao, VectorXd(W.diagonal()))){
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        ViX = context.blockSolver.solve(X);
+        ViY = context.blockSolver.solve(Y);
+        logdet_V = context.blockSolver.logdet();
+    }else{
+        Eigen::SimplicialLDLT<SpMat> &solverV = context.solver;
+        SpMat V = W + cur_tao * fam;
+        if(!context.analysed){
+            solverV.analyzePattern(V);
+            context.analysed = true;
+        }
+        solverV.factorize(V);
+        if(solverV.info() != Eigen::Success){
+            LOGGER.e(0, "the V matrix is not invertible.");
+        }
 
-    MatrixXd ViX = solverV.solve(X); // n*c
-    if(solverV.info() != Eigen::Success){
-        LOGGER.e(0, "the ViX matrix is not invertible.");
-    }
+        ViX = solverV.solve(X); // n*c
+        if(solverV.info() != Eigen::Success){
+            LOGGER.e(0, "the ViX matrix is not invertible.");
+        }
+        ViY = solverV.solve(Y);
 
-    VectorXd d = solverV.vectorD();
-    double logdet_V = d.array().log().sum(); 
+        logdet_V = solverV.vectorD().array().log().sum(); 
+    }
 
     auto XtVX_solver = (X.transpose() * ViX).colPivHouseholderQr();
     if(!XtVX_solver.isInvertible()){
@@ -3794,7 +5183,7 @@ double FastFAM::binLogL(double cur_tao, const SpMat& fam, const SpMat& W, const
     double logdet_XtVX = XtVX_solver.logAbsDeterminant();
 
     MatrixXd inv_XtVX_ViX = XtVX_solver.solve(ViX.transpose()); // c*n
-    VectorXd PY = solverV.solve(Y) - ViX * (inv_XtVX_ViX * Y);
+    VectorXd PY = ViY - ViX * (inv_XtVX_ViX * Y);
 
     return(-0.5 * (logdet_V + logdet_XtVX + Y.dot(PY)));
 
@@ -3822,12 +5211,16 @@ bool FastFAM::binGridREML(const SpMat& fam, Ref<VectorXd> est_a, int maxIter, do
     
     double cur_tao = options_d["tao_start"] * varVector(Y); 
 
+    // the pattern of V = W + tao * fam is fixed, solverV is analysed once and refactorised for each tao
+    vector<BinLogLContext> contexts(omp_get_max_threads());
+
     {
         // test the tao val
     
         W.diagonal() = var_mu_i;
         SpMat V = W + cur_tao * fam;
-        solverV.compute(V);
+        solverV.analyzePattern(V);
+        solverV.factorize(V);
 
         if(solverV.info() != Eigen::Success){
             LOGGER.e(0, "can't invert the V matrix!");
@@ -3956,17 +5349,31 @@ bool FastFAM::binGridREML(const SpMat& fam, Ref<VectorXd> est_a, int maxIter, do
         double start = startTao;
         double end = endTao;
 
+        // a finer grid spans the two points bracketing the maximum of the coarser one, their logLs are carried
+        bool bCarry = false;
+        double start_logL = 0;
        for(int iter = 0; iter < trails.size(); iter++){
             int n_trails = trails[iter];
             double step = (end - start) / (n_trails - 1);
             vector<double> varcomps(n_trails);
             vector<double> logLs(n_trails);
-
-            #pragma omp parallel for
+            vector<int> evals;
             for(int i = 0; i < n_trails; i++){
-                double temp_tao = start + i * step;
-                varcomps[i] = temp_tao;
-                logLs[i] = binLogL(temp_tao, fam, W, Y, covar);
+                varcomps[i] = start + i * step;
+            }
+            varcomps[n_trails - 1] = end;
+            if(bCarry){
+                logLs[0] = start_logL;
+                logLs[n_trails - 1] = end_logL;
+                for(int i = 1; i < n_trails - 1; i++) evals.push_back(i);
+            }else{
+                for(int i = 0; i < n_trails; i++) evals.push_back(i);
+            }
+
+            #pragma omp parallel for schedule(dynamic)
+            for(int k = 0; k < evals.size(); k++){
+                int i = evals[k];
+                logLs[i] = binLogL(varcomps[i], fam, W, Y, covar, contexts[omp_get_thread_num()]);
             }
 
             double max_logL = -1e300;
@@ -3981,19 +5388,13 @@ bool FastFAM::binGridREML(const SpMat& fam, Ref<VectorXd> est_a, int maxIter, do
                     max_index = i;
                 }
             }
-            if(max_index == 0){
-                start = varcomps[max_index];
-                end = varcomps[max_index + 1];
-                end_logL = logLs[max_index + 1];
-            }else if(max_index == n_trails - 1){
-                start = varcomps[max_index - 1];
-                end = varcomps[max_index];
-                end_logL = logLs[max_index];
-            }else{
-                start = varcomps[max_index - 1];
-                end = varcomps[max_index + 1];
-                end_logL = logLs[max_index + 1];
-            }
+            int start_index = std::max(max_index - 1, 0);
+            int end_index = std::min(max_index + 1, n_trails - 1);
+            start = varcomps[start_index];
+            end = varcomps[end_index];
+            start_logL = logLs[start_index];
+            end_logL = logLs[end_index];
+            bCarry = true;
 
             if(b_reml){
                 for(int i = 0; i < logLs.size(); i++){
@@ -4035,7 +5436,7 @@ bool FastFAM::binGridREML(const SpMat& fam, Ref<VectorXd> est_a, int maxIter, do
             numAbTol = 0;
         }
         SpMat V = W + cur_tao * fam;
-        solverV.compute(V);
+        solverV.factorize(V);
 
         if(solverV.info() != Eigen::Success){
             LOGGER.e(0, "can't invert the V matrix.");
@@ -4100,7 +5501,7 @@ bool FastFAM::binGridREML(const SpMat& fam, Ref<VectorXd> est_a, int maxIter, do
     // for 
     W.diagonal() = var_mu_i;
     SpMat V = W + cur_tao * fam;
-    solverV.compute(V);
+    solverV.factorize(V);
 
     taoVal = cur_tao;
 
@@ -4127,9 +5528,19 @@ bool FastFAM::binGridREML(const SpMat& fam, Ref<VectorXd> est_a, int maxIter, do
 
 void FastFAM::initVar(){
     numi_indi = num_indi;
-    phenoVecMu = phenoVec - mu;
+    // the mapped model files have them saved
+    if(!bModelLoaded){
+        phenoVecMu = phenoVec - mu;
+        dWp = mu.array() * (-mu.array() + 1);
+    }
     SPA::setMu(mu);
-    dWp = mu.array() * (-mu.array() + 1);
+
+    MatrixXd Y(num_indi, 2);
+    Y << phenoVecMu, phenoVec;
+    initSparseSums(Y, spaSums);
+    spaSums.sumD = dWp.sum();
+    spaSums.CtD = covar.transpose() * dWp;
+    spaSums.CtDC = covar.transpose() * dWp.asDiagonal() * covar;
 
     if(spaCutOff < 0.1){
         spaCutOff = 0.1;
@@ -4167,29 +5578,45 @@ void FastFAM::initBinary(const SpMat &fam){
         inv_id.close();
         LOGGER << "Sample information have been saved to [" << id_file << "]." << std::endl;
 
-        char magic[5];
-        magic[0] = 'f';
-        magic[1] = 'G';
-        magic[2] = 'L';
-        magic[3] = 'M';
-        magic[4] = '\0';
- 
+        BinMDLHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "GCTABMDL", 8);
+        header.version = 1;
+        header.num_indi = num_indi;
+        header.num_covar = covar.cols();
+        header.precise_covar = bPreciseCovar;
+        header.id_hash = GRMContainer::hashIDs(ids);
+        header.tao = taoVal;
+        header.c_inf = c_inf;
+        const double *sections[6] = {mu.data(), phenoVec.data(), phenoVecMu.data(), dWp.data(), covar.data(), H.data()};
+        uint64_t section_size[6] = {num_indi, num_indi, num_indi, num_indi, (uint64_t)covar.size(), (uint64_t)H.size()};
+        uint64_t pos = sizeof(header);
+        for(int k = 0; k < 6; k++){
+            pos = (pos + 63) / 64 * 64;
+            header.section[k] = pos;
+            pos += section_size[k] * sizeof(double);
+        }
+        header.file_bytes = pos;
+
         string bin_file = options["out"] + ".mdl.bin2";
         FILE * pFile = fopen(bin_file.c_str(), "wb");
-        // TODO check the output
-        fwrite(magic, 5, sizeof(char), pFile);
-        fwrite(&num_indi, 1, sizeof(uint32_t), pFile);
-        uint32_t col_covar = covar.cols();
-        fwrite(&col_covar, 1, sizeof(uint32_t), pFile);
-        fwrite(&bPreciseCovar, 1, sizeof(bool), pFile);
-
-        fwrite(&taoVal, 1, sizeof(double), pFile);
-        fwrite(&c_inf, 1, sizeof(double), pFile);
-        fwrite(mu.data(), mu.size(), sizeof(double), pFile);
-        fwrite(phenoVec.data(), phenoVec.size(), sizeof(double), pFile);
-        fwrite(covar.data(), covar.rows() * covar.cols(), sizeof(double), pFile);
-        fwrite(H.data(), H.rows() * H.cols(), sizeof(double), pFile);
-        fclose(pFile);
+        if(!pFile){
+            LOGGER.e(0, "can't open " + bin_file + " to write.");
+        }
+        if(fwrite(&header, sizeof(header), 1, pFile) != 1){
+            LOGGER.e(0, "can't write headers to " + bin_file + ".");
+        }
+        vector<char> zeros(64, 0);
+        for(int k = 0; k < 6; k++){
+            uint64_t pad = header.section[k] - ftell(pFile);
+            if(fwrite(zeros.data(), 1, pad, pFile) != pad ||
+                    fwrite(sections[k], sizeof(double), section_size[k], pFile) != section_size[k]){
+                LOGGER.e(0, "can't write the model to " + bin_file + ".");
+            }
+        }
+        if(fclose(pFile) != 0){
+            LOGGER.e(0, "can't write the model to " + bin_file + ".");
+        }
         LOGGER << "Data for model have been saved to [" << bin_file << "]." << std::endl;
     }
     ViX.resize(0,0);
@@ -4346,64 +5773,197 @@ void FastFAM::estBinGamma(){
     bValids.resize(0);
 }
 
+// The score test of a marker decoded as carriers, returns the SE of the score; input is set if SPA is needed.
+//  x = base + delta at the carriers, the covariates are adjusted by Hx over the carriers;
+//  the adjusted genotypes of all the samples are made only for the range of q in SPA.
+double FastFAM::spaSparse(const GenoBufItem &item, SPARes &res, SPAInput &input){
+    const SparseSums &sums = spaSums;
+    const vector<uint32_t> &carriers = item.carriers;
+    const vector<double> &delta = item.carrier_delta;
+    double base = item.sparse_base;
+
+    double xDx = base * base * sums.sumD;
+    double x_mu = base * sums.sumY[0];
+    double x_y = base * sums.sumY[1];
+    VectorXd Hx = base * sums.H1;
+    VectorXd CtDx = base * sums.CtD;
+    for(size_t k = 0; k < carriers.size(); k++){
+        uint32_t i = carriers[k];
+        double d = delta[k];
+        xDx += dWp[i] * d * (2.0 * base + d);
+        x_mu += d * phenoVecMu[i];
+        x_y += d * phenoVec[i];
+        Hx += d * H.col(i);
+        CtDx += (d * dWp[i]) * covar.row(i).transpose();
+    }
+    // the same of x - C * Hx
+    double adjDx = xDx - 2.0 * Hx.dot(CtDx) + Hx.dot(sums.CtDC * Hx);
+    double adj_mu = x_mu - Hx.dot(sums.CtY.col(0));
+
+    double varSNP = std::sqrt((bPreciseCovar ? adjDx : xDx) * c_inf);
+    res.score = bPreciseCovar ? adj_mu : x_mu;
+    double chisq = std::abs(res.score) / varSNP;
+    res.p = StatLib::pchisqd1(chisq * chisq);
+
+    res.bConverge = true;
+    if(chisq < spaCutOff){
+        res.p_adj = res.p;
+    }else{
+        input.need = true;
+        input.q = x_y - Hx.dot(sums.CtY.col(1));
+        input.qinv = input.q - res.score - res.score;
+        input.mu1muGSum = adjDx;
+
+        // index0 as the dense path: the samples carrying the coded allele, i.e. above the
+        //   centered genotype 0, which are all but the carriers if the coded allele is the major one
+        double thresh = -item.mean + 1e-6;
+        vector<uint32_t> &index0 = input.index;
+        VectorXd xvec = (-covar * Hx).array() + base;
+        size_t k = 0;
+        for(uint32_t i = 0; i < num_indi; i++){
+            double geno = base;
+            if(k < carriers.size() && carriers[k] == i){
+                geno += delta[k];
+                xvec[i] += delta[k];
+                k++;
+            }
+            if(geno > thresh) index0.push_back(i);
+        }
+        if((double)index0.size() / num_indi < 0.5){
+            input.gIndex.resize(index0.size());
+            for(size_t j = 0; j < index0.size(); j++){
+                input.gIndex[j] = xvec[index0[j]];
+            }
+        }else{
+            index0.resize(num_indi);
+            std::iota(index0.begin(), index0.end(), 0);
+            input.gIndex = xvec;
+        }
+        input.gPos = 0;
+        input.gNeg = 0;
+        for(uint32_t i = 0; i < num_indi; i++){
+            if(xvec[i] > 0){
+                input.gPos += xvec[i];
+            }else{
+                input.gNeg += xvec[i];
+            }
+        }
+    }
+    return varSNP;
+}
+
+// The markers reaching SPA are solved together by SPABatch, in chunks of markers
+//   to hold the genotypes of the common ones.
 void FastFAM::calculate_spa(uintptr_t *genobuf, const vector<uint32_t> &markerIndex){
     int num_marker = markerIndex.size();
     vector<uint8_t> isValids(num_marker);
-    #pragma omp parallel for schedule(dynamic)
-    for(int i = 0; i < num_marker; i++){
-        uint32_t cur_marker = markerIndex[i];
-        GenoBufItem item;
-        item.extractedMarkerIndex = cur_marker;
-        geno->getGenoDouble(genobuf, i, &item);
-        
-        isValids[i] = item.valid;
-        if(!item.valid){
-            continue;
-        }
+    vector<SPARes> results(num_marker);
+    vector<double> varSNPs(num_marker);
+    int chunk = (int)std::max((uint64_t)16, std::min((uint64_t)256, (uint64_t)(8 << 20) / std::max(num_indi, (uint32_t)1)));
+    SPABatch batch(mu);
+
+    for(int from = 0; from < num_marker; from += chunk){
+        int num = std::min(chunk, num_marker - from);
+        vector<SPAInput> inputs(num);
+        #pragma omp parallel for schedule(dynamic)
+        for(int k = 0; k < num; k++){
+            int i = from + k;
+            GenoBufItem item;
+            item.extractedMarkerIndex = markerIndex[i];
+            item.sparseMAF = sparseMAF;
+            geno->getGenoDouble(genobuf, i, &item);
+
+            isValids[i] = item.valid;
+            if(!item.valid){
+                continue;
+            }
+            af[i] = (float)item.af;
+            countMarkers[i] = item.nValidN;
+            info[i] = item.info;
+
+            SPARes &res = results[i];
+            if(item.bSparse){
+                varSNPs[i] = spaSparse(item, res, inputs[k]);
+                continue;
+            }
 
-        Map< VectorXd > xvec(item.geno.data(), num_indi);
-        VectorXd xvec2 = xvec;
+            Map< VectorXd > xvec(item.geno.data(), num_indi);
+            VectorXd xvec2 = xvec;
 
-        if(bPreciseCovar) conditionCovarBinReg(xvec);
+            if(bPreciseCovar) conditionCovarBinReg(xvec);
 
-        double varSNP = std::sqrt(xvec.dot(dWp.cwiseProduct(xvec)) * c_inf);
+            double varSNP = std::sqrt(xvec.dot(dWp.cwiseProduct(xvec)) * c_inf);
+            varSNPs[i] = varSNP;
  
-        SPARes res;
-        res.score = xvec.dot(phenoVecMu);
-        double chisq = std::abs(res.score) / varSNP;
+            res.score = xvec.dot(phenoVecMu);
+            double chisq = std::abs(res.score) / varSNP;
 
-        res.p = StatLib::pchisqd1(chisq * chisq);
+            res.p = StatLib::pchisqd1(chisq * chisq);
 
-        res.bConverge = true;
-        if( chisq < spaCutOff){
-            res.p_adj = res.p;
-        }else{
-            vector<uint32_t> index0;
-            index0.reserve(num_indi);
-            double thresh = -item.mean + 1e-6;
-            //double thresh = 1e-6;
-            for(uint32_t i = 0; i < num_indi; i++){
-                if(xvec2[i] > thresh){
-                    index0.push_back(i);
+            res.bConverge = true;
+            if( chisq < spaCutOff){
+                res.p_adj = res.p;
+            }else{
+                SPAInput &input = inputs[k];
+                input.need = true;
+                vector<uint32_t> &index0 = input.index;
+                index0.reserve(num_indi);
+                double thresh = -item.mean + 1e-6;
+                //double thresh = 1e-6;
+                for(uint32_t j = 0; j < num_indi; j++){
+                    if(xvec2[j] > thresh){
+                        index0.push_back(j);
+                    }
                 }
-            }
 
-            if(!bPreciseCovar) conditionCovarBinReg(xvec);
+                if(!bPreciseCovar) conditionCovarBinReg(xvec);
+
+                input.q = xvec.dot(phenoVec);
+                input.qinv = input.q - res.score - res.score;
+                input.mu1muGSum = dWp.dot(xvec.cwiseAbs2());
+                input.gPos = 0;
+                input.gNeg = 0;
+                for(uint32_t j = 0; j < num_indi; j++){
+                    double tgeno = xvec[j];
+                    if(tgeno > 0){
+                        input.gPos += tgeno;
+                    }else{
+                        input.gNeg += tgeno;
+                    }
+                }
+                // the samples out of index0 by the normal approximation if they are the majority
+                if((double)index0.size() / num_indi < 0.5){
+                    input.gIndex.resize(index0.size());
+                    for(size_t j = 0; j < index0.size(); j++){
+                        input.gIndex[j] = xvec[index0[j]];
+                    }
+                }else{
+                    index0.resize(num_indi);
+                    std::iota(index0.begin(), index0.end(), 0);
+                    input.gIndex = xvec;
+                }
+            }
+        }
 
-            double q = xvec.dot(phenoVec);
-            double qinv = q - res.score - res.score;
-            SPA spa(q, qinv, xvec, index0);
-            spa.saddleProb(&res);
+        for(int k = 0; k < num; k++){
+            if(inputs[k].need){
+                batch.add(inputs[k], &results[from + k]);
+                inputs[k].gIndex.resize(0);
+                vector<uint32_t>().swap(inputs[k].index);
+            }
         }
+        batch.solve();
+    }
 
+    for(int i = 0; i < num_marker; i++){
+        if(!isValids[i]) continue;
+        const SPARes &res = results[i];
+        double varSNP = varSNPs[i];
         Tscore[i] = (float)res.score; //* geno->RDev[cur_raw_marker]; 
         Tse[i] = (float)varSNP;
         p[i] = res.p; 
         padj[i] = res.p_adj;
         rConverge[i] = res.bConverge;
-        af[i] = (float)item.af;
-        countMarkers[i] = item.nValidN;
-        info[i] = item.info;
         double temp_beta = res.score / (varSNP *varSNP);
         beta[i] = (float) temp_beta;
         se[i] = std::abs(temp_beta) / sqrt(StatLib::qchisqd1(res.p_adj));
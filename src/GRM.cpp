@@ -25,9 +25,14 @@
 #include <sstream>
 #include <cstring>
 #include <numeric>
+#include <memory>
 #include <unordered_set>
+#include <set>
 #include "utils.hpp"
 #include "AsyncBuffer.hpp"
+#include "GRMMap.hpp"
+#include "RelGraph.hpp"
+#include "SparseGRM.hpp"
 #include "utils.hpp"
 #include <omp.h>
 #include "OptionIO.h"
@@ -35,6 +40,15 @@
 #include <boost/algorithm/string/join.hpp>
 #include <sstream>
 #include <csignal>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#include <intrin.h>
+#endif
 
 using std::to_string;
 
@@ -43,6 +57,28 @@ map<string, double> GRM::options_d;
 map<string, bool> GRM::options_b;
 vector<string> GRM::processFunctions;
 
+// positional writes, can be called from many threads on the same file;
+//  false on error, the caller reports it out of the parallel region
+static bool pwriteAll(int fd, const void *buf, uint64_t bytes, uint64_t offset){
+    const char *cur = (const char *)buf;
+    while(bytes){
+#ifndef _WIN32
+        ssize_t num_write = pwrite(fd, cur, bytes, offset);
+#else
+        int64_t num_write;
+        #pragma omp critical (grm_positional_io)
+        {
+            _lseeki64(fd, offset, SEEK_SET);
+            num_write = _write(fd, cur, (unsigned int)std::min(bytes, (uint64_t)(1U << 30)));
+        }
+#endif
+        if(num_write <= 0) return false;
+        cur += num_write;
+        offset += num_write;
+        bytes -= num_write;
+    }
+    return true;
+}
 
 GRM::GRM(){
     bool has_single_grm = false;
@@ -55,14 +91,20 @@ GRM::GRM(){
         num_subjects = grm_ids.size();
 
         uint64_t num_grm = num_subjects * (num_subjects + 1) / 2;
-        FILE *file = fopen((grm_file + ".grm.bin").c_str(), "rb");
-        if(!file){
+        if(!GRMRowReader::exists(grm_file)){
             LOGGER.e(0, "can't open " + grm_file + ".grm.bin");
         }
-        if(num_grm * 4 != getFileByteSize(file)){
-            LOGGER.e(0, "The IDs in GRM and the IDs in the GRM binary file do not match [" + grm_file + "]");
+        FILE *file = fopen((grm_file + ".grm.bin").c_str(), "rb");
+        if(file){
+            if(num_grm * 4 != getFileByteSize(file)){
+                LOGGER.e(0, "The IDs in GRM and the IDs in the GRM binary file do not match [" + grm_file + "]");
+            }
+            fclose(file);
+        }else{
+            // checks the header and the IDs of the GRM v2 container
+            GRMRowReader check;
+            check.open(grm_file, num_subjects);
         }
-        fclose(file);
 
         uint64_t num_grm_byte = num_grm * 4;
         uint64_t num_parts = (num_grm_byte + num_byte_GRM_read - 1) / num_byte_GRM_read;
@@ -111,7 +153,7 @@ void GRM::subtract_grm(string mgrm_file, string out_file){
     while(getline(mgrm, line)){
         boost::trim(line);
         if(!line.empty()){
-            if(checkFileReadable(line+".grm.id") && checkFileReadable(line+".grm.bin") && checkFileReadable(line + ".grm.N.bin")){
+            if(checkFileReadable(line+".grm.id") && GRMRowReader::exists(line) && GRMRowReader::exists(line, true)){
                 files.push_back(line);
             }else{
                 err_files.push_back(line);
@@ -120,7 +162,7 @@ void GRM::subtract_grm(string mgrm_file, string out_file){
     }
 
     if(err_files.size() != 0){
-        string out_err = "can't read GRM (*.grm.id, *.grm.bin) in ";
+        string out_err = "can't read GRM (*.grm.id, *.grm.bin and *.grm.N.bin, or *.grm.v2) in ";
         out_err += boost::algorithm::join(err_files, ", ");
         out_err += ".";
         LOGGER.e(0, out_err);
@@ -143,65 +185,61 @@ void GRM::subtract_grm(string mgrm_file, string out_file){
     std::copy(common_id.begin(), common_id.end(), std::ostream_iterator<string>(o_id, "\n"));
     o_id.close();
 
-    uint64_t grm_size = (1 + common_id.size()) * common_id.size() / 2;
-    uint64_t grm_file_size = grm_size * 4; 
+    uint64_t num_sample = common_id.size();
 
-    FILE * h_grm1 = fopen((files[0] + ".grm.bin").c_str(), "rb");
-    FILE * h_grmN1 = fopen((files[0] + ".grm.N.bin").c_str(), "rb");
-    FILE * h_grm2 = fopen((files[1] + ".grm.bin").c_str(), "rb");
-    FILE * h_grmN2 = fopen((files[1] + ".grm.N.bin").c_str(), "rb");
-    if(grm_file_size != getFileSize(h_grm1)){
-        LOGGER.e(0, "The size of [" + files[0] + ".grm.bin] is not correct.");
-    }
-    if(grm_file_size != getFileSize(h_grmN1)){
-        LOGGER.e(0, "The size of [" + files[0] + ".grm.N.bin] is not correct.");
-    }
-    if(grm_file_size != getFileSize(h_grm2)){
-        LOGGER.e(0, "The size of [" + files[1] + ".grm.bin] is not correct.");
-    }
-    if(grm_file_size != getFileSize(h_grmN2)){
-        LOGGER.e(0, "The size of [" + files[1] + ".grm.N.bin] is not correct.");
-    }
+    // streamed by row blocks from either format, the memory is bounded by the block size
+    GRMRowReader readers[4];
+    readers[0].open(files[0], num_sample);
+    readers[1].open(files[1], num_sample);
+    readers[2].open(files[0], num_sample, true);
+    readers[3].open(files[1], num_sample, true);
 
-    uint64_t itemRead = 26214400;
-    float *buf1 = new float[itemRead];
-    float *buf2 = new float[itemRead];
-    float *buf = new float[itemRead];
-    float *bufN1 = new float[itemRead];
-    float *bufN2 = new float[itemRead];
-    float *bufN = new float[itemRead];
-    
-    int loop_num = (grm_size + itemRead - 1) / itemRead;
-    uint64_t remain_item = grm_size % itemRead;
     LOGGER.i(0, "Subtracting GRMs...");
     FILE *ho_grm = fopen((out_file + ".grm.bin").c_str(), "wb");
     FILE *ho_grmN = fopen((out_file + ".grm.N.bin").c_str(), "wb");
-
-    for(int i = 0; i < loop_num; i++){
-        if(i == loop_num - 1 && remain_item != 0) itemRead = remain_item;
-        readBytes(h_grm1, itemRead, buf1);
-        readBytes(h_grm2, itemRead, buf2);
-        readBytes(h_grmN1, itemRead, bufN1);
-        readBytes(h_grmN2, itemRead, bufN2);
-        for(int j = 0; j < itemRead; j++){
-            bufN[j] = bufN1[j] - bufN2[j];
-            buf[j] = (float)(((double)buf1[j] * bufN1[j] - (double)buf2[j] * bufN2[j]) / bufN[j]);
-        }
-        if(fwrite(buf, sizeof(float), itemRead, ho_grm) != itemRead){
-            LOGGER.e(0, "can't write to [" + out_file + ".grm.bin].");
+    if((!ho_grm) || (!ho_grmN)){
+        LOGGER.e(0, "can't write to [" + out_file + ".grm.bin, .grm.N.bin].");
+    }
+
+    const uint64_t block_items = 16 * 1024 * 1024;
+    vector<float> bufs[4];
+    vector<float> buf, bufN;
+    bool write_ok = true;
+    uint64_t cur = 0;
+    while(cur < num_sample && write_ok){
+        uint64_t end = cur + 1;
+        while(end < num_sample && ((end + 1) * (end + 2) / 2 - cur * (cur + 1) / 2) <= block_items) end++;
+        uint64_t num_item = end * (end + 1) / 2 - cur * (cur + 1) / 2;
+        bool read_ok[4];
+        #pragma omp parallel for num_threads(4)
+        for(int k = 0; k < 4; k++){
+            bufs[k].resize(num_item);
+            read_ok[k] = readers[k].readRows(cur, end, bufs[k].data());
+        }
+        for(int k = 0; k < 4; k++){
+            if(!read_ok[k]){
+                LOGGER.e(0, "the size of [" + readers[k].name() + "] does not match the number of IDs in the GRM.");
+            }
         }
-        if(fwrite(bufN, sizeof(float), itemRead, ho_grmN) != itemRead){
-            LOGGER.e(0, "can't write to [" + out_file + ".grm.N.bin].");
+        buf.resize(num_item);
+        bufN.resize(num_item);
+        const float *buf1 = bufs[0].data(), *buf2 = bufs[1].data(), *bufN1 = bufs[2].data(), *bufN2 = bufs[3].data();
+        float *po_buf = buf.data(), *po_bufN = bufN.data();
+        #pragma omp parallel for simd
+        for(uint64_t j = 0; j < num_item; j++){
+            po_bufN[j] = bufN1[j] - bufN2[j];
+            po_buf[j] = (float)(((double)buf1[j] * bufN1[j] - (double)buf2[j] * bufN2[j]) / po_bufN[j]);
         }
+        write_ok = fwrite(po_buf, sizeof(float), num_item, ho_grm) == num_item
+            && fwrite(po_bufN, sizeof(float), num_item, ho_grmN) == num_item;
+        cur = end;
+    }
+    write_ok = (fclose(ho_grm) == 0) && write_ok;
+    write_ok = (fclose(ho_grmN) == 0) && write_ok;
+    if(!write_ok){
+        LOGGER.e(0, "can't write to [" + out_file + ".grm.bin, .grm.N.bin].");
     }
     LOGGER.i(0, "The subtracted GRM has been written to [" + out_file + ".grm.bin, .grm.N.bin].");
-
-    delete[] buf1;
-    delete[] buf2;
-    delete[] bufN1;
-    delete[] bufN2;
-    delete[] buf;
-    delete[] bufN;
 }
 
 
@@ -216,7 +254,7 @@ void GRM::unify_grm(string mgrm_file, string out_file){
     while(getline(mgrm, line)){
         boost::trim(line);
         if(!line.empty()){
-            if(checkFileReadable(line+".grm.id") && checkFileReadable(line+".grm.bin")){
+            if(checkFileReadable(line+".grm.id") && GRMRowReader::exists(line)){
                 files.push_back(line);
             }else{
                 err_files.push_back(line);
@@ -307,67 +345,60 @@ void GRM::unify_grm(string mgrm_file, string out_file){
     }
 
     LOGGER.i(0, "Writing unified GRM in binary format...");
-    #pragma omp parallel for
     for(int i = 0; i < grm_indices.size(); i++){
-        vector<uint32_t> &p_index = grm_indices[i];
+        const vector<uint32_t> &p_index = grm_indices[i];
         uint32_t size_grm = p_index.size();
-        uint32_t largest_grm_size = ids[i].size();
-        string file_name = files[i] + ".grm.bin";
-        string wfile_name = output_fileNames[i] + ".grm.bin";
-        FILE *h_grm = fopen(file_name.c_str(), "rb");
-        if(!h_grm){
-            LOGGER.e(0, "can't read " + file_name + ".");
-        }
+        uint64_t largest_grm_size = ids[i].size();
+        GRMMap grm_map(files[i], largest_grm_size);
 
-        FILE *h_wgrm = fopen(wfile_name.c_str(), "wb");
-        if(!h_wgrm){
+        string wfile_name = output_fileNames[i] + ".grm.bin";
+        FILE *h_wfile = fopen(wfile_name.c_str(), "wb");
+        if(!h_wfile){
             LOGGER.e(0, "can't write to " + wfile_name + ".");
         }
 
-        float *buf = new float[largest_grm_size];
-        float *wbuf = new float[size_grm];
-
-        vector<uint64_t> start_pos(largest_grm_size);
-        for(int j = 0; j < largest_grm_size; j++){
-            uint64_t byte_start_grm = (1 + j) * j / 2 * sizeof(float);
-            start_pos[j] = byte_start_grm;
-        }
-
-        for(int j = 0; j < size_grm; j++){
-            uint64_t grm_index = p_index[j];
-            uint64_t num_grm = grm_index + 1;
-            uint64_t byte_start_grm = start_pos[grm_index];
-            fseek(h_grm, byte_start_grm, SEEK_SET);
-            if(fread(buf, sizeof(float), num_grm, h_grm) != num_grm){
-                LOGGER.e(0, "error in reading [" + file_name + "], in position " + to_string(ftell(h_grm)), ".");
+        // tiles of output rows, ~4MB each, filled in parallel and written at their offsets
+        vector<uint32_t> tile_starts(1, 0);
+        const uint64_t tile_items = 1024 * 1024;
+        uint64_t cur_items = 0;
+        for(uint32_t j = 0; j < size_grm; j++){
+            cur_items += j + 1;
+            if(cur_items >= tile_items){
+                tile_starts.push_back(j + 1);
+                cur_items = 0;
             }
-            uint64_t size_write = j + 1;
-            for(int k = 0; k < size_write; k++){
-                uint32_t cur_index = p_index[k];
-                float grm_value;
-                if(cur_index < num_grm){
-                    grm_value = *(buf + cur_index);
-                }else{
-                    //fill the other parts
-                    auto bytes_offset = start_pos[cur_index] + grm_index * sizeof(float);
-                    fseek(h_grm, bytes_offset, SEEK_SET); 
-                    if(fread(&grm_value, sizeof(float), 1, h_grm) != 1){
-                        LOGGER.e(0, "error in reading [" + file_name + "], in position " + to_string(bytes_offset), ".");
+        }
+        if(tile_starts.back() != size_grm) tile_starts.push_back(size_grm);
+
+        bool write_ok = true;
+        #pragma omp parallel
+        {
+            vector<float> wbuf;
+            #pragma omp for schedule(dynamic)
+            for(int tile = 0; tile < (int)tile_starts.size() - 1; tile++){
+                bool cur_ok;
+                #pragma omp atomic read
+                cur_ok = write_ok;
+                if(!cur_ok) continue;
+                uint64_t row_from = tile_starts[tile], row_to = tile_starts[tile + 1];
+                uint64_t item_from = row_from * (row_from + 1) / 2;
+                wbuf.resize(row_to * (row_to + 1) / 2 - item_from);
+                float *po_wbuf = wbuf.data();
+                for(uint64_t j = row_from; j < row_to; j++){
+                    uint32_t grm_index = p_index[j];
+                    for(uint64_t l = 0; l <= j; l++){
+                        *(po_wbuf++) = grm_map.at(grm_index, p_index[l]);
                     }
                 }
-                *(wbuf + k) = grm_value;
-            }
-            //last element
-            //*(wbuf + j) = *(buf + grm_index);
-
-            if(size_write != fwrite(wbuf, sizeof(float), size_write, h_wgrm)){
-                LOGGER.e(0, "error in writing to [" + wfile_name + "], pos: " + std::to_string(ftell(h_wgrm)) + "."); 
+                if(!pwriteAll(fileno(h_wfile), wbuf.data(), wbuf.size() * sizeof(float), item_from * sizeof(float))){
+                    #pragma omp atomic write
+                    write_ok = false;
+                }
             }
         }
-        delete[] buf;
-        delete[] wbuf;
-        fclose(h_grm);
-        fclose(h_wgrm);
+        if(fclose(h_wfile) != 0 || !write_ok){
+            LOGGER.e(0, "error in writing to [" + wfile_name + "].");
+        }
         LOGGER.i(0, "GRM has been written to [" + wfile_name + "].");
     }
 
@@ -376,13 +407,17 @@ void GRM::unify_grm(string mgrm_file, string out_file){
 void GRM::prune_fam(float thresh, bool isSparse, float *value){
     LOGGER.i(0, "Pruning the GRM to a sparse matrix with a cutoff of " + to_string(thresh) + "...");
     LOGGER.i(0, "Total number of parts to be processed: " + to_string(index_grm_pairs.size()));
-    FILE *grmFile = fopen((grm_file + ".grm.bin").c_str(), "rb");
+    GRMRowReader grmFile;
+    grmFile.open(grm_file, num_subjects);
 
     std::ofstream o_id((options["out"] + ".grm.id").c_str());
     if(!o_id) LOGGER.e(0, "can't write to [" + options["out"] + ".grm.id]");
     std::ofstream o_fam;
     FILE* o_bk;
-    if(isSparse){
+    bool bSparseBin = isSparse && options_b["sparse_bin"];
+    if(bSparseBin){
+        // opened after the IDs are known
+    }else if(isSparse){
         o_fam.open((options["out"] + ".grm.sp").c_str());
         if(!o_fam) LOGGER.e(0, "can't write to [" + options["out"] + ".grm.sp]");
     }else{
@@ -398,6 +433,10 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
     LOGGER.i(2, "Saving " + to_string(keep_ID.size()) + " individual IDs");
     std::copy(keep_ID.begin(), keep_ID.end(), std::ostream_iterator<string>(o_id, "\n"));
     o_id.close();
+    std::unique_ptr<SparseGRMWriter> sp_out;
+    if(bSparseBin){
+        sp_out.reset(new SparseGRMWriter(options["out"], keep_ID.size(), GRMContainer::hashIDs(keep_ID)));
+    }
     keep_ID.clear();
     keep_ID.shrink_to_fit();
 
@@ -412,7 +451,7 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
     float *cur_grm_buf;
     int new_id1 = 0;
     for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(grm_buf, sizeof(float), byte_part_grms[part_index], grmFile) != byte_part_grms[part_index]){
+        if(!grmFile.readRows(index_grm_pairs[part_index].first, index_grm_pairs[part_index].second + 1, grm_buf)){
             LOGGER.e(0, "Failed to read GRM between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
                         + to_string(index_grm_pairs[part_index].second + 1));
         };
@@ -471,12 +510,21 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
     }
     delete [] grm_buf;
     delete [] out_grm_buf;
-    fclose(grmFile);
+    grmFile.close();
     if(!isSparse){
         fclose(o_bk);
     }
 
-    if(isSparse){
+    if(bSparseBin){
+        LOGGER.i(0, "Saving the sparse GRM (" + to_string(rm_grm.size()) + " pairs) to [" + SparseGRM::fileName(options["out"]) + "]");
+        for(uint64_t index = 0; index != rm_grm.size(); index++){
+            sp_out->add(rm_grm_ID1[index], rm_grm_ID2[index], rm_grm[index]);
+        }
+        uint64_t num_saved = sp_out->close();
+        LOGGER.i(0, to_string(num_saved) + " GRM elements have been saved in the file [" + SparseGRM::fileName(options["out"]) + "]");
+        LOGGER.i(0, "Success:", "finished generating a sparse GRM");
+        return;
+    }else if(isSparse){
         LOGGER.i(0, "Saving the sparse GRM (" + to_string(rm_grm.size()) + " pairs) to [" + options["out"] + ".grm.sp]");
         //    auto sorted_index = sort_indexes(rm_grm_ID2, rm_grm_ID1);
         //    for(auto index : sorted_index){
@@ -491,14 +539,15 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
         LOGGER.i(0, "GRM has been saved to [" + options["out"] + ".grm.bin]");
     }
 
-    FILE *NFile = fopen((grm_file + ".grm.N.bin").c_str(), "rb");
+    GRMRowReader NFile;
+    NFile.open(grm_file, num_subjects, true);
     FILE *ONFile = fopen((options["out"] + ".grm.N.bin").c_str(), "wb");
     float *N_buf = new float[num_byte_buffer];
     float *cur_N_pos0;
     float *out_N_buf = new float[num_byte_buffer];
     float *cur_N_buf;
     for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(N_buf, sizeof(float), byte_part_grms[part_index], NFile) != byte_part_grms[part_index]){
+        if(!NFile.readRows(index_grm_pairs[part_index].first, index_grm_pairs[part_index].second + 1, N_buf)){
             LOGGER.w(0, "Reading GRM N failed between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
                         + to_string(index_grm_pairs[part_index].second + 1));
             LOGGER.i(0, "Stop pruning the GRM N");
@@ -531,7 +580,7 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
     delete [] out_N_buf;
     delete [] N_buf;
     fclose(ONFile);
-    fclose(NFile);
+    NFile.close();
     LOGGER.i(0, "GRM N has been saved to [" + options["out"] + ".grm.N.bin]");
 }
 
@@ -540,7 +589,8 @@ void GRM::prune_fam(float thresh, bool isSparse, float *value){
 void GRM::cut_rel(float thresh, bool no_grm){
     LOGGER.i(0, "Pruning the GRM with a cutoff of " + to_string(thresh) + "...");
     LOGGER.i(0, "Total number of parts to be processed: " + to_string(index_grm_pairs.size()));
-    FILE *grmFile = fopen((grm_file + ".grm.bin").c_str(), "rb");
+    GRMRowReader grmFile;
+    grmFile.open(grm_file, num_subjects);
     // put this first to avoid unwritable disk
     std::ofstream o_keep;
     if(!no_grm){
@@ -562,82 +612,39 @@ void GRM::cut_rel(float thresh, bool no_grm){
     }
  
 
-    std::unordered_set<int> keeps_ori(index_keep.begin(), index_keep.end());
-
-    float *grm_buf = new float[num_byte_buffer];
-    float cur_grm, *cur_grm_pos0;
-    vector<float> rm_grm;
-    vector<int> rm_grm_ID1, rm_grm_ID2;
-    for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(grm_buf, sizeof(float), byte_part_grms[part_index], grmFile) != byte_part_grms[part_index]){
-            LOGGER.e(0, "Failed to read GRM between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
-                        + to_string(index_grm_pairs[part_index].second + 1));
-        };
-        if(part_index % 50 == 0){
-            LOGGER.i(2, "Processing part " + to_string(part_index + 1));
-        }
-        cur_grm_pos0 = grm_buf;
-        for(int id1 = index_grm_pairs[part_index].first; id1 != index_grm_pairs[part_index].second + 1; id1++){
-            if (keeps_ori.find(id1) == keeps_ori.end()) {
-                cur_grm_pos0 += id1 + 1;
-                continue;
-            }
-            for(int id2 : index_keep){
-                if(id2 >= id1) break;
-                cur_grm = *(cur_grm_pos0 + id2);
-                if(cur_grm > thresh){
-                    rm_grm_ID1.push_back(id1);
-                    rm_grm_ID2.push_back(id2);
-                    rm_grm.push_back(cur_grm);
-                }
-            }
-            cur_grm_pos0 += id1 + 1;
-        }
+    // the related pairs among the kept samples, in the order of the kept samples
+    vector<RelEdge> edges;
+    {
+        GRMMap grm_map(grm_file, num_subjects);
+        edges = RelGraph::scan(index_keep.size(), thresh, [this, &grm_map](uint32_t i, uint32_t j){
+                return grm_map.row(index_keep[i])[index_keep[j]];
+                });
     }
-    delete [] grm_buf;
+    LOGGER.i(2, to_string(edges.size()) + " pairs of individuals in " + to_string(RelGraph::numComponents(index_keep.size(), edges))
+            + " families are related above the cutoff.");
 
     if(detail_flag){
-        for(int index = 0; index != rm_grm.size(); index++){
-            out_fam << grm_ids[rm_grm_ID1[index]] << "\t" <<  grm_ids[rm_grm_ID2[index]] << "\t" << rm_grm[index] << std::endl;
+        for(auto &edge : edges){
+            out_fam << grm_ids[index_keep[edge.id1]] << "\t" <<  grm_ids[index_keep[edge.id2]] << "\t" << edge.value << std::endl;
         }
         out_fam.close();
         LOGGER.i(0, "Related family pairs have been saved to " + options["out"] + ".family.txt");
     }
 
-    int i_buf;
-    // copy from GCTA 1.26
-    vector<int> rm_uni_ID(rm_grm_ID1);
-    rm_uni_ID.insert(rm_uni_ID.end(), rm_grm_ID2.begin(), rm_grm_ID2.end());
-    stable_sort(rm_uni_ID.begin(), rm_uni_ID.end());
-    rm_uni_ID.erase(unique(rm_uni_ID.begin(), rm_uni_ID.end()), rm_uni_ID.end());
-    std::map<int, int> rm_uni_ID_count;
-    for (int i = 0; i < rm_uni_ID.size(); i++) {
-        i_buf = count(rm_grm_ID1.begin(), rm_grm_ID1.end(), rm_uni_ID[i]) + count(rm_grm_ID2.begin(), rm_grm_ID2.end(), rm_uni_ID[i]);
-        rm_uni_ID_count.insert(std::pair<int, int>(rm_uni_ID[i], i_buf));
-    }
-
-    // swapping
-    std::map<int, int>::iterator iter1, iter2;
-    for (int i = 0; i < rm_grm_ID1.size(); i++) {
-        iter1 = rm_uni_ID_count.find(rm_grm_ID1[i]);
-        iter2 = rm_uni_ID_count.find(rm_grm_ID2[i]);
-        if (iter1->second < iter2->second) {
-            i_buf = rm_grm_ID1[i];
-            rm_grm_ID1[i] = rm_grm_ID2[i];
-            rm_grm_ID2[i] = i_buf;
-        }
-    }
-
-    stable_sort(rm_grm_ID1.begin(), rm_grm_ID1.end());
-    rm_grm_ID1.erase(unique(rm_grm_ID1.begin(), rm_grm_ID1.end()), rm_grm_ID1.end());
+    bool mis = options_b["cutoff_mis"];
+    if(mis) LOGGER.i(2, "Keeping a maximal set of unrelated individuals in each family.");
+    vector<uint32_t> rm_index = RelGraph::prune(index_keep.size(), edges, mis);
     vector<string> removed_ID;
-    removed_ID.reserve(rm_grm_ID1.size());
-    for (auto &index : rm_grm_ID1) removed_ID.push_back(grm_ids[index]);
+    removed_ID.reserve(rm_index.size());
+    for (auto &index : rm_index) removed_ID.push_back(grm_ids[index_keep[index]]);
 
-    auto diff = [&rm_grm_ID1](int value) ->bool{
-        return std::binary_search(rm_grm_ID1.begin(), rm_grm_ID1.end(), value);
-    };
-    index_keep.erase(std::remove_if(index_keep.begin(), index_keep.end(), diff), index_keep.end());
+    vector<char> is_removed(index_keep.size(), 0);
+    for(auto &index : rm_index) is_removed[index] = 1;
+    uint32_t num_remain = 0;
+    for(uint32_t i = 0; i < index_keep.size(); i++){
+        if(!is_removed[i]) index_keep[num_remain++] = index_keep[i];
+    }
+    index_keep.resize(num_remain);
 
     vector<string> keep_ID;
     keep_ID.reserve(index_keep.size());
@@ -659,7 +666,6 @@ void GRM::cut_rel(float thresh, bool no_grm){
     }
 
     if(no_grm) {
-        fclose(grmFile);
         return;
     }
 
@@ -668,37 +674,36 @@ void GRM::cut_rel(float thresh, bool no_grm){
     if(!grm_out_file){
         LOGGER.e(0, "can't open [" + options["out"] + ".grm.bin] to write");
     }
-    fseek(grmFile, 0, SEEK_SET);
     outBinFile(grmFile, grm_out_file);
-    fclose(grmFile);
+    grmFile.close();
     fclose(grm_out_file);
     LOGGER.i(2, "GRM values have been saved to [" + options["out"] + ".grm.bin]");
 
     LOGGER.i(0, "Pruning number of SNPs to calculate GRM, total parts " + std::to_string(index_grm_pairs.size()));
-    FILE *NFile = fopen((grm_file + ".grm.N.bin").c_str(), "rb");
-    if(!NFile){
+    if(!GRMRowReader::exists(grm_file, true)){
         LOGGER.w(2, "There is no [" + grm_file + ".grm.N.bin]");
         return;
     }
     FILE *N_out_file = fopen((options["out"] + ".grm.N.bin").c_str(), "wb");
     if(!N_out_file){
         LOGGER.w(2, "can't open [" + options["out"] + ".grm.N.bin] to write. Ignore this step");
-        fclose(NFile);
         return;
     }
+    GRMRowReader NFile;
+    NFile.open(grm_file, num_subjects, true);
     outBinFile(NFile, N_out_file);
-    fclose(NFile);
+    NFile.close();
     fclose(N_out_file);
     LOGGER.i(2, "Number of SNPs has been saved to [" + options["out"] + ".grm.N.bin]");
 }
 
-void GRM::outBinFile(FILE *sFile, FILE *dFile) {
+void GRM::outBinFile(GRMRowReader &sFile, FILE *dFile) {
     std::unordered_set<int> keeps(index_keep.begin(), index_keep.end());
     float *grm_buf = new float[num_byte_buffer];
     float *grm_out_buffer = new float[num_byte_buffer];
     float *cur_grm_pos, *cur_out_pos;
     for(int part_index = 0; part_index != index_grm_pairs.size(); part_index++){
-        if(fread(grm_buf, sizeof(float), byte_part_grms[part_index], sFile) != byte_part_grms[part_index]){
+        if(!sFile.readRows(index_grm_pairs[part_index].first, index_grm_pairs[part_index].second + 1, grm_buf)){
             LOGGER.e(0, "Failed to read GRM between line " + to_string(index_grm_pairs[part_index].first + 1) + " and "
                         + to_string(index_grm_pairs[part_index].second + 1));
         };
@@ -763,6 +768,10 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         }
     }
 
+    if(options.find("update_grm") != options.end()){
+        init_update_order();
+    }
+
     // init the geno buffers
     /*
     if(!bBLAS){
@@ -805,17 +814,26 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         fill_grm = (uint64_t)num_individual * (part_keep_indices.second + 1);
     }
 
-    int ret_grm = posix_memalign((void **)&grm, 32, fill_grm * sizeof(double));
-    if(ret_grm){
-        LOGGER.e(0, "can't allocate enough memory to store the (parted) GRM: " + to_string(fill_grm*sizeof(double) / 1024.0/1024/1024) + "GB required.");
+    if(options_b.find("sparse_direct") != options_b.end()){
+        bDirectSparse = options_b["sparse_direct"];
     }
-    memset(grm, 0, fill_grm * sizeof(double));
 
-    int ret_N = posix_memalign((void **)&N, 32, fill_N * sizeof(uint32_t));
-    if(ret_N){
-        LOGGER.e(0, "can't allocate enough memory to store (parted) N: " + to_string(fill_grm*sizeof(uint32_t) / 1024.0/1024/1024) + "GB required.");
+    grm_bytes = fill_grm * sizeof(double);
+    N_bytes = fill_N * sizeof(uint32_t);
+    if(bDirectSparse){
+        // the dense accumulators are not needed
+    }else if(bBLAS && options.find("ooc_file") != options.end()){
+        map_ooc(fill_grm, fill_N);
+    }else{
+        int ret_grm = posix_memalign((void **)&grm, 32, fill_grm * sizeof(double));
+        if(ret_grm){
+            LOGGER.e(0, "can't allocate enough memory to store the (parted) GRM: " + to_string(fill_grm*sizeof(double) / 1024.0/1024/1024) + "GB required. Try --grm-out-of-core.");
+        }
+        memset(grm, 0, fill_grm * sizeof(double));
+
+        // in the BLAS mode N is allocated at the first missing genotype
+        if(!bBLAS) alloc_N();
     }
-    memset(N, 0, fill_N * sizeof(uint32_t));
 
     sub_miss = new uint32_t[index_keep.size() + 64]();
 
@@ -840,10 +858,24 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         isMtd = options_b["isMtd"];
     }
 
+    if(options_b.find("grm_add_dom") != options_b.end()){
+        bAddDom = options_b["grm_add_dom"];
+    }
+    if(bAddDom){
+        if(bOutOfCore || bDirectSparse || options.find("update_grm") != options.end() || options.find("checkpoint_file") != options.end()){
+            LOGGER.e(0, "--make-grm with --make-grm-d can't be used with --grm-out-of-core, --make-grm-sparse, --update-grm or --grm-checkpoint.");
+        }
+        int ret_grm_d = posix_memalign((void **)&grm_d, 32, grm_bytes);
+        if(ret_grm_d){
+            LOGGER.e(0, "can't allocate enough memory to store the (parted) dominance GRM: " + to_string(grm_bytes / 1024.0/1024/1024) + "GB required.");
+        }
+        memset(grm_d, 0, grm_bytes);
+    }
+
     //t_print(begin, "  INIT finished");
 
     string fstring = bBLAS ? " v2 " : " ";
-    string com_string = string("Computing the ") + (isDominance ? "dominance " : "") + "genetic relationship matrix (GRM)" + fstring + "...";
+    string com_string = string("Computing the ") + (isDominance ? "dominance " : "") + (bAddDom ? "additive and dominance " : "") + "genetic relationship matrix (GRM)" + fstring + "...";
     LOGGER.i(0, com_string);
     LOGGER.i(0, "Subset " + to_string(part) + "/" + to_string(num_parts) + ", no. subject " + to_string(part_keep_indices.first + 1) + "-" + to_string(part_keep_indices.second + 1));
     LOGGER.i(1, to_string(num_individual) + " samples, " + to_string(marker->count_extract()) + " markers, " + to_string(num_grm) + " GRM elements");
@@ -854,7 +886,13 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
         o_name += ".d";
     }
 
-    output_id();
+    // --make-grm-multi saves the IDs with each GRM
+    if(options.find("grm_multi_file") == options.end()) output_id();
+    if(bAddDom){
+        o_name += ".d";
+        output_id();
+        o_name = options["out"];
+    }
 
 #ifndef NDEBUG
     o_geno0 = fopen("./test.bin", "wb");
@@ -863,8 +901,209 @@ GRM::GRM(Pheno* pheno, Marker* marker) {
 }
 
 
+// Order the samples as in the existing GRM and put the new samples at the end.
+//  New samples: only the rows of the new samples are computed (a part of the GRM).
+//  New SNPs: the whole GRM of the new SNPs is computed and merged at deduce_GRM.
+void GRM::init_update_order(){
+    string old_name = options["update_grm"];
+    bUpdateMarkers = options["update_mode"] == "markers";
+    if(num_parts != 1){
+        LOGGER.e(0, "--update-grm can't be run by parts.");
+    }
+    if(isMtd || options_b["isMtd"]){
+        LOGGER.e(0, "--update-grm doesn't support --make-grm-alg 1.");
+    }
+
+    LOGGER.i(0, "Reading the existing GRM IDs from [" + old_name + ".grm.id]...");
+    vector<string> old_ids = Pheno::read_sublist(old_name + ".grm.id");
+    vector<string> keep_ids = pheno->get_id(0, index_keep.size() - 1);
+    std::map<string, uint32_t> keep_pos;
+    for(uint32_t i = 0; i < keep_ids.size(); i++){
+        keep_pos[keep_ids[i]] = i;
+    }
+
+    vector<char> in_old(keep_ids.size(), 0);
+    sample_order.clear();
+    sample_order.reserve(keep_ids.size());
+    for(auto &id : old_ids){
+        auto it = keep_pos.find(id);
+        if(it == keep_pos.end()){
+            LOGGER.e(0, "the sample " + id + " in the existing GRM is not in the genotype data or has been excluded.");
+        }
+        sample_order.push_back(it->second);
+        in_old[it->second] = 1;
+    }
+    update_num_old = old_ids.size();
+    for(uint32_t i = 0; i < keep_ids.size(); i++){
+        if(!in_old[i]) sample_order.push_back(i);
+    }
+    uint32_t num_new = sample_order.size() - update_num_old;
+
+    // the existing GRM: .grm.bin and .grm.N.bin, or a whole .grm.v2 (the reader refuses the parts of it)
+    if(!GRMRowReader::exists(old_name) || !GRMRowReader::exists(old_name, true)){
+        LOGGER.e(0, "can't find [" + old_name + ".grm.bin, .grm.N.bin] or [" + GRMContainer::fileName(old_name) + "].");
+    }
+    uint64_t old_size = (uint64_t)update_num_old * (update_num_old + 1) / 2 * sizeof(float);
+    for(int k = 0; k < 2; k++){
+        GRMRowReader reader;
+        reader.open(old_name, update_num_old, k == 1);
+        if(reader.isContainer() || reader.isConstN()) continue;
+        FILE *h_file = fopen(reader.name().c_str(), "rb");
+        if(!h_file){
+            LOGGER.e(0, "can't open [" + reader.name() + "] to read.");
+        }
+        uint64_t file_size = getFileSize(h_file);
+        fclose(h_file);
+        if(file_size > old_size){
+            LOGGER.e(0, "[" + reader.name() + "] has more values than the IDs in [" + old_name
+                    + ".grm.id], it looks like a part of --make-grm-part. Merge the parts into one GRM first.");
+        }
+        if(file_size != old_size){
+            LOGGER.e(0, "The size of [" + reader.name() + "] does not match the IDs in [" + old_name + ".grm.id].");
+        }
+    }
+
+    if(bUpdateMarkers){
+        if(num_new != 0){
+            LOGGER.e(0, "adding SNPs to an existing GRM requires the same samples, but " + to_string(num_new) + " samples are not in [" + old_name + ".grm.id].");
+        }
+        part_keep_indices = std::make_pair(0, update_num_old - 1);
+        LOGGER.i(0, "Adding the SNPs to the existing GRM of " + to_string(update_num_old) + " samples.");
+    }else{
+        if(num_new == 0){
+            LOGGER.e(0, "no new sample to be added to the existing GRM.");
+        }
+        part_keep_indices = std::make_pair(update_num_old, sample_order.size() - 1);
+        LOGGER.i(0, "Adding " + to_string(num_new) + " new samples to the existing GRM of " + to_string(update_num_old) + " samples.");
+    }
+}
+
+// reorder the genotype and missing bits of one SNP to the order of the updated GRM
+void GRM::permute_samples(GenoBufItem &item, double *out){
+    uint32_t num_sample = sample_order.size();
+    const double *geno_value = item.geno.data();
+    for(uint32_t j = 0; j < num_sample; j++){
+        out[j] = geno_value[sample_order[j]];
+    }
+    if(item.missing.size()){
+        vector<uintptr_t> missing(item.missing.size(), 0);
+        const uintptr_t *miss_ori = item.missing.data();
+        for(uint32_t j = 0; j < num_sample; j++){
+            uint32_t ori = sample_order[j];
+            if((miss_ori[ori / 64] >> (ori % 64)) & 1){
+                missing[j / 64] |= ((uintptr_t)1) << (j % 64);
+            }
+        }
+        item.missing.swap(missing);
+    }
+}
+
+// the rows of the existing samples are kept as they are
+void GRM::copy_update_grm(FILE *grm_out, FILE *N_out){
+    if(bUpdateMarkers) return;
+    string old_name = options["update_grm"];
+    vector<FILE *> out_files = {grm_out, N_out};
+    vector<float> buf;
+    for(int i = 0; i < out_files.size(); i++){
+        // in blocks of rows of about num_byte_GRM_read bytes, expanded from .grm.v2 or a constant N
+        GRMRowReader reader;
+        reader.open(old_name, update_num_old, i == 1);
+        uint64_t row_from = 0;
+        while(row_from < update_num_old){
+            uint64_t row_to = row_from + 1;
+            while(row_to < update_num_old && ((row_to + 1) * (row_to + 2) / 2 - row_from * (row_from + 1) / 2) * sizeof(float) <= num_byte_GRM_read){
+                row_to++;
+            }
+            uint64_t num_item = row_to * (row_to + 1) / 2 - row_from * (row_from + 1) / 2;
+            buf.resize(num_item);
+            if(!reader.readRows(row_from, row_to, buf.data())){
+                LOGGER.e(0, "can't read [" + reader.name() + "].");
+            }
+            if(fwrite(buf.data(), sizeof(float), num_item, out_files[i]) != num_item){
+                LOGGER.e(0, "can't write to [" + o_name + ".grm.bin, .grm.N.bin].");
+            }
+            row_from = row_to;
+        }
+    }
+}
+
+#ifndef _WIN32
+// Map a zero filled scratch file of num_bytes. The file is unlinked right after mapping,
+//  so the disk space is released when the mapping goes away, even if the run is killed.
+static void *map_scratch_file(const string &file_name, uint64_t num_bytes){
+    int fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd == -1){
+        LOGGER.e(0, "can't open [" + file_name + "] to write.");
+    }
+    if(ftruncate(fd, num_bytes) != 0){
+        close(fd);
+        unlink(file_name.c_str());
+        LOGGER.e(0, "can't reserve " + to_string(num_bytes / 1024.0/1024/1024) + "GB on the disk for [" + file_name + "].");
+    }
+    void *addr = mmap(NULL, num_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    unlink(file_name.c_str());
+    if(addr == MAP_FAILED){
+        LOGGER.e(0, "can't map [" + file_name + "] into memory.");
+    }
+    return addr;
+}
+
+// ask the kernel to read ahead a range of a mapping, the start is aligned down to the page
+static void advise_range(void *start, uint64_t num_bytes, int advice){
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t addr = (uintptr_t)start;
+    uintptr_t aligned = addr & ~(page_size - 1);
+    madvise((void *)aligned, num_bytes + (addr - aligned), advice);
+}
+#endif
+
+void GRM::map_ooc(uint64_t fill_grm, uint64_t fill_N){
+#ifdef _WIN32
+    LOGGER.e(0, "--grm-out-of-core is not supported on Windows.");
+#else
+    bOutOfCore = true;
+    string ooc_file = options["ooc_file"];
+    ooc_grm_bytes = fill_grm * sizeof(double);
+    ooc_N_bytes = fill_N * sizeof(uint32_t);
+    grm = (double *)map_scratch_file(ooc_file + ".acc", ooc_grm_bytes);
+    N = (uint32_t *)map_scratch_file(ooc_file + ".N.acc", ooc_N_bytes);
+
+    // each tile is a block of contiguous rows of the part, about 512MB
+    uint64_t n = part_keep_indices.second + 1;
+    uint64_t tile_cols = (512ULL * 1024 * 1024) / (n * sizeof(double));
+    if(tile_cols == 0) tile_cols = 1;
+    if(tile_cols > num_individual) tile_cols = num_individual;
+    ooc_tile_cols = tile_cols;
+
+    LOGGER.i(0, "Accumulating the GRM out-of-core in scratch files [" + ooc_file + ".acc, .N.acc], "
+            + to_string_precision((ooc_grm_bytes + ooc_N_bytes) / 1024.0/1024/1024, 2) + "GB on the disk.");
+#endif
+}
+
+void GRM::unmap_ooc(){
+#ifndef _WIN32
+    if(grm) munmap(grm, ooc_grm_bytes);
+    if(N) munmap(N, ooc_N_bytes);
+    grm = NULL;
+    N = NULL;
+#endif
+}
+
 void GRM::output_id() {
-    vector<string> out_id = pheno->get_id(part_keep_indices.first, part_keep_indices.second);
+    vector<string> out_id;
+    if(sample_order.empty()){
+        out_id = pheno->get_id(part_keep_indices.first, part_keep_indices.second);
+    }else{
+        // the updated GRM holds all the samples, the existing ones first
+        vector<string> keep_id = pheno->get_id(0, index_keep.size() - 1);
+        out_id.reserve(sample_order.size());
+        for(auto index : sample_order){
+            out_id.push_back(keep_id[index]);
+        }
+    }
+
+    id_hash = GRMContainer::hashIDs(out_id);
 
     string o_grm_id = o_name + ".grm.id";
     std::ofstream grm_id(o_grm_id.c_str());
@@ -902,6 +1141,16 @@ uint64_t revbits(uint64_t x) {
     return x;
 }
 
+static inline uint32_t ctz64(uint64_t x){
+#ifdef _WIN64
+    unsigned long tz = 0;
+    _BitScanForward64(&tz, x);
+    return tz;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
 /*
 void flip64(uint64_t a[64]) {
   uint64_t m = 0x00000000FFFFFFFF;
@@ -930,14 +1179,40 @@ uint32_t popcounts(uint64_t dw){
     return popcount(dw);
 }
 
-void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex){
-    int num_marker = markerIndex.size();
+// acc += panel * panel' for the rows of the part, lower triangle
+void GRM::accumulate_panel(double *panel, double *acc, int numValidMarker){
+    int m = part_keep_indices.second - part_keep_indices.first + 1;
+    int n = part_keep_indices.second + 1;
+    int n_sample = n;
+    int s_n = n - m;
 
-    static int m = part_keep_indices.second - part_keep_indices.first + 1;
-    static int n = part_keep_indices.second + 1;
-    static int n_sample = n;
-    static int s_n = n - m;
-    static int bytesStdGeno = sizeof(double) * n_sample;
+    static char notrans='N', trans='T';
+    static double alpha = 1.0, beta = 1.0;
+    static char uplo='L';
+    if(part_keep_indices.first == 0){
+#if GCTA_CPU_x86
+        dsyrk(&uplo, &notrans, &n, &numValidMarker, &alpha, panel, &n_sample, &beta, acc, &m);
+#else
+        dsyrk_(&uplo, &notrans, &n, &numValidMarker, &alpha, panel, &n_sample, &beta, acc, &m);
+#endif
+    }else{
+#if GCTA_CPU_x86
+        dgemm(&notrans, &trans, &m, &s_n, &numValidMarker, &alpha, panel + part_keep_indices.first, &n_sample, panel, &n_sample, &beta, acc, &m);
+#else
+        dgemm_(&notrans, &trans, &m, &s_n, &numValidMarker, &alpha, panel + part_keep_indices.first, &n_sample, panel, &n_sample, &beta, acc, &m);
+#endif
+        double * acc_start = acc + ((uint64_t)s_n) * m;
+#if GCTA_CPU_x86
+        dsyrk(&uplo, &notrans, &m, &numValidMarker, &alpha, panel + part_keep_indices.first, &n_sample, &beta, acc_start, &m); 
+#else
+        dsyrk_(&uplo, &notrans, &m, &numValidMarker, &alpha, panel + part_keep_indices.first, &n_sample, &beta, acc_start, &m); 
+#endif
+    }
+}
+
+// decode the markers into gbufitems, return the index of the valid ones
+vector<int> GRM::decode_markers(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    int num_marker = markerIndex.size();
 
    // GenoBufItem items[num_marker];
  
@@ -955,41 +1230,52 @@ void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex
             validIndex.push_back(i);
         }
     }
+    return validIndex;
+}
+
+void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    vector<int> validIndex = decode_markers(buf, markerIndex);
+    add_valid_markers(validIndex);
+    finished_marker += markerIndex.size();
+}
+
+// add the decoded markers in validIndex to the GRM and N
+void GRM::add_valid_markers(const vector<int> &validIndex){
+    static int n = part_keep_indices.second + 1;
+    static int n_sample = n;
+    static int bytesStdGeno = sizeof(double) * n_sample;
 
     int curNumValidMarkers = validIndex.size();
 
+    if(!sample_order.empty()){
+        #pragma omp parallel for
+        for(int i = 0; i < curNumValidMarkers; i++){
+            permute_samples(gbufitems[validIndex[i]], stdGeno + (uint64_t)i * n_sample);
+        }
+    }
+
     for(int i = 0; i < curNumValidMarkers; i++){
         int curIndex = validIndex[i];
-        memcpy(stdGeno + i * n_sample, gbufitems[curIndex].geno.data(), bytesStdGeno);
+        if(sample_order.empty()){
+            memcpy(stdGeno + i * n_sample, gbufitems[curIndex].geno.data(), bytesStdGeno);
+        }
         sd.push_back(gbufitems[curIndex].sd);
         /*
         if(gbufitems[i].missing[41/64] & (1UL << (41 %64))){
         */
     }
 
-    static char notrans='N', trans='T';
-    static double alpha = 1.0, beta = 1.0;
-    static char uplo='L';
    // A * At 
-    if(part_keep_indices.first == 0){
-#if GCTA_CPU_x86
-        dsyrk(&uplo, &notrans, &n, &curNumValidMarkers, &alpha, stdGeno, &n_sample, &beta, grm, &m);
-#else
-        dsyrk_(&uplo, &notrans, &n, &curNumValidMarkers, &alpha, stdGeno, &n_sample, &beta, grm, &m);
-#endif
+    if(bOutOfCore){
+        calculate_GRM_tiles(curNumValidMarkers);
     }else{
-        //dgemm(&notrans, &trans, &m, &n, &num_marker, &alpha, stdGeno + part_keep_indices.first, &n_sample, stdGeno, &n_sample, &beta, grm, &m);
-#if GCTA_CPU_x86
-        dgemm(&notrans, &trans, &m, &s_n, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, stdGeno, &n_sample, &beta, grm, &m);
-#else
-        dgemm_(&notrans, &trans, &m, &s_n, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, stdGeno, &n_sample, &beta, grm, &m);
-#endif
-        double * grm_start = grm + ((uint64_t)s_n) * m;
-#if GCTA_CPU_x86
-        dsyrk(&uplo, &notrans, &m, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, &beta, grm_start, &m); 
-#else
-        dsyrk_(&uplo, &notrans, &m, &curNumValidMarkers, &alpha, stdGeno + part_keep_indices.first, &n_sample, &beta, grm_start, &m); 
-#endif
+        accumulate_panel(stdGeno, grm, curNumValidMarkers);
+    }
+    if(bAddDom){
+        for(int i = 0; i < curNumValidMarkers; i++){
+            memcpy(stdGeno_d + (uint64_t)i * n_sample, gbufitems[validIndex[i]].geno_d.data(), bytesStdGeno);
+        }
+        accumulate_panel(stdGeno_d, grm_d, curNumValidMarkers);
     }
 
     //memset(this->cmask_buf, 0, num_byte_cmask);
@@ -1001,11 +1287,57 @@ void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex
     //LOGGER << "marker block: " << numNblock << ", sample block:" << numNSampleBlock << ", MarkerPerN: " << markerPerN << std::endl;
     //LOGGER << ", n: " << n << std::endl;
     uintptr_t *sample_miss = new uintptr_t[numNSampleBlock * markerPerN]; // don't need to set to 0
+    // per sample missing masks of the sparse path, cleared after each group
+    vector<uintptr_t> miss_mask(numNSampleBlock * markerPerN, 0);
+    vector<vector<uint32_t>> block_miss_samples(numNSampleBlock);
+    vector<uint32_t> miss_samples;
     for(int i = 0; i < numNblock; i++){
         int lastIndex = markerPerN * (i + 1);
         int lastValidIndex = lastIndex > curNumValidMarkers ? curNumValidMarkers : lastIndex;
 
         int baseMarkerIndex = markerPerN * i;
+
+        uint64_t num_miss = 0;
+        #pragma omp parallel for reduction(+:num_miss)
+        for(int j = 0; j < numNSampleBlock; j++){
+            for(int k = baseMarkerIndex; k < lastValidIndex; k++){
+                num_miss += popcounts(gbufitems[validIndex[k]].missing[j]);
+            }
+        }
+        if(num_miss == 0) continue;
+        if(!N) alloc_N();
+
+        // few missing genotypes: collect the missing samples and update their pairs only
+        if(num_miss <= n / 8){
+            #pragma omp parallel for schedule(dynamic, 64)
+            for(int j = 0; j < numNSampleBlock; j++){
+                vector<uint32_t> &cur_samples = block_miss_samples[j];
+                for(int k = baseMarkerIndex; k < lastValidIndex; k++){
+                    uintptr_t word = gbufitems[validIndex[k]].missing[j];
+                    while(word){
+                        uint32_t sample = j * markerPerN + ctz64(word);
+                        if(!miss_mask[sample]) cur_samples.push_back(sample);
+                        miss_mask[sample] |= 1ULL << (k - baseMarkerIndex);
+                        word &= word - 1;
+                    }
+                }
+                std::sort(cur_samples.begin(), cur_samples.end());
+            }
+            miss_samples.clear();
+            for(auto &cur_samples : block_miss_samples){
+                miss_samples.insert(miss_samples.end(), cur_samples.begin(), cur_samples.end());
+                cur_samples.clear();
+            }
+            for(uint32_t sample : miss_samples){
+                sub_miss[sample] += popcounts(miss_mask[sample]);
+            }
+            N_sparse(miss_samples, miss_mask.data());
+            for(uint32_t sample : miss_samples){
+                miss_mask[sample] = 0;
+            }
+            continue;
+        }
+
         #pragma omp parallel for
         for(int j = 0; j < numNSampleBlock; j++){
             int baseMissIndex = j * markerPerN;
@@ -1031,12 +1363,58 @@ void GRM::calculate_GRM_blas(uintptr_t *buf, const vector<uint32_t> &markerIndex
     }
     delete[] sample_miss;
 
-    finished_marker += num_marker;
-
     numValidMarkers += curNumValidMarkers;
 
 }
 
+// Out-of-core update: grm holds the part transposed, row i of the part is contiguous with
+//  leading dimension n, so only the upper triangle of the diagonal block is needed.
+//  Each panel of markers updates every tile; the tiles are visited in a serpentine order
+//  so that the tiles updated last by the previous panel are still resident.
+void GRM::calculate_GRM_tiles(int numValidMarker){
+    if(numValidMarker == 0) return;
+
+    int n_sample = part_keep_indices.second + 1;
+    int first = part_keep_indices.first;
+    int m = num_individual;
+    int num_tiles = (m + ooc_tile_cols - 1) / ooc_tile_cols;
+    bool reverse = (ooc_num_panel++) % 2;
+
+    static char notrans='N', trans='T';
+    static double alpha = 1.0, beta = 1.0;
+    static char uplo='U';
+    for(int t = 0; t < num_tiles; t++){
+        int tile = reverse ? (num_tiles - 1 - t) : t;
+        int r0 = tile * ooc_tile_cols;
+        int nc = std::min((int)ooc_tile_cols, m - r0);
+
+#ifndef _WIN32
+        if(t + 1 < num_tiles){
+            int next = reverse ? (tile - 1) : (tile + 1);
+            int next_r0 = next * ooc_tile_cols;
+            int next_nc = std::min((int)ooc_tile_cols, m - next_r0);
+            advise_range(grm + (uint64_t)next_r0 * n_sample, (uint64_t)next_nc * n_sample * sizeof(double), MADV_WILLNEED);
+        }
+#endif
+
+        double *tile_grm = grm + (uint64_t)r0 * n_sample;
+        // samples before the diagonal block
+        int nr = first + r0;
+        if(nr > 0){
+#if GCTA_CPU_x86
+            dgemm(&notrans, &trans, &nr, &nc, &numValidMarker, &alpha, stdGeno, &n_sample, stdGeno + nr, &n_sample, &beta, tile_grm, &n_sample);
+#else
+            dgemm_(&notrans, &trans, &nr, &nc, &numValidMarker, &alpha, stdGeno, &n_sample, stdGeno + nr, &n_sample, &beta, tile_grm, &n_sample);
+#endif
+        }
+#if GCTA_CPU_x86
+        dsyrk(&uplo, &notrans, &nc, &numValidMarker, &alpha, stdGeno + nr, &n_sample, &beta, tile_grm + nr, &n_sample);
+#else
+        dsyrk_(&uplo, &notrans, &nc, &numValidMarker, &alpha, stdGeno + nr, &n_sample, &beta, tile_grm + nr, &n_sample);
+#endif
+    }
+}
+
     /*
     int num_process_block = (num_marker + num_marker_block - 1) / num_marker_block;
     this->cur_num_block = (num_marker + num_marker_process_block - 1) / num_marker_process_block;
@@ -1330,11 +1708,15 @@ void GRM::calculate_GRM(uint64_t *buf, int num_marker) {
     //out_message << std::fixed << std::setprecision(2) << finished_marker * 100.0 / geno->marker->count_extract();
     //LOGGER.i(0, out_message.str() + "% has been finished");
 
-bool write_GRM(float *grm, float *N, FILE *grm_out, FILE *N_out, uint32_t row_index, float thresh=-99){
-    if(thresh == -99){
+bool write_GRM(float *grm, float *N, FILE *grm_out, FILE *N_out, uint32_t row_index, float thresh=-99, SparseGRMWriter *sp_out=NULL){
+    if(sp_out){
+        for(int i = 0; i <= row_index; i++){
+            if(grm[i] >= thresh) sp_out->add(row_index, i, grm[i]);
+        }
+    }else if(thresh == -99){
         //binary output
         fwrite(grm, sizeof(float), row_index + 1, grm_out);
-        fwrite(N, sizeof(float), row_index + 1, N_out);
+        if(N_out) fwrite(N, sizeof(float), row_index + 1, N_out);
     }else{
         std::stringstream ss;
         ss << std::setprecision( std::numeric_limits<float>::digits10+2); 
@@ -1354,15 +1736,21 @@ bool write_GRM(float *grm, float *N, FILE *grm_out, FILE *N_out, uint32_t row_in
 
 
 void GRM::deduce_GRM(){
-    LOGGER.i(0, "The GRM computation is completed.");
+    // run twice by --make-grm-d with the additive GRM, the messages tell the component
+    string grm_label = bAddDom ? (isDominance ? "dominance GRM" : "additive GRM") : "GRM";
+    string grm_title = bAddDom ? (isDominance ? "Dominance GRM" : "Additive GRM") : "GRM";
+    string N_label = bAddDom ? " of the " + grm_label : "";
+    if(!(bAddDom && isDominance)){
+        LOGGER.i(0, "The GRM computation is completed.");
+    }
     float thresh = -99;
     bool isSparse = false;
     if(options_d.find("sparse_cutoff") != options_d.end()){
         thresh = options_d["sparse_cutoff"];
         isSparse = true;
-        LOGGER.i(0, "Saving sparse GRM with a cutoff " + to_string(thresh) + "...");
+        LOGGER.i(0, "Saving sparse " + grm_label + " with a cutoff " + to_string(thresh) + "...");
     }else{
-        LOGGER.i(0, "Saving GRM...");
+        LOGGER.i(0, "Saving " + grm_label + "...");
     }
     //Just for test
 #ifndef NDEBUG
@@ -1372,13 +1760,27 @@ void GRM::deduce_GRM(){
 
     //clock_t begin = t_begin();
     FILE *grm_out, *N_out;
-    if(isSparse){
+    std::unique_ptr<GRMContainerWriter> v2_out;
+    std::unique_ptr<SparseGRMWriter> sp_out;
+    if(isSparse && options_b["sparse_bin"]){
+        grm_out = NULL;
+        N_out = NULL;
+        sp_out.reset(new SparseGRMWriter(o_name, index_keep.size(), id_hash));
+    }else if(isSparse){
         string grm_name = o_name + ".grm.sp";
         grm_out = fopen(grm_name.c_str(), "wb");
         N_out = NULL;
         if(!grm_out){
             LOGGER.e(0, "can't open " + o_name + ".grm.sp to write");
         }
+    }else if(options_b["grm_v2"]){
+        grm_out = NULL;
+        N_out = NULL;
+        uint32_t flags = 0;
+        if(isDominance) flags |= GRMContainer::FLAG_DOMINANCE;
+        if(options_b["xchr"]) flags |= GRMContainer::FLAG_XCHR;
+        v2_out.reset(new GRMContainerWriter(GRMContainer::fileName(o_name), index_keep.size(), part_keep_indices.first,
+                    part_keep_indices.second - part_keep_indices.first + 1, numValidMarkers, options_b["isMtd"] ? 1 : 0, flags, id_hash));
     }else{
         string grm_name = o_name + ".grm.bin";
         string N_name = o_name + ".grm.N.bin";
@@ -1389,6 +1791,10 @@ void GRM::deduce_GRM(){
         }
     }
 
+    if(!sample_order.empty()){
+        copy_update_grm(grm_out, N_out);
+    }
+
     float mtd_weight = 1.0;
     if(options_b["isMtd"]){
         float weight = 0;
@@ -1421,6 +1827,16 @@ void GRM::deduce_GRM(){
     float *w_grm = new float[num_sample];
     float *w_N = new float[num_sample];
 
+    GRMRowReader old_grm_file, old_N_file;
+    float *old_grm = NULL, *old_N = NULL;
+    if(bUpdateMarkers){
+        string old_name = options["update_grm"];
+        old_grm_file.open(old_name, num_sample);
+        old_N_file.open(old_name, num_sample, true);
+        old_grm = new float[num_sample];
+        old_N = new float[num_sample];
+    }
+
     double *po_grm = grm;
     uint32_t *po_N = N;
 
@@ -1435,15 +1851,77 @@ void GRM::deduce_GRM(){
     osub.close();
     */
     
+    // out-of-core buffer is stored by rows of the part
+    uint64_t grm_stride = m;
+#ifndef _WIN32
+    if(bOutOfCore){
+        grm_stride = 1;
+        advise_range(grm, ooc_grm_bytes, MADV_SEQUENTIAL);
+        advise_range(N, ooc_N_bytes, MADV_SEQUENTIAL);
+    }
+#endif
+    // no missing genotype was seen: N was never allocated and is the number of SNPs for all pairs
+    vector<uint32_t> zero_N;
+    bool bConstN = false;
+    if(!N){
+        zero_N.resize(part_keep_indices.second + 1, 0);
+        // no sample is missing at all: by --grm-const-N, .grm.N.bin of the whole GRM is only the constant;
+        //  it's not readable by the tools expecting the full layout, so the default stays the full file
+        bConstN = N_out && options_b["grm_const_N"] && !bUpdateMarkers && sample_order.empty() && part_keep_indices.first == 0
+            && part_keep_indices.second + 1 == num_sample
+            && std::all_of(sub_miss, sub_miss + num_sample, [](uint32_t miss){return miss == 0;});
+        if(bConstN){
+            if(!GRMContainer::writeConstN(N_out, num_sample, (float)numValidMarkers)){
+                LOGGER.e(0, "can't write to [" + o_name + ".grm.N.bin].");
+            }
+            fclose(N_out);
+            N_out = NULL;
+        }
+    }
     if(bBLAS){
+        vector<double> row_weight(x_weight.empty() ? 0 : part_keep_indices.second + 1);
         for(int pair1 = part_keep_indices.first; pair1 != part_keep_indices.second + 1; pair1++){
             uint32_t sub_miss1 = numValidMarkers - sub_miss[pair1];
+            const uint32_t *row_N = N ? po_N : zero_N.data();
+            if(bOutOfCore){
+                po_grm = grm + (uint64_t)(pair1 - part_keep_indices.first) * (part_keep_indices.second + 1);
+            }
+            if(!x_weight.empty()){
+                for(int pair2 = 0; pair2 != pair1 + 1; pair2++){
+                    row_weight[pair2] = x_weight[pair1] * x_weight[pair2];
+                }
+            }
+            auto raw_grm = [&](int pair2) -> double {
+                double value = *(po_grm + (uint64_t)pair2 * grm_stride);
+                return x_weight.empty() ? value : value * row_weight[pair2];
+            };
+            if(bUpdateMarkers){
+                // weight the existing GRM by its N: G = (G_old * N_old + sum(z_i * z_j)) / (N_old + N_new)
+                if(!old_grm_file.readRows(pair1, pair1 + 1, old_grm) || !old_N_file.readRows(pair1, pair1 + 1, old_N)){
+                    LOGGER.e(0, "can't read the row " + to_string(pair1 + 1) + " of [" + options["update_grm"] + "].");
+                }
+                for(int pair2 = 0; pair2 != pair1 + 1; pair2++){
+                    uint32_t sub_N = row_N[pair2] + sub_miss1 - sub_miss[pair2];
+                    double tot_N = (double)old_N[pair2] + sub_N;
+                    w_N[pair2] = (float)tot_N;
+                    if(tot_N > 0){
+                        w_grm[pair2] = (float)(((double)old_grm[pair2] * old_N[pair2] + raw_grm(pair2) * mtd_weight) / tot_N);
+                    }else{
+                        w_grm[pair2] = 0.0;
+                    }
+                }
+                if(v2_out) v2_out->addRow(w_grm, w_N, pair1 + 1);
+                else write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh, sp_out.get());
+                if(N) po_N = po_N + pair1 + 1;
+                po_grm = po_grm + 1;
+                continue;
+            }
             for(int pair2 = 0; pair2 != pair1 + 1; pair2++){
-                uint32_t sub_N = *(po_N + pair2) + sub_miss1 - sub_miss[pair2];
+                uint32_t sub_N = row_N[pair2] + sub_miss1 - sub_miss[pair2];
                 w_N[pair2] = (float)sub_N;
 
                 if(sub_N){
-                    w_grm[pair2] = (float)((*(po_grm + (uint64_t)pair2 * m))/sub_N) * mtd_weight;
+                    w_grm[pair2] = (float)(raw_grm(pair2)/sub_N) * mtd_weight;
                 }else{
                     w_grm[pair2] = 0.0;
                 }
@@ -1452,8 +1930,9 @@ void GRM::deduce_GRM(){
             }
             //fwrite(w_grm, sizeof(float), pair1 + 1, grm_out);
             //fwrite(w_N, sizeof(float), pair1 + 1, N_out);
-            write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh);
-            po_N = po_N + pair1 + 1;
+            if(v2_out) v2_out->addRow(w_grm, w_N, pair1 + 1);
+            else write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh, sp_out.get());
+            if(N) po_N = po_N + pair1 + 1;
             po_grm = po_grm + 1;
         }
     }
@@ -1476,7 +1955,7 @@ void GRM::deduce_GRM(){
                 }
                 //fwrite(w_grm, sizeof(float), pair1 + 1, grm_out);
                 //fwrite(w_N, sizeof(float), pair1 + 1, N_out);
-                write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh);
+                write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh, sp_out.get());
             }
         }else{
             for(uint32_t pair1 = part_keep_indices.first; pair1 != part_keep_indices.second + 1; pair1++){
@@ -1498,32 +1977,81 @@ void GRM::deduce_GRM(){
                 }
                 //fwrite(w_grm, sizeof(float), pair1 + 1, grm_out);
                 //fwrite(w_N, sizeof(float), pair1 + 1, N_out);
-                write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh);
+                write_GRM(w_grm, w_N, grm_out, N_out, pair1, thresh, sp_out.get());
             }
         }
     }
     */
 
 
+    if(bUpdateMarkers){
+        old_grm_file.close();
+        old_N_file.close();
+        delete[] old_grm;
+        delete[] old_N;
+    }
     if(grm_out)fclose(grm_out);
     if(N_out)fclose(N_out);
     delete[] w_grm;
     delete[] w_N;
     //t_print(begin, "  GRM deduce finished");
-    if(!isSparse){
-        LOGGER.i(0, "GRM has been saved in the file [" + o_name + ".grm.bin]");
-        LOGGER.i(0, "Number of SNPs in each pair of individuals has been saved in the file [" + o_name + ".grm.N.bin]");
+    if(sp_out){
+        uint64_t num_saved = sp_out->close();
+        LOGGER.i(0, to_string(num_saved) + " " + grm_label + " elements have been saved in the file [" + SparseGRM::fileName(o_name) + "]");
+    }else if(v2_out){
+        v2_out->close();
+        LOGGER.i(0, grm_title + " and the number of SNPs in each pair of individuals have been saved in the file [" + GRMContainer::fileName(o_name) + "] ("
+                + to_string(v2_out->bytes() / 1024 / 1024) + " MB)");
+    }else if(!isSparse){
+        LOGGER.i(0, grm_title + " has been saved in the file [" + o_name + ".grm.bin]");
+        if(bConstN){
+            LOGGER.i(0, "No missing genotypes, the number of SNPs (" + to_string(numValidMarkers)
+                    + ") for all pairs" + N_label + " has been saved in the file [" + o_name + ".grm.N.bin]");
+        }else{
+            LOGGER.i(0, "Number of SNPs in each pair of individuals" + N_label + " has been saved in the file [" + o_name + ".grm.N.bin]");
+        }
     }else{
-        LOGGER.i(0, "GRM has been saved in the file [" + o_name + ".grm.sp]");
+        LOGGER.i(0, grm_title + " has been saved in the file [" + o_name + ".grm.sp]");
     }
 
 }
 
 
-void GRM::N_thread(int grm_index_from, int grm_index_to, const uintptr_t* cur_cmask){
-    uint64_t startPos = ((uint64_t)grm_index_from + 1 + part_keep_indices.first) * (grm_index_from - part_keep_indices.first) / 2;
-
-    uint32_t *po_N_start = N + startPos;
+void GRM::alloc_N(){
+    if(N) return;
+    int ret_N = posix_memalign((void **)&N, 32, N_bytes);
+    if(ret_N){
+        N = NULL;
+        LOGGER.e(0, "can't allocate enough memory to store (parted) N: " + to_string(N_bytes / 1024.0/1024/1024) + "GB required. Try --grm-out-of-core.");
+    }
+    memset(N, 0, N_bytes);
+}
+
+// Count the samples missing in both of each pair, for the pairs of samples in miss_samples only.
+//  miss_mask: per sample, bit k is set if the sample is missing at the k-th marker of the group
+void GRM::N_sparse(const vector<uint32_t> &miss_samples, const uintptr_t *miss_mask){
+    uint32_t first = part_keep_indices.first;
+    auto it_first = std::lower_bound(miss_samples.begin(), miss_samples.end(), first);
+    auto it_last = std::upper_bound(miss_samples.begin(), miss_samples.end(), part_keep_indices.second);
+    int64_t index_from = it_first - miss_samples.begin();
+    int64_t index_to = it_last - miss_samples.begin();
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int64_t index1 = index_from; index1 < index_to; index1++){
+        uint32_t sample1 = miss_samples[index1];
+        uintptr_t mask1 = miss_mask[sample1];
+        uint32_t *po_N = N + ((uint64_t)sample1 + 1 + first) * (sample1 - first) / 2;
+        for(int64_t index2 = 0; index2 <= index1; index2++){
+            uint32_t sample2 = miss_samples[index2];
+            uintptr_t mask = mask1 & miss_mask[sample2];
+            if(mask) po_N[sample2] += popcounts(mask);
+        }
+    }
+}
+
+void GRM::N_thread(int grm_index_from, int grm_index_to, const uintptr_t* cur_cmask){
+    uint64_t startPos = ((uint64_t)grm_index_from + 1 + part_keep_indices.first) * (grm_index_from - part_keep_indices.first) / 2;
+
+    uint32_t *po_N_start = N + startPos;
     //for(int cur_block = 0; cur_block != Constants::NUM_MARKER_READ / num_cmask_block; cur_block++){
     //uint64_t *cur_cmask = cmask_buf + cur_block * index_keep.size();
     uint32_t *po_N = po_N_start;
@@ -1817,6 +2345,22 @@ int GRM::registerOption(map<string, vector<string>>& options_in) {
         return_value++;
     }
 
+    string op_grm_multi = "--make-grm-multi";
+    if(options_in.find(op_grm_multi) != options_in.end()){
+        if(options_in[op_grm_multi].size() != 1){
+            LOGGER.e(0, op_grm_multi + " takes one spec file of the GRMs to make.");
+        }
+        options["grm_multi_file"] = options_in[op_grm_multi][0];
+        processFunctions.push_back("make_grm_multi");
+        options_in.erase(op_grm_multi);
+
+        std::map<string, vector<string>> t_option;
+        t_option["--autosome"] = {};
+        Marker::registerOption(t_option);
+
+        return_value++;
+    }
+
     options_b["isMtd"] = false;
     string op_grm_mtd = "--make-grm-alg";
     if(options_in.find(op_grm_mtd) != options_in.end()){
@@ -1848,6 +2392,152 @@ int GRM::registerOption(map<string, vector<string>>& options_in) {
     }
  
 
+    string op_grm_sp_direct = "--make-grm-sparse";
+    if(options_in.find(op_grm_sp_direct) != options_in.end()){
+        if(options_in[op_grm_sp_direct].size() == 0){
+            options_d["sparse_cutoff"] = 0.05;
+        }else if(options_in[op_grm_sp_direct].size() == 1){
+            options_d["sparse_cutoff"] = std::stod(options_in[op_grm_sp_direct][0]);
+        }else{
+            LOGGER.e(0, op_grm_sp_direct + " takes at most one argument: the GRM cutoff.");
+        }
+        options_d["sparse_screen_snp"] = 8192;
+        string op_screen = "--sparse-screen";
+        if(options_in.find(op_screen) != options_in.end()){
+            auto screen_values = options_in[op_screen];
+            if(screen_values.size() < 1 || screen_values.size() > 2){
+                LOGGER.e(0, op_screen + " takes the number of SNPs to screen related pairs and optionally the screen cutoff.");
+            }
+            options_d["sparse_screen_snp"] = std::stoi(screen_values[0]);
+            if(screen_values.size() == 2){
+                options_d["sparse_screen_thresh"] = std::stod(screen_values[1]);
+            }
+            options_in.erase(op_screen);
+        }
+        options_b["sparse_direct"] = true;
+        processFunctions.push_back("make_grm_sparse");
+        options_in.erase(op_grm_sp_direct);
+
+        std::map<string, vector<string>> t_option;
+        t_option["--autosome"] = {};
+        Marker::registerOption(t_option);
+        return_value++;
+    }
+
+    string op_update = "--update-grm";
+    if(options_in.find(op_update) != options_in.end()){
+        auto update_values = options_in[op_update];
+        if(update_values.size() < 1 || update_values.size() > 2){
+            LOGGER.e(0, op_update + " takes the prefix of the existing GRM, and optionally \"samples\" (default) or \"markers\".");
+        }
+        options["update_grm"] = update_values[0];
+        options["update_mode"] = "samples";
+        if(update_values.size() == 2){
+            if(update_values[1] != "samples" && update_values[1] != "markers"){
+                LOGGER.e(0, op_update + " can only update \"samples\" or \"markers\".");
+            }
+            options["update_mode"] = update_values[1];
+        }
+        if(options["update_grm"] == options["out"]){
+            LOGGER.e(0, "it is not allowed to have the same file name for the input and the output files.");
+        }
+        if(options_d.find("sparse_cutoff") != options_d.end()){
+            LOGGER.e(0, op_update + " can't output a sparse GRM.");
+        }
+        processFunctions.push_back("make_grm");
+        options_in.erase(op_update);
+        options_in.erase("--make-grm");
+
+        std::map<string, vector<string>> t_option;
+        t_option["--autosome"] = {};
+        Marker::registerOption(t_option);
+        return_value++;
+    }
+
+    string op_ooc = "--grm-out-of-core";
+    if(options_in.find(op_ooc) != options_in.end()){
+        if(options_in[op_ooc].size() == 0){
+            options["ooc_file"] = options["out"] + ".grm.tmp";
+        }else if(options_in[op_ooc].size() == 1){
+            options["ooc_file"] = options_in[op_ooc][0];
+        }else{
+            LOGGER.e(0, op_ooc + " takes at most one argument: the prefix of the scratch files.");
+        }
+        options_in.erase(op_ooc);
+    }
+
+    string op_panel = "--grm-panel";
+    if(options_in.find(op_panel) != options_in.end()){
+        int panel = 0;
+        if(options_in[op_panel].size() == 1){
+            try{
+                panel = std::stoi(options_in[op_panel][0]);
+            }catch(std::invalid_argument&){
+                panel = 0;
+            }
+        }
+        if(panel <= 0){
+            LOGGER.e(0, op_panel + " takes one positive integer: the number of SNPs in each panel.");
+        }
+        options_d["grm_panel"] = panel;
+        options_in.erase(op_panel);
+    }
+
+    string op_v2 = "--grm-v2";
+    options_b["grm_v2"] = false;
+    if(options_in.find(op_v2) != options_in.end()){
+        if(options.find("update_grm") != options.end()){
+            LOGGER.e(0, op_v2 + " can't be used with --update-grm.");
+        }
+        options_b["grm_v2"] = true;
+        options_in.erase(op_v2);
+    }
+
+    string op_const_N = "--grm-const-N";
+    options_b["grm_const_N"] = false;
+    if(options_in.find(op_const_N) != options_in.end()){
+        options_b["grm_const_N"] = true;
+        options_in.erase(op_const_N);
+    }
+
+    // sparse GRM saved as binary CSR (.grm.spb) instead of text (.grm.sp)
+    string op_sp_bin = "--sparse-bin";
+    options_b["sparse_bin"] = false;
+    if(options_in.find(op_sp_bin) != options_in.end()){
+        if(num_parts != 1){
+            LOGGER.e(0, op_sp_bin + " can't be run by parts.");
+        }
+        options_b["sparse_bin"] = true;
+        options_in.erase(op_sp_bin);
+    }
+
+    string op_ckpt = "--grm-checkpoint";
+    options_b["resume"] = false;
+    if(options_in.find(op_ckpt) != options_in.end() || options_in.find("--resume") != options_in.end()){
+        options["checkpoint_file"] = options["out"] + ".grm.ckpt";
+        options_d["checkpoint_interval"] = 30;
+        if(options_in.find(op_ckpt) != options_in.end()){
+            auto &ckpt_values = options_in[op_ckpt];
+            double interval = 0;
+            if(ckpt_values.size() == 1){
+                try{
+                    interval = std::stod(ckpt_values[0]);
+                }catch(std::invalid_argument&){
+                    interval = 0;
+                }
+            }
+            if(ckpt_values.size() > 1 || (ckpt_values.size() == 1 && interval <= 0)){
+                LOGGER.e(0, op_ckpt + " takes at most one positive value: the interval in minutes between checkpoints.");
+            }
+            if(ckpt_values.size() == 1) options_d["checkpoint_interval"] = interval;
+            options_in.erase(op_ckpt);
+        }
+        if(options_in.find("--resume") != options_in.end()){
+            options_b["resume"] = true;
+            options_in.erase("--resume");
+        }
+    }
+
     string op_grm_unify = "--unify-grm";
     if(options_in.find(op_grm_unify) != options_in.end()){
         processFunctions.push_back("unify_grm");
@@ -1863,6 +2553,8 @@ int GRM::registerOption(map<string, vector<string>>& options_in) {
     }
 
     if(options_in.find("--make-grm") != options_in.end()){
+        // with --make-grm-d: both GRMs from one pass of the genotypes
+        options_b["grm_add_dom"] = isDominance && options.find("grm_file") == options.end();
         isDominance = false;
         if(options.find("grm_file") == options.end()){
             processFunctions.push_back("make_grm");
@@ -1912,6 +2604,12 @@ int GRM::registerOption(map<string, vector<string>>& options_in) {
             if(options_in.find("--cutoff-detail") != options_in.end()){
                 options["cutoff_detail"] = "true";
             }
+
+            options_b["cutoff_mis"] = false;
+            if(options_in.find("--grm-cutoff-mis") != options_in.end()){
+                options_b["cutoff_mis"] = true;
+                options_in.erase("--grm-cutoff-mis");
+            }
         }
 
     }
@@ -1965,7 +2663,10 @@ int GRM::registerOption(map<string, vector<string>>& options_in) {
 }
 
 void GRM::processMakeGRM(){
-    nMarkerBlock = 128;
+    nMarkerBlock = bOutOfCore ? 1024 : 128;
+    if(options_d.find("grm_panel") != options_d.end()){
+        nMarkerBlock = (int)options_d["grm_panel"];
+    }
     gbufitems = new GenoBufItem[nMarkerBlock];
     /*
     uint32_t sampleCT, missPtrSize; 
@@ -1988,22 +2689,39 @@ void GRM::processMakeGRM(){
         //callBacks.push_back(bind(&GRM::calculate_GRM, &grm, _1, _2));
         LOGGER.e(0, "the original version has been deleted. Please use GCTA >= 1.92.4");
     }
-    geno->setGRMMode(true, isDominance);
+    if(bAddDom){
+        if(posix_memalign((void **)&stdGeno_d, 32, num_byte_geno) != 0){
+            LOGGER.e(0, "can't allocate enough memory for the genotype buffer.");
+        }
+    }
+    geno->setGRMMode(true, isDominance, bAddDom);
     bool isSTD = true;
     if(isMtd) isSTD = false;
     vector<uint32_t> processIndex = marker->get_extract_index_autosome();
     sd.reserve(processIndex.size());
-    LOGGER << "Computing GRM..." << std::endl;
-    geno->loopDouble(processIndex, nMarkerBlock, true, true, isSTD, true, callBacks);
+    loop_markers(processIndex, isSTD, callBacks);
     LOGGER << "  Used " << numValidMarkers << " valid SNPs."<< std::endl;
     deduce_GRM();
+    if(bAddDom){
+        // the dominance GRM shares N and the SNP variances with the additive one
+        posix_mem_free(stdGeno_d);
+        stdGeno_d = NULL;
+        std::swap(grm, grm_d);
+        isDominance = true;
+        o_name += ".d";
+        deduce_GRM();
+    }
+    finish_checkpoint();
     delete[] gbufitems;
     posix_mem_free(stdGeno);
     geno->setGRMMode(false, false);
 }
 
 void GRM::processMakeGRMX(){
-    nMarkerBlock = 128;
+    nMarkerBlock = bOutOfCore ? 1024 : 128;
+    if(options_d.find("grm_panel") != options_d.end()){
+        nMarkerBlock = (int)options_d["grm_panel"];
+    }
     gbufitems = new GenoBufItem[nMarkerBlock];
     /*
     uint32_t sampleCT, missPtrSize; 
@@ -2027,18 +2745,834 @@ void GRM::processMakeGRMX(){
         LOGGER.e(0, "the original version has been deleted. Please use GCTA >= 1.92.4");
     }
     geno->setGRMMode(true, isDominance);
+    // the male weight of chrX is the same for all SNPs, it scales the GRM once at the end
+    vector<uint32_t> male_index;
+    double male_weight;
+    if(geno->deferMaleWeight(male_index, male_weight)){
+        vector<uint32_t> position(index_keep.size());
+        if(sample_order.empty()){
+            std::iota(position.begin(), position.end(), 0);
+        }else{
+            for(uint32_t j = 0; j < sample_order.size(); j++) position[sample_order[j]] = j;
+        }
+        x_weight.assign(index_keep.size(), 1.0);
+        for(auto index : male_index){
+            x_weight[position[index]] = male_weight;
+        }
+    }
     bool isSTD = true;
     if(isMtd) isSTD = false;
     vector<uint32_t> processIndex = marker->get_extract_index_X();
     sd.reserve(processIndex.size());
-    LOGGER << "Computing GRM..." << std::endl;
-    geno->loopDouble(processIndex, nMarkerBlock, true, true, isSTD, true, callBacks);
+    loop_markers(processIndex, isSTD, callBacks);
     LOGGER << numValidMarkers << " valid SNPs are included."<< std::endl;
     deduce_GRM();
+    finish_checkpoint();
+    delete[] gbufitems;
+    posix_mem_free(stdGeno);
+    geno->setGRMMode(false, false);
+
+}
+
+// chromosomes as "1,3,5-7"
+static vector<int> parse_chr_list(const string &value){
+    vector<string> items;
+    boost::split(items, value, boost::is_any_of(","));
+    vector<int> chrs;
+    try{
+        for(auto &item : items){
+            size_t pos = item.find('-', 1);
+            if(pos == string::npos){
+                chrs.push_back(std::stoi(item));
+            }else{
+                int from = std::stoi(item.substr(0, pos)), to = std::stoi(item.substr(pos + 1));
+                for(int chr = from; chr <= to; chr++) chrs.push_back(chr);
+            }
+        }
+    }catch(std::exception &){
+        LOGGER.e(0, "invalid chromosome list [" + value + "] in --make-grm-multi.");
+    }
+    return chrs;
+}
+
+// Each line of the spec file is a target GRM: the name followed by the conditions on its SNPs,
+//   all of which have to hold:
+//   chr=1,3,5-7      SNPs on these chromosomes
+//   no-chr=3         SNPs not on these chromosomes (e.g. LOCO)
+//   maf=0.01,0.05    0.01 < MAF <= 0.05
+//   extract=file     SNPs listed in the file
+//   a target without condition takes all the SNPs.
+void GRM::init_targets(string spec_file){
+    if(bOutOfCore || bDirectSparse || bAddDom || options.find("update_grm") != options.end() || options.find("checkpoint_file") != options.end()){
+        LOGGER.e(0, "--make-grm-multi can't be used with --grm-out-of-core, --make-grm-sparse, --make-grm-d, --update-grm or --grm-checkpoint.");
+    }
+    std::ifstream h_spec(spec_file.c_str());
+    if(!h_spec){
+        LOGGER.e(0, "can't open " + spec_file + " to read.");
+    }
+
+    uint32_t num_extract = marker->count_extract();
+    vector<int> marker_chr(num_extract);
+    vector<string> marker_name(num_extract);
+    for(uint32_t i = 0; i < num_extract; i++){
+        vector<string> fields;
+        string marker_str = marker->getMarkerStrExtract(i);
+        boost::split(fields, marker_str, boost::is_any_of("\t"));
+        marker_chr[i] = std::stoi(fields[0]);
+        marker_name[i] = fields[1];
+    }
+
+    string line;
+    std::set<string> names;
+    while(std::getline(h_spec, line)){
+        boost::trim(line);
+        if(line.empty() || line[0] == '#') continue;
+        vector<string> fields;
+        boost::split(fields, line, boost::is_any_of(" \t"), boost::token_compress_on);
+        if(targets.size() == 64){
+            LOGGER.e(0, "--make-grm-multi can make at most 64 GRMs in one run.");
+        }
+        uint64_t bit = 1ULL << targets.size();
+        GRMTarget target;
+        target.name = fields[0];
+        if(!names.insert(target.name).second){
+            LOGGER.e(0, "duplicated GRM name [" + target.name + "] in " + spec_file + ".");
+        }
+
+        vector<char> allowed(num_extract, 1);
+        for(size_t k = 1; k < fields.size(); k++){
+            size_t pos = fields[k].find('=');
+            string key = fields[k].substr(0, pos);
+            string value = pos == string::npos ? "" : fields[k].substr(pos + 1);
+            if(key == "chr" || key == "no-chr"){
+                vector<int> chrs = parse_chr_list(value);
+                bool in_list = key == "chr";
+                for(uint32_t i = 0; i < num_extract; i++){
+                    bool found = std::find(chrs.begin(), chrs.end(), marker_chr[i]) != chrs.end();
+                    if(found != in_list) allowed[i] = 0;
+                }
+            }else if(key == "maf"){
+                vector<string> values;
+                boost::split(values, value, boost::is_any_of(","));
+                try{
+                    if(values.size() != 2) throw std::invalid_argument(value);
+                    target.maf_from = std::stod(values[0]);
+                    target.maf_to = std::stod(values[1]);
+                }catch(std::exception &){
+                    LOGGER.e(0, "invalid MAF range [" + value + "] of the GRM [" + target.name + "].");
+                }
+                target.bMAF = true;
+            }else if(key == "extract"){
+                std::ifstream h_extract(value.c_str());
+                if(!h_extract){
+                    LOGGER.e(0, "can't open " + value + " to read.");
+                }
+                std::unordered_set<string> snps;
+                string snp, rest;
+                while(h_extract >> snp){
+                    snps.insert(snp);
+                    std::getline(h_extract, rest);
+                }
+                for(uint32_t i = 0; i < num_extract; i++){
+                    if(snps.find(marker_name[i]) == snps.end()) allowed[i] = 0;
+                }
+            }else{
+                LOGGER.e(0, "unknown condition [" + fields[k] + "] of the GRM [" + target.name + "].");
+            }
+        }
+        target_mask.resize(num_extract, 0);
+        for(uint32_t i = 0; i < num_extract; i++){
+            if(allowed[i]) target_mask[i] |= bit;
+        }
+        targets.push_back(target);
+    }
+    if(targets.empty()){
+        LOGGER.e(0, "no GRM in " + spec_file + ".");
+    }
+
+    // the accumulators of all the targets are in memory, N of each target only if a genotype is missing
+    double total_GB = grm_bytes * targets.size() / 1024.0/1024/1024;
+    LOGGER.i(0, to_string(targets.size()) + " GRMs take " + to_string_precision(total_GB, 2) + "GB of memory, up to "
+            + to_string_precision((grm_bytes + N_bytes) * targets.size() / 1024.0/1024/1024, 2) + "GB with missing genotypes.");
+    long long avail_KB = getMemAvailKB();
+    if(avail_KB >= 0 && grm_bytes * (targets.size() - 1) > (uint64_t)avail_KB * 1024){
+        LOGGER.e(0, "not enough memory to store " + to_string(targets.size()) + " GRMs: " + to_string_precision(total_GB, 2)
+                + "GB required, " + to_string_precision(avail_KB / 1024.0/1024, 2)
+                + "GB available. Split the targets into several runs, or make each GRM by --grm-out-of-core.");
+    }
+
+    // the first target takes the accumulators allocated already
+    swap_target(targets[0]);
+    for(size_t t = 1; t < targets.size(); t++){
+        GRMTarget &target = targets[t];
+        if(posix_memalign((void **)&target.grm, 32, grm_bytes)){
+            LOGGER.e(0, "can't allocate enough memory to store " + to_string(targets.size()) + " GRMs: "
+                    + to_string_precision(total_GB, 2) + "GB required.");
+        }
+        memset(target.grm, 0, grm_bytes);
+        target.sub_miss = new uint32_t[index_keep.size() + 64]();
+    }
+    LOGGER.i(0, to_string(targets.size()) + " GRMs are computed from one pass of the genotypes.");
+}
+
+void GRM::swap_target(GRMTarget &target){
+    std::swap(grm, target.grm);
+    std::swap(N, target.N);
+    std::swap(sub_miss, target.sub_miss);
+    sd.swap(target.sd);
+    std::swap(numValidMarkers, target.numValidMarkers);
+}
+
+void GRM::calculate_GRM_multi(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    vector<int> validIndex = decode_markers(buf, markerIndex);
+    for(size_t t = 0; t < targets.size(); t++){
+        GRMTarget &target = targets[t];
+        uint64_t bit = 1ULL << t;
+        vector<int> targetIndex;
+        for(int index : validIndex){
+            const GenoBufItem &item = gbufitems[index];
+            if(!(target_mask[item.extractedMarkerIndex] & bit)) continue;
+            if(target.bMAF){
+                double maf = std::min(item.af, 1.0 - item.af);
+                if(maf <= target.maf_from || maf > target.maf_to) continue;
+            }
+            targetIndex.push_back(index);
+        }
+        if(targetIndex.empty()) continue;
+        swap_target(target);
+        add_valid_markers(targetIndex);
+        swap_target(target);
+    }
+    finished_marker += markerIndex.size();
+}
+
+void GRM::processMakeGRMMulti(){
+    nMarkerBlock = 128;
+    if(options_d.find("grm_panel") != options_d.end()){
+        nMarkerBlock = (int)options_d["grm_panel"];
+    }
+    gbufitems = new GenoBufItem[nMarkerBlock];
+    this->num_byte_geno = sizeof(double) * nMarkerBlock * (part_keep_indices.second + 1);
+    int ret = posix_memalign((void **)&stdGeno, 32, num_byte_geno);
+    if(ret != 0){
+        LOGGER.e(0, "can't allocate enough memory for the genotype buffer.");
+    }
+    init_targets(options["grm_multi_file"]);
+
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(bind(&GRM::calculate_GRM_multi, this, _1, _2));
+    geno->setGRMMode(true, isDominance);
+    bool isSTD = true;
+    if(isMtd) isSTD = false;
+    vector<uint32_t> processIndex = marker->get_extract_index_autosome();
+    for(auto &target : targets){
+        target.sd.reserve(processIndex.size());
+    }
+    loop_markers(processIndex, isSTD, callBacks);
+
+    string out = o_name;
+    for(auto &target : targets){
+        swap_target(target);
+        LOGGER.i(0, "GRM [" + target.name + "]: " + to_string(numValidMarkers) + " valid SNPs.");
+        if(numValidMarkers == 0){
+            LOGGER.w(0, "no SNP in the GRM [" + target.name + "], skipped.");
+        }else{
+            o_name = out + "." + target.name;
+            output_id();
+            deduce_GRM();
+        }
+        swap_target(target);
+    }
+    o_name = out;
     delete[] gbufitems;
     posix_mem_free(stdGeno);
     geno->setGRMMode(false, false);
+}
 
+// Run the GRM callbacks over the markers; with a checkpoint, skip the markers done before
+void GRM::loop_markers(const vector<uint32_t> &processIndex, bool isSTD,
+        vector<function<void (uintptr_t *, const vector<uint32_t> &)>> &callBacks){
+    init_checkpoint(processIndex);
+    uint32_t start = 0;
+    if(options_b["resume"]){
+        start = load_checkpoint(processIndex.size());
+    }
+    if(bCheckpoint){
+        callBacks.push_back(bind(&GRM::checkpoint, this, _1, _2));
+    }
+    LOGGER << "Computing GRM..." << std::endl;
+    if(start < processIndex.size()){
+        vector<uint32_t> remainIndex(processIndex.begin() + start, processIndex.end());
+        geno->loopDouble(remainIndex, nMarkerBlock, true, true, isSTD, true, callBacks);
+    }
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, uint64_t bytes){
+    const unsigned char *cur = (const unsigned char *)data;
+    for(uint64_t i = 0; i < bytes; i++){
+        hash ^= cur[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct GRMCheckpointHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t finished_marker;
+    uint64_t num_valid_marker;
+    uint64_t num_sd;
+    uint64_t num_sub_miss;
+    uint64_t grm_bytes;
+    uint64_t N_bytes;
+};
+
+void GRM::init_checkpoint(const vector<uint32_t> &processIndex){
+    if(options.find("checkpoint_file") == options.end()) return;
+    bCheckpoint = true;
+    ckpt_file = options["checkpoint_file"];
+    ckpt_interval = options_d["checkpoint_interval"] * 60;
+
+    // a checkpoint is only valid for the same samples, markers and settings
+    uint64_t key = 14695981039346656037ULL;
+    key = hash_bytes(key, processIndex.data(), processIndex.size() * sizeof(uint32_t));
+    key = hash_bytes(key, &id_hash, sizeof(id_hash));
+    uint32_t settings[] = {part_keep_indices.first, part_keep_indices.second, (uint32_t)index_keep.size(), (uint32_t)nMarkerBlock,
+        (uint32_t)isDominance, (uint32_t)isMtd, (uint32_t)bOutOfCore, (uint32_t)sample_order.size(), (uint32_t)bUpdateMarkers};
+    key = hash_bytes(key, settings, sizeof(settings));
+    ckpt_key = key;
+    LOGGER.ts("GRM_CHECKPOINT");
+    LOGGER.i(0, "Saving a checkpoint of the GRM to [" + ckpt_file + "] every " + to_string_precision(ckpt_interval / 60, 1) + " minutes.");
+}
+
+uint32_t GRM::load_checkpoint(uint32_t num_marker){
+    FILE *h_ckpt = fopen(ckpt_file.c_str(), "rb");
+    if(!h_ckpt){
+        LOGGER.w(0, "no checkpoint in [" + ckpt_file + "], computing the GRM from the beginning.");
+        return 0;
+    }
+    GRMCheckpointHeader header;
+    if(fread(&header, sizeof(header), 1, h_ckpt) != 1 || memcmp(header.magic, "GCTACKP1", 8) != 0){
+        LOGGER.e(0, "[" + ckpt_file + "] is not a GRM checkpoint.");
+    }
+    if(header.key != ckpt_key || header.grm_bytes != grm_bytes || (header.N_bytes != N_bytes && header.N_bytes != 0)
+            || header.num_sub_miss != index_keep.size() + 64 || header.finished_marker > num_marker){
+        LOGGER.e(0, "the checkpoint [" + ckpt_file + "] was saved with different samples, SNPs or options.");
+    }
+    sd.resize(header.num_sd);
+    bool ok = fread(sd.data(), sizeof(double), sd.size(), h_ckpt) == sd.size()
+        && fread(sub_miss, sizeof(uint32_t), header.num_sub_miss, h_ckpt) == header.num_sub_miss
+        && fread(grm, 1, grm_bytes, h_ckpt) == grm_bytes
+        && (header.N_bytes == 0 || (alloc_N(), fread(N, 1, N_bytes, h_ckpt) == N_bytes));
+    fclose(h_ckpt);
+    if(!ok){
+        LOGGER.e(0, "the checkpoint [" + ckpt_file + "] is incomplete.");
+    }
+    finished_marker = header.finished_marker;
+    numValidMarkers = header.num_valid_marker;
+    LOGGER.i(0, "Resumed from the checkpoint [" + ckpt_file + "]: " + to_string(finished_marker) + " of "
+            + to_string(num_marker) + " SNPs have been processed.");
+    return finished_marker;
+}
+
+// write all
+static bool write_fd(int fd, const void *data, uint64_t bytes){
+    const char *cur = (const char *)data;
+    while(bytes){
+#ifndef _WIN32
+        ssize_t num_write = write(fd, cur, bytes > (1ULL << 30) ? (1ULL << 30) : bytes);
+#else
+        int num_write = _write(fd, cur, (unsigned int)(bytes > (1ULL << 30) ? (1ULL << 30) : bytes));
+#endif
+        if(num_write <= 0) return false;
+        cur += num_write;
+        bytes -= num_write;
+    }
+    return true;
+}
+
+// the state of the accumulation at one marker, the buffers are the live ones or a copy
+struct GRMCheckpointData {
+    GRMCheckpointHeader header;
+    const double *sd;
+    const uint32_t *sub_miss;
+    const void *grm;
+    const void *N;
+};
+
+static bool write_checkpoint_file(const string &file_name, const GRMCheckpointData &data){
+    string tmp_name = file_name + ".tmp";
+    const GRMCheckpointHeader &header = data.header;
+#ifndef _WIN32
+    int fd = open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#else
+    int fd = _open(tmp_name.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#endif
+    bool ok = fd >= 0 && write_fd(fd, &header, sizeof(header)) && write_fd(fd, data.sd, header.num_sd * sizeof(double))
+        && write_fd(fd, data.sub_miss, header.num_sub_miss * sizeof(uint32_t))
+        && write_fd(fd, data.grm, header.grm_bytes) && write_fd(fd, data.N, header.N_bytes);
+#ifndef _WIN32
+    ok = ok && fsync(fd) == 0;
+    if(fd >= 0) close(fd);
+#else
+    if(fd >= 0) _close(fd);
+#endif
+    // the old checkpoint is replaced only by a complete one
+    if(ok) ok = rename(tmp_name.c_str(), file_name.c_str()) == 0;
+    if(!ok) remove(tmp_name.c_str());
+    return ok;
+}
+
+GRMCheckpointData GRM::checkpoint_data(){
+    GRMCheckpointData data;
+    GRMCheckpointHeader &header = data.header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "GCTACKP1", 8);
+    header.key = ckpt_key;
+    header.finished_marker = finished_marker;
+    header.num_valid_marker = numValidMarkers;
+    header.num_sd = sd.size();
+    header.num_sub_miss = index_keep.size() + 64;
+    header.grm_bytes = grm_bytes;
+    header.N_bytes = N ? N_bytes : 0;
+    data.sd = sd.data();
+    data.sub_miss = sub_miss;
+    data.grm = grm;
+    data.N = N;
+    return data;
+}
+
+// In memory, the accumulators are copied (a memcpy, seconds) and the copy is written by a thread while
+//  the BLAS threads go on; the copy doubles the memory of the accumulators, so it's only taken if the
+//  memory is available, otherwise the checkpoint is written in place and the computation waits.
+//  The out-of-core accumulators are written in place too: they don't fit in memory, and the mapped
+//  file keeps changing after a msync, so it can't be the checkpoint by itself.
+void GRM::checkpoint(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    if(LOGGER.tp("GRM_CHECKPOINT") < ckpt_interval) return;
+    // the previous checkpoint is still being written, don't wait for it
+    if(ckpt_busy) return;
+    if(ckpt_thread.joinable()) ckpt_thread.join();
+    LOGGER.ts("GRM_CHECKPOINT");
+
+    GRMCheckpointData data = checkpoint_data();
+    const GRMCheckpointHeader &header = data.header;
+    uint64_t copy_bytes = header.grm_bytes + header.N_bytes + header.num_sd * sizeof(double) + header.num_sub_miss * sizeof(uint32_t);
+    long long avail_KB = getMemAvailKB();
+    // MemAvailable is unknown out of Linux, the allocation decides there
+    if(!bOutOfCore && (avail_KB < 0 || (uint64_t)avail_KB * 1024 > copy_bytes + (copy_bytes >> 3))){
+        std::shared_ptr<char> copy(new (std::nothrow) char[copy_bytes], std::default_delete<char[]>());
+        if(copy){
+            char *cur = copy.get();
+            memcpy(cur, data.sd, header.num_sd * sizeof(double));
+            data.sd = (const double *)cur;
+            cur += header.num_sd * sizeof(double);
+            memcpy(cur, data.sub_miss, header.num_sub_miss * sizeof(uint32_t));
+            data.sub_miss = (const uint32_t *)cur;
+            cur += header.num_sub_miss * sizeof(uint32_t);
+            const char *srcs[2] = {(const char *)data.grm, (const char *)data.N};
+            uint64_t sizes[2] = {header.grm_bytes, header.N_bytes};
+            for(int k = 0; k < 2; k++){
+                const uint64_t chunk = 64ULL << 20;
+                int64_t num_chunk = (sizes[k] + chunk - 1) / chunk;
+                #pragma omp parallel for
+                for(int64_t c = 0; c < num_chunk; c++){
+                    uint64_t start = c * chunk;
+                    memcpy(cur + start, srcs[k] + start, std::min(chunk, sizes[k] - start));
+                }
+                if(k == 0) data.grm = cur;
+                else data.N = cur;
+                cur += sizes[k];
+            }
+            ckpt_busy = true;
+            string file_name = ckpt_file;
+            ckpt_thread = std::thread([this, copy, data, file_name](){
+                if(!write_checkpoint_file(file_name, data)) ckpt_failed = true;
+                ckpt_busy = false;
+            });
+            return;
+        }
+    }
+    if(!bOutOfCore && !ckpt_warned){
+        LOGGER.w(0, "not enough memory to copy the GRM for the checkpoint ("
+                + to_string_precision(copy_bytes / 1024.0/1024/1024, 2) + "GB), the computation waits while it is written.");
+        ckpt_warned = true;
+    }
+    LOGGER.ts("GRM_CHECKPOINT_WRITE");
+    if(!write_checkpoint_file(ckpt_file, data)){
+        LOGGER.w(0, "can't write the checkpoint to [" + ckpt_file + "].");
+    }else if(bOutOfCore){
+        LOGGER.i(0, "Checkpoint saved in " + to_string_precision(LOGGER.tp("GRM_CHECKPOINT_WRITE"), 1) + " seconds.");
+    }
+    LOGGER.ts("GRM_CHECKPOINT");
+}
+
+void GRM::finish_checkpoint(){
+    if(!bCheckpoint) return;
+    if(ckpt_thread.joinable()) ckpt_thread.join();
+    if(ckpt_failed){
+        LOGGER.w(0, "a checkpoint couldn't be written to [" + ckpt_file + "].");
+    }
+    remove(ckpt_file.c_str());
+    remove((ckpt_file + ".tmp").c_str());
+}
+
+// Screen all pairs with a bit-packed KING-robust kinship on a panel of SNPs:
+//  phi = (N_AaAa - 2 * N_AAaa) / (N_Aa(i) + N_Aa(j)), and keep the pairs with 2 * phi >= screen_thresh.
+//  The panel takes the evenly spaced candidates with MAF >= 0.05 that are not in LD (r2 < 0.8) with the
+//  previous SNP in the panel. Each sample takes 3 bits per SNP, contiguous, so a pair costs a few popcounts
+//  per 64 SNPs; the pairs are screened in tiles of samples which stay in the cache. Every pair is screened,
+//  so the candidates are those of the exact screen at any sample size.
+void GRM::screen_sparse_pairs(const vector<uint32_t> &processIndex, float screen_thresh, int num_screen_marker){
+    const double min_maf = 0.05, max_r2 = 0.8;
+    uint32_t num_marker = processIndex.size();
+    vector<uint32_t> candidateIndex;
+    uint32_t num_panel = num_marker;
+    if(num_screen_marker <= 0 || (uint32_t)num_screen_marker >= num_marker){
+        candidateIndex = processIndex;
+    }else{
+        // twice the panel evenly spaced, some are dropped by MAF and LD
+        num_panel = num_screen_marker;
+        uint32_t num_candidate = std::min(num_marker, 2 * num_panel);
+        candidateIndex.reserve(num_candidate);
+        double step = (double)num_marker / num_candidate;
+        for(uint32_t i = 0; i < num_candidate; i++){
+            candidateIndex.push_back(processIndex[(uint32_t)(i * step)]);
+        }
+    }
+
+    uint32_t n = num_individual;
+    uint32_t num_word = (num_panel + 63) / 64;
+    // sample j: het, hom0 and hom2 bits at (3 * j + type) * num_word
+    vector<uint64_t> bits((uint64_t)n * 3 * num_word, 0);
+
+    LOGGER.i(0, "Screening related pairs with up to " + to_string(num_panel) + " SNPs (MAF >= " + to_string_precision(min_maf, 2)
+            + ", r2 < " + to_string_precision(max_r2, 1) + " with the previous SNP) from " + to_string(candidateIndex.size()) + " candidates...");
+    uint32_t finished = 0;
+    vector<double> prev_geno;
+    auto fill_bits = [this, &bits, &finished, &prev_geno, n, num_word, num_panel, min_maf, max_r2](uintptr_t *buf, const vector<uint32_t> &markerIndex){
+        int num_marker = markerIndex.size();
+        #pragma omp parallel for
+        for(int i = 0; i < num_marker; i++){
+            GenoBufItem &item = gbufitems[i];
+            item.extractedMarkerIndex = markerIndex[i];
+            geno->getGenoDouble(buf, i, &item);
+        }
+
+        // the panel column of each SNP, -1 if dropped
+        vector<int64_t> column(num_marker, -1);
+        for(int i = 0; i < num_marker && finished < num_panel; i++){
+            GenoBufItem &item = gbufitems[i];
+            if(!item.valid || std::min(item.af, 1.0 - item.af) < min_maf) continue;
+            const double *x = item.geno.data();
+            if(!prev_geno.empty()){
+                const double *y = prev_geno.data();
+                double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+                #pragma omp parallel for reduction(+:sx,sy,sxx,syy,sxy)
+                for(uint32_t j = 0; j < n; j++){
+                    sx += x[j];
+                    sy += y[j];
+                    sxx += x[j] * x[j];
+                    syy += y[j] * y[j];
+                    sxy += x[j] * y[j];
+                }
+                double cov = sxy - sx * sy / n;
+                double r2 = cov * cov / ((sxx - sx * sx / n) * (syy - sy * sy / n));
+                if(r2 >= max_r2) continue;
+            }
+            prev_geno.assign(x, x + n);
+            column[i] = finished++;
+        }
+
+        #pragma omp parallel for
+        for(uint32_t j = 0; j < n; j++){
+            uint64_t *het = bits.data() + (uint64_t)j * 3 * num_word;
+            uint64_t *hom0 = het + num_word;
+            uint64_t *hom2 = hom0 + num_word;
+            uint64_t miss_word = j / 64, miss_bit = 1ULL << (j % 64);
+            for(int i = 0; i < num_marker; i++){
+                if(column[i] < 0) continue;
+                GenoBufItem &item = gbufitems[i];
+                if(item.missing.size() && (item.missing[miss_word] & miss_bit)) continue;
+                uint64_t k = column[i];
+                uint64_t bit = 1ULL << (k % 64);
+                double dosage = item.geno[j];
+                if(dosage < 0.5){
+                    hom0[k / 64] |= bit;
+                }else if(dosage < 1.5){
+                    het[k / 64] |= bit;
+                }else{
+                    hom2[k / 64] |= bit;
+                }
+            }
+        }
+    };
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(fill_bits);
+    geno->loopDouble(candidateIndex, nMarkerBlock, true, false, false, true, callBacks, false);
+    vector<double>().swap(prev_geno);
+    if(finished == 0){
+        LOGGER.e(0, "no SNP with MAF >= " + to_string_precision(min_maf, 2) + " to screen related pairs.");
+    }
+    LOGGER.i(1, to_string(finished) + " SNPs in the screening panel.");
+    if(finished < num_panel){
+        LOGGER.w(1, "fewer SNPs than asked by --sparse-screen passed the MAF and LD filters.");
+    }
+
+    vector<uint32_t> num_het(n, 0);
+    #pragma omp parallel for
+    for(uint32_t j = 0; j < n; j++){
+        const uint64_t *p = bits.data() + (uint64_t)j * 3 * num_word;
+        uint32_t count = 0;
+        for(uint32_t w = 0; w < num_word; w++) count += popcounts(p[w]);
+        num_het[j] = count;
+    }
+
+    // KING-robust 2 * phi of a pair on the screening SNPs
+    auto pass_screen = [&bits, &num_het, num_word, screen_thresh](uint32_t i, uint32_t j){
+        const uint64_t *het1 = bits.data() + (uint64_t)i * 3 * num_word;
+        const uint64_t *hom01 = het1 + num_word;
+        const uint64_t *hom21 = hom01 + num_word;
+        const uint64_t *het2 = bits.data() + (uint64_t)j * 3 * num_word;
+        const uint64_t *hom02 = het2 + num_word;
+        const uint64_t *hom22 = hom02 + num_word;
+        int32_t n_hethet = 0, n_opp = 0;
+        for(uint32_t w = 0; w < num_word; w++){
+            n_hethet += popcounts(het1[w] & het2[w]);
+            n_opp += popcounts((hom01[w] & hom22[w]) | (hom21[w] & hom02[w]));
+        }
+        uint32_t denom = num_het[i] + num_het[j];
+        return denom && 2.0 * (n_hethet - 2.0 * n_opp) / denom >= screen_thresh;
+    };
+
+    // the lower triangle in tiles of tile x tile samples
+    const uint32_t tile = 256;
+    uint64_t num_tile = (n + tile - 1) / tile;
+    int64_t num_tile_pair = num_tile * (num_tile + 1) / 2;
+    int num_thread = omp_get_max_threads();
+    vector<vector<pair<uint32_t, uint32_t>>> thread_pairs(num_thread);
+    #pragma omp parallel for schedule(dynamic)
+    for(int64_t t = 0; t < num_tile_pair; t++){
+        uint64_t ti = (uint64_t)((std::sqrt(8.0 * t + 1) - 1) / 2);
+        while(ti * (ti + 1) / 2 > (uint64_t)t) ti--;
+        while((ti + 1) * (ti + 2) / 2 <= (uint64_t)t) ti++;
+        uint64_t tj = t - ti * (ti + 1) / 2;
+        auto &cur_pairs = thread_pairs[omp_get_thread_num()];
+        uint32_t i_end = std::min((uint64_t)n, (ti + 1) * tile), j_end = std::min((uint64_t)n, (tj + 1) * tile);
+        for(uint32_t i = ti * tile; i < i_end; i++){
+            for(uint32_t j = tj * tile; j < std::min(i, j_end); j++){
+                if(pass_screen(i, j)){
+                    cur_pairs.push_back(std::make_pair(i + part_keep_indices.first, j + part_keep_indices.first));
+                }
+            }
+        }
+    }
+
+    sp_pairs.clear();
+    for(auto &cur_pairs : thread_pairs){
+        sp_pairs.insert(sp_pairs.end(), cur_pairs.begin(), cur_pairs.end());
+    }
+    std::sort(sp_pairs.begin(), sp_pairs.end());
+    LOGGER.i(1, to_string(sp_pairs.size()) + " candidate pairs passed the screen.");
+}
+
+// exact GRM values for the candidate pairs and the diagonal, called per block of SNPs
+void GRM::calculate_sparse_GRM(uintptr_t *buf, const vector<uint32_t> &markerIndex){
+    int num_marker = markerIndex.size();
+    #pragma omp parallel for
+    for(int i = 0; i < num_marker; i++){
+        GenoBufItem &item = gbufitems[i];
+        item.extractedMarkerIndex = markerIndex[i];
+        geno->getGenoDouble(buf, i, &item);
+    }
+
+    vector<int> validIndex;
+    validIndex.reserve(num_marker);
+    for(int i = 0; i < num_marker; i++){
+        if(gbufitems[i].valid){
+            validIndex.push_back(i);
+            sd.push_back(gbufitems[i].sd);
+        }
+    }
+    int curNumValidMarkers = validIndex.size();
+    if(curNumValidMarkers == 0) return;
+
+    // diagonal and missingness of every sample
+    uint32_t n = num_individual;
+    #pragma omp parallel for
+    for(uint32_t j = 0; j < n; j++){
+        uint64_t miss_word = j / 64, miss_bit = 1ULL << (j % 64);
+        double sum = 0;
+        uint32_t miss = 0;
+        for(int k = 0; k < curNumValidMarkers; k++){
+            GenoBufItem &item = gbufitems[validIndex[k]];
+            double value = item.geno[j];
+            sum += value * value;
+            if(item.missing[miss_word] & miss_bit) miss++;
+        }
+        sp_diag[j] += sum;
+        sub_miss[j] += miss;
+    }
+
+    // copy the samples in candidate pairs into a compact row major panel
+    uint32_t num_sp_sample = sp_samples.size();
+    int num_miss_word = (curNumValidMarkers + 63) / 64;
+    vector<double> panel((uint64_t)num_sp_sample * curNumValidMarkers);
+    vector<uint64_t> panel_miss((uint64_t)num_sp_sample * num_miss_word, 0);
+    #pragma omp parallel for
+    for(uint32_t u = 0; u < num_sp_sample; u++){
+        uint32_t j = sp_samples[u];
+        uint64_t miss_word = j / 64, miss_bit = 1ULL << (j % 64);
+        double *row = panel.data() + (uint64_t)u * curNumValidMarkers;
+        uint64_t *row_miss = panel_miss.data() + (uint64_t)u * num_miss_word;
+        for(int k = 0; k < curNumValidMarkers; k++){
+            GenoBufItem &item = gbufitems[validIndex[k]];
+            row[k] = item.geno[j];
+            if(item.missing[miss_word] & miss_bit) row_miss[k / 64] |= 1ULL << (k % 64);
+        }
+    }
+
+    uint64_t num_pair = sp_pairs.size();
+    #pragma omp parallel for schedule(static)
+    for(uint64_t p = 0; p < num_pair; p++){
+        uint32_t u1 = sp_compact[sp_pairs[p].first - part_keep_indices.first];
+        uint32_t u2 = sp_compact[sp_pairs[p].second - part_keep_indices.first];
+        const double *row1 = panel.data() + (uint64_t)u1 * curNumValidMarkers;
+        const double *row2 = panel.data() + (uint64_t)u2 * curNumValidMarkers;
+        double sum = 0;
+        for(int k = 0; k < curNumValidMarkers; k++){
+            sum += row1[k] * row2[k];
+        }
+        sp_grm[p] += sum;
+
+        const uint64_t *miss1 = panel_miss.data() + (uint64_t)u1 * num_miss_word;
+        const uint64_t *miss2 = panel_miss.data() + (uint64_t)u2 * num_miss_word;
+        uint32_t miss = 0;
+        for(int w = 0; w < num_miss_word; w++){
+            miss += popcounts(miss1[w] & miss2[w]);
+        }
+        sp_miss_both[p] += miss;
+    }
+
+    finished_marker += num_marker;
+    numValidMarkers += curNumValidMarkers;
+}
+
+void GRM::write_sparse_GRM(float thresh){
+    float mtd_weight = 1.0;
+    if(isMtd){
+        double weight = 0;
+        for(int i = 0; i < numValidMarkers; i++){
+            weight += sd[i];
+        }
+        mtd_weight = 1.0 / (weight / numValidMarkers);
+    }
+
+    std::unique_ptr<SparseGRMWriter> sp_out;
+    string grm_name;
+    FILE *grm_out = NULL;
+    if(options_b["sparse_bin"]){
+        grm_name = SparseGRM::fileName(o_name);
+        sp_out.reset(new SparseGRMWriter(o_name, index_keep.size(), id_hash));
+    }else{
+        grm_name = o_name + ".grm.sp";
+        grm_out = fopen(grm_name.c_str(), "wb");
+        if(!grm_out){
+            LOGGER.e(0, "can't open " + grm_name + " to write");
+        }
+    }
+
+    uint32_t first = part_keep_indices.first;
+    uint64_t num_pair = sp_pairs.size();
+    uint64_t num_saved = 0;
+    uint64_t cur_pair = 0;
+    for(uint32_t id1 = first; id1 != part_keep_indices.second + 1; id1++){
+        std::stringstream ss;
+        ss << std::setprecision( std::numeric_limits<float>::digits10+2); 
+        uint32_t miss1 = sub_miss[id1 - first];
+        for(; cur_pair < num_pair && sp_pairs[cur_pair].first == id1; cur_pair++){
+            uint32_t id2 = sp_pairs[cur_pair].second;
+            uint32_t sub_N = numValidMarkers - miss1 - sub_miss[id2 - first] + sp_miss_both[cur_pair];
+            if(sub_N == 0) continue;
+            float value = (float)(sp_grm[cur_pair] / sub_N) * mtd_weight;
+            if(value >= thresh){
+                if(sp_out) sp_out->add(id1, id2, value);
+                else ss << id1 << "\t" << id2 << "\t" << value << "\n";
+                num_saved++;
+            }
+        }
+        uint32_t sub_N = numValidMarkers - miss1;
+        if(sub_N){
+            float value = (float)(sp_diag[id1 - first] / sub_N) * mtd_weight;
+            if(value >= thresh){
+                if(sp_out) sp_out->add(id1, id1, value);
+                else ss << id1 << "\t" << id1 << "\t" << value << "\n";
+                num_saved++;
+            }
+        }
+        const string tmp = ss.str();
+        if(tmp.size() > 0){
+            fputs(tmp.c_str(), grm_out);
+        }
+    }
+    if(sp_out) sp_out->close();
+    else fclose(grm_out);
+    LOGGER.i(0, to_string(num_saved) + " GRM elements have been saved in the file [" + grm_name + "]");
+}
+
+void GRM::processMakeGRMSparse(){
+    if(num_parts != 1){
+        LOGGER.e(0, "--make-grm-sparse can't be run by parts.");
+    }
+    if(isDominance){
+        LOGGER.e(0, "--make-grm-sparse doesn't support the dominance GRM.");
+    }
+    float thresh = options_d["sparse_cutoff"];
+    float screen_thresh = thresh / 2;
+    if(options_d.find("sparse_screen_thresh") != options_d.end()){
+        screen_thresh = options_d["sparse_screen_thresh"];
+    }
+    int num_screen_marker = (int)options_d["sparse_screen_snp"];
+
+    nMarkerBlock = 128;
+    if(options_d.find("grm_panel") != options_d.end()){
+        nMarkerBlock = (int)options_d["grm_panel"];
+    }
+    gbufitems = new GenoBufItem[nMarkerBlock];
+    geno->setGRMMode(true, false);
+    vector<uint32_t> processIndex = marker->get_extract_index_autosome();
+
+    LOGGER.ts("SP_SCREEN");
+    screen_sparse_pairs(processIndex, screen_thresh, num_screen_marker);
+    LOGGER.i(1, "Screen finished in " + to_string_precision(LOGGER.tp("SP_SCREEN"), 1) + " sec.");
+
+    sp_compact.assign(num_individual, -1);
+    for(auto &cur_pair : sp_pairs){
+        sp_compact[cur_pair.first - part_keep_indices.first] = 0;
+        sp_compact[cur_pair.second - part_keep_indices.first] = 0;
+    }
+    sp_samples.clear();
+    for(uint32_t j = 0; j < num_individual; j++){
+        if(sp_compact[j] == 0){
+            sp_compact[j] = sp_samples.size();
+            sp_samples.push_back(j);
+        }
+    }
+    sp_grm.assign(sp_pairs.size(), 0.0);
+    sp_miss_both.assign(sp_pairs.size(), 0);
+    sp_diag.assign(num_individual, 0.0);
+
+    vector<function<void (uintptr_t *, const vector<uint32_t> &)>> callBacks;
+    callBacks.push_back(bind(&GRM::calculate_sparse_GRM, this, _1, _2));
+    bool isSTD = true;
+    if(isMtd) isSTD = false;
+    sd.reserve(processIndex.size());
+    LOGGER << "Computing the sparse GRM for " << sp_pairs.size() << " candidate pairs..." << std::endl;
+    geno->loopDouble(processIndex, nMarkerBlock, true, true, isSTD, true, callBacks);
+    LOGGER << "  Used " << numValidMarkers << " valid SNPs."<< std::endl;
+    LOGGER.i(0, "Saving sparse GRM with a cutoff " + to_string(thresh) + "...");
+    write_sparse_GRM(thresh);
+    delete[] gbufitems;
+    geno->setGRMMode(false, false);
 }
 
 void GRM::processMain() {
@@ -2053,6 +3587,24 @@ void GRM::processMain() {
             return;
         }
 
+        if(process_function == "make_grm_multi"){
+            LOGGER.i(0, "Note: GRM is computed using the SNPs on the autosomes.");
+            Pheno pheno;
+            Marker marker;
+            GRM grm(&pheno, &marker);
+            grm.processMakeGRMMulti();
+            return;
+        }
+
+        if(process_function == "make_grm_sparse"){
+            LOGGER.i(0, "Note: GRM is computed using the SNPs on the autosomes.");
+            Pheno pheno;
+            Marker marker;
+            GRM grm(&pheno, &marker);
+            grm.processMakeGRMSparse();
+            return;
+        }
+
         if(process_function == "make_grmx"){
             LOGGER.i(0, "Note: this function takes X chromosome as non-PAR region.");
 
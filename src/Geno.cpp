@@ -819,6 +819,7 @@ void Geno::readGeno_pgen(const vector<uint32_t> &extractIndex){
 }
 
 void Geno::getGenoDouble(uintptr_t *buf, int bufIndex, GenoBufItem* gbuf){
+    gbuf->bSparse = false;
     (this->*getGenoDoubleFuncs[genoFormat])(buf, bufIndex, gbuf);
 }
 
@@ -956,23 +957,19 @@ void Geno::getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf){
                     a2 = (aa2 - center_value) * rdev;
                     na = (mu - center_value) * rdev;
                }else{
-                   double psq = 0.5 * mu * mu;
-                   if(bGenoCenter)center_value = psq; // psq
-                   if(bGenoStd){
-                       rdev = 1.0 / sd;
-                   }
-                   double aa0 = 0.0, aa2 = 2.0 * mu - 2.0;
-                   if(isEffRev){
-                       double temp = aa0;
-                       aa0 = aa2;
-                       aa2 = temp;
-                   }
-                   a0 = (aa0 - center_value) * rdev;
-                   a1 = (mu - center_value) * rdev;
-                   a2 = (aa2 - center_value) * rdev;
-                   na = (psq - center_value)*rdev;
+                   domCoding(mu, sd, isEffRev, a0, a1, a2, na);
                 }
 
+                // rare variants: the samples that differ from the common homozygote
+                if(maf < gbuf->sparseMAF && !bGRMDom && !bGRMBoth && !bMakeMiss && isSexXY != 1){
+                    uint32_t major_code = snpinfo.af > 0.5 ? 2 : 0;
+                    double base = major_code ? a2 : a0;
+                    const double delta[4] = {a0 - base, a1 - base, a2 - base, na - base};
+                    gbuf->bSparse = true;
+                    gbuf->sparse_base = base;
+                    PgenReader::ExtractSparseExt(cur_buf, keepMaskPtr, rawSampleCT, keepSampleCT, major_code, delta, gbuf->carriers, gbuf->carrier_delta);
+                    return;
+                }
                 const double lookup[32] __attribute__ ((aligned (16))) = GET_TABLE16(a0, a1, a2, na);
                 gbuf->geno.resize(keepSampleCT);
                 uintptr_t * pmiss = NULL;
@@ -981,8 +978,15 @@ void Geno::getGenoDouble_bed(uintptr_t *buf, int idx, GenoBufItem* gbuf){
                     pmiss = gbuf->missing.data();
                 }
                 PgenReader::ExtractDoubleExt(cur_buf, keepMaskPtr, rawSampleCT, keepSampleCT, lookup, gbuf->geno.data(), pmiss); 
+                if(bGRMBoth){
+                    double d0, d1, d2, dna;
+                    domCoding(mu, sd, isEffRev, d0, d1, d2, dna);
+                    const double lookup_d[32] __attribute__ ((aligned (16))) = GET_TABLE16(d0, d1, d2, dna);
+                    gbuf->geno_d.resize(keepSampleCT);
+                    PgenReader::ExtractDoubleExt(cur_buf, keepMaskPtr, rawSampleCT, keepSampleCT, lookup_d, gbuf->geno_d.data(), NULL); 
+                }
                 // adjust for chr X;
-                if(isSexXY == 1){
+                if(isSexXY == 1 && !bDeferMaleWeight){
                     /* don't set to missing
                     if(!hasNoHET){
                         for(int i = 0 ; i < keepMaleSampleCT; i++){
@@ -1388,44 +1392,42 @@ void Geno::getGenoDouble_bgen(uintptr_t *buf, int idx, GenoBufItem* gbuf){
                         dos_lookup[i] = (tdos - center_value) *rdev;
                     }
                     dos_lookup[max_dos] = ( mu - center_value) * rdev;
-                }else{// dominance
-                    uint32_t cut05 = ceil(0.5 * mask);
-                    uint32_t cut15 = ceil(1.5 * mask);
-                    double psq = 0.5 * mu * mu;
-                    double dos00 = bEffRev ? (2.0 * mu - 2.0) : 0.0;
-                    double dos01 = mu;
-                    double dos10 = bEffRev ? 0.0 : (2.0 * mu - 2.0);
-                    double dosna = psq;
-
-                    if(bGenoCenter)center_value = psq; // psq
-                    if(bGenoStd){
-                        rdev = 1.0 / std;
-                    }
-                    double a0 = (dos00 - center_value) * rdev;
-                    double a1 = (dos01 - center_value) * rdev;
-                    double a2 = (dos10 - center_value) * rdev;
-                    double na = (dosna - center_value) * rdev;
-                    
+                }
+                // dominance: hard calls from the dosage
+                uint32_t cut05 = ceil(0.5 * mask);
+                uint32_t cut15 = ceil(1.5 * mask);
+                auto dom_lookup = [&](double *cur_lookup){
+                    double a0, a1, a2, na;
+                    domCoding(mu, std, bEffRev, a0, a1, a2, na);
                     for(uint32_t i = 0; i < cut05; i++){
-                        dos_lookup[i] = a0;
+                        cur_lookup[i] = a0;
                     }
                     for(uint32_t i = cut05; i < cut15; i++){
-                        dos_lookup[i] = a1;
+                        cur_lookup[i] = a1;
                     }
                     for(uint32_t i = cut15; i < max_dos; i++){
-                        dos_lookup[i] = a2;
+                        cur_lookup[i] = a2;
                     }
-
-                    dos_lookup[max_dos] = (dosna - center_value) * rdev;
+                    cur_lookup[max_dos] = na;
+                };
+                if(bGRMDom){
+                    dom_lookup(dos_lookup);
                 }
 
                 gbuf->geno.resize(curSampleCT);
                 for(int j = 0; j < curSampleCT; j++){
                     gbuf->geno[j] = dos_lookup[dosages[j]];
                 }
+                if(bGRMBoth){
+                    dom_lookup(dos_lookup);
+                    gbuf->geno_d.resize(curSampleCT);
+                    for(int j = 0; j < curSampleCT; j++){
+                        gbuf->geno_d[j] = dos_lookup[dosages[j]];
+                    }
+                }
                 delete[] dos_lookup;
                 // adjust for chr X;
-                if(isSexXY == 1){
+                if(isSexXY == 1 && !bDeferMaleWeight){
                     double weight;
                     bool needWeight;
                     setMaleWeight(weight, needWeight);
@@ -1461,9 +1463,40 @@ void Geno::getGenoDouble_bgen(uintptr_t *buf, int idx, GenoBufItem* gbuf){
  
 }
 
-void Geno::setGRMMode(bool grm, bool dominace){
+void Geno::setGRMMode(bool grm, bool dominace, bool both){
     this->bGRM = grm;
     this->bGRMDom = dominace;
+    this->bGRMBoth = both;
+    if(!grm) bDeferMaleWeight = false;
+}
+
+bool Geno::deferMaleWeight(vector<uint32_t> &maleIndex, double &weight){
+    bool needWeight;
+    setMaleWeight(weight, needWeight);
+    bDeferMaleWeight = needWeight;
+    maleIndex = keepMaleExtractIndex;
+    return needWeight;
+}
+
+// dominance coding of the genotypes 0, 1, 2 and missing
+void Geno::domCoding(double mu, double sd, bool isEffRev, double &a0, double &a1, double &a2, double &na){
+    double center_value = 0.0;
+    double rdev = 1.0;
+    double psq = 0.5 * mu * mu;
+    if(bGenoCenter)center_value = psq; // psq
+    if(bGenoStd){
+        rdev = 1.0 / sd;
+    }
+    double aa0 = 0.0, aa2 = 2.0 * mu - 2.0;
+    if(isEffRev){
+        double temp = aa0;
+        aa0 = aa2;
+        aa2 = temp;
+    }
+    a0 = (aa0 - center_value) * rdev;
+    a1 = (mu - center_value) * rdev;
+    a2 = (aa2 - center_value) * rdev;
+    na = (psq - center_value) * rdev;
 }
 
 void Geno::endGenoDouble_bed(){
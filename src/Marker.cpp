@@ -722,6 +722,10 @@ void Marker::getStartPosSize(uint32_t raw_index, uint64_t &pos, uint64_t &size){
     size = byte_size[raw_index];
 }
 
+uint64_t Marker::getMarkerBytes(uint32_t raw_index){
+    return raw_index < byte_size.size() ? byte_size[raw_index] : 0;
+}
+
 MarkerParam Marker::getBgenMarkerParam(FILE *h_bgen, string &outputs){
     // check file formats
     uint32_t start_byte = read1Byte<uint32_t>(h_bgen);
@@ -93,22 +93,92 @@ Pheno::Pheno() {
             LOGGER.e(0, " duplicated IDs found in the phenotype data.");
         }
 
-        int cur_pheno = 1;
-        if(options.find("mpheno") != options.end()){
-            try{
-                cur_pheno = std::stoi(options["mpheno"]);
-            }catch(std::invalid_argument&){
-                LOGGER.e(0, "non-numberic value specified for –mpheno.");
+        // --mpheno: a column, a list such as 1,3,5-9, or all
+        vector<int> cur_phenos;
+        string mpheno_spec = options.find("mpheno") != options.end() ? options["mpheno"] : "1";
+        if(mpheno_spec == "all"){
+            cur_phenos.resize(phenos.size());
+            std::iota(cur_phenos.begin(), cur_phenos.end(), 1);
+        }else{
+            vector<string> items;
+            boost::split(items, mpheno_spec, boost::is_any_of(","));
+            for(auto &item : items){
+                if(item.empty()) continue;
+                try{
+                    auto dash = item.find('-');
+                    if(dash == string::npos){
+                        cur_phenos.push_back(std::stoi(item));
+                    }else{
+                        int col_from = std::stoi(item.substr(0, dash));
+                        int col_to = std::stoi(item.substr(dash + 1));
+                        if(col_from > col_to){
+                            LOGGER.e(0, "invalid range [" + item + "] in --mpheno.");
+                        }
+                        for(int col = col_from; col <= col_to; col++) cur_phenos.push_back(col);
+                    }
+                }catch(std::invalid_argument&){
+                    LOGGER.e(0, "non-numberic value specified for –mpheno.");
+                }
             }
         }
-
-        if(cur_pheno <= 0 || cur_pheno > phenos.size()){
-            LOGGER.e(0, "the value specified for --mpheno can't be less than 0 or larger than the total number of columns in .pheno file.");
+        if(cur_phenos.empty()){
+            LOGGER.e(0, "no phenotype column specified by --mpheno.");
         }
+        // a trait listed twice would be tested twice into the same output file
+        std::sort(cur_phenos.begin(), cur_phenos.end());
+        cur_phenos.erase(std::unique(cur_phenos.begin(), cur_phenos.end()), cur_phenos.end());
 
-        cur_pheno -= 1;
+        for(int cur_pheno : cur_phenos){
+            if(cur_pheno <= 0 || cur_pheno > phenos.size()){
+                LOGGER.e(0, "the value specified for --mpheno can't be less than 0 or larger than the total number of columns in .pheno file.");
+            }
+        }
 
-        update_pheno(pheno_subjects, phenos[cur_pheno]);
+        if(cur_phenos.size() == 1){
+            update_pheno(pheno_subjects, phenos[cur_phenos[0] - 1]);
+        }else{
+            if(options.find("mpheno_multi") == options.end()){
+                LOGGER.e(0, "multiple traits in --mpheno can only be tested by --fastGWA-mlm or --fastGWA-lr.");
+            }
+            // the samples with non-missing values in all the traits; the first trait is the current one
+            int num_trait = cur_phenos.size();
+            mpheno_cols = cur_phenos;
+            mpheno.resize(num_trait);
+            vector<uint32_t> keep_all = index_keep;
+            vector<uint32_t> trait_N(num_trait);
+            vector<int> num_valid(pheno.size(), 0);
+            for(int k = num_trait - 1; k >= 0; k--){
+                index_keep = keep_all;
+                update_pheno(pheno_subjects, phenos[cur_phenos[k] - 1]);
+                mpheno[k] = pheno;
+                trait_N[k] = index_keep.size();
+                for(uint32_t index : index_keep) num_valid[index]++;
+            }
+            index_keep.clear();
+            for(uint32_t index : keep_all){
+                if(num_valid[index] == num_trait) index_keep.push_back(index);
+            }
+            LOGGER.i(0, to_string(num_trait) + " traits read from the phenotype file.");
+
+            // the traits are tested in the common samples, which can be far fewer than a trait alone has
+            uint32_t num_common = index_keep.size();
+            vector<int> dropped;
+            LOGGER.l(0, "Individuals with non-missing values in each trait, and those not in all traits:");
+            for(int k = 0; k < num_trait; k++){
+                uint32_t num_lost = trait_N[k] - num_common;
+                LOGGER.l(1, "column " + to_string(cur_phenos[k]) + ": " + to_string(trait_N[k]) + ", " + to_string(num_lost) + " excluded");
+                if(num_lost > 0.1 * trait_N[k]) dropped.push_back(k);
+            }
+            if(!dropped.empty()){
+                string examples;
+                for(int j = 0; j < std::min((int)dropped.size(), 5); j++){
+                    int k = dropped[j];
+                    examples += (j ? ", " : "") + string("column ") + to_string(cur_phenos[k]) + " (" + to_string(trait_N[k]) + " -> " + to_string(num_common) + ")";
+                }
+                LOGGER.w(0, to_string(dropped.size()) + " traits lose more than 10% of their individuals to the missing values of the other traits, e.g. "
+                        + examples + ". Their results differ from testing them alone. The counts of each trait are in the log file.");
+            }
+        }
         LOGGER.i(0, to_string(index_keep.size()) + " overlapping individuals with non-missing data to be included from the phenotype file.");
         
     }
@@ -610,6 +680,22 @@ void Pheno::save_pheno(string filename){
 
 }
 
+int Pheno::count_mpheno(){
+    return mpheno.size();
+}
+
+// values of the traits from --mpheno in the kept samples, and the column of each trait in the phenotype file
+void Pheno::get_mpheno(vector<vector<double>>& values, vector<int>& cols){
+    cols = mpheno_cols;
+    values.resize(mpheno.size());
+    for(int k = 0; k < mpheno.size(); k++){
+        values[k].resize(index_keep.size());
+        for(int i = 0; i < index_keep.size(); i++){
+            values[k][i] = mpheno[k][index_keep[i]];
+        }
+    }
+}
+
 void Pheno::get_pheno(vector<string>& ids, vector<double>& pheno){
     ids.clear();
     ids.reserve(index_keep.size());
@@ -965,8 +1051,12 @@ int Pheno::registerOption(map<string, vector<string>>& options_in){
         if(options.find("qpheno_file") == options.end()){
             LOGGER.e(0, "--mpheno only works with --pheno");
         }
-        options["mpheno"] = options_in["--mpheno"][0];
+        options["mpheno"] = boost::algorithm::join(options_in["--mpheno"], ",");
         options_in.erase("--mpheno");
+        // only fastGWA tests the traits of a list, the other modules would use the first one
+        if(options_in.find("--fastGWA-mlm") != options_in.end() || options_in.find("--fastGWA-lr") != options_in.end()){
+            options["mpheno_multi"] = "yes";
+        }
     }
 
     if(options_in.find("--filter-sex") != options_in.end()){
@@ -20,6 +20,8 @@
 #include <boost/math/distributions/chi_squared.hpp>
 #include <boost/math/distributions/normal.hpp>
 #include <boost/math/distributions/beta.hpp>
+#include <boost/math/distributions/non_central_chi_squared.hpp>
+#include <boost/math/constants/constants.hpp>
 #include "cpu.h"
 
 using namespace boost::math;
@@ -79,6 +81,69 @@ namespace StatLib{
         }
     }
 
+    double pchisqMixture(const VectorXd &lambda, double q){
+        if(lambda.size() == 0 || !std::isfinite(q)){
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        double c1 = lambda.sum();
+        double c2 = lambda.array().square().sum();
+        double c3 = lambda.array().cube().sum();
+        double c4 = lambda.array().square().square().sum();
+        if(c2 <= 0){
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        double s1 = c3 / std::pow(c2, 1.5);
+        double s2 = c4 / (c2 * c2);
+        double a, delta, l;
+        if(s1 * s1 > s2){
+            a = 1.0 / (s1 - std::sqrt(s1 * s1 - s2));
+            delta = s1 * a * a * a - a * a;
+            l = a * a - 2.0 * delta;
+        }else{
+            a = 1.0 / s1;
+            delta = 0;
+            l = 1.0 / (s1 * s1);
+        }
+        double t = (q - c1) / std::sqrt(2.0 * c2);
+        double x = t * std::sqrt(2.0) * a + l + delta;
+        if(x <= 0){
+            return 1.0;
+        }
+        if(delta > 0){
+            non_central_chi_squared dist(l, delta);
+            return cdf(complement(dist, x));
+        }else{
+            chi_squared dist(l);
+            return cdf(complement(dist, x));
+        }
+    }
+
+    double pCauchy(const VectorXd &p, const VectorXd &weights){
+        const double pi = boost::math::constants::pi<double>();
+        double sum_w = 0, stat = 0;
+        for(int i = 0; i < p.size(); i++){
+            if(!(p[i] >= 0 && p[i] <= 1) || weights[i] <= 0) continue;
+            if(p[i] == 0) return 0;
+            if(p[i] == 1) continue;
+            sum_w += weights[i];
+            // tan((0.5 - p) * pi) loses the precision of a tiny p
+            if(p[i] < 1e-15){
+                stat += weights[i] / (p[i] * pi);
+            }else{
+                stat += weights[i] * std::tan((0.5 - p[i]) * pi);
+            }
+        }
+        if(sum_w <= 0){
+            return p.size() ? 1.0 : std::numeric_limits<double>::quiet_NaN();
+        }
+        stat /= sum_w;
+        // the tail of the standard Cauchy, 1 / (stat * pi) for a large stat
+        if(stat > 1e15){
+            return 1.0 / (stat * pi);
+        }
+        return 0.5 - std::atan(stat) / pi;
+    }
+
     //n rank size,  Z shall be n * n double memory.
     // return true, success; false, unsuccess
     bool rankContrast(int n, double * Z){
@@ -90,10 +90,14 @@ int main(int argc, char *argv[]){
         "--make-bed", "--recodet", "--sum-geno-x", "--sample", "--bgen", "--mbgen", "--hard-call-thresh", "--dosage-call", "--dosage", "--mgrm", "--unify-grm", "--rel-only", 
         "--ld-matrix", "--r", "--ld-wind", "--r2", "--subtract-grm", "--save-pheno", "--save-bin", "--no-marker", "--joint-covar", "--sparse-cutoff", "--noblas", "--fastGWA-gram",
         "--inv-t1", "--est-vg", "--force-gwa", "--reml-detail", "--h2-limit", "--gwa-no-constrain", "--verbose", "--c-inf", "--c-inf-no-filter", "--geno", "--info", "--nofilter",
-        "--set-list", "--burden",
+        "--set-list", "--burden", "--skat", "--acat-v",
         "--pfile", "--bpfile", "--mpfile", "--mbpfile", "--model-only", "--load-model", "--seed", "--fastGWA-mlm-binary", "--num-vec", "--trace-exact", "--cv-threshold", "--tao-start",
         "--acat", "--gene-list", "--snp-list", "--min-mac", "--max-maf", "--wind",
         "--envir", "--optimal-rho", "--noSandwich", "--grid-size",
+        "--grm-out-of-core", "--grm-panel", "--make-grm-sparse", "--sparse-screen",
+        "--update-grm", "--grm-v2", "--grm-cutoff-mis", "--grm-checkpoint", "--resume",
+        "--make-grm-multi", "--sparse-bin", "--grm-const-N",
+        "--shard", "--merge-shards", "--null-panel",
     };
     map<string, vector<string>> options;
     vector<string> keys;
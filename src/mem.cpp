@@ -91,8 +91,18 @@ int getVMPeakKB(){
     return result;
 }
 
+long long getMemAvailKB(){
+    FILE* file = fopen("/proc/meminfo", "r");
+    if(!file) return -1;
+    long long result = -1;
+    char line[128];
 
-
-
-
-
+    while (fgets(line, 128, file) != NULL){
+        if (strncmp(line, "MemAvailable:", 13) == 0){
+            result = atoll(line + 13);
+            break;
+        }
+    }
+    fclose(file);
+    return result;
+}
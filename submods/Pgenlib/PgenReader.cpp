@@ -564,6 +564,40 @@ void PgenReader::ExtractDoubleExt(uintptr_t *in, const uintptr_t *subsets, uint3
     }
 }
 
+// Samples whose genotype code differs from major_code, with gtable[code] of each;
+//  the words of major codes are skipped as a whole.
+void PgenReader::ExtractSparseExt(uintptr_t *in, const uintptr_t *subsets, uint32_t rawSampleSize, uint32_t keepSize, uint32_t major_code, const double *gtable, vector<uint32_t> &index, vector<double> &values){
+    uintptr_t *bufptr = NULL;
+    bool newBuf = false;
+    if(rawSampleSize == keepSize){
+        bufptr = in;
+    }else{
+        newBuf = true;
+        bufptr = new uintptr_t[GetGenoBufPtrSize(keepSize)];
+        ExtractGenoExt(in, subsets, rawSampleSize, keepSize, bufptr);
+    }
+    index.clear();
+    values.clear();
+    const uintptr_t major_word = plink2::kMask5555 * major_code;
+    const uint32_t word_ct = (keepSize + plink2::kBitsPerWordD2 - 1) / plink2::kBitsPerWordD2;
+    for(uint32_t widx = 0; widx < word_ct; widx++){
+        const uintptr_t geno_word = bufptr[widx];
+        uintptr_t diff = geno_word ^ major_word;
+        diff = (diff | (diff >> 1)) & plink2::kMask5555;
+        while(diff){
+            const uint32_t shift = plink2::ctzw(diff);
+            const uint32_t sample = widx * plink2::kBitsPerWordD2 + shift / 2;
+            if(sample >= keepSize) break;
+            index.push_back(sample);
+            values.push_back(gtable[(geno_word >> shift) & 3]);
+            diff &= diff - 1;
+        }
+    }
+    if(newBuf){
+        delete[] bufptr;
+    }
+}
+
 
 
 void PgenReader::ReadHardcalls(vector<double> &buf, int variant_idx, int allele_idx) {